@@ -52,6 +52,11 @@ namespace
         std::condition_variable WriteConfirmCv;
         bool WriteConfirmed = false;
 
+        std::atomic<uint64_t> ReceivedFrames{0};
+        std::atomic<uint64_t> SentFrames{0};
+        std::atomic<uint64_t> WriteErrors{0};
+        std::atomic<uint64_t> WriteTimeouts{0};
+
         void SetWriteConfirmed()
         {
             std::unique_lock<std::mutex> waitLock(WriteConfirmMutex);
@@ -98,6 +103,7 @@ namespace
                         if (msg.msg_flags & MSG_CONFIRM) {
                             SetWriteConfirmed();
                         } else {
+                            ++ReceivedFrames;
                             RunHandlers(frame);
                         }
                     } else {
@@ -182,15 +188,25 @@ namespace
             auto nbytes = write(Socket, &frame, CAN_MTU);
 
             if (nbytes < static_cast<int>(CAN_MTU)) {
+                ++WriteErrors;
                 throw std::runtime_error(std::string("CAN write error: ") + strerror(errno));
             }
             std::unique_lock<std::mutex> waitLock(WriteConfirmMutex);
-            if (WriteConfirmed) {
-                return;
-            }
-            if (std::cv_status::timeout == WriteConfirmCv.wait_for(waitLock, WRITE_TIMEOUT)) {
+            if (!WriteConfirmed && std::cv_status::timeout == WriteConfirmCv.wait_for(waitLock, WRITE_TIMEOUT)) {
+                ++WriteTimeouts;
                 throw std::runtime_error("CAN write timeout");
             }
+            ++SentFrames;
+        }
+
+        CAN::TPortStats GetStats()
+        {
+            CAN::TPortStats stats;
+            stats.ReceivedFrames = ReceivedFrames.load();
+            stats.SentFrames = SentFrames.load();
+            stats.WriteErrors = WriteErrors.load();
+            stats.WriteTimeouts = WriteTimeouts.load();
+            return stats;
         }
     };
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <linux/can.h>
+#include <cstdint>
 #include <linux/can/raw.h>
 #include <memory>
 
@@ -24,6 +25,18 @@ namespace CAN
         virtual bool Handle(const TFrame& frame) = 0;
     };
 
+    struct TPortStats
+    {
+        uint64_t ReceivedFrames = 0;
+        uint64_t SentFrames = 0;
+
+        //! Failed writes to the socket
+        uint64_t WriteErrors = 0;
+
+        //! Writes without confirmation from the interface during WRITE_TIMEOUT
+        uint64_t WriteTimeouts = 0;
+    };
+
     class IPort
     {
     public:
@@ -38,6 +51,15 @@ namespace CAN
          * @param frame
          */
         virtual void Send(const TFrame& frame) = 0;
+
+        /**
+         * @brief Returns counters of received and sent frames. Must be threadsafe.
+         *        Ports without statistics return zeros.
+         */
+        virtual TPortStats GetStats()
+        {
+            return TPortStats();
+        }
     };
 
     std::shared_ptr<IPort> MakePort(const std::string& ifname);
@@ -0,0 +1,218 @@
+#include "CanTransactions.h"
+
+#include <string.h>
+#include <wblib/utils.h>
+
+#include "log.h"
+
+#define LOG(logger) ::logger.Log() << "[CAN] "
+
+namespace CAN
+{
+    TTransactions::TTransactions(std::shared_ptr<IPort> port, TResponseKeyFn getResponseKey)
+        : Port(port),
+          GetResponseKey(getResponseKey),
+          Enabled(true)
+    {
+        Port->AddHandler(this);
+        Thread = std::thread([this]() {
+            WBMQTT::SetThreadName("CAN transactions");
+            CheckTimeouts();
+        });
+    }
+
+    TTransactions::~TTransactions()
+    {
+        Port->RemoveHandler(this);
+        {
+            std::unique_lock<std::mutex> lk(Mutex);
+            Enabled = false;
+            Cv.notify_all();
+        }
+        Thread.join();
+        for (const auto& transactions: {&InFlight, &Queued}) {
+            for (const auto& transaction: *transactions) {
+                TTransactionResult result;
+                result.Attempts = transaction.second.Attempts;
+                for (const auto& callback: transaction.second.Callbacks) {
+                    callback(result);
+                }
+            }
+        }
+    }
+
+    void TTransactions::Start(const TFrame& request,
+                              TTransactionKey key,
+                              std::chrono::milliseconds timeout,
+                              uint32_t retries,
+                              TTransactionCallback callback)
+    {
+        {
+            std::unique_lock<std::mutex> lk(Mutex);
+            auto it = InFlight.find(key);
+            if (it != InFlight.end()) {
+                it->second.Callbacks.push_back(callback);
+                return;
+            }
+            auto now = std::chrono::steady_clock::now();
+            TTransaction transaction{request, timeout, retries, 1, now, Deadlines.end(), {callback}};
+            transaction.Deadline = Deadlines.emplace(now + timeout, key);
+            InFlight.emplace(key, transaction);
+            Cv.notify_all();
+        }
+        // The response can't come before the request, so the transaction is registered first
+        SendRequest(request);
+    }
+
+    std::future<TTransactionResult> TTransactions::Start(const TFrame& request,
+                                                         TTransactionKey key,
+                                                         std::chrono::milliseconds timeout,
+                                                         uint32_t retries)
+    {
+        auto promise = std::make_shared<std::promise<TTransactionResult>>();
+        Start(request, key, timeout, retries, [promise](const TTransactionResult& result) {
+            promise->set_value(result);
+        });
+        return promise->get_future();
+    }
+
+    void TTransactions::StartFresh(const TFrame& request,
+                                   TTransactionKey key,
+                                   std::chrono::milliseconds timeout,
+                                   uint32_t retries,
+                                   TTransactionCallback callback)
+    {
+        {
+            std::unique_lock<std::mutex> lk(Mutex);
+            auto it = InFlight.find(key);
+            if (it != InFlight.end()) {
+                if (it->second.Attempts == 0) {
+                    // Isn't sent yet, so it is fresh too
+                    it->second.Callbacks.push_back(callback);
+                    return;
+                }
+                auto queued = Queued.find(key);
+                if (queued != Queued.end()) {
+                    queued->second.Callbacks.push_back(callback);
+                } else {
+                    Queued.emplace(key, TTransaction{request, timeout, retries, 0, {}, Deadlines.end(), {callback}});
+                }
+                return;
+            }
+        }
+        Start(request, key, timeout, retries, callback);
+    }
+
+    void TTransactions::StartQueued(TTransactionKey key, TTimePoint now)
+    {
+        auto queued = Queued.find(key);
+        if (queued == Queued.end()) {
+            return;
+        }
+        // The deadline is already reached, so the timeout thread sends the request as a retry.
+        // The request can't be sent here, the port doesn't allow sending from its frame handlers
+        auto& transaction = InFlight.emplace(key, std::move(queued->second)).first->second;
+        transaction.Deadline = Deadlines.emplace(now, key);
+        Queued.erase(queued);
+        Cv.notify_all();
+    }
+
+    bool TTransactions::Handle(const TFrame& frame)
+    {
+        TTransactionKey key;
+        if (!GetResponseKey(frame, key)) {
+            return false;
+        }
+        TTransactionResult result;
+        std::vector<TTransactionCallback> callbacks;
+        {
+            std::unique_lock<std::mutex> lk(Mutex);
+            auto it = InFlight.find(key);
+            if (it == InFlight.end() || it->second.Attempts == 0) {
+                return false;
+            }
+            result.Ok = true;
+            result.Response = frame;
+            result.Attempts = it->second.Attempts;
+            result.Rtt =
+                std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() -
+                                                                      it->second.SendTime);
+            Rtt.Add(result.Rtt);
+            callbacks.swap(it->second.Callbacks);
+            Deadlines.erase(it->second.Deadline);
+            InFlight.erase(it);
+            StartQueued(key, std::chrono::steady_clock::now());
+        }
+        for (const auto& callback: callbacks) {
+            callback(result);
+        }
+        return false;
+    }
+
+    size_t TTransactions::GetInFlightCount()
+    {
+        std::unique_lock<std::mutex> lk(Mutex);
+        return InFlight.size();
+    }
+
+    TDurationHistogram TTransactions::GetRttStats()
+    {
+        std::unique_lock<std::mutex> lk(Mutex);
+        return Rtt;
+    }
+
+    void TTransactions::SendRequest(const TFrame& frame)
+    {
+        try {
+            Port->Send(frame);
+        } catch (const std::exception& e) {
+            // The request is sent again on timeout if retries are left
+            LOG(WBMQTT::Error) << "Failed to send transaction request: " << e.what();
+        }
+    }
+
+    void TTransactions::CheckTimeouts()
+    {
+        std::unique_lock<std::mutex> lk(Mutex);
+        while (Enabled) {
+            if (Deadlines.empty()) {
+                Cv.wait(lk);
+                continue;
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (Deadlines.begin()->first > now) {
+                Cv.wait_until(lk, Deadlines.begin()->first);
+                continue;
+            }
+            std::vector<TFrame> resends;
+            std::vector<std::pair<TTransactionResult, std::vector<TTransactionCallback>>> failed;
+            while (!Deadlines.empty() && Deadlines.begin()->first <= now) {
+                auto key = Deadlines.begin()->second;
+                Deadlines.erase(Deadlines.begin());
+                auto& transaction = InFlight.at(key);
+                if (transaction.Attempts <= transaction.Retries) {
+                    ++transaction.Attempts;
+                    transaction.SendTime = now;
+                    transaction.Deadline = Deadlines.emplace(now + transaction.Timeout, key);
+                    resends.push_back(transaction.Request);
+                    continue;
+                }
+                TTransactionResult result;
+                result.Attempts = transaction.Attempts;
+                failed.emplace_back(result, std::move(transaction.Callbacks));
+                InFlight.erase(key);
+                StartQueued(key, now);
+            }
+            lk.unlock();
+            for (const auto& frame: resends) {
+                SendRequest(frame);
+            }
+            for (const auto& item: failed) {
+                for (const auto& callback: item.second) {
+                    callback(item.first);
+                }
+            }
+            lk.lock();
+        }
+    }
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "CanPort.h"
+#include "scheduler.h"
+
+namespace CAN
+{
+    //! Identifies a request and its response, e.g. CAN id without message type and first data bytes
+    using TTransactionKey = uint64_t;
+
+    /**
+     * @brief Returns false if the frame isn't a response, otherwise sets the key of the answered request.
+     *        Must be threadsafe.
+     */
+    using TResponseKeyFn = std::function<bool(const TFrame& frame, TTransactionKey& key)>;
+
+    struct TTransactionResult
+    {
+        //! false if there is no response after all retries
+        bool Ok = false;
+
+        TFrame Response{};
+
+        //! Time from the last send of the request to the response
+        std::chrono::microseconds Rtt{0};
+
+        //! Number of sent requests
+        uint32_t Attempts = 0;
+    };
+
+    using TTransactionCallback = std::function<void(const TTransactionResult& result)>;
+
+    /**
+     * @brief Sends requests and matches responses by key with timeouts and retries.
+     *        In-flight transactions are kept in a hash map, so matching of every received frame is O(1).
+     *        A request with the key of an in-flight transaction isn't sent again, it gets the same response.
+     *        StartFresh waits for such a transaction instead.
+     *        Responses are not consumed, other frame handlers of the port get them too,
+     *        so the object must be added to the port before handlers returning true.
+     *        Callbacks are called from the CAN port thread or the timeout thread and must be fast.
+     */
+    class TTransactions: public IFrameHandler
+    {
+    public:
+        TTransactions(std::shared_ptr<IPort> port, TResponseKeyFn getResponseKey);
+
+        //! Pending transactions are completed with failure
+        ~TTransactions();
+
+        /**
+         * @param timeout time to wait for response after every send
+         * @param retries number of resends after timeout
+         */
+        void Start(const TFrame& request,
+                   TTransactionKey key,
+                   std::chrono::milliseconds timeout,
+                   uint32_t retries,
+                   TTransactionCallback callback);
+
+        std::future<TTransactionResult> Start(const TFrame& request,
+                                              TTransactionKey key,
+                                              std::chrono::milliseconds timeout,
+                                              uint32_t retries);
+
+        /**
+         * @brief Like Start, but doesn't join a transaction with the same key sent before the call.
+         *        The request is sent by the timeout thread after that transaction completes,
+         *        so the response reflects everything sent to the device before the call, e.g. a write.
+         */
+        void StartFresh(const TFrame& request,
+                        TTransactionKey key,
+                        std::chrono::milliseconds timeout,
+                        uint32_t retries,
+                        TTransactionCallback callback);
+
+        bool Handle(const TFrame& frame) override;
+
+        size_t GetInFlightCount();
+
+        //! Round trip times of all completed transactions
+        TDurationHistogram GetRttStats();
+
+    private:
+        using TTimePoint = std::chrono::steady_clock::time_point;
+
+        struct TTransaction
+        {
+            TFrame Request;
+            std::chrono::milliseconds Timeout;
+            uint32_t Retries;
+
+            //! 0 until the request is sent, responses are ignored till then
+            uint32_t Attempts;
+            TTimePoint SendTime;
+            std::multimap<TTimePoint, TTransactionKey>::iterator Deadline;
+            std::vector<TTransactionCallback> Callbacks;
+        };
+
+        std::shared_ptr<IPort> Port;
+        TResponseKeyFn GetResponseKey;
+
+        std::mutex Mutex;
+        std::condition_variable Cv;
+        std::unordered_map<TTransactionKey, TTransaction> InFlight;
+
+        //! Transactions started by StartFresh waiting for completion of in-flight ones with the same key
+        std::unordered_map<TTransactionKey, TTransaction> Queued;
+        std::multimap<TTimePoint, TTransactionKey> Deadlines;
+        TDurationHistogram Rtt;
+
+        bool Enabled;
+        std::thread Thread;
+
+        void SendRequest(const TFrame& frame);
+
+        //! Moves queued transaction with the key to InFlight to be sent by the timeout thread. Mutex must be held
+        void StartQueued(TTransactionKey key, TTimePoint now);
+        void CheckTimeouts();
+    };
+}
@@ -0,0 +1,134 @@
+#include "ConfigWatcher.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <poll.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <wblib/log.h>
+#include <wblib/utils.h>
+
+#define LOG(logger) ::logger.Log() << "[config] "
+
+namespace
+{
+    const auto POLL_TIMEOUT_MS = 200;
+
+    const uint32_t WATCH_MASK = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE;
+}
+
+TConfigWatcher::TConfigWatcher(const std::vector<std::string>& paths,
+                               std::chrono::milliseconds debounce,
+                               std::function<void()> onChange)
+    : Debounce(debounce),
+      OnChange(onChange),
+      Enabled(true)
+{
+    InotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (InotifyFd < 0) {
+        throw std::runtime_error(std::string("inotify_init1 failed: ") + strerror(errno));
+    }
+    for (const auto& path: paths) {
+        AddWatch(path);
+    }
+    Thread = std::thread([this]() { TaskFn(); });
+}
+
+TConfigWatcher::~TConfigWatcher()
+{
+    Enabled.store(false);
+    Thread.join();
+    close(InotifyFd);
+}
+
+void TConfigWatcher::AddWatch(const std::string& dir, const std::string& fileName)
+{
+    int wd = inotify_add_watch(InotifyFd, dir.c_str(), WATCH_MASK);
+    if (wd < 0) {
+        LOG(WBMQTT::Warn) << "Can't watch " << dir << ": " << strerror(errno);
+        return;
+    }
+    // inotify returns the same descriptor for a directory watched again
+    auto& watch = Watches[wd];
+    watch.Dir = dir;
+    if (std::find(watch.Files.begin(), watch.Files.end(), fileName) == watch.Files.end()) {
+        watch.Files.push_back(fileName);
+    }
+}
+
+void TConfigWatcher::AddWatch(const std::string& path)
+{
+    std::filesystem::path p(path);
+    auto parent = p.parent_path();
+    AddWatch(parent.empty() ? std::string(".") : parent.string(), p.filename().string());
+    std::error_code ec;
+    if (std::filesystem::is_directory(path, ec)) {
+        AddWatch(path, std::string());
+    }
+}
+
+bool TConfigWatcher::ReadEvents()
+{
+    alignas(struct inotify_event) char buf[4096];
+    bool changed = false;
+    std::vector<std::string> createdDirs;
+    while (true) {
+        auto len = read(InotifyFd, buf, sizeof(buf));
+        if (len <= 0) {
+            // Watches can't be added while iterating over them
+            for (const auto& dir: createdDirs) {
+                AddWatch(dir, std::string());
+            }
+            return changed;
+        }
+        for (char* ptr = buf; ptr < buf + len;) {
+            auto event = reinterpret_cast<const struct inotify_event*>(ptr);
+            ptr += sizeof(struct inotify_event) + event->len;
+            auto watch = Watches.find(event->wd);
+            if (watch == Watches.end()) {
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                // The directory is removed, it is watched again after creation through its parent
+                Watches.erase(watch);
+                continue;
+            }
+            std::string name(event->len ? event->name : "");
+            for (const auto& fileName: watch->second.Files) {
+                if (fileName.empty() || fileName == name) {
+                    changed = true;
+                }
+                if (!fileName.empty() && fileName == name && (event->mask & IN_ISDIR) &&
+                    (event->mask & (IN_CREATE | IN_MOVED_TO)))
+                {
+                    createdDirs.push_back(watch->second.Dir + "/" + name);
+                }
+            }
+        }
+    }
+}
+
+void TConfigWatcher::TaskFn()
+{
+    WBMQTT::SetThreadName("config watcher");
+    bool pending = false;
+    auto deadline = std::chrono::steady_clock::now();
+    while (Enabled.load()) {
+        pollfd fd{InotifyFd, POLLIN, 0};
+        if (poll(&fd, 1, POLL_TIMEOUT_MS) > 0 && ReadEvents()) {
+            pending = true;
+            deadline = std::chrono::steady_clock::now() + Debounce;
+        }
+        if (pending && deadline <= std::chrono::steady_clock::now()) {
+            pending = false;
+            LOG(WBMQTT::Info) << "Configuration is changed, reloading";
+            try {
+                OnChange();
+            } catch (const std::exception& e) {
+                LOG(WBMQTT::Error) << "Configuration reload failed: " << e.what();
+            }
+        }
+    }
+}
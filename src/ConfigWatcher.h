@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Watches files and directories with inotify and calls handler after changes.
+ *        Handler is called from the watcher's thread once changes stop for the debounce interval,
+ *        so a series of writes by an editor or a package manager causes one reload.
+ */
+class TConfigWatcher
+{
+    int InotifyFd;
+
+    struct TWatch
+    {
+        std::string Dir;
+
+        //! Watched file names. Empty name means that all files of the directory are watched
+        std::vector<std::string> Files;
+    };
+
+    //! Watch descriptor to watched directory
+    std::unordered_map<int, TWatch> Watches;
+
+    std::chrono::milliseconds Debounce;
+    std::function<void()> OnChange;
+
+    std::thread Thread;
+    std::atomic_bool Enabled;
+
+    void AddWatch(const std::string& dir, const std::string& fileName);
+    void AddWatch(const std::string& path);
+    bool ReadEvents();
+    void TaskFn();
+
+public:
+    /**
+     * @param paths files or directories. Paths are watched through their parent directories,
+     *              so replacing by rename and creation of missing paths are detected.
+     *              Directories are watched with all their files, also after they are created.
+     */
+    TConfigWatcher(const std::vector<std::string>& paths,
+                   std::chrono::milliseconds debounce,
+                   std::function<void()> onChange);
+    ~TConfigWatcher();
+};
@@ -1,5 +1,7 @@
 #include "MqttToSmartWebGateway.h"
 
+#include <algorithm>
+#include <set>
 #include <string.h>
 #include <wblib/exceptions.h>
 
@@ -17,7 +19,7 @@ namespace
         TTimeIntervalMin(10); // after 10 minutes without any messages connection is considered lost
     const auto SEND_MESSAGES_TIME_M = TTimeIntervalMin(10);        // send value during 10 minutes
     const auto SEND_MESSAGES_INTERVAL_MS = TTimeIntervalMs(30000); // interval between messages
-    const auto READ_TIMEOUT_MS = TTimeIntervalMs(1000);            // 1 sec for messages waiting
+    const auto TICK_INTERVAL_MS = TTimeIntervalMs(1000);           // 1 sec between controllers housekeeping
 
     TTimePoint now()
     {
@@ -61,11 +63,6 @@ void TMqttChannel::from_string(const string& deviceControl)
     }
 }
 
-bool TMqttChannel::is_initialized() const
-{
-    return !device.empty() || !control.empty();
-}
-
 string TMqttChannel::to_string(const string& device, const string& control)
 {
     return device + "/" + control;
@@ -99,6 +96,125 @@ void TBroadcastChannel::schedule_to_send(const SmartWeb::TMappingPoint& mp)
     mapping_point = mp;
 }
 
+uint16_t TMqttChannelNames::Intern(const std::string& deviceControl)
+{
+    auto it = Ids.find(deviceControl);
+    if (it != Ids.end()) {
+        return it->second;
+    }
+    TMqttChannel channel;
+    channel.from_string(deviceControl);
+    Channels.push_back(channel);
+    Ids.insert({deviceControl, Channels.size() - 1});
+    return Channels.size() - 1;
+}
+
+const TMqttChannel& TMqttChannelNames::Get(uint16_t id) const
+{
+    return Channels.at(id);
+}
+
+size_t TMqttChannelNames::Size() const
+{
+    return Channels.size();
+}
+
+bool TOutputMapping::Add(uint16_t outputIndex, uint16_t channelNameId)
+{
+    auto it = std::lower_bound(Channels.begin(), Channels.end(), outputIndex, [](const auto& channel, auto index) {
+        return channel.OutputIndex < index;
+    });
+    if (it != Channels.end() && it->OutputIndex == outputIndex) {
+        return false;
+    }
+    TBroadcastChannel channel{};
+    channel.OutputIndex = outputIndex;
+    channel.ChannelNameId = channelNameId;
+    Channels.insert(it, channel);
+    return true;
+}
+
+TBroadcastChannel* TOutputMapping::Find(uint16_t outputIndex)
+{
+    auto it = std::lower_bound(Channels.begin(), Channels.end(), outputIndex, [](const auto& channel, auto index) {
+        return channel.OutputIndex < index;
+    });
+    if (it != Channels.end() && it->OutputIndex == outputIndex) {
+        return &(*it);
+    }
+    return nullptr;
+}
+
+size_t TOutputMapping::Size() const
+{
+    return Channels.size();
+}
+
+uint8_t TOutputMapping::GetHostIdCount() const
+{
+    if (Channels.empty()) {
+        return 0;
+    }
+    return Channels.back().OutputIndex / CONTROLLER_OUTPUT_MAX + 1;
+}
+
+std::vector<TBroadcastChannel>::iterator TOutputMapping::begin()
+{
+    return Channels.begin();
+}
+
+std::vector<TBroadcastChannel>::iterator TOutputMapping::end()
+{
+    return Channels.end();
+}
+
+std::vector<TBroadcastChannel>::const_iterator TOutputMapping::begin() const
+{
+    return Channels.begin();
+}
+
+std::vector<TBroadcastChannel>::const_iterator TOutputMapping::end() const
+{
+    return Channels.end();
+}
+
+bool IsSameMapping(const TMqttToSmartWebConfig& c1, const TMqttToSmartWebConfig& c2)
+{
+    if (c1.ProgramId != c2.ProgramId || c1.ParameterCount != c2.ParameterCount ||
+        c1.ParameterMapping.size() != c2.ParameterMapping.size() ||
+        c1.OutputMapping.Size() != c2.OutputMapping.Size() ||
+        c1.MqttChannelsTiming.size() != c2.MqttChannelsTiming.size())
+    {
+        return false;
+    }
+    // Channel name ids depend on mapping order, so channel names are compared
+    for (const auto& parameter: c1.ParameterMapping) {
+        auto it = c2.ParameterMapping.find(parameter.first);
+        if (it == c2.ParameterMapping.end() ||
+            c1.ChannelNames.Get(parameter.second).to_string() != c2.ChannelNames.Get(it->second).to_string())
+        {
+            return false;
+        }
+    }
+    auto output2 = c2.OutputMapping.begin();
+    for (const auto& output1: c1.OutputMapping) {
+        if (output1.OutputIndex != output2->OutputIndex ||
+            c1.ChannelNames.Get(output1.ChannelNameId).to_string() !=
+                c2.ChannelNames.Get(output2->ChannelNameId).to_string())
+        {
+            return false;
+        }
+        ++output2;
+    }
+    for (const auto& timing: c1.MqttChannelsTiming) {
+        auto it = c2.MqttChannelsTiming.find(timing.first);
+        if (it == c2.MqttChannelsTiming.end() || it->second.ValueTimeoutMin != timing.second.ValueTimeoutMin) {
+            return false;
+        }
+    }
+    return true;
+}
+
 TMqttChannelTiming::TMqttChannelTiming(const TMqttChannelTiming& other)
     : LastUpdateTimePointMutex(),
       ValueTimeoutMin(other.ValueTimeoutMin)
@@ -128,429 +244,608 @@ TTimePoint TMqttChannelTiming::get_last_update_timepoint() const
     return LastUpdateTimePoint;
 }
 
-bool TMqttToSmartWebGateway::FilterIsSet = false;
-std::mutex TMqttToSmartWebGateway::StartupMutex;
-
 TMqttToSmartWebGateway::TMqttToSmartWebGateway(const TMqttToSmartWebConfig& config,
                                                std::shared_ptr<CAN::IPort> canPort,
                                                WBMQTT::PDeviceDriver driver)
     : DriverState(config),
       CanPort(canPort),
-      Driver(driver)
+      Driver(driver),
+      Status(DS_IDLE),
+      HandledFrames(0)
 {
     CONTROLLER_TYPE = 14; // External controller
-    Enabled.store(true);
-    CanPort->AddHandler(this);
-    Thread = std::thread([this]() { TaskFn(); });
+    SendIAmHereTime = now();
 }
 
-TMqttToSmartWebGateway::~TMqttToSmartWebGateway()
+uint8_t TMqttToSmartWebGateway::GetProgramId() const
 {
-    CanPort->RemoveHandler(this);
-    Enabled.store(false);
-    if (Thread.joinable()) {
-        Thread.join();
-    }
+    return DriverState.ProgramId;
 }
 
-bool TMqttToSmartWebGateway::Handle(const CAN::TFrame& frame)
+EDriverStatus TMqttToSmartWebGateway::GetStatus() const
 {
-    SmartWeb::TCanHeader header;
-    header.raw = frame.can_id;
-    if (!IsForMe(header, frame.data)) {
-        return false;
-    }
-    std::unique_lock<std::mutex> waitLock(CanFramesMutex);
-    CanFrames.push(frame);
-    waitLock.unlock();
-    CanFramesCv.notify_all();
-    return true;
+    return Status;
 }
 
-bool TMqttToSmartWebGateway::SelectTimeout(CAN::TFrame& frame)
+uint64_t TMqttToSmartWebGateway::GetHandledFrameCount() const
 {
-    std::unique_lock<std::mutex> waitLock(CanFramesMutex);
-    if (CanFrames.empty()) {
-        if (std::cv_status::timeout == CanFramesCv.wait_for(waitLock, READ_TIMEOUT_MS)) {
-            return false;
-        }
-    }
-    frame = CanFrames.front();
-    CanFrames.pop();
-    return true;
+    return HandledFrames.load();
 }
 
-bool TMqttToSmartWebGateway::IsForMe(const SmartWeb::TCanHeader& header, const TFrameData& data) const
+const TMqttToSmartWebConfig& TMqttToSmartWebGateway::GetConfig() const
 {
-    if (header.rec.program_id == DriverState.ProgramId) {
-        return true;
-    }
-    if (header.rec.message_type == SmartWeb::MT_MSG_REQUEST && header.rec.program_type == SmartWeb::PT_CONTROLLER &&
-        header.rec.function_id == SmartWeb::Controller::Function::GET_OUTPUT_VALUE)
-    {
-        SmartWeb::TMappingPoint mapping_point;
-        memcpy(&mapping_point.raw, data, 2);
-        return mapping_point.hostID ==
-               DriverState.ProgramId; // NOLINT(clang-analyzer-core.UndefinedBinaryOperatorResult)
-    }
-
-    return false;
+    return DriverState;
 }
 
-void TMqttToSmartWebGateway::TaskFn()
+bool TMqttToSmartWebGateway::IsOutputHost(uint8_t hostId) const
 {
-    WBMQTT::SetThreadName("MQTT to SW " + to_string(int(DriverState.ProgramId)));
-    {
-        std::unique_lock<std::mutex> lk(StartupMutex);
-        if (!FilterIsSet) {
-            Driver->SetFilter(GetAllDevicesFilter());
-            Driver->WaitForReady();
-            FilterIsSet = true;
-        }
-    }
+    return hostId >= DriverState.ProgramId && hostId - DriverState.ProgramId < GetOutputHostIdCount();
+}
 
-    uint8_t program_id = DriverState.ProgramId;
+uint8_t TMqttToSmartWebGateway::GetOutputHostIdCount() const
+{
+    return std::max(uint8_t(1), DriverState.OutputMapping.GetHostIdCount());
+}
 
-    auto onHandler = Driver->On<TControlValueEvent>([&](const TControlValueEvent& event) {
-        auto deviceControl = TMqttChannel::to_string(event.Control->GetDevice()->GetId(), event.Control->GetId());
-        try {
-            DriverState.MqttChannelsTiming.at(deviceControl).refresh_last_update_timepoint();
-        } catch (out_of_range&) {
-        }
-    });
+TMqttChannelTiming* TMqttToSmartWebGateway::GetChannelTiming(const std::string& deviceControl)
+{
+    auto it = DriverState.MqttChannelsTiming.find(deviceControl);
+    if (it == DriverState.MqttChannelsTiming.end()) {
+        return nullptr;
+    }
+    return &it->second;
+}
 
-    auto get_response_frame = [&](SmartWeb::TCanHeader header) {
-        if (header.rec.message_type != SmartWeb::MT_MSG_REQUEST) {
-            throw TFrameError("Frame error: response to NOT request frame");
-        }
+TFrame TMqttToSmartWebGateway::GetResponseFrame(SmartWeb::TCanHeader header) const
+{
+    if (header.rec.message_type != SmartWeb::MT_MSG_REQUEST) {
+        throw TFrameError("Frame error: response to NOT request frame");
+    }
 
-        if (header.rec.program_id != program_id) {
-            throw TFrameError("Frame error: response to request frame for different device (" +
-                              to_string((int)header.rec.program_id) + ")");
-        }
+    if (header.rec.program_id != DriverState.ProgramId) {
+        throw TFrameError("Frame error: response to request frame for different device (" +
+                          to_string((int)header.rec.program_id) + ")");
+    }
 
-        header.rec.message_type = SmartWeb::MT_MSG_RESPONSE;
+    header.rec.message_type = SmartWeb::MT_MSG_RESPONSE;
 
-        TFrame response{0};
-        response.can_id = header.raw;
+    TFrame response{0};
+    response.can_id = header.raw;
 
-        return response;
-    };
+    return response;
+}
 
-    auto postpone_i_am_here = [&] { SendIAmHereTime = now() + KEEP_ALIVE_INTERVAL_S; };
-    auto postpone_connection_reset = [&] { ResetConnectionTime = now() + CONNECTION_TIMEOUT_MIN; };
+void TMqttToSmartWebGateway::SendFrame(TFrame& frame, const std::string& prefix)
+{
+    frame.can_id |= CAN_EFF_FLAG; // just in case
+    try {
+        CanPort->Send(frame);
+        print_frame(DebugMqttToSw, frame, "[" + std::to_string(DriverState.ProgramId) + "] " + prefix);
+    } catch (const std::exception& e) {
+        print_frame(ErrorMqttToSw, frame, "[" + std::to_string(DriverState.ProgramId) + "] " + prefix + " " + e.what());
+    }
+}
 
-    auto send_frame = [&](TFrame& frame, const std::string& prefix) {
-        frame.can_id |= CAN_EFF_FLAG; // just in case
-        try {
-            CanPort->Send(frame);
-            print_frame(DebugMqttToSw, frame, "[" + std::to_string(DriverState.ProgramId) + "] " + prefix);
-        } catch (const std::exception& e) {
-            print_frame(ErrorMqttToSw,
-                        frame,
-                        "[" + std::to_string(DriverState.ProgramId) + "] " + prefix + " " + e.what());
-        }
-    };
-
-    auto read_mqtt_value = [&](const string& device_id, const string& control_id) {
-        try {
-            const auto& mqtt_channel_timing =
-                DriverState.MqttChannelsTiming.at(TMqttChannel::to_string(device_id, control_id));
-            if (mqtt_channel_timing.is_timed_out()) {
-                WarnMqttToSw.Log() << "MQTT value of control " << control_id << " of device " << device_id
-                                   << " timed out. Returning undefined value";
-                return SmartWeb::SENSOR_UNDEFINED;
-            }
-        } catch (out_of_range&) {
-            // Should never happen. Means that we did not add all mqtt channels to DriverState.MqttChannelsTiming at
-            // startup as we should've.
-            ErrorMqttToSw.Log() << "[error code 1] There is bug in code; Report error code to driver maintainer";
+int16_t TMqttToSmartWebGateway::ReadMqttValue(const string& device_id, const string& control_id)
+{
+    try {
+        const auto& mqtt_channel_timing =
+            DriverState.MqttChannelsTiming.at(TMqttChannel::to_string(device_id, control_id));
+        if (mqtt_channel_timing.is_timed_out()) {
+            WarnMqttToSw.Log() << "MQTT value of control " << control_id << " of device " << device_id
+                               << " timed out. Returning undefined value";
+            return SmartWeb::SENSOR_UNDEFINED;
         }
+    } catch (out_of_range&) {
+        // Should never happen. Means that we did not add all mqtt channels to DriverState.MqttChannelsTiming at
+        // startup as we should've.
+        ErrorMqttToSw.Log() << "[error code 1] There is bug in code; Report error code to driver maintainer";
+    }
+
+    if (!Driver) {
+        return SmartWeb::SENSOR_UNDEFINED;
+    }
 
-        try {
-            auto tx = Driver->BeginTx();
-            if (auto device = tx->GetDevice(device_id)) {
-                if (auto control = device->GetControl(control_id)) {
-                    if (control->GetError().empty()) {
-                        return SmartWeb::SensorData::FromDouble(control->GetValue().As<double>());
-                    } else {
-                        WarnMqttToSw.Log() << "Unable to read mqtt value because of error on control " << control_id
-                                           << " of device " << device_id << ": " << control->GetError();
-                        return SmartWeb::SENSOR_UNDEFINED;
-                    }
+    try {
+        auto tx = Driver->BeginTx();
+        if (auto device = tx->GetDevice(device_id)) {
+            if (auto control = device->GetControl(control_id)) {
+                if (control->GetError().empty()) {
+                    return SmartWeb::SensorData::FromDouble(control->GetValue().As<double>());
                 } else {
-                    WarnMqttToSw.Log() << "Unable to read mqtt value because control " << control_id << " of device "
-                                       << device_id << " does not exist";
+                    WarnMqttToSw.Log() << "Unable to read mqtt value because of error on control " << control_id
+                                       << " of device " << device_id << ": " << control->GetError();
                     return SmartWeb::SENSOR_UNDEFINED;
                 }
             } else {
-                WarnMqttToSw.Log() << "Unable to read mqtt value because device " << device_id << " does not exist";
+                WarnMqttToSw.Log() << "Unable to read mqtt value because control " << control_id << " of device "
+                                   << device_id << " does not exist";
                 return SmartWeb::SENSOR_UNDEFINED;
             }
-        } catch (const WBMQTT::TBaseException& e) {
-            WarnMqttToSw.Log() << "Unable to read mqtt value: " << e.what();
-
+        } else {
+            WarnMqttToSw.Log() << "Unable to read mqtt value because device " << device_id << " does not exist";
             return SmartWeb::SENSOR_UNDEFINED;
         }
-    };
+    } catch (const WBMQTT::TBaseException& e) {
+        WarnMqttToSw.Log() << "Unable to read mqtt value: " << e.what();
 
-    auto i_am_here = [&] {
-        postpone_i_am_here();
+        return SmartWeb::SENSOR_UNDEFINED;
+    }
+}
 
-        SmartWeb::TCanHeader header;
+void TMqttToSmartWebGateway::SendIAmHere()
+{
+    SendIAmHereTime = now() + KEEP_ALIVE_INTERVAL_S;
 
-        header.rec.program_type = SmartWeb::PT_CONTROLLER;
-        header.rec.program_id = program_id;
-        header.rec.function_id = SmartWeb::Controller::Function::I_AM_HERE;
-        header.rec.message_format = SmartWeb::MF_FORMAT_0;
-        header.rec.message_type = SmartWeb::MT_MSG_RESPONSE;
+    SmartWeb::TCanHeader header;
 
-        TFrame frame{0};
-        frame.can_id = header.raw | CAN_EFF_FLAG;
-        frame.can_dlc = 1;
-        frame.data[0] = CONTROLLER_TYPE;
+    header.rec.program_type = SmartWeb::PT_CONTROLLER;
+    header.rec.program_id = DriverState.ProgramId;
+    header.rec.function_id = SmartWeb::Controller::Function::I_AM_HERE;
+    header.rec.message_format = SmartWeb::MF_FORMAT_0;
+    header.rec.message_type = SmartWeb::MT_MSG_RESPONSE;
 
-        send_frame(frame, "send I_AM_HERE");
-    };
+    TFrame frame{0};
+    frame.can_id = header.raw | CAN_EFF_FLAG;
+    frame.can_dlc = 1;
+    frame.data[0] = CONTROLLER_TYPE;
 
-    auto send_scheduled_i_am_here = [&] {
-        if (SendIAmHereTime <= now()) {
-            i_am_here();
-        }
-    };
+    SendFrame(frame, "send I_AM_HERE");
+}
+
+void TMqttToSmartWebGateway::SendScheduledIAmHere()
+{
+    if (SendIAmHereTime <= now()) {
+        SendIAmHere();
+    }
+}
 
-    auto get_channel_number = [&](const SmartWeb::TCanHeader& header) {
-        auto channel_number = max((size_t)DriverState.ParameterCount, DriverState.ParameterMapping.size());
+void TMqttToSmartWebGateway::GetChannelNumber(const SmartWeb::TCanHeader& header)
+{
+    auto channel_number = max((size_t)DriverState.ParameterCount, DriverState.ParameterMapping.size());
 
-        auto response = get_response_frame(header);
-        response.can_dlc = 2;
-        response.data[0] = 0xFF & channel_number;
-        response.data[1] = 0xFF & channel_number >> 8;
-        send_frame(response, "send channel number");
-    };
+    auto response = GetResponseFrame(header);
+    response.can_dlc = 2;
+    response.data[0] = 0xFF & channel_number;
+    response.data[1] = 0xFF & channel_number >> 8;
+    SendFrame(response, "send channel number");
+}
 
-    auto get_parameter_value = [&](const SmartWeb::TCanHeader& header, const TFrameData& data) {
-        SmartWeb::TParameterData parameter_data{0};
+void TMqttToSmartWebGateway::GetParameterValue(const SmartWeb::TCanHeader& header, const TFrameData& data)
+{
+    SmartWeb::TParameterData parameter_data{0};
 
-        memcpy(&parameter_data.raw, data, 4);
+    memcpy(&parameter_data.raw, data, 4);
 
-        if (parameter_data.program_type != SmartWeb::PT_CONTROLLER) {
-            throw TUnsupportedError("Unsupported program type " + to_string((int)parameter_data.program_type) +
-                                    " for GET_PARAMETER_VALUE");
-        }
+    if (parameter_data.program_type != SmartWeb::PT_CONTROLLER) {
+        throw TUnsupportedError("Unsupported program type " + to_string((int)parameter_data.program_type) +
+                                " for GET_PARAMETER_VALUE");
+    }
 
-        const auto& itDeviceChannel = DriverState.ParameterMapping.find(parameter_data.raw_info);
+    const auto& itDeviceChannel = DriverState.ParameterMapping.find(parameter_data.raw_info);
 
-        int16_t value = SmartWeb::SENSOR_UNDEFINED;
+    int16_t value = SmartWeb::SENSOR_UNDEFINED;
 
-        if (itDeviceChannel == DriverState.ParameterMapping.end()) {
-            DebugMqttToSw.Log() << "[" << (int)DriverState.ProgramId
-                                << "] unmapped parameter: type: " << (int)parameter_data.program_type
-                                << ", id: " << (int)parameter_data.parameter_id
-                                << ", index: " << (int)parameter_data.indexed_parameter.index;
-        } else {
-            DebugMqttToSw.Log() << "[" << (int)DriverState.ProgramId
-                                << "] get parameter: type: " << (int)parameter_data.program_type
-                                << ", id: " << (int)parameter_data.parameter_id
-                                << ", index: " << (int)parameter_data.indexed_parameter.index << ", raw "
-                                << (int)parameter_data.raw_info;
-            value = read_mqtt_value(itDeviceChannel->second.device, itDeviceChannel->second.control);
-        }
+    if (itDeviceChannel == DriverState.ParameterMapping.end()) {
+        DebugMqttToSw.Log() << "[" << (int)DriverState.ProgramId
+                            << "] unmapped parameter: type: " << (int)parameter_data.program_type
+                            << ", id: " << (int)parameter_data.parameter_id
+                            << ", index: " << (int)parameter_data.indexed_parameter.index;
+    } else {
+        DebugMqttToSw.Log() << "[" << (int)DriverState.ProgramId
+                            << "] get parameter: type: " << (int)parameter_data.program_type
+                            << ", id: " << (int)parameter_data.parameter_id
+                            << ", index: " << (int)parameter_data.indexed_parameter.index << ", raw "
+                            << (int)parameter_data.raw_info;
+        const auto& channel = DriverState.ChannelNames.Get(itDeviceChannel->second);
+        value = ReadMqttValue(channel.device, channel.control);
+    }
 
-        auto response = get_response_frame(header);
+    auto response = GetResponseFrame(header);
 
-        response.can_dlc = 5;
+    response.can_dlc = 5;
 
-        memset(response.data, 0, sizeof response.data);
+    memset(response.data, 0, sizeof response.data);
 
-        memcpy(parameter_data.indexed_parameter.value, &value, sizeof value);
+    memcpy(parameter_data.indexed_parameter.value, &value, sizeof value);
 
-        memcpy(response.data, &parameter_data.raw, 5);
+    memcpy(response.data, &parameter_data.raw, 5);
 
-        send_frame(response, "get parameter response");
+    SendFrame(response, "get parameter response");
 
-        DebugMqttToSw.Log() << "[" << (int)DriverState.ProgramId
-                            << "] parameter {type: " << (int)parameter_data.program_type
-                            << ", id: " << (int)parameter_data.parameter_id
-                            << ", index: " << (int)parameter_data.indexed_parameter.index
-                            << "} <== " << SmartWeb::SensorData::ToDouble(value);
-    };
+    DebugMqttToSw.Log() << "[" << (int)DriverState.ProgramId << "] parameter {type: " << (int)parameter_data.program_type
+                        << ", id: " << (int)parameter_data.parameter_id
+                        << ", index: " << (int)parameter_data.indexed_parameter.index
+                        << "} <== " << SmartWeb::SensorData::ToDouble(value);
+}
 
-    auto get_output_value = [&](const SmartWeb::TCanHeader& header, const TFrameData& data) {
-        SmartWeb::TMappingPoint mapping_point{};
-        memcpy(mapping_point.rawID, data, 2);
+void TMqttToSmartWebGateway::GetOutputValue(const SmartWeb::TCanHeader& header, const TFrameData& data)
+{
+    SmartWeb::TMappingPoint mapping_point{};
+    memcpy(mapping_point.rawID, data, 2);
 
-        if (mapping_point.hostID != program_id) {
-            throw TFrameError("hostID of mapping point does not match with driver program_id");
-        }
+    if (!IsOutputHost(mapping_point.hostID)) {
+        throw TFrameError("hostID of mapping point does not match with driver program_id");
+    }
+
+    uint16_t output_index =
+        (mapping_point.hostID - DriverState.ProgramId) * CONTROLLER_OUTPUT_MAX + mapping_point.channelID;
+
+    auto channel = DriverState.OutputMapping.Find(output_index);
+
+    if (channel) {
+        channel->schedule_to_send(mapping_point);
+        InfoMqttToSw.Log() << "[" << (int)DriverState.ProgramId << "] scheduled output " << (int)output_index;
+    } else {
+        WarnMqttToSw.Log() << "[" << (int)DriverState.ProgramId << "] unmapped output " << (int)output_index;
+    }
+}
+
+void TMqttToSmartWebGateway::SendScheduledOutputs()
+{
+    SmartWeb::TCanHeader header;
+    header.rec.program_type = SmartWeb::PT_CONTROLLER;
+    header.rec.program_id = DriverState.ProgramId;
+    header.rec.function_id = SmartWeb::Controller::Function::GET_OUTPUT_VALUE;
+    header.rec.message_format = SmartWeb::MF_FORMAT_0;
+    header.rec.message_type = SmartWeb::MT_MSG_RESPONSE;
 
-        auto channel_id = mapping_point.channelID;
-        if (channel_id >= CONTROLLER_OUTPUT_MAX) {
-            throw TFrameError("channel_id of mapping point is out of bounds: " + to_string(channel_id));
+    TFrame frame{0};
+
+    frame.can_dlc = 4;
+
+    for (auto& channel: DriverState.OutputMapping) {
+        if (channel.SendEndTimePoint < now()) {
+            continue; // too late
         }
 
-        auto& channel = DriverState.OutputMapping[channel_id];
+        const auto& mqtt_channel = DriverState.ChannelNames.Get(channel.ChannelNameId);
 
-        if (channel.is_initialized()) {
-            channel.schedule_to_send(mapping_point);
-            InfoMqttToSw.Log() << "[" << (int)DriverState.ProgramId << "] scheduled output " << (int)channel_id;
-        } else {
-            WarnMqttToSw.Log() << "[" << (int)DriverState.ProgramId << "] unmapped output " << (int)channel_id;
+        auto lastUpdate = DriverState.MqttChannelsTiming.at(mqtt_channel.to_string()).get_last_update_timepoint();
+        if (lastUpdate <= channel.LastSendTimePoint) { // no channel updates
+            if (channel.SendTimePoint > now()) {
+                continue; // too soon
+            }
         }
-    };
 
-    auto send_scheduled_outputs = [&] {
-        SmartWeb::TCanHeader header;
-        header.rec.program_type = SmartWeb::PT_CONTROLLER;
-        header.rec.program_id = program_id;
-        header.rec.function_id = SmartWeb::Controller::Function::GET_OUTPUT_VALUE;
-        header.rec.message_format = SmartWeb::MF_FORMAT_0;
-        header.rec.message_type = SmartWeb::MT_MSG_RESPONSE;
+        auto value = ReadMqttValue(mqtt_channel.device, mqtt_channel.control);
 
-        TFrame frame{0};
+        frame.can_id = header.raw | CAN_EFF_FLAG;
+        memcpy(frame.data, &channel.mapping_point.raw, sizeof channel.mapping_point.raw);
+        frame.data[2] = 0xFF & value >> 8;
+        frame.data[3] = 0xFF & value;
 
-        frame.can_dlc = 4;
+        SendFrame(frame, "send output");
 
-        for (uint8_t channel_id = 0; channel_id < CONTROLLER_OUTPUT_MAX; ++channel_id) {
-            auto& channel = DriverState.OutputMapping[channel_id];
+        DebugMqttToSw.Log() << "[" << (int)DriverState.ProgramId << "] output {index: " << (int)channel.OutputIndex
+                            << "} <== " << SmartWeb::SensorData::ToDouble(value);
 
-            if (channel.SendEndTimePoint < now()) {
-                continue; // too late
-            }
+        channel.postpone_send();
+    }
+}
+
+void TMqttToSmartWebGateway::GetControllerType(const SmartWeb::TCanHeader& header)
+{
+    auto response = GetResponseFrame(header);
+    response.can_dlc = 1;
+    response.data[0] = CONTROLLER_TYPE;
+    SendFrame(response, "send controller type");
+}
 
-            if (channel.device.empty() || channel.control.empty()) {
-                continue; // weird
+void TMqttToSmartWebGateway::HandleRequest(const SmartWeb::TCanHeader& header, const TFrameData& data)
+{
+    switch (header.rec.program_type) {
+        case SmartWeb::PT_CONTROLLER:
+            switch (header.rec.function_id) {
+                case SmartWeb::Controller::Function::GET_CHANNEL_NUMBER:
+                    return GetChannelNumber(header);
+                case SmartWeb::Controller::Function::GET_CONTROLLER_TYPE:
+                    return GetControllerType(header);
+                case SmartWeb::Controller::Function::GET_OUTPUT_VALUE:
+                    return GetOutputValue(header, data);
+                case SmartWeb::Controller::Function::I_AM_HERE:
+                    return SendIAmHere();
+                default:
+                    throw TUnsupportedError("function id " + to_string((int)header.rec.function_id) +
+                                            " is unsupported");
+            }
+        case SmartWeb::PT_REMOTE_CONTROL:
+            switch (header.rec.function_id) {
+                case SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE:
+                    return GetParameterValue(header, data);
+                default:
+                    throw TUnsupportedError("function id " + to_string((int)header.rec.function_id) +
+                                            " is unsupported");
             }
+        default:
+            throw TUnsupportedError("program_type " + to_string((int)header.rec.program_type) + " is unsupported");
+    }
+}
 
-            auto lastUpdate =
-                DriverState.MqttChannelsTiming.at(TMqttChannel::to_string(channel.device, channel.control))
-                    .get_last_update_timepoint();
-            if (lastUpdate <= channel.LastSendTimePoint) { // no channel updates
-                if (channel.SendTimePoint > now()) {
-                    continue; // too soon
+void TMqttToSmartWebGateway::RunSafe(const std::function<void()>& fn)
+{
+    try {
+        fn();
+    } catch (const TUnsupportedError& e) {
+        DebugMqttToSw.Log() << "[" << (int)DriverState.ProgramId << "] " << e.what();
+    } catch (const TDriverError& e) {
+        WarnMqttToSw.Log() << "[" << (int)DriverState.ProgramId << "] " << e.what();
+    } catch (const std::exception& e) {
+        ErrorMqttToSw.Log() << "[" << (int)DriverState.ProgramId << "] " << e.what();
+        exit(1);
+    }
+}
+
+//   can0  0015AC0B   [8]  00 00 00 00 00 00 00 00  (CONTROLLER: JOURNAL (Get controller journal notes))
+//   can0  000AAC0B   [0]                           (CONTROLLER: GET_CHANNEL_NUMBER (Узнать количество
+//   входов/выходов)) can0  0003AC0B   [0]                           (CONTROLLER: GET_ACTIVE_PROGRAMS_LIST (Узнать
+//   список активных программ)) can0  0001AC16   [4]  0B 01 00 00              (REMOTE_CONTROL: GET_PARAMETER_VALUE)
+//   can0  0001AC16   [4]  0B 1E 00 00              (REMOTE_CONTROL: GET_PARAMETER_VALUE)
+//   can0  0001AC16   [4]  0B 02 00 00              (REMOTE_CONTROL: GET_PARAMETER_VALUE)
+//   can0  0008AC0B   [0]                           (CONTROLLER: GET_CONTROLLER_TYPE (Узнать тип контроллера))
+//   can0  0018AC0B   [1]  00                       (CONTROLLER: GET_RELAY_MAPPING (Get controller output binding))
+//   can0  0001AC16   [4]  0B 1C 00 00              (REMOTE_CONTROL: GET_PARAMETER_VALUE)
+//   can0  0001AC16   [4]  0B 1D 00 00              (REMOTE_CONTROL: GET_PARAMETER_VALUE)
+//   can0  0001AC16   [6]  0B 05 00 09 8A 2F        (REMOTE_CONTROL: GET_PARAMETER_VALUE)
+
+void TMqttToSmartWebGateway::HandleFrame(const CAN::TFrame& frame)
+{
+    print_frame(DebugMqttToSw, frame, "[" + std::to_string(DriverState.ProgramId) + "] got frame");
+    ++HandledFrames;
+
+    RunSafe([&] {
+        if (Status == DS_IDLE) {
+            Status = DS_RUNNING;
+            InfoMqttToSw.Log() << "[" << (int)DriverState.ProgramId << "] CONNECTION ESTABILISHED. RUNNING";
+        }
+
+        ResetConnectionTime = now() + CONNECTION_TIMEOUT_MIN;
+
+        SmartWeb::TCanHeader header{0};
+        header.raw = frame.can_id;
+        HandleRequest(header, frame.data);
+
+        SendScheduledOutputs();
+        SendScheduledIAmHere();
+    });
+}
+
+void TMqttToSmartWebGateway::Tick()
+{
+    if (Status != DS_IDLE) {
+        if (ResetConnectionTime <= now()) {
+            Status = DS_IDLE;
+            InfoMqttToSw.Log() << "[" << (int)DriverState.ProgramId << "] CONNECTION LOST: TIMEOUT. IDLE";
+        }
+    }
+
+    RunSafe([&] {
+        if (Status == DS_RUNNING) {
+            SendScheduledOutputs();
+        }
+        SendScheduledIAmHere();
+    });
+}
+
+TMqttToSmartWebExecutor::TMqttToSmartWebExecutor(const std::vector<TMqttToSmartWebConfig>& controllers,
+                                                 std::shared_ptr<CAN::IPort> canPort,
+                                                 WBMQTT::PDeviceDriver driver)
+    : CanPort(canPort),
+      Driver(driver),
+      ReceivedFrames(0),
+      DroppedFrames(0)
+{
+    UpdateControllers(controllers);
+
+    if (Driver) {
+        EventHandler = Driver->On<TControlValueEvent>([this](const TControlValueEvent& event) {
+            auto deviceControl = TMqttChannel::to_string(event.Control->GetDevice()->GetId(), event.Control->GetId());
+            std::unique_lock<std::mutex> lk(ChannelsTimingMutex);
+            auto it = ChannelsTiming.find(deviceControl);
+            if (it != ChannelsTiming.end()) {
+                for (auto timing: it->second) {
+                    timing->refresh_last_update_timepoint();
                 }
             }
+        });
+    }
 
-            auto value = read_mqtt_value(channel.device, channel.control);
+    Enabled.store(true);
+    CanPort->AddHandler(this);
+    Thread = std::thread([this]() { TaskFn(); });
+}
 
-            frame.can_id = header.raw | CAN_EFF_FLAG;
-            memcpy(frame.data, &channel.mapping_point.raw, sizeof channel.mapping_point.raw);
-            frame.data[2] = 0xFF & value >> 8;
-            frame.data[3] = 0xFF & value;
+TMqttToSmartWebExecutor::~TMqttToSmartWebExecutor()
+{
+    if (Thread.joinable()) {
+        CanPort->RemoveHandler(this);
+        Enabled.store(false);
+        CanFramesCv.notify_all();
+        Thread.join();
+    }
+    if (EventHandler) {
+        Driver->RemoveEventHandler(EventHandler);
+    }
+}
 
-            send_frame(frame, "send output");
+void TMqttToSmartWebExecutor::UpdateControllers(const std::vector<TMqttToSmartWebConfig>& controllers)
+{
+    std::unique_lock<std::shared_mutex> lk(GatewaysMutex);
 
-            DebugMqttToSw.Log() << "[" << (int)DriverState.ProgramId << "] output {channel_id: " << (int)channel_id
-                                << "} <== " << SmartWeb::SensorData::ToDouble(value);
+    std::unordered_map<uint8_t, std::unique_ptr<TMqttToSmartWebGateway>> oldGateways;
+    for (auto& gateway: Gateways) {
+        auto programId = gateway->GetProgramId();
+        oldGateways.insert({programId, std::move(gateway)});
+    }
 
-            channel.postpone_send();
+    std::vector<std::unique_ptr<TMqttToSmartWebGateway>> gateways;
+    std::set<uint8_t> programIds;
+    for (const auto& controller: controllers) {
+        if (!programIds.insert(controller.ProgramId).second) {
+            ErrorMqttToSw.Log() << "Controller " << (int)controller.ProgramId << " is already defined";
+            continue;
         }
-    };
-
-    auto get_controller_type = [&](const SmartWeb::TCanHeader& header) {
-        auto response = get_response_frame(header);
-        response.can_dlc = 1;
-        response.data[0] = CONTROLLER_TYPE;
-        send_frame(response, "send controller type");
-    };
-
-    auto handle_request = [&](const SmartWeb::TCanHeader& header, const TFrameData& data) {
-        switch (header.rec.program_type) {
-            case SmartWeb::PT_CONTROLLER:
-                switch (header.rec.function_id) {
-                    case SmartWeb::Controller::Function::GET_CHANNEL_NUMBER:
-                        return get_channel_number(header);
-                    case SmartWeb::Controller::Function::GET_CONTROLLER_TYPE:
-                        return get_controller_type(header);
-                    case SmartWeb::Controller::Function::GET_OUTPUT_VALUE:
-                        return get_output_value(header, data);
-                    case SmartWeb::Controller::Function::I_AM_HERE:
-                        return i_am_here();
-                    default:
-                        throw TUnsupportedError("function id " + to_string((int)header.rec.function_id) +
-                                                " is unsupported");
-                }
-            case SmartWeb::PT_REMOTE_CONTROL:
-                switch (header.rec.function_id) {
-                    case SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE:
-                        return get_parameter_value(header, data);
-                    default:
-                        throw TUnsupportedError("function id " + to_string((int)header.rec.function_id) +
-                                                " is unsupported");
-                }
-            default:
-                throw TUnsupportedError("program_type " + to_string((int)header.rec.program_type) + " is unsupported");
+        auto old = oldGateways.find(controller.ProgramId);
+        if (old != oldGateways.end() && IsSameMapping(old->second->GetConfig(), controller)) {
+            gateways.push_back(std::move(old->second));
+            continue;
+        }
+        if (old != oldGateways.end()) {
+            InfoMqttToSw.Log() << "Controller " << (int)controller.ProgramId << " is changed";
+        }
+        gateways.push_back(std::make_unique<TMqttToSmartWebGateway>(controller, CanPort, Driver));
+    }
+    for (const auto& old: oldGateways) {
+        if (old.second && !programIds.count(old.first)) {
+            InfoMqttToSw.Log() << "Controller " << (int)old.first << " is removed";
         }
-    };
+    }
+    Gateways.swap(gateways);
+    UpdateLookupTables();
+    // Old gateways are destroyed after ChannelsTiming is updated, so the driver thread can't touch them
+}
 
-    TFrame frame{0};
+void TMqttToSmartWebExecutor::UpdateLookupTables()
+{
+    GatewaysByProgramId.clear();
+    GatewaysByHostId.clear();
+    std::unordered_map<std::string, std::vector<TMqttChannelTiming*>> channelsTiming;
+
+    for (const auto& gateway: Gateways) {
+        GatewaysByProgramId.insert({gateway->GetProgramId(), gateway.get()});
+        for (const auto& timing: gateway->GetConfig().MqttChannelsTiming) {
+            channelsTiming[timing.first].push_back(gateway->GetChannelTiming(timing.first));
+        }
+    }
 
-    SendIAmHereTime = now();
+    for (const auto& gateway: Gateways) {
+        for (uint8_t i = 0; i < gateway->GetOutputHostIdCount(); ++i) {
+            uint8_t hostId = gateway->GetProgramId() + i;
+            auto owner = GatewaysByProgramId.find(hostId);
+            if (i != 0 && owner != GatewaysByProgramId.end()) {
+                ErrorMqttToSw.Log() << "Outputs of controller " << (int)gateway->GetProgramId() << " with host id "
+                                    << (int)hostId << " conflict with controller " << (int)hostId;
+                continue;
+            }
+            if (!GatewaysByHostId.insert({hostId, gateway.get()}).second) {
+                ErrorMqttToSw.Log() << "Outputs of controller " << (int)gateway->GetProgramId() << " with host id "
+                                    << (int)hostId << " conflict with controller "
+                                    << (int)GatewaysByHostId[hostId]->GetProgramId();
+            }
+        }
+    }
 
-    SmartWeb::TCanHeader header{0};
+    std::unique_lock<std::mutex> lk(ChannelsTimingMutex);
+    ChannelsTiming.swap(channelsTiming);
+}
 
-    //   can0  0015AC0B   [8]  00 00 00 00 00 00 00 00  (CONTROLLER: JOURNAL (Get controller journal notes))
-    //   can0  000AAC0B   [0]                           (CONTROLLER: GET_CHANNEL_NUMBER (Узнать количество
-    //   входов/выходов)) can0  0003AC0B   [0]                           (CONTROLLER: GET_ACTIVE_PROGRAMS_LIST (Узнать
-    //   список активных программ)) can0  0001AC16   [4]  0B 01 00 00              (REMOTE_CONTROL: GET_PARAMETER_VALUE)
-    //   can0  0001AC16   [4]  0B 1E 00 00              (REMOTE_CONTROL: GET_PARAMETER_VALUE)
-    //   can0  0001AC16   [4]  0B 02 00 00              (REMOTE_CONTROL: GET_PARAMETER_VALUE)
-    //   can0  0008AC0B   [0]                           (CONTROLLER: GET_CONTROLLER_TYPE (Узнать тип контроллера))
-    //   can0  0018AC0B   [1]  00                       (CONTROLLER: GET_RELAY_MAPPING (Get controller output binding))
-    //   can0  0001AC16   [4]  0B 1C 00 00              (REMOTE_CONTROL: GET_PARAMETER_VALUE)
-    //   can0  0001AC16   [4]  0B 1D 00 00              (REMOTE_CONTROL: GET_PARAMETER_VALUE)
-    //   can0  0001AC16   [6]  0B 05 00 09 8A 2F        (REMOTE_CONTROL: GET_PARAMETER_VALUE)
+size_t TMqttToSmartWebExecutor::GetGatewayCount() const
+{
+    std::shared_lock<std::shared_mutex> lk(GatewaysMutex);
+    return Gateways.size();
+}
 
-    while (Enabled.load()) {
-        memset(&frame, 0, sizeof(TFrame));
+TMqttToSmartWebStats TMqttToSmartWebExecutor::GetStats()
+{
+    TMqttToSmartWebStats stats;
+    stats.ReceivedFrames = ReceivedFrames.load();
+    stats.DroppedFrames = DroppedFrames.load();
+    {
+        std::unique_lock<std::mutex> waitLock(CanFramesMutex);
+        stats.QueueLength = CanFrames.size();
+    }
+    std::shared_lock<std::shared_mutex> lk(GatewaysMutex);
+    for (const auto& gateway: Gateways) {
+        stats.Controllers.push_back(TMqttToSmartWebStats::TController{gateway->GetProgramId(),
+                                                                      gateway->GetStatus(),
+                                                                      gateway->GetHandledFrameCount()});
+    }
+    return stats;
+}
 
-        bool frame_for_me = SelectTimeout(frame);
+TMqttToSmartWebGateway* TMqttToSmartWebExecutor::FindGateway(const CAN::TFrame& frame) const
+{
+    SmartWeb::TCanHeader header;
+    header.raw = frame.can_id;
+    auto it = GatewaysByProgramId.find(header.rec.program_id);
+    if (it != GatewaysByProgramId.end()) {
+        return it->second;
+    }
+    if (header.rec.message_type == SmartWeb::MT_MSG_REQUEST && header.rec.program_type == SmartWeb::PT_CONTROLLER &&
+        header.rec.function_id == SmartWeb::Controller::Function::GET_OUTPUT_VALUE)
+    {
+        SmartWeb::TMappingPoint mapping_point;
+        memcpy(&mapping_point.raw, frame.data, 2);
+        it = GatewaysByHostId.find(mapping_point.hostID);
+        if (it != GatewaysByHostId.end()) {
+            return it->second;
+        }
+    }
+    return nullptr;
+}
 
-        if (!frame_for_me) {
-            if (Status != DS_IDLE) {
-                if (ResetConnectionTime <= now()) {
-                    Status = DS_IDLE;
-                    InfoMqttToSw.Log() << "[" << (int)DriverState.ProgramId << "] CONNECTION LOST: TIMEOUT. IDLE";
-                }
-            }
+bool TMqttToSmartWebExecutor::Handle(const CAN::TFrame& frame)
+{
+    {
+        std::shared_lock<std::shared_mutex> lk(GatewaysMutex);
+        if (!FindGateway(frame)) {
+            return false;
         }
+    }
+    ++ReceivedFrames;
+    std::unique_lock<std::mutex> waitLock(CanFramesMutex);
+    CanFrames.push(frame);
+    waitLock.unlock();
+    CanFramesCv.notify_all();
+    return true;
+}
 
-        if (frame_for_me) {
-            print_frame(DebugMqttToSw, frame, "[" + std::to_string(DriverState.ProgramId) + "] got frame");
+bool TMqttToSmartWebExecutor::SelectTimeout(CAN::TFrame& frame, TTimePoint deadline)
+{
+    std::unique_lock<std::mutex> waitLock(CanFramesMutex);
+    if (CanFrames.empty()) {
+        if (std::cv_status::timeout == CanFramesCv.wait_until(waitLock, deadline)) {
+            return false;
+        }
+        if (CanFrames.empty()) {
+            return false;
         }
+    }
+    frame = CanFrames.front();
+    CanFrames.pop();
+    return true;
+}
+
+void TMqttToSmartWebExecutor::TaskFn()
+{
+    WBMQTT::SetThreadName("MQTT to SW");
+    if (Driver) {
+        Driver->SetFilter(GetAllDevicesFilter());
+        Driver->WaitForReady();
+    }
 
-        try {
-            switch (Status) {
-                case DS_IDLE:
-                    if (frame_for_me) {
-                        Status = DS_RUNNING;
-                        InfoMqttToSw.Log() << "[" << (int)DriverState.ProgramId << "] CONNECTION ESTABILISHED. RUNNING";
-                    } else {
-                        send_scheduled_i_am_here();
-                        break;
-                    }
-
-                case DS_RUNNING:
-                    if (frame_for_me) {
-                        postpone_connection_reset();
-                        header.raw = frame.can_id;
-                        handle_request(header, frame.data);
-                    }
-
-                    send_scheduled_outputs();
-                    send_scheduled_i_am_here();
-
-                    break;
+    TFrame frame{0};
+    auto nextTick = now();
+
+    while (Enabled.load()) {
+        memset(&frame, 0, sizeof(TFrame));
+
+        if (SelectTimeout(frame, nextTick)) {
+            std::shared_lock<std::shared_mutex> lk(GatewaysMutex);
+            auto gateway = FindGateway(frame);
+            if (gateway) {
+                gateway->HandleFrame(frame);
+            } else {
+                ++DroppedFrames;
             }
+        }
 
-        } catch (const TUnsupportedError& e) {
-            DebugMqttToSw.Log() << "[" << (int)DriverState.ProgramId << "] " << e.what();
-        } catch (const TDriverError& e) {
-            WarnMqttToSw.Log() << "[" << (int)DriverState.ProgramId << "] " << e.what();
-        } catch (const std::exception& e) {
-            ErrorMqttToSw.Log() << "[" << (int)DriverState.ProgramId << "] " << e.what();
-            exit(1);
+        if (nextTick <= now()) {
+            std::shared_lock<std::shared_mutex> lk(GatewaysMutex);
+            for (auto& gateway: Gateways) {
+                gateway->Tick();
+            }
+            nextTick = now() + TICK_INTERVAL_MS;
         }
     }
-    Driver->RemoveEventHandler(onHandler);
-}
\ No newline at end of file
+}
@@ -1,10 +1,16 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <queue>
+#include <shared_mutex>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include <wblib/log.h>
 #include <wblib/wbmqtt.h>
@@ -17,6 +23,7 @@ using TTimeIntervalMs = std::chrono::milliseconds;
 using TTimeIntervalS = std::chrono::seconds;
 using TTimeIntervalMin = std::chrono::minutes;
 
+//! Number of outputs addressable by one host id (channelID of mapping point is 5 bits wide)
 const uint8_t CONTROLLER_OUTPUT_MAX = 32;
 
 enum EDriverStatus
@@ -31,7 +38,6 @@ struct TMqttChannel
     std::string control;
 
     void from_string(const std::string& deviceControl);
-    bool is_initialized() const;
     std::string to_string() const;
 
     static std::string to_string(const std::string& device, const std::string& control);
@@ -48,13 +54,64 @@ struct TChannelState
     void schedule_to_send();
 };
 
-struct TBroadcastChannel: TMqttChannel, TChannelState
+/**
+ * @brief Interned MQTT channel names. Every channel is stored once regardless of number of its mappings.
+ */
+class TMqttChannelNames
 {
+    std::vector<TMqttChannel> Channels;
+    std::unordered_map<std::string, uint16_t> Ids;
+
+public:
+    /**
+     * @brief Returns id of the channel, adds the channel if it is not known yet.
+     *        Throws TDriverError on malformed channel name.
+     */
+    uint16_t Intern(const std::string& deviceControl);
+
+    const TMqttChannel& Get(uint16_t id) const;
+
+    size_t Size() const;
+};
+
+struct TBroadcastChannel: TChannelState
+{
+    uint16_t OutputIndex;
+    uint16_t ChannelNameId;
     SmartWeb::TMappingPoint mapping_point;
 
     void schedule_to_send(const SmartWeb::TMappingPoint& mp);
 };
 
+/**
+ * @brief Sparse table of controller outputs sorted by output index.
+ *        Memory depends only on number of mapped outputs.
+ *        Output N is addressed by mapping point with hostID = ProgramId + N / CONTROLLER_OUTPUT_MAX
+ *        and channelID = N % CONTROLLER_OUTPUT_MAX.
+ */
+class TOutputMapping
+{
+    std::vector<TBroadcastChannel> Channels;
+
+public:
+    /**
+     * @brief Adds output. Returns false if the output is already mapped.
+     */
+    bool Add(uint16_t outputIndex, uint16_t channelNameId);
+
+    TBroadcastChannel* Find(uint16_t outputIndex);
+
+    size_t Size() const;
+
+    //! Number of host ids needed to address all mapped outputs
+    uint8_t GetHostIdCount() const;
+
+    std::vector<TBroadcastChannel>::iterator begin();
+    std::vector<TBroadcastChannel>::iterator end();
+    std::vector<TBroadcastChannel>::const_iterator begin() const;
+    std::vector<TBroadcastChannel>::const_iterator end() const;
+};
+
 struct TMqttChannelTiming
 {
 private:
@@ -75,45 +132,172 @@ public:
 struct TMqttToSmartWebConfig
 {
     uint8_t ProgramId;
-    std::unordered_map<uint32_t, TMqttChannel> ParameterMapping;
+    TMqttChannelNames ChannelNames;
+
+    //! Raw TParameterInfo to ChannelNames id mapping
+    std::unordered_map<uint32_t, uint16_t> ParameterMapping;
     std::unordered_map<std::string, TMqttChannelTiming> MqttChannelsTiming;
-    TBroadcastChannel OutputMapping[CONTROLLER_OUTPUT_MAX];
-    uint8_t ParameterCount = 0;
+    TOutputMapping OutputMapping;
+    uint16_t ParameterCount = 0;
 };
 
-class TMqttToSmartWebGateway: public CAN::IFrameHandler
+/**
+ * @brief Compares controller id and mapping of parameters, outputs and value timeouts.
+ *        Runtime state of channels is ignored.
+ */
+bool IsSameMapping(const TMqttToSmartWebConfig& c1, const TMqttToSmartWebConfig& c2);
+
+/**
+ * @brief State machine of a single virtual SmartWeb controller.
+ *        Has no thread of its own, all methods are called by TMqttToSmartWebExecutor
+ *        from its worker thread.
+ */
+class TMqttToSmartWebGateway
 {
     TMqttToSmartWebConfig DriverState;
     uint8_t CONTROLLER_TYPE; // SWX for now
     std::shared_ptr<CAN::IPort> CanPort;
     WBMQTT::PDeviceDriver Driver;
 
-    EDriverStatus Status = DS_IDLE;
+    //! Changed by the executor thread, read by statistics
+    std::atomic<EDriverStatus> Status;
+    std::atomic<uint64_t> HandledFrames;
+
     TTimePoint SendIAmHereTime;
     TTimePoint ResetConnectionTime;
 
+    CAN::TFrame GetResponseFrame(SmartWeb::TCanHeader header) const;
+    void SendFrame(CAN::TFrame& frame, const std::string& prefix);
+    int16_t ReadMqttValue(const std::string& deviceId, const std::string& controlId);
+
+    void SendIAmHere();
+    void SendScheduledIAmHere();
+    void SendScheduledOutputs();
+
+    void GetChannelNumber(const SmartWeb::TCanHeader& header);
+    void GetParameterValue(const SmartWeb::TCanHeader& header, const CAN::TFrameData& data);
+    void GetOutputValue(const SmartWeb::TCanHeader& header, const CAN::TFrameData& data);
+    void GetControllerType(const SmartWeb::TCanHeader& header);
+    void HandleRequest(const SmartWeb::TCanHeader& header, const CAN::TFrameData& data);
+
+    void RunSafe(const std::function<void()>& fn);
+
+public:
+    TMqttToSmartWebGateway(const TMqttToSmartWebConfig& config,
+                           std::shared_ptr<CAN::IPort> canPort,
+                           WBMQTT::PDeviceDriver driver);
+
+    uint8_t GetProgramId() const;
+    EDriverStatus GetStatus() const;
+    uint64_t GetHandledFrameCount() const;
+    const TMqttToSmartWebConfig& GetConfig() const;
+
+    /**
+     * @brief Returns true if GET_OUTPUT_VALUE requests with the host id are handled by the controller
+     */
+    bool IsOutputHost(uint8_t hostId) const;
+
+    uint8_t GetOutputHostIdCount() const;
+
+    /**
+     * @brief Returns timing of MQTT channel or nullptr if the channel is not used by the controller
+     */
+    TMqttChannelTiming* GetChannelTiming(const std::string& deviceControl);
+
+    /**
+     * @brief Handles request addressed to the controller
+     */
+    void HandleFrame(const CAN::TFrame& frame);
+
+    /**
+     * @brief Sends scheduled outputs and keepalive messages, checks connection timeout.
+     *        Must be called periodically.
+     */
+    void Tick();
+};
+
+struct TMqttToSmartWebStats
+{
+    struct TController
+    {
+        uint8_t ProgramId;
+        EDriverStatus Status;
+        uint64_t HandledFrames;
+    };
+
+    //! Requests to controllers put into the queue
+    uint64_t ReceivedFrames = 0;
+
+    //! Queued requests of controllers removed before the requests were handled
+    uint64_t DroppedFrames = 0;
+
+    size_t QueueLength = 0;
+
+    std::vector<TController> Controllers;
+};
+
+/**
+ * @brief Runs all virtual SmartWeb controllers on a single thread.
+ *        Frames are dispatched to controllers by program id,
+ *        so thread count does not depend on the number of controllers.
+ */
+class TMqttToSmartWebExecutor: public CAN::IFrameHandler
+{
+    std::shared_ptr<CAN::IPort> CanPort;
+    WBMQTT::PDeviceDriver Driver;
+    WBMQTT::PDriverEventHandlerHandle EventHandler = nullptr;
+
+    //! Guards controllers and their lookup tables. Exclusively locked only on controllers update
+    mutable std::shared_mutex GatewaysMutex;
+
+    std::vector<std::unique_ptr<TMqttToSmartWebGateway>> Gateways;
+
+    //! Program id to controller mapping
+    std::unordered_map<uint8_t, TMqttToSmartWebGateway*> GatewaysByProgramId;
+
+    //! Mapping point host id to controller mapping
+    std::unordered_map<uint8_t, TMqttToSmartWebGateway*> GatewaysByHostId;
+
+    //! Guards ChannelsTiming, it is used from MQTT driver thread. Driver must not be called under the lock
+    std::mutex ChannelsTimingMutex;
+
+    //! MQTT channel to timings of all controllers using the channel
+    std::unordered_map<std::string, std::vector<TMqttChannelTiming*>> ChannelsTiming;
+
     std::mutex CanFramesMutex;
     std::condition_variable CanFramesCv;
     std::queue<CAN::TFrame> CanFrames;
 
+    std::atomic<uint64_t> ReceivedFrames;
+    std::atomic<uint64_t> DroppedFrames;
+
     std::thread Thread;
     std::atomic_bool Enabled;
 
-    static bool FilterIsSet;
-    static std::mutex StartupMutex;
-
-    bool SelectTimeout(CAN::TFrame& frame);
+    TMqttToSmartWebGateway* FindGateway(const CAN::TFrame& frame) const;
+    void UpdateLookupTables();
+    bool SelectTimeout(CAN::TFrame& frame, TTimePoint deadline);
     void TaskFn();
-    bool Handle(const CAN::TFrame& frame);
-    bool IsForMe(const SmartWeb::TCanHeader& header, const CAN::TFrameData& data) const;
+    bool Handle(const CAN::TFrame& frame) override;
 
 public:
-    TMqttToSmartWebGateway(const TMqttToSmartWebConfig& config,
-                           std::shared_ptr<CAN::IPort> canPort,
-                           WBMQTT::PDeviceDriver driver);
-    ~TMqttToSmartWebGateway();
+    /**
+     * @param driver may be nullptr if controllers do not need MQTT values (e.g. in benchmarks)
+     */
+    TMqttToSmartWebExecutor(const std::vector<TMqttToSmartWebConfig>& controllers,
+                            std::shared_ptr<CAN::IPort> canPort,
+                            WBMQTT::PDeviceDriver driver);
+    ~TMqttToSmartWebExecutor();
+
+    /**
+     * @brief Applies new controllers list. Controllers with unchanged mapping keep their state,
+     *        changed controllers are restarted, missing controllers are removed.
+     */
+    void UpdateControllers(const std::vector<TMqttToSmartWebConfig>& controllers);
+
+    size_t GetGatewayCount() const;
 
-    void Stop();
+    TMqttToSmartWebStats GetStats();
 };
 
 void print_frame(WBMQTT::TLogger& logger, const CAN::TFrame& frame, const std::string& prefix);
\ No newline at end of file
@@ -0,0 +1,147 @@
+#include "ParametersRpc.h"
+
+#include <set>
+#include <stdexcept>
+
+#include "log.h"
+
+namespace
+{
+    const auto RPC_SERVICE = "parameters";
+
+    uint8_t GetProgramId(const Json::Value& params)
+    {
+        if (!params.isObject() || !params["program_id"].isUInt() || params["program_id"].asUInt() > 0xFF) {
+            throw std::runtime_error("'program_id' must be a number from 0 to 255");
+        }
+        return params["program_id"].asUInt();
+    }
+
+    TBulkResultCallback MakeResultCallback(uint8_t programId,
+                                           WBMQTT::TMqttRpcMethodResultCallback onResult,
+                                           WBMQTT::TMqttRpcMethodErrorCallback onError)
+    {
+        return [programId, onResult, onError](const std::string& error,
+                                              const std::vector<TBulkParameterResult>& results) {
+            if (!error.empty()) {
+                onError(WBMQTT::TMqttRpcErrorCode::REQUEST_HANDLING_ERROR, error);
+                return;
+            }
+            onResult(MakeParametersRpcResponse(programId, results));
+        };
+    }
+}
+
+TParametersRpcRequest ParseReadParametersRequest(const Json::Value& params)
+{
+    TParametersRpcRequest res;
+    res.ProgramId = GetProgramId(params);
+    const auto& names = params["parameters"];
+    if (names.isNull() || (names.isString() && names.asString() == "all")) {
+        return res;
+    }
+    if (!names.isArray() || names.empty()) {
+        throw std::runtime_error("'parameters' must be \"all\" or a non-empty array of parameter names");
+    }
+    std::set<std::string> uniqueNames;
+    for (const auto& name: names) {
+        if (!name.isString()) {
+            throw std::runtime_error("'parameters' must contain only strings");
+        }
+        // Results are keyed by names, so a duplicate would hide the result of the first request
+        if (!uniqueNames.insert(name.asString()).second) {
+            throw std::runtime_error("Parameter '" + name.asString() + "' is requested twice");
+        }
+        res.Values.emplace_back(name.asString(), std::string());
+    }
+    return res;
+}
+
+TParametersRpcRequest ParseWriteParametersRequest(const Json::Value& params)
+{
+    TParametersRpcRequest res;
+    res.ProgramId = GetProgramId(params);
+    const auto& values = params["values"];
+    if (!values.isObject() || values.empty()) {
+        throw std::runtime_error("'values' must be a non-empty object with parameter names as keys");
+    }
+    for (auto it = values.begin(); it != values.end(); ++it) {
+        if (!it->isString() && !it->isNumeric() && !it->isBool()) {
+            throw std::runtime_error("Value of '" + it.name() + "' must be a string or a number");
+        }
+        res.Values.emplace_back(it.name(), it->isBool() ? (it->asBool() ? "1" : "0") : it->asString());
+    }
+    return res;
+}
+
+Json::Value MakeParametersRpcResponse(uint8_t programId, const std::vector<TBulkParameterResult>& results)
+{
+    Json::Value res(Json::objectValue);
+    res["program_id"] = programId;
+    auto& parameters = res["parameters"];
+    parameters = Json::Value(Json::objectValue);
+    for (const auto& result: results) {
+        Json::Value item(Json::objectValue);
+        if (result.Error.empty() || !result.Value.empty()) {
+            item["value"] = result.Value;
+        }
+        if (!result.Error.empty()) {
+            item["error"] = result.Error;
+        }
+        parameters[result.Name] = item;
+    }
+    return res;
+}
+
+TParametersRpcHandler::TParametersRpcHandler(WBMQTT::PMqttRpcServer rpcServer, TSmartWebToMqttGateway& gateway)
+    : Gateway(gateway)
+{
+    rpcServer->RegisterAsyncMethod(RPC_SERVICE,
+                                   "Read",
+                                   [this](const Json::Value& params,
+                                          WBMQTT::TMqttRpcMethodResultCallback onResult,
+                                          WBMQTT::TMqttRpcMethodErrorCallback onError) {
+                                       Read(params, onResult, onError);
+                                   });
+    rpcServer->RegisterAsyncMethod(RPC_SERVICE,
+                                   "Write",
+                                   [this](const Json::Value& params,
+                                          WBMQTT::TMqttRpcMethodResultCallback onResult,
+                                          WBMQTT::TMqttRpcMethodErrorCallback onError) {
+                                       Write(params, onResult, onError);
+                                   });
+}
+
+void TParametersRpcHandler::Read(const Json::Value& params,
+                                 WBMQTT::TMqttRpcMethodResultCallback onResult,
+                                 WBMQTT::TMqttRpcMethodErrorCallback onError)
+{
+    TParametersRpcRequest request;
+    try {
+        request = ParseReadParametersRequest(params);
+    } catch (const std::exception& e) {
+        onError(WBMQTT::TMqttRpcErrorCode::REQUEST_HANDLING_ERROR, e.what());
+        return;
+    }
+    std::vector<std::string> names;
+    for (const auto& value: request.Values) {
+        names.push_back(value.first);
+    }
+    Gateway.BulkRead(request.ProgramId, names, MakeResultCallback(request.ProgramId, onResult, onError));
+}
+
+void TParametersRpcHandler::Write(const Json::Value& params,
+                                  WBMQTT::TMqttRpcMethodResultCallback onResult,
+                                  WBMQTT::TMqttRpcMethodErrorCallback onError)
+{
+    TParametersRpcRequest request;
+    try {
+        request = ParseWriteParametersRequest(params);
+    } catch (const std::exception& e) {
+        onError(WBMQTT::TMqttRpcErrorCode::REQUEST_HANDLING_ERROR, e.what());
+        return;
+    }
+    InfoSwToMqtt.Log() << "Write of " << request.Values.size() << " parameter(s) to program "
+                       << (int)request.ProgramId << " is requested over RPC";
+    Gateway.BulkWrite(request.ProgramId, request.Values, MakeResultCallback(request.ProgramId, onResult, onError));
+}
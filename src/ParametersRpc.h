@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <wblib/rpc.h>
+
+#include "SmartWebToMqttGateway.h"
+
+/**
+ * @brief Parsed params of parameters/Read and parameters/Write RPC methods
+ */
+struct TParametersRpcRequest
+{
+    uint8_t ProgramId = 0;
+
+    //! Parameter names and values, values are empty for reads. Empty list of reads means all parameters
+    std::vector<std::pair<std::string, std::string>> Values;
+};
+
+/**
+ * @brief Parses {"program_id": 10, "parameters": ["name", ...]}.
+ *        Missing "parameters" or "all" instead of the list means all parameters of the program.
+ *        Throws std::runtime_error on invalid request.
+ */
+TParametersRpcRequest ParseReadParametersRequest(const Json::Value& params);
+
+/**
+ * @brief Parses {"program_id": 10, "values": {"name": "value", ...}}. Numbers are accepted as values.
+ *        Throws std::runtime_error on invalid request.
+ */
+TParametersRpcRequest ParseWriteParametersRequest(const Json::Value& params);
+
+/**
+ * @brief Builds {"program_id": 10, "parameters": {"name": {"value": "..."}, "name2": {"error": "..."}}}.
+ *        Written parameters with error have both fields, the value is the one read back from the program.
+ */
+Json::Value MakeParametersRpcResponse(uint8_t programId, const std::vector<TBulkParameterResult>& results);
+
+/**
+ * @brief Registers parameters/Read and parameters/Write methods for bulk access to program parameters,
+ *        e.g. for backup and restore of controller settings.
+ */
+class TParametersRpcHandler
+{
+    TSmartWebToMqttGateway& Gateway;
+
+    void Read(const Json::Value& params,
+              WBMQTT::TMqttRpcMethodResultCallback onResult,
+              WBMQTT::TMqttRpcMethodErrorCallback onError);
+
+    void Write(const Json::Value& params,
+               WBMQTT::TMqttRpcMethodResultCallback onResult,
+               WBMQTT::TMqttRpcMethodErrorCallback onError);
+
+public:
+    TParametersRpcHandler(WBMQTT::PMqttRpcServer rpcServer, TSmartWebToMqttGateway& gateway);
+};
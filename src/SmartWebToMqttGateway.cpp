@@ -1,7 +1,11 @@
 #include "SmartWebToMqttGateway.h"
 
+#include <algorithm>
+#include <set>
+#include <stdio.h>
 #include <string.h>
 #include <wblib/exceptions.h>
+#include <wblib/json_utils.h>
 
 #include "exceptions.h"
 #include "log.h"
@@ -13,6 +17,104 @@ namespace
     const int16_t SENSOR_SHORT_VALUE = -32768;
     const int16_t SENSOR_OPEN_VALUE = -32767;
     const int16_t SENSOR_UNDEFINED = -32766;
+
+    uint32_t MakeValueKey(uint8_t programType, TParameterKind kind, uint8_t parameterId)
+    {
+        return (uint32_t(programType) << 16) | (uint32_t(kind) << 8) | parameterId;
+    }
+
+    //! Metadata requests sent for every parameter by metadata discovery in this order
+    const uint8_t METADATA_FUNCTIONS[] = {SmartWeb::RemoteControl::Function::GET_PARAMETER_NAME,
+                                          SmartWeb::RemoteControl::Function::GET_PARAMETER_MINIMUM,
+                                          SmartWeb::RemoteControl::Function::GET_PARAMETER_MAXIMUM,
+                                          SmartWeb::RemoteControl::Function::GET_PARAMETER_DEFAULT,
+                                          SmartWeb::RemoteControl::Function::GET_PARAMETER_UNIT};
+    const size_t METADATA_FUNCTIONS_COUNT = sizeof(METADATA_FUNCTIONS) / sizeof(METADATA_FUNCTIONS[0]);
+
+    bool ParseNumber(const std::string& str, double& value)
+    {
+        try {
+            size_t pos = 0;
+            value = std::stod(str, &pos);
+            return pos == str.size();
+        } catch (const std::exception& e) {
+            return false;
+        }
+    }
+
+    //! Returns printable ASCII characters of GET_PARAMETER_NAME or GET_PARAMETER_UNIT response up to zero byte
+    std::string DecodeMetadataText(const CAN::TFrame& frame)
+    {
+        std::string res;
+        for (size_t i = 2; i < frame.can_dlc && frame.data[i] != 0; ++i) {
+            if (frame.data[i] >= 0x20 && frame.data[i] < 0x7F) {
+                res += char(frame.data[i]);
+            }
+        }
+        return res;
+    }
+
+    //! Formats bytes of GET_SMARTNET_PROTOCOL_VERSION response as dot separated numbers
+    std::string FormatFirmwareVersion(const CAN::TFrame& frame)
+    {
+        std::string res;
+        for (size_t i = 0; i < frame.can_dlc; ++i) {
+            if (i != 0) {
+                res += ".";
+            }
+            res += std::to_string(frame.data[i]);
+        }
+        return res.empty() ? "0" : res;
+    }
+
+    std::string GetDeviceId(const TSmartWebClass& cl, uint8_t programId)
+    {
+        return "sw " + cl.Name + " " + std::to_string(programId);
+    }
+
+    const TSmartWebParameterTable& GetParameterTable(const TSmartWebClass& cl, TParameterKind kind)
+    {
+        switch (kind) {
+            case TParameterKind::INPUT:
+                return cl.Inputs;
+            case TParameterKind::OUTPUT:
+                return cl.Outputs;
+            default:
+                return cl.Parameters;
+        }
+    }
+
+    /**
+     * @brief Periodic task running until the function returns false
+     */
+    class TFunctionTask: public ITask
+    {
+        std::chrono::microseconds Period;
+        std::function<bool()> Fn;
+        std::string Name;
+
+    public:
+        TFunctionTask(const std::chrono::microseconds& period, std::function<bool()> fn, const std::string& name)
+            : Period(period),
+              Fn(fn),
+              Name(name)
+        {}
+
+        bool Run() override
+        {
+            return Fn();
+        }
+
+        const std::string& GetName() const override
+        {
+            return Name;
+        }
+
+        const std::chrono::microseconds& GetPeriod() const override
+        {
+            return Period;
+        }
+    };
 }
 
 TEnumCodec::TEnumCodec(const std::map<uint8_t, std::string>& values): Values(values)
@@ -49,6 +151,11 @@ std::string TEnumCodec::GetName() const
     return "TEnumCodec (" + res + ")";
 }
 
+const std::map<uint8_t, std::string>& TEnumCodec::GetValues() const
+{
+    return Values;
+}
+
 std::string TSensorCodec::Decode(const uint8_t* buf) const
 {
     int16_t v;
@@ -133,214 +240,1696 @@ std::string TOutputCodec::GetName() const
     return "TOutputCodec";
 }
 
+std::string TScheduleCodec::Decode(const uint8_t* buf) const
+{
+    std::string res;
+    for (size_t i = 0; i < CELL_SIZE; ++i) {
+        char byte[3];
+        snprintf(byte, sizeof(byte), "%02x", buf[i]);
+        res += byte;
+    }
+    return res;
+}
+
+std::vector<uint8_t> TScheduleCodec::Encode(const std::string& value) const
+{
+    throw std::runtime_error("schedules are readonly");
+}
+
+std::string TScheduleCodec::GetName() const
+{
+    return "TScheduleCodec";
+}
+
+std::string TScheduleCodec::FormatTable(const std::vector<std::string>& cells) const
+{
+    Json::Value res(Json::arrayValue);
+    for (size_t row = 0; row < ROWS; ++row) {
+        Json::Value rowCells(Json::arrayValue);
+        for (size_t column = 0; column < COLUMNS; ++column) {
+            rowCells.append(cells.at(row * COLUMNS + column));
+        }
+        res.append(rowCells);
+    }
+    Json::StreamWriterBuilder writerBuilder;
+    writerBuilder["indentation"] = "";
+    return Json::writeString(writerBuilder, res);
+}
+
+bool TSmartWebParameterTable::Add(const TSmartWebParameter& param)
+{
+    if (param.Id > MAX_ID) {
+        throw std::runtime_error("parameter id " + std::to_string(param.Id) + " is out of range");
+    }
+    if (Find(param.Id)) {
+        return false;
+    }
+    auto it = std::lower_bound(Items.begin(), Items.end(), param.Id, [](const auto& item, auto id) {
+        return item.Id < id;
+    });
+    Items.insert(it, param);
+    if (Index.size() <= param.Id) {
+        Index.resize(param.Id + 1, 0);
+    }
+    for (size_t i = 0; i < Items.size(); ++i) {
+        Index[Items[i].Id] = i + 1;
+    }
+    return true;
+}
+
+const TSmartWebParameter* TSmartWebParameterTable::Find(uint32_t id) const
+{
+    if (id >= Index.size() || Index[id] == 0) {
+        return nullptr;
+    }
+    return &Items[Index[id] - 1];
+}
+
+std::shared_ptr<const TSmartWebParameter> ShareParameter(const TSmartWebParameter& param)
+{
+    std::shared_ptr<const TSmartWebClass> cl;
+    if (param.ProgramClass) {
+        cl = ShareClass(*param.ProgramClass);
+    }
+    // Aliasing constructor, the parameter is a part of its class
+    return std::shared_ptr<const TSmartWebParameter>(cl, &param);
+}
+
+std::shared_ptr<const TSmartWebClass> ShareClass(const TSmartWebClass& cl)
+{
+    auto res = cl.weak_from_this().lock();
+    return res ? res : std::shared_ptr<const TSmartWebClass>(res, &cl);
+}
+
+size_t TSmartWebParameterTable::size() const
+{
+    return Items.size();
+}
+
+bool TSmartWebParameterTable::empty() const
+{
+    return Items.empty();
+}
+
+std::vector<TSmartWebParameter>::const_iterator TSmartWebParameterTable::begin() const
+{
+    return Items.begin();
+}
+
+std::vector<TSmartWebParameter>::const_iterator TSmartWebParameterTable::end() const
+{
+    return Items.end();
+}
+
 TSmartWebToMqttGateway::TSmartWebToMqttGateway(const TSmartWebToMqttConfig& config,
                                                std::shared_ptr<CAN::IPort> canPort,
-                                               WBMQTT::PDeviceDriver driver)
+                                               WBMQTT::PDeviceDriver driver,
+                                               const std::string& stateFilePath,
+                                               const std::string& metadataCacheFilePath)
     : Config(config),
+      CanPort(canPort),
       Driver(driver),
-      RequestIndex(0),
-      Scheduler(MakeSimpleThreadedScheduler("SW to MQTT"))
+      PollPlan(std::make_shared<TPollPlan>()),
+      PollPlanVersion(0),
+      CurrentPollPlan(PollPlan),
+      CurrentPollPlanVersion(0),
+      CurrentPollRequestCount(0),
+      PassiveSkippedRequests(0),
+      SentPollRequests(0),
+      PollCycleRequests(0),
+      PollCycleStart(std::chrono::steady_clock::now()),
+      PollCycleDurationMs(0),
+      PassiveListen(config.PassiveListen),
+      ForeignValueResponses(0),
+      StartTime(std::chrono::steady_clock::now()),
+      LastReadBackId(0),
+      OfflineMisses(config.OfflineMisses),
+      Scheduler(MakeSimpleThreadedScheduler("SW to MQTT")),
+      StateChanged(false),
+      StateFilePath(stateFilePath),
+      MetadataChanged(false),
+      MetadataCacheFilePath(metadataCacheFilePath)
 {
-    EventHandler = Driver->On<WBMQTT::TControlOnValueEvent>([this, canPort](const WBMQTT::TControlOnValueEvent& event) {
+    for (auto& counter: UnansweredRequests) {
+        counter.store(0);
+    }
+    for (auto& time: LastResponseTimes) {
+        time.store(0);
+    }
+    for (auto& offline: ProgramOffline) {
+        offline.store(false);
+    }
+
+    // The task is woken up by new writes, the period is only a fallback
+    WriteTask = Scheduler->AddTask(MakePeriodicTask(
+        WRITE_TASK_PERIOD,
+        [this]() { this->WriteParameters(); },
+        "SmartWeb write task"));
+
+    // The handler is called from MQTT driver thread, so it must not wait for CAN port
+    EventHandler = Driver->On<WBMQTT::TControlOnValueEvent>([this](const WBMQTT::TControlOnValueEvent& event) {
         try {
             auto param = event.Control->GetUserData().As<TSmartWebParameterControl>();
-            auto frame = MakeSetParameterValueRequest(param, event.RawValue);
-            canPort->Send(frame);
-            print_frame(DebugSwToMqtt, frame, "Set value request");
+            if (!param.Parameter) {
+                // Known programs can't be accessed from MQTT driver thread
+                auto programId = param.ProgramId;
+                auto controlId = event.Control->GetId();
+                auto value = event.RawValue;
+                Scheduler->AddTask(std::make_shared<TFunctionTask>(
+                    std::chrono::microseconds(0),
+                    [this, programId, controlId, value]() {
+                        this->HandleProgramControl(programId, controlId, value);
+                        return false;
+                    },
+                    "SmartWeb program control"));
+                return;
+            }
+            if (WriteQueue.Push(TParameterWriteQueue::TWrite{param, event.RawValue, event.Control})) {
+                Scheduler->RescheduleTask(WriteTask, std::chrono::steady_clock::now());
+            }
         } catch (const std::exception& e) {
             ErrorSwToMqtt.Log() << "Set value request: " << e.what();
         }
     });
 
-    Scheduler->AddTask(MakePeriodicTask(
-        config.PollInterval,
-        [this, canPort]() { this->HandleMapping(*canPort); },
-        "SmartWeb->MQTT task"));
+    // Metadata goes first to create restored controls with it
+    LoadMetadata();
+    RestoreState();
+    {
+        std::unique_lock<std::mutex> lk(KnownProgramsMutex);
+        PublishClasses();
+    }
+
+    AddPollTask();
+    AddProbeTask();
+
+    if (!StateFilePath.empty()) {
+        StateTask = Scheduler->AddTask(MakePeriodicTask(
+            STATE_SAVE_INTERVAL,
+            [this]() { this->SaveState(); },
+            "SmartWeb state saving task"));
+    }
+
+    Transactions = std::make_unique<CAN::TTransactions>(canPort, GetResponseTransactionKey);
 
     CanReader = std::make_unique<TThreadedCanReader>(
         "SmartWeb->MQTT reader",
         canPort,
         100,
         [this](const CAN::TFrame& frame) { return AcceptFrame(frame); },
-        [this](const CAN::TFrame& frame) { HandleFrame(frame); });
+        [this](const CAN::TFrame& frame) { HandleFrame(frame); },
+        Config.FrameWorkers,
+        [](const CAN::TFrame& frame) {
+            // Frames of a program are handled by one worker in order of receiving
+            SmartWeb::TCanHeader* header = (SmartWeb::TCanHeader*)&frame.can_id;
+            return header->rec.program_id;
+        });
+
+    if (Config.MetadataDiscovery) {
+        std::unique_lock<std::mutex> lk(KnownProgramsMutex);
+        for (const auto& program: KnownPrograms) {
+            QueueMetadataDiscovery(program.first);
+        }
+        AddMetadataTask();
+    }
+
+    StartDiscovery();
 }
 
 TSmartWebToMqttGateway::~TSmartWebToMqttGateway()
 {
+    TTaskStats stats;
+    if (Scheduler->GetTaskStats(PollTask, stats)) {
+        InfoSwToMqtt.Log() << stats.Name << ": " << stats.Runtime.Count << " runs, lateness avg "
+                           << stats.Lateness.GetAverage().count() << " us, p99 "
+                           << stats.Lateness.GetPercentile(99).count() << " us, max " << stats.Lateness.Max.count()
+                           << " us, runtime avg " << stats.Runtime.GetAverage().count() << " us, max "
+                           << stats.Runtime.Max.count() << " us, skipped runs " << stats.SkippedRuns
+                           << ", requests skipped in passive listen mode " << PassiveSkippedRequests.load();
+    }
+    Driver->RemoveEventHandler(EventHandler);
     Scheduler.reset();
+    Transactions.reset();
     CanReader.reset();
-    Driver->RemoveEventHandler(EventHandler);
+    SaveState();
     auto tx = Driver->BeginTx();
-    for (const auto& d: DeviceIds) {
-        tx->RemoveDeviceById(d).Sync();
+    for (const auto& d: DeviceClassNames) {
+        tx->RemoveDeviceById(d.first).Sync();
     }
 }
 
-void TSmartWebToMqttGateway::HandleFrame(const CAN::TFrame& frame)
+void TSmartWebToMqttGateway::AddPollTask()
 {
-    SmartWeb::TCanHeader* header = (SmartWeb::TCanHeader*)&frame.can_id;
-    if (header->rec.program_type == SmartWeb::PT_PROGRAM &&
-        header->rec.function_id == SmartWeb::Program::Function::I_AM_PROGRAM)
-    {
-        AddProgram(frame);
-        return;
-    }
+    auto pollInterval = Config.PollInterval;
+    PollTask = Scheduler->AddTask(MakePeriodicTask(
+        pollInterval,
+        [this, pollInterval]() { this->HandleMapping(*CanPort, pollInterval); },
+        "SmartWeb->MQTT task",
+        TScheduleMode::FIXED_RATE_SKIP));
+}
 
-    if (header->rec.program_type == SmartWeb::PT_REMOTE_CONTROL &&
-        header->rec.function_id == SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE)
-    {
-        HandleGetValueResponse(frame);
+void TSmartWebToMqttGateway::WriteParameters()
+{
+    for (const auto& write: WriteQueue.PopAll()) {
+        bool error = false;
+        try {
+            auto frame = MakeSetParameterValueRequest(write.Param, write.Value);
+            CanPort->Send(frame);
+            print_frame(DebugSwToMqtt, frame, "Set value request");
+            AddReadBack(write, frame);
+        } catch (const std::exception& e) {
+            ErrorSwToMqtt.Log() << "Set value request: " << e.what();
+            error = true;
+        }
+        SetWriteError(write.Control, error);
     }
+    CompleteReadBacks();
 }
 
-bool TSmartWebToMqttGateway::AcceptFrame(const CAN::TFrame& frame) const
+void TSmartWebToMqttGateway::AddReadBack(const TParameterWriteQueue::TWrite& write, const CAN::TFrame& setFrame)
 {
-    if (!(frame.can_id & CAN_EFF_FLAG)) {
-        return false;
-    }
+    const auto& param = *write.Param.Parameter;
+    SmartWeb::TParameterData* data = (SmartWeb::TParameterData*)&setFrame.data;
 
-    SmartWeb::TCanHeader* header = (SmartWeb::TCanHeader*)&frame.can_id;
-    if (header->rec.message_type != SmartWeb::MT_MSG_RESPONSE) {
-        return false;
+    // Value is published as the program will decode it, e.g. with rounding
+    std::string value(write.Value);
+    try {
+        value = param.Codec->Decode(data->value);
+    } catch (const std::exception& e) {
+        DebugSwToMqtt.Log() << "Can't decode written value '" << write.Value << "': " << e.what();
     }
-
-    if (header->rec.program_type == SmartWeb::PT_PROGRAM &&
-        header->rec.function_id == SmartWeb::Program::Function::I_AM_PROGRAM)
     {
-        return true;
+        auto& values = ProgramValues[write.Param.ProgramId];
+        std::unique_lock<std::mutex> lk(values.Mutex);
+        auto valueKey = MakeValueKey(param.ProgramClass->Type, TParameterKind::PARAMETER, param.Id);
+        values.PendingReadBacks[valueKey] = TPendingReadBack{value, write.Control, ++LastReadBackId};
+    }
+    if (write.Control) {
+        try {
+            auto tx = Driver->BeginTx();
+            write.Control->SetRawValue(tx, value).Sync();
+        } catch (const std::exception& e) {
+            ErrorSwToMqtt.Log() << "Failed to publish written value: " << e.what();
+        }
     }
 
-    if (header->rec.program_type == SmartWeb::PT_REMOTE_CONTROL &&
-        header->rec.function_id == SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE)
+    // The program handles requests in order, so the response contains the written value.
+    // Response to a read sent before the write may have the old value, StartFresh doesn't take it
+    auto readBackFrame =
+        MakeGetParameterValueRequest(write.Param.ProgramId,
+                                     TParameterRequest{2, {param.ProgramClass->Type, uint8_t(param.Id), 0}});
+    print_frame(DebugSwToMqtt, readBackFrame, "Send read-back request");
+    auto programId = write.Param.ProgramId;
+    auto parameter = write.Param.Parameter;
+    auto id = LastReadBackId;
+    Transactions->StartFresh(readBackFrame,
+                             MakeTransactionKey(readBackFrame),
+                             READ_BACK_TIMEOUT,
+                             READ_BACK_RETRIES,
+                             [this, programId, parameter, id](const CAN::TTransactionResult& result) {
+                                 std::unique_lock<std::mutex> lk(this->ReadBackResultsMutex);
+                                 this->ReadBackResults.push_back(TReadBackResult{programId, parameter, id, result});
+                             });
+}
+
+void TSmartWebToMqttGateway::CompleteReadBacks()
+{
+    std::vector<TReadBackResult> results;
     {
-        return true;
+        std::unique_lock<std::mutex> lk(ReadBackResultsMutex);
+        results.swap(ReadBackResults);
+    }
+    for (const auto& result: results) {
+        const auto& param = *result.Param;
+        auto valueKey = MakeValueKey(param.ProgramClass->Type, TParameterKind::PARAMETER, param.Id);
+        TPendingReadBack readBack;
+        std::string lastValue;
+        {
+            auto& values = ProgramValues[result.ProgramId];
+            std::unique_lock<std::mutex> lk(values.Mutex);
+            auto pending = values.PendingReadBacks.find(valueKey);
+            if (pending == values.PendingReadBacks.end() || pending->second.Id != result.Id) {
+                continue;
+            }
+            readBack = pending->second;
+            values.PendingReadBacks.erase(pending);
+            auto last = values.LastValues.find(valueKey);
+            if (last != values.LastValues.end()) {
+                lastValue = last->second;
+            }
+        }
+        if (result.Result.Ok) {
+            try {
+                SmartWeb::TParameterData* data = (SmartWeb::TParameterData*)&result.Result.Response.data;
+                auto value = param.Codec->Decode(data->value);
+                if (readBack.Value == value) {
+                    DebugSwToMqtt.Log() << "Write of '" << param.ProgramClass->Name << "':" << (int)result.ProgramId
+                                        << " " << param.Name << " is confirmed";
+                } else {
+                    WarnSwToMqtt.Log() << "Value '" << readBack.Value << "' written to '" << param.ProgramClass->Name
+                                       << "':" << (int)result.ProgramId << " " << param.Name
+                                       << " is not applied, actual value is '" << value << "'";
+                }
+            } catch (const std::exception& e) {
+                WarnSwToMqtt.Log() << "Can't decode read-back of '" << param.ProgramClass->Name
+                                   << "':" << (int)result.ProgramId << " " << param.Name << ": " << e.what();
+            }
+            continue;
+        }
+        WarnSwToMqtt.Log() << "No read-back of value '" << readBack.Value << "' written to '"
+                           << param.ProgramClass->Name << "':" << (int)result.ProgramId << " " << param.Name
+                           << ", the value is rolled back";
+        if (readBack.Control) {
+            try {
+                auto tx = Driver->BeginTx();
+                if (!lastValue.empty()) {
+                    readBack.Control->SetRawValue(tx, lastValue).Sync();
+                }
+                readBack.Control->SetError(tx, "w").Sync();
+            } catch (const std::exception& e) {
+                ErrorSwToMqtt.Log() << "Failed to roll back written value: " << e.what();
+            }
+        }
     }
+}
 
-    return false;
+void TSmartWebToMqttGateway::BulkRead(uint8_t programId,
+                                      const std::vector<std::string>& names,
+                                      TBulkResultCallback callback)
+{
+    std::vector<std::pair<std::string, std::string>> values;
+    for (const auto& name: names) {
+        values.emplace_back(name, std::string());
+    }
+    // Known programs can't be accessed from MQTT threads
+    Scheduler->AddTask(std::make_shared<TFunctionTask>(
+        std::chrono::microseconds(0),
+        [this, programId, values, callback]() {
+            this->StartBulkRequest(programId, values, false, callback);
+            return false;
+        },
+        "SmartWeb bulk read"));
 }
 
-void TSmartWebToMqttGateway::HandleMapping(CAN::IPort& canPort)
+void TSmartWebToMqttGateway::BulkWrite(uint8_t programId,
+                                       const std::vector<std::pair<std::string, std::string>>& values,
+                                       TBulkResultCallback callback)
 {
-    CAN::TFrame frame;
+    Scheduler->AddTask(std::make_shared<TFunctionTask>(
+        std::chrono::microseconds(0),
+        [this, programId, values, callback]() {
+            this->StartBulkRequest(programId, values, true, callback);
+            return false;
+        },
+        "SmartWeb bulk write"));
+}
+
+void TSmartWebToMqttGateway::StartBulkRequest(uint8_t programId,
+                                              std::vector<std::pair<std::string, std::string>> values,
+                                              bool write,
+                                              TBulkResultCallback callback)
+{
+    auto request = std::make_shared<TBulkRequest>();
+    request->Pending = 0;
+    request->Callback = callback;
+
+    struct TParameterRequests
+    {
+        size_t Index;
+        std::shared_ptr<const TSmartWebParameter> Param;
+        CAN::TFrame SetRequest;
+        CAN::TFrame GetRequest;
+    };
+    std::vector<TParameterRequests> requests;
     {
-        std::unique_lock<std::mutex> lk(RequestMutex);
-        if (Requests.empty()) {
+        std::unique_lock<std::mutex> lk(KnownProgramsMutex);
+        auto cl = KnownPrograms.find(programId);
+        if (cl == KnownPrograms.end()) {
+            lk.unlock();
+            callback("Unknown program " + std::to_string(programId), {});
             return;
         }
-        if (RequestIndex == Requests.size()) {
-            RequestIndex = 0;
+        auto params = GetProgramParameters(*cl->second, Config.Classes);
+        if (values.empty() && !write) {
+            for (const auto& p: params) {
+                if (!GetScheduleCodec(*p)) {
+                    values.emplace_back(p->Name, std::string());
+                }
+            }
+        }
+        std::unordered_set<const TSmartWebParameter*> requestedParams;
+        for (const auto& value: values) {
+            TBulkParameterResult result{value.first, std::string(), std::string()};
+            auto p = std::find_if(params.begin(), params.end(), [&](const auto& candidate) {
+                return candidate->Name == value.first;
+            });
+            if (p == params.end()) {
+                result.Error = "unknown parameter";
+            } else if (!requestedParams.insert(*p).second) {
+                result.Error = "duplicate parameter";
+            } else if (write && (*p)->ReadOnly) {
+                result.Error = "read-only parameter";
+            } else if (GetScheduleCodec(**p)) {
+                result.Error = "table parameter";
+            } else {
+                const auto& param = **p;
+                TParameterRequests paramRequests{request->Results.size(), ShareParameter(param), {}, {}};
+                TParameterRequest getRequest{2, {param.ProgramClass->Type, uint8_t(param.Id), 0}};
+                paramRequests.GetRequest = MakeGetParameterValueRequest(programId, getRequest);
+                try {
+                    if (write) {
+                        TSmartWebParameterControl pc{programId, paramRequests.Param};
+                        paramRequests.SetRequest = MakeSetParameterValueRequest(pc, value.second);
+                        // Written value as the program will decode it, it is compared with read-back
+                        SmartWeb::TParameterData* data = (SmartWeb::TParameterData*)&paramRequests.SetRequest.data;
+                        result.Value = param.Codec->Decode(data->value);
+                    }
+                    requests.push_back(paramRequests);
+                } catch (const std::exception& e) {
+                    result.Error = e.what();
+                }
+            }
+            request->Results.push_back(result);
         }
-        frame = Requests[RequestIndex];
     }
-    try {
-        canPort.Send(frame);
-        print_frame(DebugSwToMqtt, frame, "Send request");
-    } catch (const std::exception& e) {
-        print_frame(ErrorSwToMqtt, frame, std::string("Send request: ") + e.what());
+    if (requests.empty()) {
+        callback(std::string(), request->Results);
+        return;
+    }
+    request->Pending = requests.size();
+
+    // Requests are sent one after another without waiting for responses
+    for (const auto& paramRequests: requests) {
+        if (write) {
+            try {
+                CanPort->Send(paramRequests.SetRequest);
+                print_frame(DebugSwToMqtt, paramRequests.SetRequest, "Send bulk write request");
+            } catch (const std::exception& e) {
+                // Read-back reports the value kept by the program
+                print_frame(ErrorSwToMqtt,
+                            paramRequests.SetRequest,
+                            std::string("Send bulk write request: ") + e.what());
+            }
+        }
+        auto index = paramRequests.Index;
+        auto param = paramRequests.Param;
+        auto onResponse = [this, request, index, param, write](const CAN::TTransactionResult& response) {
+            this->CompleteBulkRequest(request, index, *param, write, response);
+        };
+        const auto& frame = paramRequests.GetRequest;
+        auto key = MakeTransactionKey(frame);
+        if (write) {
+            // Response to a read sent before the write may have the old value
+            Transactions->StartFresh(frame, key, BULK_REQUEST_TIMEOUT, BULK_REQUEST_RETRIES, onResponse);
+        } else {
+            Transactions->Start(frame, key, BULK_REQUEST_TIMEOUT, BULK_REQUEST_RETRIES, onResponse);
+        }
     }
-    ++RequestIndex;
 }
 
-CAN::TFrame MakeSetParameterValueRequest(const TSmartWebParameterControl& param, const std::string& value)
+void TSmartWebToMqttGateway::CompleteBulkRequest(const std::shared_ptr<TBulkRequest>& request,
+                                                 size_t index,
+                                                 const TSmartWebParameter& param,
+                                                 bool write,
+                                                 const CAN::TTransactionResult& response)
 {
-    CAN::TFrame frame{0};
-    SmartWeb::TParameterData pd;
-    pd.program_type = param.Parameter->ProgramClass->Type;
-    pd.parameter_id = param.Parameter->Id;
-    try {
-        auto bytes = param.Parameter->Codec->Encode(value);
-        memcpy(pd.value, bytes.data(), bytes.size());
-        frame.can_dlc = bytes.size() + 2;
-        memcpy(frame.data, &pd.raw, frame.can_dlc);
-    } catch (std::exception& e) {
-        throw std::runtime_error("Can't encode '" + value + "' for '" + param.Parameter->ProgramClass->Name + "'(" +
-                                 std::to_string(int(param.ProgramId)) + "):'" + param.Parameter->Name + "'");
+    std::unique_lock<std::mutex> lk(request->Mutex);
+    auto& result = request->Results[index];
+    if (!response.Ok) {
+        result.Error = "timeout";
+    } else {
+        try {
+            SmartWeb::TParameterData* data = (SmartWeb::TParameterData*)&response.Response.data;
+            auto value = param.Codec->Decode(data->value);
+            if (write && result.Value != value) {
+                result.Error = "value is not applied";
+            }
+            result.Value = value;
+        } catch (const std::exception& e) {
+            result.Error = e.what();
+        }
+    }
+    if (--request->Pending == 0) {
+        lk.unlock();
+        request->Callback(std::string(), request->Results);
     }
-    SmartWeb::TCanHeader header{0};
-    header.rec.program_type = SmartWeb::PT_REMOTE_CONTROL;
-    header.rec.program_id = param.ProgramId;
-    header.rec.function_id = SmartWeb::RemoteControl::Function::SET_PARAMETER_VALUE;
-    header.rec.message_type = SmartWeb::MT_MSG_REQUEST;
-    frame.can_id = header.raw | CAN_EFF_FLAG;
-    return frame;
 }
 
-void AddRequests(std::vector<CAN::TFrame>& requests,
-                 const std::string& programType,
-                 const TSmartWebClass& cl,
-                 uint8_t programId,
-                 const std::unordered_map<uint8_t, std::shared_ptr<TSmartWebClass>>& classes)
+void TSmartWebToMqttGateway::SetWriteError(const WBMQTT::PControl& control, bool error)
 {
-    CAN::TFrame frame{0};
-    SmartWeb::TCanHeader header{0};
-    header.rec.program_type = SmartWeb::PT_REMOTE_CONTROL;
-    header.rec.program_id = programId;
-    header.rec.function_id = SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE;
-    header.rec.message_type = SmartWeb::MT_MSG_REQUEST;
-    frame.can_id = header.raw | CAN_EFF_FLAG;
-
-    SmartWeb::TParameterData pd;
-    pd.program_type = SmartWeb::PT_PROGRAM;
-    pd.parameter_id = SmartWeb::RemoteControl::Parameters::SENSOR;
-    frame.can_dlc = 3;
-    for (const auto& i: cl.Inputs) {
-        pd.indexed_parameter.index = i.first;
-        memcpy(frame.data, &pd.raw, frame.can_dlc);
-        requests.push_back(frame);
+    if (!control) {
+        return;
     }
-
-    pd.program_type = SmartWeb::PT_PROGRAM;
-    pd.parameter_id = SmartWeb::RemoteControl::Parameters::OUTPUT;
-    for (const auto& o: cl.Outputs) {
-        pd.indexed_parameter.index = o.first;
-        memcpy(frame.data, &pd.raw, frame.can_dlc);
-        requests.push_back(frame);
+    try {
+        if (error) {
+            auto tx = Driver->BeginTx();
+            control->SetError(tx, "w").Sync();
+        } else if (control->GetError() == "w") {
+            auto tx = Driver->BeginTx();
+            control->SetError(tx, "").Sync();
+        }
+    } catch (const std::exception& e) {
+        ErrorSwToMqtt.Log() << "Failed to set write error: " << e.what();
     }
+}
 
-    pd.program_type = cl.Type;
-    frame.can_dlc = 2;
-    for (const auto& p: cl.Parameters) {
-        pd.parameter_id = p.first;
-        memcpy(frame.data, &pd.raw, frame.can_dlc);
-        requests.push_back(frame);
-    }
+void TSmartWebToMqttGateway::AddProbeTask()
+{
+    ProbeTask = Scheduler->AddTask(MakePeriodicTask(
+        Config.OfflineProbeInterval,
+        [this]() { this->SendProbeRequests(); },
+        "SmartWeb offline probe task"));
+}
 
-    for (const auto& c: cl.ParentClasses) {
-        bool ok = false;
-        for (const auto& cl: classes) {
-            if (cl.second->Name == c) {
-                AddRequests(requests, programType, *cl.second, programId, classes);
-                ok = true;
-                break;
+void TSmartWebToMqttGateway::SendProbeRequests()
+{
+    std::vector<CAN::TFrame> frames;
+    {
+        std::unique_lock<std::mutex> lk(KnownProgramsMutex);
+        for (auto programId: OfflinePrograms) {
+            auto cl = KnownPrograms.find(programId);
+            if (cl == KnownPrograms.end()) {
+                continue;
+            }
+            if (cl->second->RequestTemplate.empty()) {
+                frames.push_back(MakeGetProgramTypeRequest(programId));
+            } else {
+                frames.push_back(MakeGetParameterValueRequest(programId, cl->second->RequestTemplate.front()));
             }
         }
-        if (!ok && c != "PROGRAM") {
-            WarnSwToMqtt.Log() << "Unknown program type: '" << c << "'";
+    }
+    for (const auto& frame: frames) {
+        try {
+            CanPort->Send(frame);
+            print_frame(DebugSwToMqtt, frame, "Send probe request");
+        } catch (const std::exception& e) {
+            print_frame(ErrorSwToMqtt, frame, std::string("Send probe request: ") + e.what());
         }
     }
 }
 
-void TSmartWebToMqttGateway::AddProgram(const CAN::TFrame& frame)
+void TSmartWebToMqttGateway::SetProgramOffline(uint8_t programId)
 {
-    SmartWeb::TCanHeader* header = (SmartWeb::TCanHeader*)&frame.can_id;
-    if (KnownPrograms.count(header->rec.program_id)) {
+    std::unique_lock<std::mutex> lk(KnownProgramsMutex);
+    auto cl = KnownPrograms.find(programId);
+    if (cl == KnownPrograms.end() || !OfflinePrograms.insert(programId).second) {
         return;
     }
-    if (frame.can_dlc != 3) {
-        print_frame(DebugSwToMqtt,
-                    frame,
-                    "Invalid I_AM_PROGRAM frame. Expected exactly 3 bytes of data. Possibly the firmware is too old");
+    ProgramOffline[programId].store(true);
+    WarnSwToMqtt.Log() << "Program '" << cl->second->Name << "':" << (int)programId << " doesn't answer "
+                       << OfflineMisses.load() << " requests, it is polled only by probe requests";
+    auto plan = std::make_shared<TPollPlan>(*PollPlan);
+    plan->RemoveProgram(programId);
+    PublishPollPlan(plan);
+
+    auto controls = ProgramControls.find(programId);
+    if (controls == ProgramControls.end()) {
         return;
     }
-    auto cl = Config.Classes.find(frame.data[2]);
-    if (cl == Config.Classes.end()) {
-        print_frame(DebugSwToMqtt, frame, "Unknown program type");
-        return;
+    try {
+        auto tx = Driver->BeginTx();
+        for (const auto& control: controls->second) {
+            auto device = tx->GetDevice(control.first);
+            auto c = device ? device->GetControl(control.second) : nullptr;
+            if (c) {
+                c->SetError(tx, "r").Sync();
+            }
+        }
+    } catch (const std::exception& e) {
+        ErrorSwToMqtt.Log() << "Failed to mark controls of offline program: " << e.what();
     }
-    InfoSwToMqtt.Log() << "New program '" << cl->second->Name << "':" << (int)header->rec.program_id << " is found";
-    KnownPrograms.insert({header->rec.program_id, cl->second.get()});
-    std::unique_lock<std::mutex> lk(RequestMutex);
-    AddRequests(Requests, cl->second->Name, *cl->second, header->rec.program_id, Config.Classes);
+}
+
+void TSmartWebToMqttGateway::SetProgramOnline(uint8_t programId)
+{
+    if (!OfflinePrograms.erase(programId)) {
+        return;
+    }
+    ProgramOffline[programId].store(false);
+    auto cl = KnownPrograms.find(programId);
+    if (cl == KnownPrograms.end()) {
+        return;
+    }
+    InfoSwToMqtt.Log() << "Program '" << cl->second->Name << "':" << (int)programId << " is online again";
+    // Errors of controls are cleared by new values, see SetParameter
+    auto plan = std::make_shared<TPollPlan>(*PollPlan);
+    plan->AddProgram(programId, cl->second);
+    PublishPollPlan(plan);
+    // Discovery is interrupted when the program goes offline
+    QueueMetadataDiscovery(programId);
+}
+
+void TSmartWebToMqttGateway::StartDiscovery()
+{
+    NextDiscoveryProgramId = 0;
+    DiscoveryTask = Scheduler->AddTask(std::make_shared<TFunctionTask>(
+        DISCOVERY_REQUEST_INTERVAL,
+        [this]() { return this->SendNextDiscoveryRequest(); },
+        "SmartWeb discovery task"));
+}
+
+bool TSmartWebToMqttGateway::SendNextDiscoveryRequest()
+{
+    uint8_t programId;
+    {
+        std::unique_lock<std::mutex> lk(KnownProgramsMutex);
+        while (NextDiscoveryProgramId <= 0xFF && KnownPrograms.count(NextDiscoveryProgramId)) {
+            ++NextDiscoveryProgramId;
+        }
+        if (NextDiscoveryProgramId > 0xFF) {
+            InfoSwToMqtt.Log() << "Discovery scan is finished, " << KnownPrograms.size() << " program(s) are known";
+            return false;
+        }
+        programId = NextDiscoveryProgramId++;
+    }
+    auto frame = MakeGetProgramTypeRequest(programId);
+    try {
+        CanPort->Send(frame);
+        print_frame(DebugSwToMqtt, frame, "Send discovery request");
+    } catch (const std::exception& e) {
+        print_frame(ErrorSwToMqtt, frame, std::string("Send discovery request: ") + e.what());
+    }
+    return true;
+}
+
+void TSmartWebToMqttGateway::RebuildRequests()
+{
+    auto plan = std::make_shared<TPollPlan>();
+    for (const auto& program: KnownPrograms) {
+        if (!OfflinePrograms.count(program.first)) {
+            plan->AddProgram(program.first, program.second);
+        }
+    }
+    PublishPollPlan(plan);
+}
+
+void TSmartWebToMqttGateway::PublishPollPlan(std::shared_ptr<const TPollPlan> plan)
+{
+    // Plans share ownership of their classes, so pollers can use an old plan after config reload
+    std::atomic_store(&PollPlan, plan);
+    PollPlanVersion.fetch_add(1, std::memory_order_release);
+}
+
+void TSmartWebToMqttGateway::PublishClasses()
+{
+    auto classes = std::make_shared<TClassSnapshot>();
+    for (const auto& program: KnownPrograms) {
+        classes->Programs[program.first] = ShareClass(*program.second);
+    }
+    classes->Classes = Config.Classes;
+    std::atomic_store(&Classes, std::shared_ptr<const TClassSnapshot>(classes));
+}
+
+void TSmartWebToMqttGateway::UpdateConfig(const TSmartWebToMqttConfig& config)
+{
+    std::unique_lock<std::mutex> lk(KnownProgramsMutex);
+
+    // Unchanged classes are kept, so MQTT controls can still use their parameters.
+    // A class is replaced with its ancestors, because TableParameters point to parameters of ancestors.
+    // Replaced classes are freed when their last user releases them, see ShareClass
+    TSmartWebToMqttConfig::TClasses classes(config.Classes);
+    std::unordered_set<uint8_t> sameTypes;
+    std::unordered_set<std::string> replacedNames;
+    for (const auto& oldClass: Config.Classes) {
+        auto newClass = classes.find(oldClass.first);
+        if (newClass != classes.end() && IsSameClass(*oldClass.second, *newClass->second)) {
+            sameTypes.insert(oldClass.first);
+        } else {
+            replacedNames.insert(oldClass.second->Name);
+        }
+    }
+    for (const auto& newClass: classes) {
+        if (!sameTypes.count(newClass.first)) {
+            replacedNames.insert(newClass.second->Name);
+        }
+    }
+    for (bool replaced = true; replaced;) {
+        replaced = false;
+        for (auto type = sameTypes.begin(); type != sameTypes.end();) {
+            const auto& cl = *classes[*type];
+            auto isReplaced = [&](const std::string& parent) { return replacedNames.count(parent) > 0; };
+            if (std::any_of(cl.ParentClasses.begin(), cl.ParentClasses.end(), isReplaced)) {
+                replacedNames.insert(cl.Name);
+                type = sameTypes.erase(type);
+                replaced = true;
+            } else {
+                ++type;
+            }
+        }
+    }
+
+    std::vector<std::shared_ptr<TSmartWebClass>> changedClasses;
+    std::unordered_set<uint8_t> changedTypes;
+    bool hasNewClasses = false;
+    for (const auto& oldClass: Config.Classes) {
+        if (sameTypes.count(oldClass.first)) {
+            classes[oldClass.first] = oldClass.second;
+            continue;
+        }
+        InfoSwToMqtt.Log() << "Class '" << oldClass.second->Name << "' (program type = " << (int)oldClass.first
+                           << ") is " << (classes.count(oldClass.first) ? "changed" : "removed");
+        changedClasses.push_back(oldClass.second);
+        changedTypes.insert(oldClass.first);
+    }
+    for (const auto& newClass: classes) {
+        if (!Config.Classes.count(newClass.first)) {
+            InfoSwToMqtt.Log() << "Class '" << newClass.second->Name << "' (program type = " << (int)newClass.first
+                               << ") is added";
+            hasNewClasses = true;
+        }
+    }
+    Config.Classes.swap(classes);
+
+    for (auto program = KnownPrograms.begin(); program != KnownPrograms.end();) {
+        auto cl = Config.Classes.find(program->second->Type);
+        if (cl == Config.Classes.end()) {
+            // Devices of ancestors declaring parameters of the program are deleted too
+            try {
+                auto tx = Driver->BeginTx();
+                std::unordered_set<std::string> devices;
+                for (const auto& control: ProgramControls[program->first]) {
+                    if (devices.insert(control.first).second) {
+                        tx->RemoveDeviceById(control.first).Sync();
+                        DeviceClassNames.erase(control.first);
+                    }
+                }
+            } catch (const std::exception& e) {
+                ErrorSwToMqtt.Log() << "Failed to remove devices of program: " << e.what();
+            }
+            {
+                auto& values = ProgramValues[program->first];
+                std::unique_lock<std::mutex> valuesLk(values.Mutex);
+                values.LastValues.clear();
+                values.PendingReadBacks.clear();
+            }
+            FirmwareVersions.erase(program->first);
+            OfflinePrograms.erase(program->first);
+            ProgramOffline[program->first].store(false);
+            ProgramControls.erase(program->first);
+            program = KnownPrograms.erase(program);
+        } else {
+            program->second = cl->second.get();
+            ++program;
+        }
+    }
+
+    if (!changedClasses.empty()) {
+        RemoveChangedControls(changedClasses);
+        try {
+            auto tx = Driver->BeginTx();
+            for (const auto& program: KnownPrograms) {
+                if (changedTypes.count(program.second->Type)) {
+                    CreateProgramControls(tx, *program.second, program.first);
+                    CreateParameterControls(tx, *program.second, program.first);
+                }
+            }
+        } catch (const std::exception& e) {
+            ErrorSwToMqtt.Log() << "Failed to create controls of changed classes: " << e.what();
+        }
+        StateChanged = true;
+    }
+
+    RebuildRequests();
+    PublishClasses();
+
+    if (Config.PollInterval != config.PollInterval) {
+        Config.PollInterval = config.PollInterval;
+        Scheduler->CancelTask(PollTask);
+        AddPollTask();
+    }
+
+    if (Config.FrameWorkers != config.FrameWorkers) {
+        WarnSwToMqtt.Log() << "Change of frame workers count requires restart";
+    }
+    Config.PassiveListen = config.PassiveListen;
+    PassiveListen.store(config.PassiveListen);
+    Config.OfflineMisses = config.OfflineMisses;
+    OfflineMisses.store(config.OfflineMisses);
+    if (Config.OfflineProbeInterval != config.OfflineProbeInterval) {
+        Config.OfflineProbeInterval = config.OfflineProbeInterval;
+        Scheduler->CancelTask(ProbeTask);
+        AddProbeTask();
+    }
+    if (Config.MetadataDiscovery != config.MetadataDiscovery) {
+        Config.MetadataDiscovery = config.MetadataDiscovery;
+        if (Config.MetadataDiscovery) {
+            for (const auto& program: KnownPrograms) {
+                QueueMetadataDiscovery(program.first);
+            }
+            AddMetadataTask();
+        } else {
+            Scheduler->CancelTask(MetadataTask);
+            MetadataQueue.clear();
+            MetadataDiscovery = TMetadataDiscovery();
+        }
+    }
+
+    // Programs of new classes were ignored before, find them again
+    if (hasNewClasses) {
+        Scheduler->CancelTask(DiscoveryTask);
+        StartDiscovery();
+    }
+}
+
+void TSmartWebToMqttGateway::RemoveChangedControls(const std::vector<std::shared_ptr<TSmartWebClass>>& oldClasses)
+{
+    // Controls are created in devices of classes declaring the parameters, see SetParameter.
+    // Unchanged writable controls keep parameters of old classes in user data, they are encoded the same way
+    std::unordered_set<std::string> removedClasses;
+    std::unordered_map<std::string, std::unordered_set<std::string>> removedControls;
+    std::unordered_set<uint32_t> removedValues;
+    for (const auto& oldClass: oldClasses) {
+        auto newClass = Config.Classes.find(oldClass->Type);
+        if (newClass == Config.Classes.end() || newClass->second->Name != oldClass->Name) {
+            removedClasses.insert(oldClass->Name);
+        }
+        auto diff = [&](const TSmartWebParameterTable& oldParams,
+                        const TSmartWebParameterTable* newParams,
+                        TParameterKind kind) {
+            for (const auto& p: oldParams) {
+                auto newParam = newParams ? newParams->Find(p.Id) : nullptr;
+                if (!newParam || !IsSameParameter(p, *newParam)) {
+                    removedControls[oldClass->Name].insert(p.Name);
+                    removedValues.insert(MakeValueKey(oldClass->Type, kind, p.Id));
+                }
+            }
+        };
+        const TSmartWebClass* cl = removedClasses.count(oldClass->Name) ? nullptr : newClass->second.get();
+        diff(oldClass->Inputs, cl ? &cl->Inputs : nullptr, TParameterKind::INPUT);
+        diff(oldClass->Outputs, cl ? &cl->Outputs : nullptr, TParameterKind::OUTPUT);
+        diff(oldClass->Parameters, cl ? &cl->Parameters : nullptr, TParameterKind::PARAMETER);
+    }
+
+    std::unordered_set<std::string> removedDevices;
+    try {
+        auto tx = Driver->BeginTx();
+        for (auto device = DeviceClassNames.begin(); device != DeviceClassNames.end();) {
+            if (removedClasses.count(device->second)) {
+                removedDevices.insert(device->first);
+                tx->RemoveDeviceById(device->first).Sync();
+                device = DeviceClassNames.erase(device);
+                continue;
+            }
+            auto controls = removedControls.find(device->second);
+            auto d = std::dynamic_pointer_cast<WBMQTT::TLocalDevice>(tx->GetDevice(device->first));
+            if (controls != removedControls.end() && d) {
+                for (const auto& controlId: controls->second) {
+                    if (d->GetControl(controlId)) {
+                        d->RemoveControl(tx, controlId).Sync();
+                    }
+                }
+            }
+            ++device;
+        }
+    } catch (const std::exception& e) {
+        ErrorSwToMqtt.Log() << "Failed to remove controls of changed classes: " << e.what();
+    }
+    for (auto& controls: ProgramControls) {
+        auto isRemoved = [&](const std::pair<std::string, std::string>& control) {
+            if (removedDevices.count(control.first)) {
+                return true;
+            }
+            auto className = DeviceClassNames.find(control.first);
+            if (className == DeviceClassNames.end()) {
+                return false;
+            }
+            auto classControls = removedControls.find(className->second);
+            return classControls != removedControls.end() && classControls->second.count(control.second) > 0;
+        };
+        controls.second.erase(std::remove_if(controls.second.begin(), controls.second.end(), isRemoved),
+                              controls.second.end());
+    }
+    for (auto& values: ProgramValues) {
+        std::unique_lock<std::mutex> valuesLk(values.Mutex);
+        for (auto key: removedValues) {
+            values.LastValues.erase(key);
+            values.PendingReadBacks.erase(key);
+        }
+    }
+}
+
+void TSmartWebToMqttGateway::HandleFrame(const CAN::TFrame& frame)
+{
+    SmartWeb::TCanHeader* header = (SmartWeb::TCanHeader*)&frame.can_id;
+    auto programId = header->rec.program_id;
+
+    // All accepted frames are responses, any of them proves that the program is alive
+    LastResponseTimes[programId].store(GetTimeMs());
+    UnansweredRequests[programId].store(0);
+    if (ProgramOffline[programId].load()) {
+        std::unique_lock<std::mutex> lk(KnownProgramsMutex);
+        SetProgramOnline(programId);
+    }
+
+    if (header->rec.program_type == SmartWeb::PT_PROGRAM &&
+        header->rec.function_id == SmartWeb::Program::Function::I_AM_PROGRAM)
+    {
+        std::unique_lock<std::mutex> lk(KnownProgramsMutex);
+        AddProgram(frame);
+        return;
+    }
+
+    if (header->rec.program_type == SmartWeb::PT_PROGRAM &&
+        header->rec.function_id == SmartWeb::Program::Function::GET_PROGRAM_TYPE)
+    {
+        // Response of discovery scan, the first byte is the program type
+        if (frame.can_dlc < 1) {
+            print_frame(DebugSwToMqtt, frame, "Invalid GET_PROGRAM_TYPE frame. Expected program type");
+            return;
+        }
+        std::unique_lock<std::mutex> lk(KnownProgramsMutex);
+        AddProgram(programId, frame.data[0], frame);
+        return;
+    }
+
+    if (header->rec.program_type == SmartWeb::PT_REMOTE_CONTROL &&
+        header->rec.function_id == SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE)
+    {
+        // Values are decoded and published without KnownProgramsMutex, so workers handle their programs
+        // in parallel, see TSmartWebToMqttConfig::FrameWorkers
+        TControlUpdate update;
+        if (!HandleGetValueResponse(*std::atomic_load(&Classes), frame, update)) {
+            return;
+        }
+        if (!SetControlValue(update)) {
+            std::unique_lock<std::mutex> lk(KnownProgramsMutex);
+            CreateValueControl(update);
+        }
+    }
+}
+
+bool TSmartWebToMqttGateway::AcceptFrame(const CAN::TFrame& frame) const
+{
+    if (!(frame.can_id & CAN_EFF_FLAG)) {
+        return false;
+    }
+
+    SmartWeb::TCanHeader* header = (SmartWeb::TCanHeader*)&frame.can_id;
+    if (header->rec.message_type != SmartWeb::MT_MSG_RESPONSE) {
+        return false;
+    }
+
+    if (header->rec.program_type == SmartWeb::PT_PROGRAM &&
+        (header->rec.function_id == SmartWeb::Program::Function::I_AM_PROGRAM ||
+         header->rec.function_id == SmartWeb::Program::Function::GET_PROGRAM_TYPE))
+    {
+        return true;
+    }
+
+    if (header->rec.program_type == SmartWeb::PT_REMOTE_CONTROL &&
+        header->rec.function_id == SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE)
+    {
+        return true;
+    }
+
+    return false;
+}
+
+uint32_t TSmartWebToMqttGateway::GetTimeMs() const
+{
+    auto time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - StartTime);
+    return static_cast<uint32_t>(time.count());
+}
+
+void TSmartWebToMqttGateway::HandleMapping(CAN::IPort& canPort, std::chrono::milliseconds pollInterval)
+{
+    // Programs going offline are removed from the plan before the next request is taken
+    CountMisses();
+
+    auto version = PollPlanVersion.load(std::memory_order_acquire);
+    if (version != CurrentPollPlanVersion) {
+        CurrentPollPlan = std::atomic_load(&PollPlan);
+        CurrentPollPlanVersion = version;
+        CurrentPollRequestCount = CurrentPollPlan->GetRequestCount();
+    }
+    CAN::TFrame frame;
+    if (PriorityPolling.GetNextRequest(frame, std::chrono::steady_clock::now())) {
+        SendPollRequest(canPort, frame);
+        return;
+    }
+    if (!CurrentPollPlan->GetNextRequest(PollCursor, frame)) {
+        return;
+    }
+    CountPollCycleRequest();
+    if (PassiveListen.load()) {
+        // Values seen during the last poll cycle are skipped, every value is read at least once per cycle
+        uint32_t cycleMs = std::min<uint64_t>(CurrentPollRequestCount * pollInterval.count(), UINT32_MAX);
+        auto now = GetTimeMs();
+        auto isRecent = [&]() {
+            SmartWeb::TCanHeader* header = (SmartWeb::TCanHeader*)&frame.can_id;
+            return ValueTimestamps.IsRecent(MakeValueRequestKey(header->rec.program_id, frame.data), now, cycleMs);
+        };
+        size_t skipped = 0;
+        while (isRecent()) {
+            ++PassiveSkippedRequests;
+            if (++skipped >= CurrentPollRequestCount || !CurrentPollPlan->GetNextRequest(PollCursor, frame)) {
+                return;
+            }
+            CountPollCycleRequest();
+        }
+    }
+    SendPollRequest(canPort, frame);
+}
+
+void TSmartWebToMqttGateway::SendPollRequest(CAN::IPort& canPort, const CAN::TFrame& frame)
+{
+    try {
+        auto programId = ((SmartWeb::TCanHeader*)&frame.can_id)->rec.program_id;
+        auto requestKey = MakeValueRequestKey(programId, frame.data);
+        auto now = GetTimeMs();
+        SentRequests.Update(requestKey, now);
+        PendingPollRequests.push_back({now, programId, requestKey});
+        canPort.Send(frame);
+        ++SentPollRequests;
+        print_frame(DebugSwToMqtt, frame, "Send request");
+    } catch (const std::exception& e) {
+        print_frame(ErrorSwToMqtt, frame, std::string("Send request: ") + e.what());
+    }
+}
+
+void TSmartWebToMqttGateway::CountMisses()
+{
+    auto now = GetTimeMs();
+    while (!PendingPollRequests.empty()) {
+        const auto& request = PendingPollRequests.front();
+        if (uint32_t(now - request.SendTimeMs) < POLL_RESPONSE_TIMEOUT.count()) {
+            return;
+        }
+        auto programId = request.ProgramId;
+        bool answeredSince = int32_t(LastResponseTimes[programId].load() - request.SendTimeMs) >= 0;
+        bool miss = !answeredSince && AnsweredRequests.Contains(request.RequestKey);
+        PendingPollRequests.pop_front();
+        if (miss && ++UnansweredRequests[programId] >= OfflineMisses.load() && !ProgramOffline[programId].load()) {
+            SetProgramOffline(programId);
+        }
+    }
+}
+
+void TSmartWebToMqttGateway::CountPollCycleRequest()
+{
+    // Skipped requests of passive listen mode and offline programs are counted too, the cycle is the plan walk
+    if (++PollCycleRequests < CurrentPollRequestCount) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    PollCycleDurationMs.store(std::chrono::duration_cast<std::chrono::milliseconds>(now - PollCycleStart).count());
+    PollCycleStart = now;
+    PollCycleRequests = 0;
+}
+
+TSmartWebToMqttStats TSmartWebToMqttGateway::GetStats()
+{
+    TSmartWebToMqttStats stats;
+    stats.Reader = CanReader->GetStats();
+    stats.PollRequests = SentPollRequests.load();
+    stats.PassiveSkippedRequests = PassiveSkippedRequests.load();
+    stats.ForeignValueResponses = ForeignValueResponses.load();
+    stats.PollCycleDuration = std::chrono::milliseconds(PollCycleDurationMs.load());
+    Scheduler->GetTaskStats(PollTask, stats.PollTask);
+    stats.WriteQueueLength = WriteQueue.Size();
+    stats.InFlightTransactions = Transactions->GetInFlightCount();
+    std::unique_lock<std::mutex> lk(KnownProgramsMutex);
+    stats.KnownPrograms = KnownPrograms.size();
+    stats.OfflinePrograms = OfflinePrograms.size();
+    return stats;
+}
+
+CAN::TFrame MakeSetParameterValueRequest(const TSmartWebParameterControl& param, const std::string& value)
+{
+    CAN::TFrame frame{0};
+    SmartWeb::TParameterData pd;
+    pd.program_type = param.Parameter->ProgramClass->Type;
+    pd.parameter_id = param.Parameter->Id;
+    try {
+        auto bytes = param.Parameter->Codec->Encode(value);
+        memcpy(pd.value, bytes.data(), bytes.size());
+        frame.can_dlc = bytes.size() + 2;
+        memcpy(frame.data, &pd.raw, frame.can_dlc);
+    } catch (std::exception& e) {
+        throw std::runtime_error("Can't encode '" + value + "' for '" + param.Parameter->ProgramClass->Name + "'(" +
+                                 std::to_string(int(param.ProgramId)) + "):'" + param.Parameter->Name + "'");
+    }
+    SmartWeb::TCanHeader header{0};
+    header.rec.program_type = SmartWeb::PT_REMOTE_CONTROL;
+    header.rec.program_id = param.ProgramId;
+    header.rec.function_id = SmartWeb::RemoteControl::Function::SET_PARAMETER_VALUE;
+    header.rec.message_type = SmartWeb::MT_MSG_REQUEST;
+    frame.can_id = header.raw | CAN_EFF_FLAG;
+    return frame;
+}
+
+bool TParameterWriteQueue::Push(const TWrite& write)
+{
+    const auto& param = *write.Param.Parameter;
+    uint32_t key = (uint32_t(write.Param.ProgramId) << 16) | (uint32_t(param.ProgramClass->Type) << 8) | param.Id;
+    std::unique_lock<std::mutex> lk(Mutex);
+    auto it = Index.find(key);
+    if (it != Index.end()) {
+        Writes[it->second] = write;
+        return false;
+    }
+    Index.insert({key, Writes.size()});
+    Writes.push_back(write);
+    return true;
+}
+
+std::vector<TParameterWriteQueue::TWrite> TParameterWriteQueue::PopAll()
+{
+    std::vector<TWrite> res;
+    std::unique_lock<std::mutex> lk(Mutex);
+    res.swap(Writes);
+    Index.clear();
+    return res;
+}
+
+size_t TParameterWriteQueue::Size()
+{
+    std::unique_lock<std::mutex> lk(Mutex);
+    return Writes.size();
+}
+
+TPriorityPolling::TPriorityPolling(): Active(false)
+{
+    QueuedRequests.fill(0);
+}
+
+void TPriorityPolling::Refresh(uint8_t programId, const TSmartWebClass* cl)
+{
+    std::unique_lock<std::mutex> lk(Mutex);
+    if (QueuedRequests[programId] != 0) {
+        return;
+    }
+    for (const auto& request: cl->RequestTemplate) {
+        Requests.push_back(MakeGetParameterValueRequest(programId, request));
+    }
+    QueuedRequests[programId] = cl->RequestTemplate.size();
+    UpdateActive();
+}
+
+void TPriorityPolling::StartBurst(uint8_t programId,
+                                  const TSmartWebClass* cl,
+                                  std::chrono::steady_clock::time_point end)
+{
+    std::unique_lock<std::mutex> lk(Mutex);
+    BurstPlan.AddProgram(programId, cl);
+    BurstEnds[programId] = end;
+    UpdateActive();
+}
+
+bool TPriorityPolling::GetNextRequest(CAN::TFrame& frame, std::chrono::steady_clock::time_point now)
+{
+    if (!Active.load()) {
+        return false;
+    }
+    std::unique_lock<std::mutex> lk(Mutex);
+    bool res = false;
+    if (!Requests.empty()) {
+        frame = Requests.front();
+        Requests.pop_front();
+        --QueuedRequests[((SmartWeb::TCanHeader*)&frame.can_id)->rec.program_id];
+        res = true;
+    } else {
+        for (auto burst = BurstEnds.begin(); burst != BurstEnds.end();) {
+            if (burst->second <= now) {
+                BurstPlan.RemoveProgram(burst->first);
+                burst = BurstEnds.erase(burst);
+            } else {
+                ++burst;
+            }
+        }
+        res = BurstPlan.GetNextRequest(BurstCursor, frame);
+    }
+    UpdateActive();
+    return res;
+}
+
+void TPriorityPolling::UpdateActive()
+{
+    Active.store(!Requests.empty() || !BurstEnds.empty());
+}
+
+bool TPriorityPolling::IsActive() const
+{
+    return Active.load();
+}
+
+uint32_t MakeValueRequestKey(uint8_t programId, const uint8_t* data)
+{
+    uint32_t index = (data[0] == SmartWeb::PT_PROGRAM) ? data[2] : 0;
+    return (uint32_t(programId) << 24) | (uint32_t(data[0]) << 16) | (uint32_t(data[1]) << 8) | index;
+}
+
+TValueTimestamps::TValueTimestamps()
+{
+    for (auto& entry: Entries) {
+        entry.store(0);
+    }
+}
+
+void TValueTimestamps::Update(uint32_t key, uint32_t timeMs)
+{
+    auto hash = key * 2654435761U;
+    Entries[(hash >> 20) % SIZE].store((uint64_t(key) << 32) | std::max<uint32_t>(timeMs, 1),
+                                       std::memory_order_relaxed);
+}
+
+bool TValueTimestamps::IsRecent(uint32_t key, uint32_t nowMs, uint32_t maxAgeMs) const
+{
+    auto hash = key * 2654435761U;
+    auto entry = Entries[(hash >> 20) % SIZE].load(std::memory_order_relaxed);
+    uint32_t time = entry & 0xFFFFFFFF;
+    return time != 0 && (entry >> 32) == key && uint32_t(nowMs - time) < maxAgeMs;
+}
+
+bool TValueTimestamps::Contains(uint32_t key) const
+{
+    auto hash = key * 2654435761U;
+    auto entry = Entries[(hash >> 20) % SIZE].load(std::memory_order_relaxed);
+    return (entry & 0xFFFFFFFF) != 0 && (entry >> 32) == key;
+}
+
+bool TValueTimestamps::TakeRecent(uint32_t key, uint32_t nowMs, uint32_t maxAgeMs)
+{
+    auto hash = key * 2654435761U;
+    auto& entry = Entries[(hash >> 20) % SIZE];
+    auto value = entry.load(std::memory_order_relaxed);
+    uint32_t time = value & 0xFFFFFFFF;
+    if (time == 0 || (value >> 32) != key || uint32_t(nowMs - time) >= maxAgeMs) {
+        return false;
+    }
+    // A concurrent update is a newer request, it is answered by the next response
+    return entry.compare_exchange_strong(value, 0, std::memory_order_relaxed);
+}
+
+CAN::TTransactionKey MakeTransactionKey(const CAN::TFrame& frame)
+{
+    SmartWeb::TCanHeader header;
+    header.raw = frame.can_id & CAN_EFF_MASK;
+    header.rec.message_type = 0;
+    CAN::TTransactionKey key = CAN::TTransactionKey(header.raw) << 32;
+    // All RemoteControl functions from GET_PARAMETER_VALUE to GET_PARAMETER_UNIT address a parameter
+    if (header.rec.program_type == SmartWeb::PT_REMOTE_CONTROL &&
+        header.rec.function_id >= SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE &&
+        header.rec.function_id <= SmartWeb::RemoteControl::Function::GET_PARAMETER_UNIT && frame.can_dlc >= 2)
+    {
+        key |= MakeValueRequestKey(0, frame.data);
+    }
+    return key;
+}
+
+bool GetResponseTransactionKey(const CAN::TFrame& frame, CAN::TTransactionKey& key)
+{
+    if (!(frame.can_id & CAN_EFF_FLAG)) {
+        return false;
+    }
+    SmartWeb::TCanHeader* header = (SmartWeb::TCanHeader*)&frame.can_id;
+    if (header->rec.message_type != SmartWeb::MT_MSG_RESPONSE) {
+        return false;
+    }
+    key = MakeTransactionKey(frame);
+    return true;
+}
+
+const TScheduleCodec* GetScheduleCodec(const TSmartWebParameter& param)
+{
+    return dynamic_cast<const TScheduleCodec*>(param.Codec.get());
+}
+
+namespace
+{
+    CAN::TFrame MakeTableCellFrame(uint8_t programId,
+                                   uint8_t functionId,
+                                   const TSmartWebParameter& param,
+                                   uint8_t n,
+                                   uint8_t m)
+    {
+        CAN::TFrame frame{0};
+        SmartWeb::TCanHeader header{0};
+        header.rec.program_type = SmartWeb::PT_REMOTE_CONTROL;
+        header.rec.program_id = programId;
+        header.rec.function_id = functionId;
+        header.rec.message_type = SmartWeb::MT_MSG_REQUEST;
+        frame.can_id = header.raw | CAN_EFF_FLAG;
+        SmartWeb::TParameterData* data = (SmartWeb::TParameterData*)&frame.data;
+        data->program_type = param.ProgramClass->Type;
+        data->parameter_id = param.Id;
+        data->table_parameter.indexN = n;
+        data->table_parameter.indexM = m;
+        frame.can_dlc = 4;
+        return frame;
+    }
+}
+
+CAN::TFrame MakeGetTableCellRequest(uint8_t programId, const TSmartWebParameter& param, uint8_t n, uint8_t m)
+{
+    return MakeTableCellFrame(programId, SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE, param, n, m);
+}
+
+CAN::TFrame MakeGetProgramTypeRequest(uint8_t programId)
+{
+    CAN::TFrame frame{0};
+    SmartWeb::TCanHeader header{0};
+    header.rec.program_type = SmartWeb::PT_PROGRAM;
+    header.rec.program_id = programId;
+    header.rec.function_id = SmartWeb::Program::Function::GET_PROGRAM_TYPE;
+    header.rec.message_type = SmartWeb::MT_MSG_REQUEST;
+    frame.can_id = header.raw | CAN_EFF_FLAG;
+    return frame;
+}
+
+CAN::TFrame MakeGetProtocolVersionRequest(uint8_t programId)
+{
+    CAN::TFrame frame{0};
+    SmartWeb::TCanHeader header{0};
+    header.rec.program_type = SmartWeb::PT_PROGRAM;
+    header.rec.program_id = programId;
+    header.rec.function_id = SmartWeb::Program::Function::GET_SMARTNET_PROTOCOL_VERSION;
+    header.rec.message_type = SmartWeb::MT_MSG_REQUEST;
+    frame.can_id = header.raw | CAN_EFF_FLAG;
+    return frame;
+}
+
+CAN::TFrame MakeGetParameterMetadataRequest(uint8_t programId, const TSmartWebParameter& param, uint8_t functionId)
+{
+    CAN::TFrame frame{0};
+    SmartWeb::TCanHeader header{0};
+    header.rec.program_type = SmartWeb::PT_REMOTE_CONTROL;
+    header.rec.program_id = programId;
+    header.rec.function_id = functionId;
+    header.rec.message_type = SmartWeb::MT_MSG_REQUEST;
+    frame.can_id = header.raw | CAN_EFF_FLAG;
+    frame.data[0] = param.ProgramClass->Type;
+    frame.data[1] = param.Id;
+    frame.can_dlc = 2;
+    return frame;
+}
+
+bool IsSameParameter(const TSmartWebParameter& p1, const TSmartWebParameter& p2)
+{
+    return p1.Id == p2.Id && p1.Name == p2.Name && p1.Type == p2.Type && p1.ReadOnly == p2.ReadOnly &&
+           p1.Order == p2.Order && p1.Codec->GetName() == p2.Codec->GetName();
+}
+
+namespace
+{
+    bool IsSameParameters(const TSmartWebParameterTable& p1, const TSmartWebParameterTable& p2)
+    {
+        return std::equal(p1.begin(), p1.end(), p2.begin(), p2.end(), IsSameParameter);
+    }
+}
+
+bool IsSameClass(const TSmartWebClass& c1, const TSmartWebClass& c2)
+{
+    return c1.Type == c2.Type && c1.Name == c2.Name && c1.ParentClasses == c2.ParentClasses &&
+           c1.Source == c2.Source && IsSameParameters(c1.Inputs, c2.Inputs) &&
+           IsSameParameters(c1.Outputs, c2.Outputs) && IsSameParameters(c1.Parameters, c2.Parameters) &&
+           c1.RequestTemplate == c2.RequestTemplate;
+}
+
+bool TParameterRequest::operator==(const TParameterRequest& other) const
+{
+    return Size == other.Size && memcmp(Data, other.Data, Size) == 0;
+}
+
+namespace
+{
+    void AddClassRequests(std::vector<TParameterRequest>& requests,
+                          std::unordered_set<uint32_t>& addedRequests,
+                          std::vector<const TSmartWebParameter*>& tables,
+                          const TSmartWebClass& cl)
+    {
+        auto add = [&](const SmartWeb::TParameterData& pd, uint8_t size) {
+            TParameterRequest request{size, {0}};
+            memcpy(request.Data, &pd.raw, size);
+            uint32_t key = size;
+            for (uint8_t i = 0; i < size; ++i) {
+                key = (key << 8) | request.Data[i];
+            }
+            if (addedRequests.insert(key).second) {
+                requests.push_back(request);
+            }
+        };
+
+        SmartWeb::TParameterData pd;
+        pd.program_type = SmartWeb::PT_PROGRAM;
+        pd.parameter_id = SmartWeb::RemoteControl::Parameters::SENSOR;
+        for (const auto& i: cl.Inputs) {
+            pd.indexed_parameter.index = i.Id;
+            add(pd, 3);
+        }
+
+        pd.parameter_id = SmartWeb::RemoteControl::Parameters::OUTPUT;
+        for (const auto& o: cl.Outputs) {
+            pd.indexed_parameter.index = o.Id;
+            add(pd, 3);
+        }
+
+        pd.program_type = cl.Type;
+        for (const auto& p: cl.Parameters) {
+            // Tables are read by cells on discovery and refresh
+            if (GetScheduleCodec(p)) {
+                tables.push_back(&p);
+                continue;
+            }
+            pd.parameter_id = p.Id;
+            add(pd, 2);
+        }
+    }
+
+    class TRequestTemplateBuilder
+    {
+        std::unordered_map<std::string, const TSmartWebClass*> ClassesByName;
+
+        const TSmartWebClass* Root;
+        std::vector<TParameterRequest> Requests;
+        std::unordered_set<uint32_t> AddedRequests;
+        std::vector<const TSmartWebParameter*> Tables;
+        std::unordered_set<const TSmartWebClass*> Visited;
+        std::vector<const TSmartWebClass*> Path;
+
+        void Visit(const TSmartWebClass& cl)
+        {
+            Visited.insert(&cl);
+            Path.push_back(&cl);
+            AddClassRequests(Requests, AddedRequests, Tables, cl);
+            for (const auto& parentName: cl.ParentClasses) {
+                auto parent = ClassesByName.find(parentName);
+                if (parent == ClassesByName.end()) {
+                    // PROGRAM is a base of all classes, it is handled by PT_PROGRAM requests
+                    if (parentName != "PROGRAM" && &cl == Root) {
+                        WarnSwToMqtt.Log() << "Unknown parent class '" << parentName << "' of '" << cl.Name << "'";
+                    }
+                    continue;
+                }
+                if (std::find(Path.begin(), Path.end(), parent->second) != Path.end()) {
+                    if (&cl == Root || parent->second == Root) {
+                        ErrorSwToMqtt.Log() << "Cyclic inheritance of class '" << Root->Name << "' through '"
+                                            << parentName << "'";
+                    }
+                    continue;
+                }
+                if (!Visited.count(parent->second)) {
+                    Visit(*parent->second);
+                }
+            }
+            Path.pop_back();
+        }
+
+    public:
+        explicit TRequestTemplateBuilder(const TSmartWebToMqttConfig::TClasses& classes)
+        {
+            for (const auto& cl: classes) {
+                ClassesByName.insert({cl.second->Name, cl.second.get()});
+            }
+        }
+
+        std::vector<TParameterRequest> Build(const TSmartWebClass& cl, std::vector<const TSmartWebParameter*>& tables)
+        {
+            Root = &cl;
+            Requests.clear();
+            AddedRequests.clear();
+            Tables.clear();
+            Visited.clear();
+            Visit(cl);
+            tables = Tables;
+            return Requests;
+        }
+    };
+}
+
+void BuildRequestTemplates(TSmartWebToMqttConfig::TClasses& classes)
+{
+    TRequestTemplateBuilder builder(classes);
+    for (auto& cl: classes) {
+        cl.second->RequestTemplate = builder.Build(*cl.second, cl.second->TableParameters);
+    }
+}
+
+std::vector<const TSmartWebParameter*> GetProgramParameters(const TSmartWebClass& cl,
+                                                            const TSmartWebToMqttConfig::TClasses& classes)
+{
+    std::vector<const TSmartWebParameter*> res;
+    for (const auto& request: cl.RequestTemplate) {
+        // Inputs and outputs are requested with index of PT_PROGRAM parameter in 3 bytes
+        if (request.Size != 2) {
+            continue;
+        }
+        auto paramClass = classes.find(request.Data[0]);
+        if (paramClass == classes.end()) {
+            continue;
+        }
+        auto p = paramClass->second->Parameters.Find(request.Data[1]);
+        if (p) {
+            res.push_back(p);
+        }
+    }
+    res.insert(res.end(), cl.TableParameters.begin(), cl.TableParameters.end());
+    return res;
+}
+
+CAN::TFrame MakeGetParameterValueRequest(uint8_t programId, const TParameterRequest& request)
+{
+    CAN::TFrame frame{0};
+    SmartWeb::TCanHeader header{0};
+    header.rec.program_type = SmartWeb::PT_REMOTE_CONTROL;
+    header.rec.program_id = programId;
+    header.rec.function_id = SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE;
+    header.rec.message_type = SmartWeb::MT_MSG_REQUEST;
+    frame.can_id = header.raw | CAN_EFF_FLAG;
+    frame.can_dlc = request.Size;
+    memcpy(frame.data, request.Data, request.Size);
+    return frame;
+}
+
+void AddRequests(std::vector<CAN::TFrame>& requests, const TSmartWebClass& cl, uint8_t programId)
+{
+    for (const auto& request: cl.RequestTemplate) {
+        requests.push_back(MakeGetParameterValueRequest(programId, request));
+    }
+}
+
+TPollPlan::TPollPlan()
+{
+    Positions.fill(NO_PROGRAM);
+}
+
+void TPollPlan::AddProgram(uint8_t programId, const TSmartWebClass* cl)
+{
+    if (Positions[programId] != NO_PROGRAM) {
+        Programs[Positions[programId]].Class = ShareClass(*cl);
+        return;
+    }
+    Positions[programId] = Programs.size();
+    Programs.push_back(TProgram{programId, ShareClass(*cl)});
+}
+
+bool TPollPlan::RemoveProgram(uint8_t programId)
+{
+    auto pos = Positions[programId];
+    if (pos == NO_PROGRAM) {
+        return false;
+    }
+    Positions[programId] = NO_PROGRAM;
+    if (pos != Programs.size() - 1) {
+        Programs[pos] = Programs.back();
+        Positions[Programs[pos].ProgramId] = pos;
+    }
+    Programs.pop_back();
+    return true;
+}
+
+void TPollPlan::Clear()
+{
+    Programs.clear();
+    Positions.fill(NO_PROGRAM);
+}
+
+bool TPollPlan::GetNextRequest(TCursor& cursor, CAN::TFrame& frame) const
+{
+    // Programs of classes without parameters are skipped, every program is visited at most once per call
+    for (size_t i = 0; i <= Programs.size(); ++i) {
+        if (cursor.ProgramIndex >= Programs.size()) {
+            cursor.ProgramIndex = 0;
+            cursor.RequestIndex = 0;
+        }
+        if (Programs.empty()) {
+            return false;
+        }
+        const auto& program = Programs[cursor.ProgramIndex];
+        if (program.ProgramId != cursor.ProgramId) {
+            cursor.ProgramId = program.ProgramId;
+            cursor.RequestIndex = 0;
+        }
+        const auto& requests = program.Class->RequestTemplate;
+        if (cursor.RequestIndex < requests.size()) {
+            frame = MakeGetParameterValueRequest(program.ProgramId, requests[cursor.RequestIndex]);
+            if (++cursor.RequestIndex == requests.size()) {
+                ++cursor.ProgramIndex;
+                cursor.RequestIndex = 0;
+            }
+            return true;
+        }
+        ++cursor.ProgramIndex;
+        cursor.RequestIndex = 0;
+    }
+    return false;
+}
+
+size_t TPollPlan::GetProgramCount() const
+{
+    return Programs.size();
+}
+
+size_t TPollPlan::GetRequestCount() const
+{
+    size_t res = 0;
+    for (const auto& program: Programs) {
+        res += program.Class->RequestTemplate.size();
+    }
+    return res;
+}
+
+void TSmartWebToMqttGateway::AddProgram(const CAN::TFrame& frame)
+{
+    SmartWeb::TCanHeader* header = (SmartWeb::TCanHeader*)&frame.can_id;
+    if (KnownPrograms.count(header->rec.program_id)) {
+        return;
+    }
+    if (frame.can_dlc != 3) {
+        print_frame(DebugSwToMqtt,
+                    frame,
+                    "Invalid I_AM_PROGRAM frame. Expected exactly 3 bytes of data. Possibly the firmware is too old");
+        return;
+    }
+    AddProgram(header->rec.program_id, frame.data[2], frame);
+}
+
+void TSmartWebToMqttGateway::AddProgram(uint8_t programId, uint8_t programType, const CAN::TFrame& frame)
+{
+    if (KnownPrograms.count(programId)) {
+        return;
+    }
+    auto cl = Config.Classes.find(programType);
+    if (cl == Config.Classes.end()) {
+        print_frame(DebugSwToMqtt, frame, "Unknown program type");
+        return;
+    }
+    InfoSwToMqtt.Log() << "New program '" << cl->second->Name << "':" << (int)programId << " is found";
+    KnownPrograms.insert({programId, cl->second.get()});
+    PublishClasses();
+    StateChanged = true;
+    try {
+        auto tx = Driver->BeginTx();
+        CreateProgramControls(tx, *cl->second, programId);
+        CreateParameterControls(tx, *cl->second, programId);
+    } catch (const std::exception& e) {
+        ErrorSwToMqtt.Log() << "Failed to create program controls: " << e.what();
+    }
+    auto plan = std::make_shared<TPollPlan>(*PollPlan);
+    plan->AddProgram(programId, cl->second.get());
+    PublishPollPlan(plan);
+    ReadTables(programId, *cl->second);
+    QueueMetadataDiscovery(programId);
 }
 
 WBMQTT::TControlArgs TSmartWebToMqttGateway::MakeControlArgs(uint8_t programId,
@@ -362,22 +1951,46 @@ WBMQTT::TControlArgs TSmartWebToMqttGateway::MakeControlArgs(uint8_t programId,
     res.SetOrder(param.Order);
     res.SetReadonly(param.ReadOnly);
     auto t = types.find(param.Type);
-    res.SetType((t != types.end()) ? t->second : "value");
+    std::string controlType((t != types.end()) ? t->second : "value");
+    if (GetScheduleCodec(param)) {
+        // The whole table is published as JSON
+        controlType = "text";
+    }
+    res.SetType(controlType);
     if (!param.ReadOnly) {
         TSmartWebParameterControl pc;
         pc.ProgramId = programId;
-        pc.Parameter = &param;
+        pc.Parameter = ShareParameter(param);
         res.SetUserData(pc);
     }
+    std::string units;
     if (param.Type == "PWM" || param.Type == "%") {
         res.SetMax(100);
-        res.SetUnits("%");
+        units = "%";
     }
     if (param.Type == "minutes") {
-        res.SetUnits("min");
+        units = "min";
     }
     if (param.Type == "pressure") {
-        res.SetUnits("bar");
+        units = "bar";
+    }
+    // Limits and units read from the program complement the class definition, see DiscoverMetadata
+    auto metadata = FindMetadata(programId, param);
+    if (metadata) {
+        double min;
+        double max;
+        if ((controlType == "value" || controlType == "range") && ParseNumber(metadata->Min, min) &&
+            ParseNumber(metadata->Max, max) && min < max)
+        {
+            res.SetMin(min);
+            res.SetMax(max);
+        }
+        if (units.empty()) {
+            units = metadata->Unit;
+        }
+    }
+    if (!units.empty()) {
+        res.SetUnits(units);
     }
     if (error) {
         res.SetError("r");
@@ -388,84 +2001,807 @@ WBMQTT::TControlArgs TSmartWebToMqttGateway::MakeControlArgs(uint8_t programId,
     return res;
 }
 
-void TSmartWebToMqttGateway::SetParameter(const std::map<uint32_t, std::shared_ptr<TSmartWebParameter>>& params,
+void TSmartWebToMqttGateway::CreateProgramControls(const WBMQTT::PDriverTx& tx,
+                                                   const TSmartWebClass& cl,
+                                                   uint8_t programId)
+{
+    auto device = GetDevice(tx, cl, programId);
+    TSmartWebParameterControl pc{programId, nullptr};
+    if (!device->GetControl(REFRESH_CONTROL_ID)) {
+        device
+            ->CreateControl(
+                tx,
+                WBMQTT::TControlArgs{}.SetId(REFRESH_CONTROL_ID).SetType("pushbutton").SetOrder(0).SetUserData(pc))
+            .GetValue();
+    }
+    if (!device->GetControl(BURST_POLLING_CONTROL_ID)) {
+        device
+            ->CreateControl(tx,
+                            WBMQTT::TControlArgs{}
+                                .SetId(BURST_POLLING_CONTROL_ID)
+                                .SetType("value")
+                                .SetUnits("s")
+                                .SetReadonly(false)
+                                .SetOrder(0)
+                                .SetUserData(pc)
+                                .SetRawValue("0"))
+            .GetValue();
+    }
+}
+
+void TSmartWebToMqttGateway::CreateParameterControls(const WBMQTT::PDriverTx& tx,
+                                                     const TSmartWebClass& cl,
+                                                     uint8_t programId)
+{
+    // Inputs and outputs of responses are looked up only in the program class, see HandleGetValueResponse
+    std::vector<const TSmartWebParameter*> params;
+    for (const auto& p: cl.Inputs) {
+        params.push_back(&p);
+    }
+    for (const auto& p: cl.Outputs) {
+        params.push_back(&p);
+    }
+    for (const auto& p: GetProgramParameters(cl, Config.Classes)) {
+        params.push_back(p);
+    }
+
+    // Controls are published together, the transaction waits for all of them at the end
+    std::vector<WBMQTT::TFuture<WBMQTT::PControl>> createdControls;
+    std::set<std::pair<std::string, std::string>> controlIds;
+    auto& programControls = ProgramControls[programId];
+    for (const auto& p: params) {
+        auto device = GetDevice(tx, *p->ProgramClass, programId);
+        if (!controlIds.emplace(device->GetId(), p->Name).second || device->GetControl(p->Name)) {
+            continue;
+        }
+        // Values are marked as read errors until the program answers polling
+        createdControls.push_back(device->CreateControl(tx, MakeControlArgs(programId, *p, std::string(), true)));
+        programControls.emplace_back(device->GetId(), p->Name);
+    }
+    for (auto& control: createdControls) {
+        control.GetValue();
+    }
+}
+
+void TSmartWebToMqttGateway::HandleProgramControl(uint8_t programId,
+                                                  const std::string& controlId,
+                                                  const std::string& value)
+{
+    std::unique_lock<std::mutex> lk(KnownProgramsMutex);
+    auto cl = KnownPrograms.find(programId);
+    if (cl == KnownPrograms.end()) {
+        return;
+    }
+    if (controlId == REFRESH_CONTROL_ID) {
+        InfoSwToMqtt.Log() << "Refresh of '" << cl->second->Name << "':" << (int)programId << " is requested";
+        PriorityPolling.Refresh(programId, cl->second);
+        ReadTables(programId, *cl->second);
+        return;
+    }
+    if (controlId == BURST_POLLING_CONTROL_ID) {
+        std::chrono::seconds duration(0);
+        try {
+            duration = std::chrono::seconds(std::stoul(value));
+        } catch (const std::exception& e) {
+            WarnSwToMqtt.Log() << "Invalid burst polling duration '" << value << "'";
+            return;
+        }
+        duration = std::min<std::chrono::seconds>(duration, MAX_BURST_POLLING_DURATION);
+        InfoSwToMqtt.Log() << "Burst polling of '" << cl->second->Name << "':" << (int)programId << " for "
+                           << duration.count() << " s is requested";
+        auto end = std::chrono::steady_clock::now() + duration;
+        PriorityPolling.StartBurst(programId, cl->second, end);
+        SetBurstPollingControl(programId, *cl->second, std::to_string(duration.count()));
+        // A new burst replaces the previous one
+        auto endTask = BurstEndTasks.find(programId);
+        if (endTask != BurstEndTasks.end()) {
+            Scheduler->CancelTask(endTask->second);
+        }
+        BurstEndTasks[programId] = Scheduler->AddTask(std::make_shared<TFunctionTask>(
+                                                          std::chrono::microseconds(0),
+                                                          [this, programId]() {
+                                                              this->EndBurst(programId);
+                                                              return false;
+                                                          },
+                                                          "SmartWeb burst polling end"),
+                                                      end);
+    }
+}
+
+void TSmartWebToMqttGateway::SetBurstPollingControl(uint8_t programId,
+                                                    const TSmartWebClass& cl,
+                                                    const std::string& value)
+{
+    try {
+        auto tx = Driver->BeginTx();
+        auto device = tx->GetDevice(GetDeviceId(cl, programId));
+        auto control = device ? device->GetControl(BURST_POLLING_CONTROL_ID) : nullptr;
+        if (control) {
+            control->SetRawValue(tx, value).Sync();
+        }
+    } catch (const std::exception& e) {
+        ErrorSwToMqtt.Log() << "Failed to set burst polling control: " << e.what();
+    }
+}
+
+void TSmartWebToMqttGateway::EndBurst(uint8_t programId)
+{
+    std::unique_lock<std::mutex> lk(KnownProgramsMutex);
+    BurstEndTasks.erase(programId);
+    auto cl = KnownPrograms.find(programId);
+    if (cl != KnownPrograms.end()) {
+        SetBurstPollingControl(programId, *cl->second, "0");
+    }
+}
+
+WBMQTT::PLocalDevice TSmartWebToMqttGateway::GetDevice(const WBMQTT::PDriverTx& tx,
+                                                       const TSmartWebClass& cl,
+                                                       uint8_t programId)
+{
+    auto deviceName = GetDeviceId(cl, programId);
+    WBMQTT::PLocalDevice device(std::dynamic_pointer_cast<WBMQTT::TLocalDevice>(tx->GetDevice(deviceName)));
+    if (!device) {
+        device = tx->CreateDevice(WBMQTT::TLocalDeviceArgs{}.SetId(deviceName).SetTitle(deviceName).SetIsVirtual(true))
+                     .GetValue();
+        DeviceClassNames[device->GetId()] = cl.Name;
+    }
+    return device;
+}
+
+bool TSmartWebToMqttGateway::SetParameter(const TSmartWebParameterTable& params,
+                                          TParameterKind kind,
                                           uint8_t parameterId,
                                           const uint8_t* data,
-                                          uint8_t programId)
+                                          uint8_t programId,
+                                          TControlUpdate& update)
 {
-    auto p = params.find(parameterId);
-    if (p == params.end()) {
+    auto p = params.Find(parameterId);
+    if (!p) {
         DebugSwToMqtt.Log() << "Unknown parameter id: " << (int)parameterId;
-        return;
+        return false;
     }
-    std::string res;
-    bool error = false;
+    update = TControlUpdate{ShareParameter(*p), programId, std::string(), false};
     try {
-        res = p->second->Codec->Decode(data);
+        update.Value = p->Codec->Decode(data);
     } catch (const std::exception& e) {
-        WarnSwToMqtt.Log() << "Error reading '" << p->second->ProgramClass->Name << "':" << (int)programId << " "
-                           << p->second->Name << ": " << e.what();
-        error = true;
+        WarnSwToMqtt.Log() << "Error reading '" << p->ProgramClass->Name << "':" << (int)programId << " " << p->Name
+                           << ": " << e.what();
+        update.Error = true;
+    }
+    UpdateValueState(*p, kind, programId, update.Value, update.Error);
+    return true;
+}
+
+void TSmartWebToMqttGateway::PublishValue(const TSmartWebParameter& p,
+                                          TParameterKind kind,
+                                          uint8_t programId,
+                                          const std::string& value,
+                                          bool error)
+{
+    TControlUpdate update{ShareParameter(p), programId, value, error};
+    if (!SetControlValue(update)) {
+        CreateValueControl(update);
     }
-    std::string deviceName("sw " + p->second->ProgramClass->Name + " " + std::to_string(programId));
+    UpdateValueState(p, kind, programId, value, error);
+}
+
+bool TSmartWebToMqttGateway::SetControlValue(const TControlUpdate& update)
+{
     try {
         auto tx = Driver->BeginTx();
-        WBMQTT::PLocalDevice device(std::dynamic_pointer_cast<WBMQTT::TLocalDevice>(tx->GetDevice(deviceName)));
-        if (!device) {
-            device =
-                tx->CreateDevice(WBMQTT::TLocalDeviceArgs{}.SetId(deviceName).SetTitle(deviceName).SetIsVirtual(true))
-                    .GetValue();
-            DeviceIds.push_back(device->GetId());
-        }
-        auto control = device->GetControl(p->second->Name);
-        if (control) {
-            if (error) {
-                control->SetError(tx, "r").Sync();
-            } else {
-                control->SetRawValue(tx, res).Sync();
-            }
+        auto device = tx->GetDevice(GetDeviceId(*update.Param->ProgramClass, update.ProgramId));
+        auto control = device ? device->GetControl(update.Param->Name) : WBMQTT::PControl();
+        if (!control) {
+            return false;
+        }
+        if (update.Error) {
+            control->SetError(tx, "r").Sync();
         } else {
-            device->CreateControl(tx, MakeControlArgs(programId, *p->second, res, error)).GetValue();
+            // Clears read error or stale mark of value restored from state
+            if (!control->GetError().empty()) {
+                control->SetError(tx, "").Sync();
+            }
+            control->SetRawValue(tx, update.Value).Sync();
         }
     } catch (const std::exception& e) {
         ErrorSwToMqtt.Log() << e.what();
     }
+    return true;
 }
 
-void TSmartWebToMqttGateway::HandleGetValueResponse(const CAN::TFrame& frame)
+void TSmartWebToMqttGateway::CreateValueControl(const TControlUpdate& update)
 {
-    SmartWeb::TCanHeader* header = (SmartWeb::TCanHeader*)&frame.can_id;
-    auto cl = KnownPrograms.find(header->rec.program_id);
+    const auto& p = *update.Param;
+
+    // The class can be replaced while the value is decoded without KnownProgramsMutex, see HandleFrame
+    auto cl = Config.Classes.find(p.ProgramClass->Type);
+    if (!KnownPrograms.count(update.ProgramId) || cl == Config.Classes.end() || cl->second.get() != p.ProgramClass) {
+        return;
+    }
+    try {
+        auto tx = Driver->BeginTx();
+        auto device = GetDevice(tx, *p.ProgramClass, update.ProgramId);
+        if (!device->GetControl(p.Name)) {
+            // Fallback if the control wasn't created on discovery, see CreateParameterControls
+            device->CreateControl(tx, MakeControlArgs(update.ProgramId, p, update.Value, update.Error)).GetValue();
+            ProgramControls[update.ProgramId].emplace_back(device->GetId(), p.Name);
+        }
+    } catch (const std::exception& e) {
+        ErrorSwToMqtt.Log() << e.what();
+    }
+}
+
+void TSmartWebToMqttGateway::UpdateValueState(const TSmartWebParameter& p,
+                                              TParameterKind kind,
+                                              uint8_t programId,
+                                              const std::string& value,
+                                              bool error)
+{
+    if (!error) {
+        // Published value is replaced by the actual one if a write isn't applied, see CompleteReadBacks
+        auto valueKey = MakeValueKey(p.ProgramClass->Type, kind, p.Id);
+        auto& values = ProgramValues[programId];
+        std::unique_lock<std::mutex> lk(values.Mutex);
+        auto& lastValue = values.LastValues[valueKey];
+        if (lastValue != value) {
+            lastValue = value;
+            StateChanged = true;
+        }
+    }
+}
+
+void TSmartWebToMqttGateway::ReadTables(uint8_t programId, const TSmartWebClass& cl)
+{
+    for (const auto& p: cl.TableParameters) {
+        StartTableRead(programId, *p);
+    }
+}
+
+void TSmartWebToMqttGateway::StartTableRead(uint8_t programId, const TSmartWebParameter& param)
+{
+    auto valueKey = MakeValueKey(param.ProgramClass->Type, TParameterKind::PARAMETER, param.Id);
+    auto& transfer = TableTransfers[{programId, valueKey}];
+    if (transfer.Param) {
+        return;
+    }
+    size_t cellCount = TScheduleCodec::ROWS * TScheduleCodec::COLUMNS;
+    transfer.Param = ShareParameter(param);
+    transfer.Cells.assign(cellCount, std::string());
+    transfer.Received.assign(cellCount, false);
+    transfer.Pending = cellCount;
+    transfer.Attempts = 1;
+    transfer.Deadline = std::chrono::steady_clock::now() + TABLE_TRANSFER_TIMEOUT;
+    std::vector<CAN::TFrame> frames;
+    for (uint8_t n = 0; n < TScheduleCodec::ROWS; ++n) {
+        for (uint8_t m = 0; m < TScheduleCodec::COLUMNS; ++m) {
+            frames.push_back(MakeGetTableCellRequest(programId, param, n, m));
+        }
+    }
+    SendTableRequests(programId, valueKey, frames);
+}
+
+void TSmartWebToMqttGateway::SendTableRequests(uint8_t programId,
+                                               uint32_t valueKey,
+                                               const std::vector<CAN::TFrame>& frames)
+{
+    // All cells are requested in one burst without waiting for responses
+    Scheduler->AddTask(std::make_shared<TFunctionTask>(
+        std::chrono::microseconds(0),
+        [this, frames]() {
+            for (const auto& frame: frames) {
+                try {
+                    CanPort->Send(frame);
+                    print_frame(DebugSwToMqtt, frame, "Send table cell request");
+                } catch (const std::exception& e) {
+                    print_frame(ErrorSwToMqtt, frame, std::string("Send table cell request: ") + e.what());
+                }
+            }
+            return false;
+        },
+        "SmartWeb table transfer"));
+    Scheduler->AddTask(std::make_shared<TFunctionTask>(
+                           std::chrono::microseconds(0),
+                           [this, programId, valueKey]() {
+                               this->CheckTableTransfer(programId, valueKey);
+                               return false;
+                           },
+                           "SmartWeb table transfer timeout"),
+                       std::chrono::steady_clock::now() + TABLE_TRANSFER_TIMEOUT);
+}
+
+void TSmartWebToMqttGateway::CheckTableTransfer(uint8_t programId, uint32_t valueKey)
+{
+    std::unique_lock<std::mutex> lk(KnownProgramsMutex);
+    auto it = TableTransfers.find({programId, valueKey});
+    auto now = std::chrono::steady_clock::now();
+    if (it == TableTransfers.end() || it->second.Deadline > now) {
+        return;
+    }
+    auto& transfer = it->second;
+    const auto& param = *transfer.Param;
+    if (transfer.Attempts >= TABLE_TRANSFER_ATTEMPTS) {
+        WarnSwToMqtt.Log() << "Error reading '" << param.ProgramClass->Name << "':" << (int)programId << " "
+                           << param.Name << ": " << transfer.Pending << " table cell(s) are not answered or invalid";
+        TableTransfers.erase(it);
+        PublishValue(param, TParameterKind::PARAMETER, programId, std::string(), true);
+        return;
+    }
+    ++transfer.Attempts;
+    transfer.Deadline = now + TABLE_TRANSFER_TIMEOUT;
+    std::vector<CAN::TFrame> frames;
+    for (size_t i = 0; i < transfer.Received.size(); ++i) {
+        if (!transfer.Received[i]) {
+            frames.push_back(
+                MakeGetTableCellRequest(programId, param, i / TScheduleCodec::COLUMNS, i % TScheduleCodec::COLUMNS));
+        }
+    }
+    SendTableRequests(programId, valueKey, frames);
+}
+
+void TSmartWebToMqttGateway::HandleTableCell(uint8_t programId,
+                                             const TSmartWebParameter& param,
+                                             const SmartWeb::TParameterData& data)
+{
+    auto valueKey = MakeValueKey(param.ProgramClass->Type, TParameterKind::PARAMETER, param.Id);
+    auto it = TableTransfers.find({programId, valueKey});
+    if (it == TableTransfers.end()) {
+        // Answer to another master or a late answer
+        return;
+    }
+    auto& transfer = it->second;
+    auto n = data.table_parameter.indexN;
+    auto m = data.table_parameter.indexM;
+    if (n >= TScheduleCodec::ROWS || m >= TScheduleCodec::COLUMNS) {
+        DebugSwToMqtt.Log() << "Invalid table cell " << (int)n << ", " << (int)m << " of " << param.Name;
+        return;
+    }
+    size_t index = n * TScheduleCodec::COLUMNS + m;
+    if (transfer.Received[index]) {
+        return;
+    }
+    try {
+        transfer.Cells[index] = param.Codec->Decode(data.table_parameter.value);
+    } catch (const std::exception& e) {
+        // The cell stays pending, it is requested again or the whole table is published with error by timeout
+        WarnSwToMqtt.Log() << "Error reading '" << param.ProgramClass->Name << "':" << (int)programId << " "
+                           << param.Name << " cell " << (int)n << ", " << (int)m << ": " << e.what();
+        return;
+    }
+    transfer.Received[index] = true;
+    --transfer.Pending;
+    if (transfer.Pending != 0) {
+        return;
+    }
+    auto value = GetScheduleCodec(param)->FormatTable(transfer.Cells);
+    TableTransfers.erase(it);
+    PublishValue(param, TParameterKind::PARAMETER, programId, value, false);
+}
+
+void TSmartWebToMqttGateway::RestoreState()
+{
+    if (StateFilePath.empty()) {
+        return;
+    }
+    std::vector<TProgramState> programs;
+    try {
+        if (!LoadGatewayState(StateFilePath, programs)) {
+            return;
+        }
+    } catch (const std::exception& e) {
+        WarnSwToMqtt.Log() << "Failed to load state: " << e.what();
+        return;
+    }
+    std::unique_lock<std::mutex> lk(KnownProgramsMutex);
+    try {
+        auto tx = Driver->BeginTx();
+        for (const auto& program: programs) {
+            auto cl = Config.Classes.find(program.ProgramType);
+            if (cl == Config.Classes.end()) {
+                DebugSwToMqtt.Log() << "Unknown program type in state: " << (int)program.ProgramType;
+                continue;
+            }
+            KnownPrograms.insert({program.ProgramId, cl->second.get()});
+            if (!program.FirmwareVersion.empty()) {
+                FirmwareVersions[program.ProgramId] = program.FirmwareVersion;
+            }
+            CreateProgramControls(tx, *cl->second, program.ProgramId);
+            for (const auto& value: program.Values) {
+                auto valueClass = Config.Classes.find(value.ProgramType);
+                if (valueClass == Config.Classes.end()) {
+                    continue;
+                }
+                auto p = GetParameterTable(*valueClass->second, value.Kind).Find(value.ParameterId);
+                if (!p) {
+                    continue;
+                }
+                auto device = GetDevice(tx, *p->ProgramClass, program.ProgramId);
+                if (!device->GetControl(p->Name)) {
+                    // Values are marked as read errors until the program answers polling
+                    device->CreateControl(tx, MakeControlArgs(program.ProgramId, *p, value.Value, true)).GetValue();
+                    ProgramControls[program.ProgramId].emplace_back(device->GetId(), p->Name);
+                }
+                auto& values = ProgramValues[program.ProgramId];
+                std::unique_lock<std::mutex> valuesLk(values.Mutex);
+                values.LastValues[MakeValueKey(value.ProgramType, value.Kind, value.ParameterId)] = value.Value;
+            }
+            CreateParameterControls(tx, *cl->second, program.ProgramId);
+        }
+    } catch (const std::exception& e) {
+        ErrorSwToMqtt.Log() << "Failed to restore devices from state: " << e.what();
+    }
+    RebuildRequests();
+    InfoSwToMqtt.Log() << KnownPrograms.size() << " program(s) are restored from state";
+}
+
+void TSmartWebToMqttGateway::SaveState()
+{
+    if (StateFilePath.empty()) {
+        return;
+    }
+    std::vector<TProgramState> programs;
+    {
+        std::unique_lock<std::mutex> lk(KnownProgramsMutex);
+        if (!StateChanged.exchange(false)) {
+            return;
+        }
+        for (const auto& knownProgram: KnownPrograms) {
+            TProgramState program{knownProgram.first, knownProgram.second->Type, {}, {}};
+            auto version = FirmwareVersions.find(knownProgram.first);
+            if (version != FirmwareVersions.end()) {
+                program.FirmwareVersion = version->second;
+            }
+            auto& values = ProgramValues[knownProgram.first];
+            std::unique_lock<std::mutex> valuesLk(values.Mutex);
+            for (const auto& value: values.LastValues) {
+                TParameterValueState state;
+                state.ProgramType = value.first >> 16;
+                state.Kind = static_cast<TParameterKind>((value.first >> 8) & 0xFF);
+                state.ParameterId = value.first & 0xFF;
+                state.Value = value.second;
+                program.Values.push_back(state);
+            }
+            programs.push_back(program);
+        }
+    }
+    try {
+        SaveGatewayState(StateFilePath, programs);
+    } catch (const std::exception& e) {
+        WarnSwToMqtt.Log() << "Failed to save state: " << e.what();
+    }
+}
+
+void TSmartWebToMqttGateway::LoadMetadata()
+{
+    if (MetadataCacheFilePath.empty()) {
+        return;
+    }
+    std::vector<TProgramMetadata> programs;
+    try {
+        if (!LoadMetadataCache(MetadataCacheFilePath, programs)) {
+            return;
+        }
+    } catch (const std::exception& e) {
+        WarnSwToMqtt.Log() << "Failed to load metadata cache: " << e.what();
+        return;
+    }
+    std::unique_lock<std::mutex> lk(KnownProgramsMutex);
+    for (const auto& program: programs) {
+        Metadata[{program.ProgramType, program.FirmwareVersion}] = program;
+    }
+}
+
+void TSmartWebToMqttGateway::AddMetadataTask()
+{
+    MetadataTask = Scheduler->AddTask(MakePeriodicTask(
+        METADATA_REQUEST_INTERVAL,
+        [this]() { this->DiscoverMetadata(); },
+        "SmartWeb metadata discovery task"));
+}
+
+void TSmartWebToMqttGateway::QueueMetadataDiscovery(uint8_t programId)
+{
+    if (!Config.MetadataDiscovery) {
+        return;
+    }
+    if ((MetadataDiscovery.Active && MetadataDiscovery.ProgramId == programId) ||
+        std::find(MetadataQueue.begin(), MetadataQueue.end(), programId) != MetadataQueue.end())
+    {
+        return;
+    }
+    auto cl = KnownPrograms.find(programId);
+    auto version = FirmwareVersions.find(programId);
+    if (cl != KnownPrograms.end() && version != FirmwareVersions.end() &&
+        Metadata.count({cl->second->Type, version->second}))
+    {
+        return;
+    }
+    MetadataQueue.push_back(programId);
+}
+
+void TSmartWebToMqttGateway::DiscoverMetadata()
+{
+    std::vector<TMetadataResponse> responses;
+    {
+        std::unique_lock<std::mutex> lk(MetadataResponsesMutex);
+        responses.swap(MetadataResponses);
+    }
+    std::vector<TProgramMetadata> cache;
+    CAN::TFrame request;
+    bool sendRequest = false;
+    uint8_t programId = 0;
+    size_t step = 0;
+    {
+        std::unique_lock<std::mutex> lk(KnownProgramsMutex);
+        for (const auto& response: responses) {
+            HandleMetadataResponse(response);
+        }
+        for (auto id: MetadataUpdates) {
+            UpdateMetadataControls(id);
+        }
+        MetadataUpdates.clear();
+        if (MetadataChanged) {
+            MetadataChanged = false;
+            for (const auto& metadata: Metadata) {
+                cache.push_back(metadata.second);
+            }
+        }
+        // Only one request is sent at a time and only if nothing else waits for the bus
+        if (!MetadataDiscovery.InFlight && !PriorityPolling.IsActive() && WriteQueue.Size() == 0 &&
+            TableTransfers.empty() && Transactions->GetInFlightCount() == 0 && GetNextMetadataRequest(request))
+        {
+            MetadataDiscovery.InFlight = true;
+            programId = MetadataDiscovery.ProgramId;
+            step = MetadataDiscovery.Step;
+            sendRequest = true;
+        }
+    }
+    if (!cache.empty() && !MetadataCacheFilePath.empty()) {
+        try {
+            SaveMetadataCache(MetadataCacheFilePath, cache);
+        } catch (const std::exception& e) {
+            WarnSwToMqtt.Log() << "Failed to save metadata cache: " << e.what();
+        }
+    }
+    if (sendRequest) {
+        print_frame(DebugSwToMqtt, request, "Send metadata request");
+        Transactions->Start(request,
+                            MakeTransactionKey(request),
+                            METADATA_REQUEST_TIMEOUT,
+                            0,
+                            [this, programId, step](const CAN::TTransactionResult& result) {
+                                std::unique_lock<std::mutex> lk(this->MetadataResponsesMutex);
+                                this->MetadataResponses.push_back(TMetadataResponse{programId, step, result});
+                            });
+    }
+}
+
+bool TSmartWebToMqttGateway::GetNextMetadataRequest(CAN::TFrame& frame)
+{
+    while (true) {
+        if (MetadataDiscovery.Active) {
+            // Discovery is dropped if the program is removed, its class is changed or it is offline
+            auto cl = KnownPrograms.find(MetadataDiscovery.ProgramId);
+            if (cl != KnownPrograms.end() && cl->second == MetadataDiscovery.Class.get() &&
+                !OfflinePrograms.count(MetadataDiscovery.ProgramId))
+            {
+                break;
+            }
+            MetadataDiscovery = TMetadataDiscovery();
+        }
+        if (MetadataQueue.empty()) {
+            return false;
+        }
+        auto cl = KnownPrograms.find(MetadataQueue.front());
+        if (cl != KnownPrograms.end()) {
+            MetadataDiscovery.Active = true;
+            MetadataDiscovery.ProgramId = cl->first;
+            MetadataDiscovery.Class = ShareClass(*cl->second);
+        }
+        MetadataQueue.pop_front();
+    }
+    if (MetadataDiscovery.Step == 0) {
+        frame = MakeGetProtocolVersionRequest(MetadataDiscovery.ProgramId);
+        return true;
+    }
+    auto index = (MetadataDiscovery.Step - 1) / METADATA_FUNCTIONS_COUNT;
+    auto functionId = METADATA_FUNCTIONS[(MetadataDiscovery.Step - 1) % METADATA_FUNCTIONS_COUNT];
+    frame = MakeGetParameterMetadataRequest(MetadataDiscovery.ProgramId, *MetadataDiscovery.Params[index], functionId);
+    return true;
+}
+
+void TSmartWebToMqttGateway::HandleMetadataResponse(const TMetadataResponse& response)
+{
+    auto& discovery = MetadataDiscovery;
+    if (!discovery.Active || discovery.ProgramId != response.ProgramId || discovery.Step != response.Step) {
+        return;
+    }
+    discovery.InFlight = false;
+    const auto& frame = response.Result.Response;
+    if (discovery.Step == 0) {
+        if (!response.Result.Ok) {
+            DebugSwToMqtt.Log() << "Program '" << discovery.Class->Name << "':" << (int)discovery.ProgramId
+                                << " doesn't answer protocol version request";
+            discovery = TMetadataDiscovery();
+            return;
+        }
+        auto version = FormatFirmwareVersion(frame);
+        auto& knownVersion = FirmwareVersions[discovery.ProgramId];
+        if (knownVersion != version) {
+            knownVersion = version;
+            StateChanged = true;
+        }
+        if (Metadata.count({discovery.Class->Type, version})) {
+            MetadataUpdates.push_back(discovery.ProgramId);
+            discovery = TMetadataDiscovery();
+            return;
+        }
+        InfoSwToMqtt.Log() << "Reading metadata of '" << discovery.Class->Name << "':" << (int)discovery.ProgramId
+                           << ", protocol version " << version;
+        discovery.Result = TProgramMetadata{discovery.Class->Type, version, {}};
+        for (const auto& p: GetProgramParameters(*discovery.Class, Config.Classes)) {
+            if (!GetScheduleCodec(*p)) {
+                discovery.Params.push_back(ShareParameter(*p));
+                discovery.Result.Parameters.push_back(TParameterMetadata{p->ProgramClass->Type, uint8_t(p->Id)});
+            }
+        }
+    } else if (response.Result.Ok && frame.can_dlc > 2) {
+        auto index = (discovery.Step - 1) / METADATA_FUNCTIONS_COUNT;
+        const auto& param = *discovery.Params[index];
+        auto& metadata = discovery.Result.Parameters[index];
+        SmartWeb::TParameterData* data = (SmartWeb::TParameterData*)&frame.data;
+        ++discovery.Answered;
+        try {
+            switch (METADATA_FUNCTIONS[(discovery.Step - 1) % METADATA_FUNCTIONS_COUNT]) {
+                case SmartWeb::RemoteControl::Function::GET_PARAMETER_NAME:
+                    metadata.Name = DecodeMetadataText(frame);
+                    break;
+                case SmartWeb::RemoteControl::Function::GET_PARAMETER_MINIMUM:
+                    metadata.Min = param.Codec->Decode(data->value);
+                    break;
+                case SmartWeb::RemoteControl::Function::GET_PARAMETER_MAXIMUM:
+                    metadata.Max = param.Codec->Decode(data->value);
+                    break;
+                case SmartWeb::RemoteControl::Function::GET_PARAMETER_DEFAULT:
+                    metadata.Default = param.Codec->Decode(data->value);
+                    break;
+                default:
+                    metadata.Unit = DecodeMetadataText(frame);
+                    break;
+            }
+        } catch (const std::exception& e) {
+            DebugSwToMqtt.Log() << "Error reading metadata of '" << param.ProgramClass->Name << "' " << param.Name
+                                << ": " << e.what();
+        }
+    }
+    ++discovery.Step;
+    if (discovery.Step == METADATA_FUNCTIONS_COUNT + 1 && discovery.Answered == 0) {
+        // Requests of other parameters would time out too
+        InfoSwToMqtt.Log() << "Program '" << discovery.Class->Name << "':" << (int)discovery.ProgramId
+                           << " doesn't answer metadata requests";
+        discovery = TMetadataDiscovery();
+        return;
+    }
+    if (discovery.Step > discovery.Params.size() * METADATA_FUNCTIONS_COUNT) {
+        InfoSwToMqtt.Log() << "Metadata of '" << discovery.Class->Name << "':" << (int)discovery.ProgramId
+                           << " is read";
+        Metadata[{discovery.Result.ProgramType, discovery.Result.FirmwareVersion}] = discovery.Result;
+        MetadataChanged = true;
+        MetadataUpdates.push_back(discovery.ProgramId);
+        discovery = TMetadataDiscovery();
+    }
+}
+
+void TSmartWebToMqttGateway::UpdateMetadataControls(uint8_t programId)
+{
+    auto cl = KnownPrograms.find(programId);
     if (cl == KnownPrograms.end()) {
         return;
     }
+    std::map<uint32_t, std::string> values;
+    {
+        std::unique_lock<std::mutex> lk(ProgramValues[programId].Mutex);
+        values = ProgramValues[programId].LastValues;
+    }
+    try {
+        auto tx = Driver->BeginTx();
+        for (const auto& p: GetProgramParameters(*cl->second, Config.Classes)) {
+            if (GetScheduleCodec(*p) || !FindMetadata(programId, *p)) {
+                continue;
+            }
+            auto device = GetDevice(tx, *p->ProgramClass, programId);
+            auto control = device->GetControl(p->Name);
+            if (!control) {
+                continue;
+            }
+            auto value = values.find(MakeValueKey(p->ProgramClass->Type, TParameterKind::PARAMETER, p->Id));
+            bool error = value == values.end() || !control->GetError().empty();
+            // Limits and units of existing control can't be changed, so it is created again
+            device->RemoveControl(tx, p->Name).Sync();
+            device
+                ->CreateControl(tx,
+                                MakeControlArgs(programId, *p, (value != values.end()) ? value->second : "", error))
+                .GetValue();
+        }
+    } catch (const std::exception& e) {
+        ErrorSwToMqtt.Log() << "Failed to apply metadata to controls of '" << cl->second->Name << "':" << (int)programId
+                            << ": " << e.what();
+    }
+}
+
+const TParameterMetadata* TSmartWebToMqttGateway::FindMetadata(uint8_t programId,
+                                                               const TSmartWebParameter& param) const
+{
+    auto version = FirmwareVersions.find(programId);
+    auto cl = KnownPrograms.find(programId);
+    if (version == FirmwareVersions.end() || cl == KnownPrograms.end()) {
+        return nullptr;
+    }
+    auto metadata = Metadata.find({cl->second->Type, version->second});
+    if (metadata == Metadata.end()) {
+        return nullptr;
+    }
+    return FindParameterMetadata(metadata->second, param.ProgramClass->Type, param.Id);
+}
+
+bool TSmartWebToMqttGateway::HandleGetValueResponse(const TClassSnapshot& classes,
+                                                    const CAN::TFrame& frame,
+                                                    TControlUpdate& update)
+{
+    SmartWeb::TCanHeader* header = (SmartWeb::TCanHeader*)&frame.can_id;
+    const auto& cl = classes.Programs[header->rec.program_id];
+    if (!cl) {
+        return false;
+    }
 
     print_frame(DebugSwToMqtt, frame, "Get value response");
 
+    // The first response after a poll request answers it, other responses are answers to requests of other masters,
+    // see TSmartWebToMqttConfig::PassiveListen
+    auto requestKey = MakeValueRequestKey(header->rec.program_id, frame.data);
+    auto now = GetTimeMs();
+    AnsweredRequests.Update(requestKey, now);
+    if (!SentRequests.TakeRecent(requestKey, now, POLL_RESPONSE_TIMEOUT.count())) {
+        ValueTimestamps.Update(requestKey, now);
+        ++ForeignValueResponses;
+    }
+
     SmartWeb::TParameterData* data = (SmartWeb::TParameterData*)&frame.data;
     if (data->program_type == SmartWeb::PT_PROGRAM) {
         if (data->parameter_id == SmartWeb::RemoteControl::Parameters::SENSOR) {
-            SetParameter(cl->second->Inputs,
-                         data->indexed_parameter.index,
-                         data->indexed_parameter.value,
-                         header->rec.program_id);
-            return;
+            return SetParameter(cl->Inputs,
+                                TParameterKind::INPUT,
+                                data->indexed_parameter.index,
+                                data->indexed_parameter.value,
+                                header->rec.program_id,
+                                update);
         }
         if (data->parameter_id == SmartWeb::RemoteControl::Parameters::OUTPUT) {
-            SetParameter(cl->second->Outputs,
-                         data->indexed_parameter.index,
-                         data->indexed_parameter.value,
-                         header->rec.program_id);
-            return;
+            return SetParameter(cl->Outputs,
+                                TParameterKind::OUTPUT,
+                                data->indexed_parameter.index,
+                                data->indexed_parameter.value,
+                                header->rec.program_id,
+                                update);
         }
         DebugSwToMqtt.Log() << "Unknown parameter id: " << (int)data->parameter_id;
-        return;
+        return false;
     }
 
-    auto clParam = Config.Classes.find(data->program_type);
-    if (clParam == Config.Classes.end()) {
+    auto clParam = classes.Classes.find(data->program_type);
+    if (clParam == classes.Classes.end()) {
         DebugSwToMqtt.Log() << "Unknown program type: " << (int)data->program_type;
-        return;
+        return false;
+    }
+    auto p = clParam->second->Parameters.Find(data->parameter_id);
+    if (p && GetScheduleCodec(*p)) {
+        std::unique_lock<std::mutex> lk(KnownProgramsMutex);
+        HandleTableCell(header->rec.program_id, *p, *data);
+        return false;
     }
-    SetParameter(clParam->second->Parameters, data->parameter_id, data->value, header->rec.program_id);
+    return SetParameter(clParam->second->Parameters,
+                        TParameterKind::PARAMETER,
+                        data->parameter_id,
+                        data->value,
+                        header->rec.program_id,
+                        update);
 }
\ No newline at end of file
@@ -1,6 +1,10 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <deque>
 #include <map>
+#include <memory>
 #include <tgmath.h>
 #include <type_traits>
 #include <unordered_map>
@@ -10,12 +14,66 @@
 #include <wblib/wbmqtt.h>
 
 #include "CanPort.h"
+#include "CanTransactions.h"
 #include "ThreadedCanReader.h"
+#include "gateway_state.h"
+#include "metadata_cache.h"
 #include "scheduler.h"
 #include "smart_web_conventions.h"
 
 const auto DEFAULT_POLL_INTERVAL_MS = std::chrono::milliseconds(500);
 
+const uint32_t DEFAULT_FRAME_WORKERS = 1;
+
+//! Number of poll requests in a row unanswered within POLL_RESPONSE_TIMEOUT after which a program is considered offline
+const uint32_t DEFAULT_OFFLINE_MISSES = 10;
+
+//! Time to wait for response to a poll request. Later responses are taken as answers to requests of other masters
+const auto POLL_RESPONSE_TIMEOUT = std::chrono::milliseconds(500);
+
+//! Interval between probe requests to offline programs
+const auto DEFAULT_OFFLINE_PROBE_INTERVAL = std::chrono::seconds(30);
+
+//! Period of write task runs without new writes from MQTT
+const auto WRITE_TASK_PERIOD = std::chrono::seconds(1);
+
+//! Time to wait for response to read-back request of written value after every send, see READ_BACK_RETRIES
+const auto READ_BACK_TIMEOUT = std::chrono::milliseconds(1000);
+
+//! Number of resends of unanswered read-back request before written value is rolled back in MQTT
+const uint32_t READ_BACK_RETRIES = 2;
+
+//! Time to wait for response to a request of bulk parameter read or write, see TSmartWebToMqttGateway::BulkRead
+const auto BULK_REQUEST_TIMEOUT = std::chrono::milliseconds(1000);
+
+//! Number of resends of unanswered requests of bulk parameter read or write
+const uint32_t BULK_REQUEST_RETRIES = 2;
+
+//! Time to wait for all cells of a table parameter before missing cells are requested again
+const auto TABLE_TRANSFER_TIMEOUT = std::chrono::seconds(3);
+
+//! Number of requests of a table cell before the table is marked with read error
+const uint32_t TABLE_TRANSFER_ATTEMPTS = 3;
+
+//! Maximum duration of burst polling started from MQTT
+const auto MAX_BURST_POLLING_DURATION = std::chrono::minutes(10);
+
+//! Ids of controls in program device to refresh all parameters and to poll the program continuously for N seconds
+const auto REFRESH_CONTROL_ID = "refresh";
+const auto BURST_POLLING_CONTROL_ID = "burst_polling";
+
+//! Interval between saves of discovered programs and last values, see TSmartWebToMqttGateway::SaveState
+const auto STATE_SAVE_INTERVAL = std::chrono::minutes(1);
+
+//! Interval between GET_PROGRAM_TYPE requests of discovery scan. All program ids are scanned in about 2.5 s
+const auto DISCOVERY_REQUEST_INTERVAL = std::chrono::milliseconds(10);
+
+//! Interval between runs of metadata discovery, every run sends at most one request
+const auto METADATA_REQUEST_INTERVAL = std::chrono::milliseconds(100);
+
+//! Time to wait for response to a metadata request. Unanswered requests are not repeated
+const auto METADATA_REQUEST_TIMEOUT = std::chrono::milliseconds(500);
+
 /**
  * @brief Interface for classes performing conversion from data received
  *        from CAN in SmartWeb encoding to string for publishing in MQTT and vice verca.
@@ -128,6 +186,8 @@ public:
     std::string Decode(const uint8_t* buf) const override;
     std::vector<uint8_t> Encode(const std::string& value) const override;
     std::string GetName() const override;
+
+    const std::map<uint8_t, std::string>& GetValues() const;
 };
 
 /**
@@ -181,6 +241,39 @@ public:
     std::string GetName() const override;
 };
 
+/**
+ * @brief Experimental. Schedule transferred as a table parameter, one request per cell.
+ *        indexN of a cell is a row, indexM is a column, 7 rows of 4 columns are assumed for weekly schedules.
+ *        The cell layout isn't confirmed by protocol documentation, so cells are published raw and never written.
+ *        Decode converts CELL_SIZE bytes of one cell to a hex string.
+ *        The whole table is published in MQTT as JSON array of rows with arrays of cells.
+ */
+class TScheduleCodec: public ISmartWebCodec
+{
+public:
+    static const uint8_t ROWS = 7;
+    static const uint8_t COLUMNS = 4;
+    static const uint8_t CELL_SIZE = 4;
+
+    std::string Decode(const uint8_t* buf) const override;
+    std::vector<uint8_t> Encode(const std::string& value) const override;
+    std::string GetName() const override;
+
+    /**
+     * @brief Builds JSON value from ROWS * COLUMNS cells ordered by row and column
+     */
+    std::string FormatTable(const std::vector<std::string>& cells) const;
+};
+
+/**
+ * @brief Returns the single shared instance of a stateless codec
+ */
+template<class TCodec> std::shared_ptr<const ISmartWebCodec> GetSharedCodec()
+{
+    static const std::shared_ptr<const ISmartWebCodec> codec = std::make_shared<TCodec>();
+    return codec;
+}
+
 struct TSmartWebClass;
 
 struct TSmartWebParameter
@@ -189,18 +282,65 @@ struct TSmartWebParameter
     std::string Name;
     std::string Type;
     bool ReadOnly = true;
-    std::unique_ptr<ISmartWebCodec> Codec;
+
+    //! Stateless codecs are shared by all parameters using them
+    std::shared_ptr<const ISmartWebCodec> Codec;
     const TSmartWebClass* ProgramClass;
     uint32_t Order;
 };
 
+/**
+ * @brief Parameters of one kind stored in an array sorted by id with O(1) lookup by id.
+ *        Ids are less than 256 by SmartWeb protocol.
+ *        Parameters are added only during class loading, after that pointers to them stay valid.
+ */
+class TSmartWebParameterTable
+{
+    std::vector<TSmartWebParameter> Items;
+
+    //! Parameter id to position in Items + 1, 0 if there is no parameter with the id
+    std::vector<uint16_t> Index;
+
+public:
+    static const uint32_t MAX_ID = 255;
+
+    /**
+     * @brief Adds parameter. Returns false if the table already has parameter with the same id.
+     *        Throws std::runtime_error if parameter id is greater than MAX_ID.
+     */
+    bool Add(const TSmartWebParameter& param);
+
+    const TSmartWebParameter* Find(uint32_t id) const;
+
+    size_t size() const;
+    bool empty() const;
+
+    std::vector<TSmartWebParameter>::const_iterator begin() const;
+    std::vector<TSmartWebParameter>::const_iterator end() const;
+};
+
 enum class TDeviceClassSource
 {
     BUILTIN,
     USER
 };
 
-struct TSmartWebClass
+/**
+ * @brief Data of GET_PARAMETER_VALUE request. Program id is set on sending.
+ */
+struct TParameterRequest
+{
+    uint8_t Size;
+    uint8_t Data[3];
+
+    bool operator==(const TParameterRequest& other) const;
+};
+
+/**
+ * @brief Classes are created by std::make_shared. Holders of their parameters outside of the gateway lock
+ *        share ownership of the class, so a class replaced by config reload is freed after its last user.
+ */
+struct TSmartWebClass: public std::enable_shared_from_this<TSmartWebClass>
 {
     uint8_t Type;
     std::string Name;
@@ -208,65 +348,693 @@ struct TSmartWebClass
 
     TDeviceClassSource Source;
 
-    //! id to TSmartWebParameter mapping
-    std::map<uint32_t, std::shared_ptr<TSmartWebParameter>> Inputs;
+    TSmartWebParameterTable Inputs;
+    TSmartWebParameterTable Outputs;
+    TSmartWebParameterTable Parameters;
 
-    //! id to TSmartWebParameter mapping
-    std::map<uint32_t, std::shared_ptr<TSmartWebParameter>> Outputs;
+    //! Requests of all parameters of the class and its ancestors without duplicates, see BuildRequestTemplates
+    std::vector<TParameterRequest> RequestTemplate;
 
-    //! id to TSmartWebParameter mapping
-    std::map<uint32_t, std::shared_ptr<TSmartWebParameter>> Parameters;
+    //! Table parameters of the class and its ancestors. They aren't polled and are not in RequestTemplate
+    std::vector<const TSmartWebParameter*> TableParameters;
 };
 
 struct TSmartWebParameterControl
 {
     uint8_t ProgramId;
-    const TSmartWebParameter* Parameter;
+
+    //! nullptr for program controls REFRESH_CONTROL_ID and BURST_POLLING_CONTROL_ID
+    std::shared_ptr<const TSmartWebParameter> Parameter;
 };
 
+/**
+ * @brief Returns pointer to the parameter sharing ownership of its class.
+ *        The pointer owns nothing if the class isn't created by std::make_shared.
+ */
+std::shared_ptr<const TSmartWebParameter> ShareParameter(const TSmartWebParameter& param);
+
+/**
+ * @brief Returns pointer sharing ownership of the class, see ShareParameter
+ */
+std::shared_ptr<const TSmartWebClass> ShareClass(const TSmartWebClass& cl);
+
 struct TSmartWebToMqttConfig
 {
+    //! Program type to TSmartWebClass mapping
+    typedef std::unordered_map<uint8_t, std::shared_ptr<TSmartWebClass>> TClasses;
+
     std::chrono::milliseconds PollInterval = DEFAULT_POLL_INTERVAL_MS;
+    uint32_t OfflineMisses = DEFAULT_OFFLINE_MISSES;
+    std::chrono::milliseconds OfflineProbeInterval = DEFAULT_OFFLINE_PROBE_INTERVAL;
 
-    //! Program type to TSmartWebClass mapping
-    std::unordered_map<uint8_t, std::shared_ptr<TSmartWebClass>> Classes;
+    //! Values seen in responses to requests of other masters, e.g. SmartWeb panels, are not polled
+    //! during one poll cycle. Responses to requests of the gateway don't count
+    bool PassiveListen = false;
+
+    //! Parameter names, limits, defaults and units are read from programs when the bus is idle
+    bool MetadataDiscovery = false;
+
+    //! Number of threads handling received frames. Frames of a program are always handled by the same thread,
+    //! values of different programs are decoded and published in parallel
+    uint32_t FrameWorkers = DEFAULT_FRAME_WORKERS;
+
+    TClasses Classes;
+};
+
+/**
+ * @brief Resolves inheritance of all classes and fills their RequestTemplate.
+ *        Every ancestor is visited once, cyclic and unknown parents are reported and skipped.
+ */
+void BuildRequestTemplates(TSmartWebToMqttConfig::TClasses& classes);
+
+CAN::TFrame MakeGetParameterValueRequest(uint8_t programId, const TParameterRequest& request);
+
+/**
+ * @brief Adds GET_PARAMETER_VALUE requests from class RequestTemplate for the program
+ */
+void AddRequests(std::vector<CAN::TFrame>& requests, const TSmartWebClass& cl, uint8_t programId);
+
+/**
+ * @brief Round-robin poll plan. Stores only program id and class per program,
+ *        request frames are built from class RequestTemplate on the fly.
+ *        Programs are added and removed in O(1).
+ *        The plan keeps no poll position, so a published plan can be shared by pollers without locks,
+ *        every poller walks it with its own TCursor.
+ */
+class TPollPlan
+{
+    struct TProgram
+    {
+        uint8_t ProgramId;
+        std::shared_ptr<const TSmartWebClass> Class;
+    };
+
+    static const uint16_t NO_PROGRAM = 0xFFFF;
+
+    std::vector<TProgram> Programs;
+
+    //! Program id to position in Programs
+    std::array<uint16_t, 256> Positions;
+
+public:
+    //! Position of a poller in the plan. Stays usable after switching to another plan
+    struct TCursor
+    {
+        size_t ProgramIndex = 0;
+        size_t RequestIndex = 0;
+
+        //! Program being polled, requests of other program at ProgramIndex are polled from the beginning
+        uint8_t ProgramId = 0;
+    };
+
+    TPollPlan();
+
+    /**
+     * @brief Adds program or replaces its class if the program is already in the plan.
+     *        The plan shares ownership of the class, see ShareClass.
+     */
+    void AddProgram(uint8_t programId, const TSmartWebClass* cl);
+
+    /**
+     * @brief Removes program. Returns false if there is no such program.
+     */
+    bool RemoveProgram(uint8_t programId);
+
+    void Clear();
+
+    /**
+     * @brief Builds next request frame and advances the cursor. Returns false if there is nothing to poll.
+     */
+    bool GetNextRequest(TCursor& cursor, CAN::TFrame& frame) const;
+
+    size_t GetProgramCount() const;
+
+    //! Number of requests in one poll cycle
+    size_t GetRequestCount() const;
+};
+
+/**
+ * @brief Requests polled before the poll plan: one-time refresh of all parameters of a program
+ *        and burst polling of a program until a deadline.
+ *        The poll task checks an atomic flag first, so without priority requests it takes no locks.
+ */
+class TPriorityPolling
+{
+public:
+    TPriorityPolling();
+
+    /**
+     * @brief Queues requests of all parameters of the program if they are not queued yet
+     */
+    void Refresh(uint8_t programId, const TSmartWebClass* cl);
+
+    /**
+     * @brief Polls the program on every poll task run until end. Extends running burst.
+     */
+    void StartBurst(uint8_t programId, const TSmartWebClass* cl, std::chrono::steady_clock::time_point end);
+
+    /**
+     * @brief Returns false if there are no priority requests
+     */
+    bool GetNextRequest(CAN::TFrame& frame, std::chrono::steady_clock::time_point now);
+
+    bool IsActive() const;
+
+private:
+    std::atomic<bool> Active;
+    std::mutex Mutex;
+
+    std::deque<CAN::TFrame> Requests;
+
+    //! Number of requests in Requests per program
+    std::array<uint16_t, 256> QueuedRequests;
+
+    TPollPlan BurstPlan;
+    TPollPlan::TCursor BurstCursor;
+    std::unordered_map<uint8_t, std::chrono::steady_clock::time_point> BurstEnds;
+
+    void UpdateActive();
 };
 
-void AddRequests(std::vector<CAN::TFrame>& requests,
-                 const std::string& name,
-                 const TSmartWebClass& cl,
-                 uint8_t programId,
-                 const std::unordered_map<uint8_t, std::shared_ptr<TSmartWebClass>>& classes);
+/**
+ * @brief Queue of parameter writes requested from MQTT with one slot per program parameter.
+ *        A new value for a parameter already in the queue replaces the old one and keeps its position,
+ *        so fast changes of a control produce one CAN frame.
+ */
+class TParameterWriteQueue
+{
+public:
+    struct TWrite
+    {
+        TSmartWebParameterControl Param;
+        std::string Value;
+
+        //! Control to report write errors, can be empty
+        WBMQTT::PControl Control;
+    };
+
+    /**
+     * @brief Puts the write into the slot of its parameter
+     *
+     * @return true if a new slot was added, false if a queued value was replaced
+     */
+    bool Push(const TWrite& write);
+
+    /**
+     * @brief Takes all queued writes in order of their first push
+     */
+    std::vector<TWrite> PopAll();
+
+    size_t Size();
+
+private:
+    std::mutex Mutex;
+    std::vector<TWrite> Writes;
+
+    //! Key of program parameter to position in Writes
+    std::unordered_map<uint32_t, size_t> Index;
+};
+
+/**
+ * @brief Builds key of a value from program id and GET_PARAMETER_VALUE request or response data.
+ *        Index is used only for indexed parameters of PT_PROGRAM.
+ */
+uint32_t MakeValueRequestKey(uint8_t programId, const uint8_t* data);
+
+/**
+ * @brief Lock-free table of times when values were last seen on the bus, keyed by MakeValueRequestKey.
+ *        The table is direct-mapped, on collision the latest value wins, so a lost entry only causes an extra request.
+ *        Times are in milliseconds and wrap around every 49 days.
+ */
+class TValueTimestamps
+{
+public:
+    static const size_t SIZE = 4096;
+
+    TValueTimestamps();
+
+    void Update(uint32_t key, uint32_t timeMs);
+
+    /**
+     * @brief Returns true if the value was seen not earlier than maxAgeMs before nowMs
+     */
+    bool IsRecent(uint32_t key, uint32_t nowMs, uint32_t maxAgeMs) const;
+
+    /**
+     * @brief Like IsRecent, but a recent entry is also removed, so only one caller gets true
+     */
+    bool TakeRecent(uint32_t key, uint32_t nowMs, uint32_t maxAgeMs);
+
+    //! Returns true if the key was updated at any time and its entry isn't taken by another key
+    bool Contains(uint32_t key) const;
+
+private:
+    //! Key in high 32 bits, time in low 32 bits. Zero time marks empty entry
+    std::array<std::atomic<uint64_t>, SIZE> Entries;
+};
 
 CAN::TFrame MakeSetParameterValueRequest(const TSmartWebParameterControl& param, const std::string& value);
 
+//! Returns schedule codec of a table parameter or nullptr for ordinary parameters
+const TScheduleCodec* GetScheduleCodec(const TSmartWebParameter& param);
+
+CAN::TFrame MakeGetTableCellRequest(uint8_t programId, const TSmartWebParameter& param, uint8_t n, uint8_t m);
+
+CAN::TFrame MakeGetProgramTypeRequest(uint8_t programId);
+
+CAN::TFrame MakeGetProtocolVersionRequest(uint8_t programId);
+
+/**
+ * @brief Builds GET_PARAMETER_NAME, _MINIMUM, _MAXIMUM, _DEFAULT or _UNIT request
+ */
+CAN::TFrame MakeGetParameterMetadataRequest(uint8_t programId, const TSmartWebParameter& param, uint8_t functionId);
+
+/**
+ * @brief Builds key of CAN::TTransactions from CAN id without message type.
+ *        Parameter value and metadata requests and responses are also distinguished by MakeValueRequestKey.
+ */
+CAN::TTransactionKey MakeTransactionKey(const CAN::TFrame& frame);
+
+/**
+ * @brief CAN::TResponseKeyFn for SmartWeb responses
+ */
+bool GetResponseTransactionKey(const CAN::TFrame& frame, CAN::TTransactionKey& key);
+
+//! Returns true if MQTT controls of the parameters are the same
+bool IsSameParameter(const TSmartWebParameter& p1, const TSmartWebParameter& p2);
+
+/**
+ * @brief Compares class definitions including parameters and their codecs
+ */
+bool IsSameClass(const TSmartWebClass& c1, const TSmartWebClass& c2);
+
+/**
+ * @brief Returns parameters of the class and its parents in order of the request template followed by table parameters.
+ *        BuildRequestTemplates must be called before.
+ */
+std::vector<const TSmartWebParameter*> GetProgramParameters(const TSmartWebClass& cl,
+                                                            const TSmartWebToMqttConfig::TClasses& classes);
+
+/**
+ * @brief Result of one parameter of bulk read or write
+ */
+struct TBulkParameterResult
+{
+    std::string Name;
+
+    //! Value read from the program. For writes it is the value read back after the write
+    std::string Value;
+
+    //! Empty on success
+    std::string Error;
+};
+
+/**
+ * @brief Called with an error if the request can't be performed at all, otherwise with results of all parameters
+ */
+typedef std::function<void(const std::string& error, const std::vector<TBulkParameterResult>& results)>
+    TBulkResultCallback;
+
+struct TSmartWebToMqttStats
+{
+    TCanReaderStats Reader;
+
+    //! Requests sent by the poll task including refresh and burst polling requests
+    uint64_t PollRequests = 0;
+
+    //! Requests not sent in passive listen mode
+    uint64_t PassiveSkippedRequests = 0;
+
+    //! Value responses to requests of other masters, they make poll requests skipped in passive listen mode
+    uint64_t ForeignValueResponses = 0;
+
+    //! Duration of the last complete poll cycle, zero until the first cycle is complete
+    std::chrono::milliseconds PollCycleDuration{0};
+
+    TTaskStats PollTask;
+
+    size_t KnownPrograms = 0;
+    size_t OfflinePrograms = 0;
+    size_t WriteQueueLength = 0;
+    size_t InFlightTransactions = 0;
+};
+
 class TSmartWebToMqttGateway
 {
     TSmartWebToMqttConfig Config;
+    std::shared_ptr<CAN::IPort> CanPort;
     WBMQTT::PDeviceDriver Driver;
     WBMQTT::PDriverEventHandlerHandle EventHandler;
-    std::vector<std::string> DeviceIds;
 
-    std::mutex RequestMutex;
-    std::vector<CAN::TFrame> Requests;
-    size_t RequestIndex;
+    //! Created device id to name of the class declaring its controls
+    std::unordered_map<std::string, std::string> DeviceClassNames;
+
+    //! Published poll plan. It is never modified, writers holding KnownProgramsMutex replace it with a changed copy
+    std::shared_ptr<const TPollPlan> PollPlan;
+
+    //! Incremented after every PollPlan replacement, lets the poll task check for a new plan without locks
+    std::atomic<uint64_t> PollPlanVersion;
+
+    //! Used only by the poll task
+    std::shared_ptr<const TPollPlan> CurrentPollPlan;
+    uint64_t CurrentPollPlanVersion;
+    TPollPlan::TCursor PollCursor;
+    size_t CurrentPollRequestCount;
+
+    //! Requests not sent because their values were seen on the bus recently, incremented only by the poll task
+    std::atomic<uint64_t> PassiveSkippedRequests;
+
+    //! Requests sent by the poll task including refresh and burst polling requests
+    std::atomic<uint64_t> SentPollRequests;
+
+    //! Requests of the poll plan taken since start of the current poll cycle and the start time.
+    //! Used only by the poll task
+    size_t PollCycleRequests;
+    std::chrono::steady_clock::time_point PollCycleStart;
+
+    //! Duration of the last complete poll cycle
+    std::atomic<int64_t> PollCycleDurationMs;
+
+    std::atomic<bool> PassiveListen;
+
+    //! Times of values seen in responses to requests of other masters
+    TValueTimestamps ValueTimestamps;
+
+    //! Times of value requests sent by the poll task. The first response after the request answers it
+    TValueTimestamps SentRequests;
+
+    //! Times of all value responses, requests never answered by a program are not counted as misses
+    TValueTimestamps AnsweredRequests;
+    std::atomic<uint64_t> ForeignValueResponses;
+    std::chrono::steady_clock::time_point StartTime;
+
+    TTaskHandle DiscoveryTask;
+    TTaskHandle ProbeTask;
+
+    TPriorityPolling PriorityPolling;
+
+    //! Tasks resetting burst_polling controls at the end of bursts. Guarded by KnownProgramsMutex
+    std::unordered_map<uint8_t, TTaskHandle> BurstEndTasks;
+
+    //! Writes from MQTT driver thread, they are sent by WriteTask
+    TParameterWriteQueue WriteQueue;
+    TTaskHandle WriteTask;
+
+    struct TPendingReadBack
+    {
+        //! Value published optimistically after write
+        std::string Value;
+
+        WBMQTT::PControl Control;
+
+        //! Result of read-back of an earlier write of the parameter doesn't complete a newer one
+        uint64_t Id;
+    };
+
+    struct TReadBackResult
+    {
+        uint8_t ProgramId;
+        std::shared_ptr<const TSmartWebParameter> Param;
+        uint64_t Id;
+        CAN::TTransactionResult Result;
+    };
+
+    //! Id of the last TPendingReadBack. Used only by the write task
+    uint64_t LastReadBackId;
+
+    //! Completed read-back transactions are handled by the write task, so transaction callbacks don't publish
+    std::mutex ReadBackResultsMutex;
+    std::vector<TReadBackResult> ReadBackResults;
+
+    /**
+     * @brief Values of one program. Frames of a program are handled by one worker, see FrameWorkers,
+     *        so workers never wait for each other. Taken after KnownProgramsMutex if both are needed.
+     */
+    struct TProgramValues
+    {
+        std::mutex Mutex;
+
+        //! Last decoded values of controls keyed by declaring class type, kind and parameter id
+        std::map<uint32_t, std::string> LastValues;
+
+        //! Written values waiting for read-back keyed by value key
+        std::map<uint32_t, TPendingReadBack> PendingReadBacks;
+    };
+
+    //! Indexed by program id
+    std::array<TProgramValues, 256> ProgramValues;
+
+    struct TBulkRequest
+    {
+        std::mutex Mutex;
+        std::vector<TBulkParameterResult> Results;
+
+        //! Number of parameters waiting for response
+        size_t Pending;
+
+        TBulkResultCallback Callback;
+    };
+
+    struct TTableTransfer
+    {
+        std::shared_ptr<const TSmartWebParameter> Param;
+        std::vector<std::string> Cells;
+        std::vector<bool> Received;
+        size_t Pending;
+        uint32_t Attempts;
+        std::chrono::steady_clock::time_point Deadline;
+    };
+
+    //! Table parameters being read, keyed by program id and value key. Guarded by KnownProgramsMutex
+    std::map<std::pair<uint8_t, uint32_t>, TTableTransfer> TableTransfers;
+
+    struct TPendingPollRequest
+    {
+        uint32_t SendTimeMs;
+        uint8_t ProgramId;
+        uint32_t RequestKey;
+    };
+
+    //! Sent poll requests in order of sending, checked for misses after POLL_RESPONSE_TIMEOUT.
+    //! Used only by the poll task
+    std::deque<TPendingPollRequest> PendingPollRequests;
+
+    //! Poll requests in a row missed by a program, see CountMisses.
+    //! Incremented by the poll task, reset by the CAN reader
+    std::array<std::atomic<uint32_t>, 256> UnansweredRequests;
+
+    //! Time of the last response of a program, see GetTimeMs
+    std::array<std::atomic<uint32_t>, 256> LastResponseTimes;
+
+    //! Copy of Config.OfflineMisses for the poll task
+    std::atomic<uint32_t> OfflineMisses;
+
+    //! Known programs excluded from polling, they only get probe requests. Guarded by KnownProgramsMutex
+    std::unordered_set<uint8_t> OfflinePrograms;
+
+    //! Program id to membership in OfflinePrograms, lets frame workers skip KnownProgramsMutex for online programs
+    std::array<std::atomic<bool>, 256> ProgramOffline;
+
+    //! Program id to device and control ids of its controls. Guarded by KnownProgramsMutex
+    std::unordered_map<uint8_t, std::vector<std::pair<std::string, std::string>>> ProgramControls;
+
+    //! Next program id to be queried by discovery scan, guarded by KnownProgramsMutex
+    uint32_t NextDiscoveryProgramId;
+
     std::unique_ptr<IScheduler> Scheduler;
+    TTaskHandle PollTask;
 
+    //! Guards Config, KnownPrograms, DeviceClassNames and PollPlan replacement.
+    //! MQTT driver thread must not take the lock
     std::mutex KnownProgramsMutex;
 
     //! Program id to TSmartWebClass mapping
     std::unordered_map<uint8_t, TSmartWebClass*> KnownPrograms;
 
+    //! Classes for frame workers, they decode values without KnownProgramsMutex
+    struct TClassSnapshot
+    {
+        //! Program id to class, nullptr for unknown programs
+        std::array<std::shared_ptr<const TSmartWebClass>, 256> Programs;
+
+        //! Copy of Config.Classes
+        TSmartWebToMqttConfig::TClasses Classes;
+    };
+
+    //! Never modified, replaced by PublishClasses like PollPlan
+    std::shared_ptr<const TClassSnapshot> Classes;
+
+    std::atomic<bool> StateChanged;
+
+    //! Empty if state saving is disabled
+    std::string StateFilePath;
+    TTaskHandle StateTask;
+
+    struct TMetadataDiscovery
+    {
+        bool Active = false;
+
+        //! A request is sent and its response isn't handled yet
+        bool InFlight = false;
+
+        uint8_t ProgramId = 0;
+        std::shared_ptr<const TSmartWebClass> Class;
+
+        //! 0 for protocol version request, next steps are metadata requests of Params
+        size_t Step = 0;
+
+        //! Number of answered metadata requests
+        size_t Answered = 0;
+
+        std::vector<std::shared_ptr<const TSmartWebParameter>> Params;
+        TProgramMetadata Result;
+    };
+
+    struct TMetadataResponse
+    {
+        uint8_t ProgramId;
+        size_t Step;
+        CAN::TTransactionResult Result;
+    };
+
+    //! Programs waiting for metadata discovery and the running discovery. Guarded by KnownProgramsMutex
+    std::deque<uint8_t> MetadataQueue;
+    TMetadataDiscovery MetadataDiscovery;
+
+    //! Programs to update controls of after their metadata is found. Guarded by KnownProgramsMutex
+    std::vector<uint8_t> MetadataUpdates;
+
+    //! Program id to protocol version used as firmware version. Guarded by KnownProgramsMutex
+    std::unordered_map<uint8_t, std::string> FirmwareVersions;
+
+    //! Metadata keyed by program type and firmware version. Guarded by KnownProgramsMutex
+    std::map<std::pair<uint8_t, std::string>, TProgramMetadata> Metadata;
+    bool MetadataChanged;
+
+    //! Responses are handled by MetadataTask, so transaction callbacks don't wait for KnownProgramsMutex
+    std::mutex MetadataResponsesMutex;
+    std::vector<TMetadataResponse> MetadataResponses;
+
+    //! Empty if metadata cache is disabled
+    std::string MetadataCacheFilePath;
+    TTaskHandle MetadataTask;
+
+    //! Request-response matching for bulk reads and writes. Added to the port before CanReader to see responses
+    std::unique_ptr<CAN::TTransactions> Transactions;
+
     std::unique_ptr<TThreadedCanReader> CanReader;
 
-    void HandleMapping(CAN::IPort& canPort);
+    void HandleMapping(CAN::IPort& canPort, std::chrono::milliseconds pollInterval);
+    void SendPollRequest(CAN::IPort& canPort, const CAN::TFrame& frame);
+    void CountPollCycleRequest();
+
+    /**
+     * @brief Counts poll requests unanswered within POLL_RESPONSE_TIMEOUT as misses and sets programs offline.
+     *        A request isn't a miss if the program has answered anything since it was sent, so slow programs
+     *        stay online, or if the program has never answered the request, e.g. for a parameter unsupported
+     *        by its firmware
+     */
+    void CountMisses();
+    uint32_t GetTimeMs() const;
+    void AddPollTask();
+    void AddProbeTask();
+    void WriteParameters();
+    void SetWriteError(const WBMQTT::PControl& control, bool error);
+    void AddReadBack(const TParameterWriteQueue::TWrite& write, const CAN::TFrame& setFrame);
+
+    /**
+     * @brief Logs confirmed and not applied writes and rolls back values without read-back response in MQTT.
+     *        Values read back are published by HandleFrame like polled ones
+     */
+    void CompleteReadBacks();
+    void StartBulkRequest(uint8_t programId,
+                          std::vector<std::pair<std::string, std::string>> values,
+                          bool write,
+                          TBulkResultCallback callback);
+    void CompleteBulkRequest(const std::shared_ptr<TBulkRequest>& request,
+                             size_t index,
+                             const TSmartWebParameter& param,
+                             bool write,
+                             const CAN::TTransactionResult& response);
+    void SendProbeRequests();
+    void AddMetadataTask();
+    void QueueMetadataDiscovery(uint8_t programId);
+    void DiscoverMetadata();
+    bool GetNextMetadataRequest(CAN::TFrame& frame);
+    void HandleMetadataResponse(const TMetadataResponse& response);
+    void UpdateMetadataControls(uint8_t programId);
+    const TParameterMetadata* FindMetadata(uint8_t programId, const TSmartWebParameter& param) const;
+    void LoadMetadata();
+    void SetProgramOffline(uint8_t programId);
+    void SetProgramOnline(uint8_t programId);
+    void RebuildRequests();
+    void PublishPollPlan(std::shared_ptr<const TPollPlan> plan);
+
+    //! Replaces Classes after changes of KnownPrograms or Config.Classes, KnownProgramsMutex must be held
+    void PublishClasses();
+    void StartDiscovery();
+    bool SendNextDiscoveryRequest();
     void AddProgram(const CAN::TFrame& frame);
-    void HandleGetValueResponse(const CAN::TFrame& frame);
+    void AddProgram(uint8_t programId, uint8_t programType, const CAN::TFrame& frame);
+
+    //! Control value to be published without KnownProgramsMutex, see HandleFrame
+    struct TControlUpdate
+    {
+        std::shared_ptr<const TSmartWebParameter> Param;
+        uint8_t ProgramId;
+        std::string Value;
+        bool Error;
+    };
+
+    /**
+     * @brief Updates state of gateway by the response. Doesn't need KnownProgramsMutex,
+     *        takes it only for cells of table parameters
+     *
+     * @return true if the update must be published by SetControlValue
+     */
+    bool HandleGetValueResponse(const TClassSnapshot& classes, const CAN::TFrame& frame, TControlUpdate& update);
 
-    void SetParameter(const std::map<uint32_t, std::shared_ptr<TSmartWebParameter>>& params,
+    bool SetParameter(const TSmartWebParameterTable& params,
+                      TParameterKind kind,
                       uint8_t parameterId,
                       const uint8_t* data,
-                      uint8_t programId);
+                      uint8_t programId,
+                      TControlUpdate& update);
+
+    //! Publishes the value and updates state of gateway, KnownProgramsMutex must be held
+    void PublishValue(const TSmartWebParameter& p,
+                      TParameterKind kind,
+                      uint8_t programId,
+                      const std::string& value,
+                      bool error);
+
+    //! Sets value of existing control. Doesn't need KnownProgramsMutex. Returns false if there is no control
+    bool SetControlValue(const TControlUpdate& update);
+
+    void CreateValueControl(const TControlUpdate& update);
+
+    //! Handles read-back of written value and remembers last value for state saving. Takes ProgramValues lock
+    void UpdateValueState(const TSmartWebParameter& p,
+                          TParameterKind kind,
+                          uint8_t programId,
+                          const std::string& value,
+                          bool error);
+
+    void ReadTables(uint8_t programId, const TSmartWebClass& cl);
+    void StartTableRead(uint8_t programId, const TSmartWebParameter& param);
+    void SendTableRequests(uint8_t programId, uint32_t valueKey, const std::vector<CAN::TFrame>& frames);
+    void CheckTableTransfer(uint8_t programId, uint32_t valueKey);
+    void HandleTableCell(uint8_t programId, const TSmartWebParameter& param, const SmartWeb::TParameterData& data);
+
+    WBMQTT::PLocalDevice GetDevice(const WBMQTT::PDriverTx& tx, const TSmartWebClass& cl, uint8_t programId);
+    void CreateProgramControls(const WBMQTT::PDriverTx& tx, const TSmartWebClass& cl, uint8_t programId);
+    void CreateParameterControls(const WBMQTT::PDriverTx& tx, const TSmartWebClass& cl, uint8_t programId);
+    void HandleProgramControl(uint8_t programId, const std::string& controlId, const std::string& value);
+    void SetBurstPollingControl(uint8_t programId, const TSmartWebClass& cl, const std::string& value);
+    void EndBurst(uint8_t programId);
+
+    void RestoreState();
+    void SaveState();
 
     WBMQTT::TControlArgs MakeControlArgs(uint8_t programId,
                                          const TSmartWebParameter& param,
@@ -277,9 +1045,60 @@ class TSmartWebToMqttGateway
     void HandleFrame(const CAN::TFrame& frame);
 
 public:
+    /**
+     * @brief Creates gateway and starts polling
+     *
+     * @param stateFilePath file for discovered programs and last values. Devices are recreated from it on start
+     *                      with values marked as errors until programs answer polling. Empty path disables the state.
+     * @param metadataCacheFilePath file for parameter metadata read by TSmartWebToMqttConfig::MetadataDiscovery.
+     *                              Empty path disables the cache, metadata is read again after restart.
+     */
     TSmartWebToMqttGateway(const TSmartWebToMqttConfig& config,
                            std::shared_ptr<CAN::IPort> canPort,
-                           WBMQTT::PDeviceDriver driver);
+                           WBMQTT::PDeviceDriver driver,
+                           const std::string& stateFilePath = std::string(),
+                           const std::string& metadataCacheFilePath = std::string());
 
     ~TSmartWebToMqttGateway();
+
+    /**
+     * @brief Applies new classes and poll interval.
+     *        Known programs of unchanged classes keep their MQTT devices and values.
+     *        In changed classes only controls of added, removed or changed parameters are created or deleted.
+     *        Devices of removed or renamed classes are deleted.
+     */
+    void UpdateConfig(const TSmartWebToMqttConfig& config);
+
+    /**
+     * @brief Deletes controls and values of parameters changed in the new definitions of classes,
+     *        see UpdateConfig. KnownProgramsMutex must be held
+     *
+     * @param oldClasses old definitions of changed and removed classes
+     */
+    void RemoveChangedControls(const std::vector<std::shared_ptr<TSmartWebClass>>& oldClasses);
+
+    /**
+     * @brief Reads parameters of a known program with pipelined requests.
+     *        Unanswered requests are resent BULK_REQUEST_RETRIES times.
+     *        The callback is called from gateway or CAN threads after all responses or timeouts.
+     *
+     * @param names parameter names, empty list means all parameters of the program class
+     */
+    void BulkRead(uint8_t programId, const std::vector<std::string>& names, TBulkResultCallback callback);
+
+    /**
+     * @brief Writes parameters of a known program with pipelined requests.
+     *        Every write is confirmed by read-back, a parameter gets an error if the program keeps another value.
+     *
+     * @param values parameter names and values
+     */
+    void BulkWrite(uint8_t programId,
+                   const std::vector<std::pair<std::string, std::string>>& values,
+                   TBulkResultCallback callback);
+
+    /**
+     * @brief Collects counters and queue lengths. Takes KnownProgramsMutex, so it must not be called
+     *        from MQTT driver thread.
+     */
+    TSmartWebToMqttStats GetStats();
 };
\ No newline at end of file
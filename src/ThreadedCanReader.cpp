@@ -1,5 +1,6 @@
 #include "ThreadedCanReader.h"
 
+#include <algorithm>
 #include <cstring>
 #include <wblib/utils.h>
 
@@ -12,57 +13,94 @@ TThreadedCanReader::TThreadedCanReader(const std::string& threadName,
                                        std::shared_ptr<CAN::IPort> canPort,
                                        size_t framesQueueMaxLength,
                                        std::function<bool(const CAN::TFrame& frame)> acceptFrame,
-                                       std::function<void(const CAN::TFrame& frame)> handleFrame)
+                                       std::function<void(const CAN::TFrame& frame)> handleFrame,
+                                       size_t workersCount,
+                                       std::function<uint32_t(const CAN::TFrame& frame)> getShardKey)
     : CanPort(canPort),
       FramesQueueMaxLength(framesQueueMaxLength),
-      AcceptFrame(acceptFrame)
+      ReceivedFrames(0),
+      AcceptedFrames(0),
+      DroppedFrames(0),
+      AcceptFrame(acceptFrame),
+      GetShardKey(getShardKey)
 {
     Enabled.store(true);
-    CanPort->AddHandler(this);
-
-    Thread = std::thread([this, threadName, handleFrame]() {
-        WBMQTT::SetThreadName(threadName);
-        CAN::TFrame frame;
-        while (Enabled.load()) {
-            memset(&frame, 0, sizeof(CAN::TFrame));
-            if (Get(frame)) {
-                handleFrame(frame);
+    for (size_t i = 0; i < std::max<size_t>(workersCount, 1); ++i) {
+        Workers.push_back(std::make_unique<TWorker>());
+    }
+    for (size_t i = 0; i < Workers.size(); ++i) {
+        auto name = (Workers.size() == 1) ? threadName : threadName + " " + std::to_string(i);
+        auto worker = Workers[i].get();
+        worker->Thread = std::thread([this, name, worker, handleFrame]() {
+            WBMQTT::SetThreadName(name);
+            CAN::TFrame frame;
+            while (Enabled.load()) {
+                memset(&frame, 0, sizeof(CAN::TFrame));
+                if (Get(*worker, frame)) {
+                    handleFrame(frame);
+                }
             }
-        }
-    });
+        });
+    }
+    CanPort->AddHandler(this);
 }
 
 TThreadedCanReader::~TThreadedCanReader()
 {
     CanPort->RemoveHandler(this);
-    Enabled.store(false);
-    if (Thread.joinable()) {
-        Thread.join();
+    for (auto& worker: Workers) {
+        std::unique_lock<std::mutex> waitLock(worker->Mutex);
+        Enabled.store(false);
+        worker->Cv.notify_all();
+    }
+    for (auto& worker: Workers) {
+        if (worker->Thread.joinable()) {
+            worker->Thread.join();
+        }
     }
 }
 
 bool TThreadedCanReader::Handle(const CAN::TFrame& frame)
 {
+    ++ReceivedFrames;
     if (!AcceptFrame(frame)) {
         return false;
     }
-    std::unique_lock<std::mutex> waitLock(Mutex);
-    if (Frames.size() < FramesQueueMaxLength) {
-        Frames.push(frame);
-        Cv.notify_all();
+    auto& worker = *Workers[(Workers.size() == 1 || !GetShardKey) ? 0 : GetShardKey(frame) % Workers.size()];
+    std::unique_lock<std::mutex> waitLock(worker.Mutex);
+    if (worker.Frames.size() < FramesQueueMaxLength) {
+        ++AcceptedFrames;
+        worker.Frames.push(frame);
+        worker.Cv.notify_all();
+    } else {
+        ++DroppedFrames;
     }
     return true;
 }
 
-bool TThreadedCanReader::Get(CAN::TFrame& frame)
+bool TThreadedCanReader::Get(TWorker& worker, CAN::TFrame& frame)
 {
-    std::unique_lock<std::mutex> waitLock(Mutex);
-    if (Frames.empty()) {
-        if (std::cv_status::timeout == Cv.wait_for(waitLock, READ_TIMEOUT)) {
-            return false;
-        }
+    std::unique_lock<std::mutex> waitLock(worker.Mutex);
+    // Enabled is checked under the lock, so the worker doesn't miss notification on destruction
+    if (!worker.Cv.wait_for(waitLock, READ_TIMEOUT, [&]() { return !worker.Frames.empty() || !Enabled.load(); }) ||
+        worker.Frames.empty())
+    {
+        return false;
     }
-    frame = Frames.front();
-    Frames.pop();
+    frame = worker.Frames.front();
+    worker.Frames.pop();
     return true;
 }
+
+TCanReaderStats TThreadedCanReader::GetStats()
+{
+    TCanReaderStats stats;
+    stats.ReceivedFrames = ReceivedFrames.load();
+    stats.AcceptedFrames = AcceptedFrames.load();
+    stats.DroppedFrames = DroppedFrames.load();
+    for (auto& worker: Workers) {
+        std::unique_lock<std::mutex> waitLock(worker->Mutex);
+        stats.QueueLength += worker->Frames.size();
+    }
+    return stats;
+}
@@ -3,34 +3,75 @@
 #include <atomic>
 #include <condition_variable>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <vector>
 
 #include "CanPort.h"
 
+struct TCanReaderStats
+{
+    //! Frames passed to the reader by the port
+    uint64_t ReceivedFrames = 0;
+
+    //! Received frames put into worker queues
+    uint64_t AcceptedFrames = 0;
+
+    //! Accepted frames lost because of full worker queue
+    uint64_t DroppedFrames = 0;
+
+    //! Total length of worker queues
+    size_t QueueLength = 0;
+};
+
+/**
+ * @brief Handles accepted frames in worker threads.
+ *        With several workers frames are distributed by shard key, so frames with equal keys
+ *        are handled by one worker in order of receiving.
+ */
 class TThreadedCanReader: public CAN::IFrameHandler
 {
+    struct TWorker
+    {
+        std::mutex Mutex;
+        std::condition_variable Cv;
+        std::queue<CAN::TFrame> Frames;
+        std::thread Thread;
+    };
+
     std::shared_ptr<CAN::IPort> CanPort;
 
-    std::mutex Mutex;
-    std::condition_variable Cv;
-    std::queue<CAN::TFrame> Frames;
+    //! Maximum queue length of every worker
     size_t FramesQueueMaxLength;
 
-    std::thread Thread;
+    std::vector<std::unique_ptr<TWorker>> Workers;
     std::atomic_bool Enabled;
 
+    std::atomic<uint64_t> ReceivedFrames;
+    std::atomic<uint64_t> AcceptedFrames;
+    std::atomic<uint64_t> DroppedFrames;
+
     std::function<bool(const CAN::TFrame& frame)> AcceptFrame;
+    std::function<uint32_t(const CAN::TFrame& frame)> GetShardKey;
 
     bool Handle(const CAN::TFrame& frame);
-    bool Get(CAN::TFrame& frame);
+    bool Get(TWorker& worker, CAN::TFrame& frame);
 
 public:
+    /**
+     * @param workersCount number of handling threads, handleFrame is called from all of them
+     * @param getShardKey  returns key of the worker for a frame, can be empty for one worker
+     */
     TThreadedCanReader(const std::string& threadName,
                        std::shared_ptr<CAN::IPort> canPort,
                        size_t framesQueueMaxLength,
                        std::function<bool(const CAN::TFrame& frame)> acceptFrame,
-                       std::function<void(const CAN::TFrame& frame)> handleFrame);
+                       std::function<void(const CAN::TFrame& frame)> handleFrame,
+                       size_t workersCount = 1,
+                       std::function<uint32_t(const CAN::TFrame& frame)> getShardKey = nullptr);
     ~TThreadedCanReader();
+
+    TCanReaderStats GetStats();
 };
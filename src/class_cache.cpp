@@ -0,0 +1,331 @@
+#include "class_cache.h"
+#include "file_utils.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    const char CACHE_MAGIC[4] = {'S', 'W', 'C', 'C'};
+
+    //! Must be incremented on every change of the file format or TSmartWebClass layout
+    const uint32_t CACHE_VERSION = 2;
+
+    const uint64_t FNV_PRIME = 0x100000001b3ULL;
+
+    const uint8_t ENUM_CODEC_INDEX = 0xFF;
+
+    typedef std::function<std::shared_ptr<const ISmartWebCodec>()> TCodecFactory;
+
+    /**
+     * @brief All stateless codecs which can be stored in cache.
+     *        Codecs are identified in cache by index in this table, so new codecs must be added to the end.
+     */
+    const std::vector<TCodecFactory>& GetCodecFactories()
+    {
+        static const std::vector<TCodecFactory> factories = {
+            GetSharedCodec<TIntCodec<int8_t, 1>>,
+            GetSharedCodec<TIntCodec<int16_t, 1>>,
+            GetSharedCodec<TIntCodec<int16_t, 10>>,
+            GetSharedCodec<TIntCodec<int16_t, 100>>,
+            GetSharedCodec<TIntCodec<uint16_t, 1>>,
+            GetSharedCodec<TIntCodec<uint32_t, 1000>>,
+            GetSharedCodec<TIntCodec<uint32_t, 60000>>,
+            GetSharedCodec<TIntCodec<uint8_t, 1>>,
+            GetSharedCodec<TSensorCodec>,
+            GetSharedCodec<TOnOffSensorCodec>,
+            GetSharedCodec<TPwmCodec>,
+            GetSharedCodec<TOutputCodec>,
+            GetSharedCodec<TScheduleCodec>,
+        };
+        return factories;
+    }
+
+    uint8_t GetCodecIndex(const ISmartWebCodec& codec)
+    {
+        if (dynamic_cast<const TEnumCodec*>(&codec)) {
+            return ENUM_CODEC_INDEX;
+        }
+        static const auto names = []() {
+            std::vector<std::string> res;
+            for (const auto& factory: GetCodecFactories()) {
+                res.push_back(factory()->GetName());
+            }
+            return res;
+        }();
+        auto it = std::find(names.begin(), names.end(), codec.GetName());
+        if (it == names.end()) {
+            throw std::runtime_error("codec " + codec.GetName() + " can't be cached");
+        }
+        return it - names.begin();
+    }
+
+    class TCacheWriter
+    {
+        std::string Data;
+
+    public:
+        template<class T> void Write(T value)
+        {
+            static_assert(std::is_trivially_copyable<T>::value, "only plain values can be written");
+            Data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+        void WriteString(const std::string& value)
+        {
+            Write<uint32_t>(value.size());
+            Data.append(value);
+        }
+
+        void WriteParameters(const TSmartWebParameterTable& params)
+        {
+            Write<uint32_t>(params.size());
+            for (const auto& p: params) {
+                Write<uint32_t>(p.Id);
+                WriteString(p.Name);
+                WriteString(p.Type);
+                Write<uint8_t>(p.ReadOnly);
+                Write<uint32_t>(p.Order);
+                auto codecIndex = GetCodecIndex(*p.Codec);
+                Write<uint8_t>(codecIndex);
+                if (codecIndex == ENUM_CODEC_INDEX) {
+                    const auto& values = dynamic_cast<const TEnumCodec&>(*p.Codec).GetValues();
+                    Write<uint32_t>(values.size());
+                    for (const auto& v: values) {
+                        Write<uint8_t>(v.first);
+                        WriteString(v.second);
+                    }
+                }
+            }
+        }
+
+        const std::string& GetData() const
+        {
+            return Data;
+        }
+    };
+
+    class TCacheReader
+    {
+        const uint8_t* Pos;
+        const uint8_t* End;
+
+        void Check(size_t size) const
+        {
+            if (size_t(End - Pos) < size) {
+                throw std::runtime_error("unexpected end of class cache");
+            }
+        }
+
+    public:
+        TCacheReader(const uint8_t* data, size_t size): Pos(data), End(data + size)
+        {}
+
+        template<class T> T Read()
+        {
+            Check(sizeof(T));
+            T res;
+            memcpy(&res, Pos, sizeof(T));
+            Pos += sizeof(T);
+            return res;
+        }
+
+        std::string ReadString()
+        {
+            auto size = Read<uint32_t>();
+            Check(size);
+            std::string res(reinterpret_cast<const char*>(Pos), size);
+            Pos += size;
+            return res;
+        }
+
+        void ReadParameters(TSmartWebParameterTable& params, const TSmartWebClass* programClass)
+        {
+            auto count = Read<uint32_t>();
+            for (uint32_t i = 0; i < count; ++i) {
+                TSmartWebParameter p;
+                p.Id = Read<uint32_t>();
+                p.Name = ReadString();
+                p.Type = ReadString();
+                p.ReadOnly = Read<uint8_t>();
+                p.Order = Read<uint32_t>();
+                p.ProgramClass = programClass;
+                auto codecIndex = Read<uint8_t>();
+                if (codecIndex == ENUM_CODEC_INDEX) {
+                    std::map<uint8_t, std::string> values;
+                    auto valuesCount = Read<uint32_t>();
+                    for (uint32_t j = 0; j < valuesCount; ++j) {
+                        auto key = Read<uint8_t>();
+                        values[key] = ReadString();
+                    }
+                    p.Codec = std::make_shared<TEnumCodec>(values);
+                } else {
+                    if (codecIndex >= GetCodecFactories().size()) {
+                        throw std::runtime_error("unknown codec in class cache");
+                    }
+                    p.Codec = GetCodecFactories()[codecIndex]();
+                }
+                // Cache of older versions may have writable schedules
+                if (GetScheduleCodec(p)) {
+                    p.ReadOnly = true;
+                }
+                if (!params.Add(p)) {
+                    throw std::runtime_error("duplicate parameter in class cache");
+                }
+            }
+        }
+
+        bool IsEnd() const
+        {
+            return Pos == End;
+        }
+    };
+
+    class TMappedFile
+    {
+        void* Data = MAP_FAILED;
+        size_t Size = 0;
+
+    public:
+        //! Maps the file to memory, returns false if the file doesn't exist
+        bool Open(const std::string& filePath)
+        {
+            int fd = open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                if (errno == ENOENT) {
+                    return false;
+                }
+                throw std::runtime_error("can't open " + filePath + ": " + strerror(errno));
+            }
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                Size = st.st_size;
+                Data = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+            close(fd);
+            if (Data == MAP_FAILED) {
+                throw std::runtime_error("can't map " + filePath);
+            }
+            return true;
+        }
+
+        ~TMappedFile()
+        {
+            if (Data != MAP_FAILED) {
+                munmap(Data, Size);
+            }
+        }
+
+        const uint8_t* GetData() const
+        {
+            return static_cast<const uint8_t*>(Data);
+        }
+
+        size_t GetSize() const
+        {
+            return Size;
+        }
+    };
+}
+
+uint64_t HashData(const void* data, size_t size, uint64_t hash)
+{
+    auto bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+uint64_t HashFile(const std::string& filePath, uint64_t hash)
+{
+    std::ifstream file(filePath, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("can't open " + filePath);
+    }
+    char buf[4096];
+    while (file.read(buf, sizeof(buf)) || file.gcount() > 0) {
+        hash = HashData(buf, file.gcount(), hash);
+    }
+    if (file.bad()) {
+        throw std::runtime_error("can't read " + filePath);
+    }
+    return hash;
+}
+
+bool LoadClassCache(const std::string& cacheFilePath, uint64_t key, TSmartWebToMqttConfig::TClasses& classes)
+{
+    TMappedFile file;
+    if (!file.Open(cacheFilePath)) {
+        return false;
+    }
+    TCacheReader reader(file.GetData(), file.GetSize());
+    for (auto c: CACHE_MAGIC) {
+        if (reader.Read<char>() != c) {
+            throw std::runtime_error("bad class cache signature");
+        }
+    }
+    if (reader.Read<uint32_t>() != CACHE_VERSION || reader.Read<uint64_t>() != key) {
+        return false;
+    }
+
+    TSmartWebToMqttConfig::TClasses res;
+    auto count = reader.Read<uint32_t>();
+    for (uint32_t i = 0; i < count; ++i) {
+        auto cl = std::make_shared<TSmartWebClass>();
+        cl->Type = reader.Read<uint8_t>();
+        cl->Source = static_cast<TDeviceClassSource>(reader.Read<uint8_t>());
+        cl->Name = reader.ReadString();
+        auto parentsCount = reader.Read<uint32_t>();
+        for (uint32_t j = 0; j < parentsCount; ++j) {
+            cl->ParentClasses.push_back(reader.ReadString());
+        }
+        reader.ReadParameters(cl->Inputs, cl.get());
+        reader.ReadParameters(cl->Outputs, cl.get());
+        reader.ReadParameters(cl->Parameters, cl.get());
+        res.insert({cl->Type, cl});
+    }
+    if (!reader.IsEnd()) {
+        throw std::runtime_error("unexpected data at the end of class cache");
+    }
+    classes.swap(res);
+    return true;
+}
+
+void SaveClassCache(const std::string& cacheFilePath, uint64_t key, const TSmartWebToMqttConfig::TClasses& classes)
+{
+    std::vector<const TSmartWebClass*> sortedClasses;
+    for (const auto& cl: classes) {
+        sortedClasses.push_back(cl.second.get());
+    }
+    std::sort(sortedClasses.begin(), sortedClasses.end(), [](auto c1, auto c2) { return c1->Type < c2->Type; });
+
+    TCacheWriter writer;
+    for (auto c: CACHE_MAGIC) {
+        writer.Write(c);
+    }
+    writer.Write(CACHE_VERSION);
+    writer.Write(key);
+    writer.Write<uint32_t>(sortedClasses.size());
+    for (auto cl: sortedClasses) {
+        writer.Write<uint8_t>(cl->Type);
+        writer.Write<uint8_t>(static_cast<uint8_t>(cl->Source));
+        writer.WriteString(cl->Name);
+        writer.Write<uint32_t>(cl->ParentClasses.size());
+        for (const auto& parent: cl->ParentClasses) {
+            writer.WriteString(parent);
+        }
+        writer.WriteParameters(cl->Inputs);
+        writer.WriteParameters(cl->Outputs);
+        writer.WriteParameters(cl->Parameters);
+    }
+
+    WriteFileAtomically(cacheFilePath, writer.GetData());
+}
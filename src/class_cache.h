@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+
+#include "SmartWebToMqttGateway.h"
+
+/**
+ * @brief Binary cache of loaded SmartWeb classes.
+ *        The cache lets the driver skip parsing and validation of class files if they are not changed.
+ *        The file is bound to a key computed from contents of class files and class schema,
+ *        it is ignored if the key doesn't match.
+ *        Data is stored in host byte order, so the file must not be moved to other machines.
+ */
+
+/**
+ * @brief Initial value for hash functions
+ */
+const uint64_t CLASS_CACHE_EMPTY_HASH = 0xcbf29ce484222325ULL;
+
+/**
+ * @brief Computes FNV-1a hash of data continuing from hash
+ */
+uint64_t HashData(const void* data, size_t size, uint64_t hash = CLASS_CACHE_EMPTY_HASH);
+
+/**
+ * @brief Computes FNV-1a hash of file contents continuing from hash.
+ *        Throws std::runtime_error if the file can't be read.
+ */
+uint64_t HashFile(const std::string& filePath, uint64_t hash = CLASS_CACHE_EMPTY_HASH);
+
+/**
+ * @brief Loads classes from memory-mapped cache file
+ *
+ * @return false if there is no cache file or it was built for another key.
+ *         Throws std::runtime_error if the file is malformed.
+ */
+bool LoadClassCache(const std::string& cacheFilePath, uint64_t key, TSmartWebToMqttConfig::TClasses& classes);
+
+/**
+ * @brief Atomically replaces cache file with new one.
+ *        Throws std::runtime_error on write errors or if a codec can't be stored.
+ */
+void SaveClassCache(const std::string& cacheFilePath, uint64_t key, const TSmartWebToMqttConfig::TClasses& classes);
@@ -1,36 +1,42 @@
 #include "config_parser.h"
 
+#include <atomic>
 #include <filesystem>
 #include <set>
+#include <thread>
 
+#include "class_cache.h"
 #include "log.h"
 
 #define LOG(logger) ::logger.Log() << "[config] "
 
 namespace
 {
-    std::unique_ptr<ISmartWebCodec> GetCodec(const Json::Value& data)
+    std::shared_ptr<const ISmartWebCodec> GetCodec(const Json::Value& data)
     {
         if (data.isMember("encoding")) {
             auto enc = data["encoding"].asString();
 
+            if (enc == "schedule1" || enc == "schedule2") {
+                return GetSharedCodec<TScheduleCodec>();
+            }
             if (WBMQTT::StringStartsWith(enc, "schedule")) {
                 throw std::runtime_error("Encoding '" + enc + "' is not supported");
             }
             if (enc == "byte")
-                return std::make_unique<TIntCodec<int8_t, 1>>();
+                return GetSharedCodec<TIntCodec<int8_t, 1>>();
             if (enc == "short")
-                return std::make_unique<TIntCodec<int16_t, 1>>();
+                return GetSharedCodec<TIntCodec<int16_t, 1>>();
             if (enc == "short10")
-                return std::make_unique<TIntCodec<int16_t, 10>>();
+                return GetSharedCodec<TIntCodec<int16_t, 10>>();
             if (enc == "short100")
-                return std::make_unique<TIntCodec<int16_t, 100>>();
+                return GetSharedCodec<TIntCodec<int16_t, 100>>();
             if (enc == "ushort")
-                return std::make_unique<TIntCodec<uint16_t, 1>>();
+                return GetSharedCodec<TIntCodec<uint16_t, 1>>();
             if (enc == "uint1K")
-                return std::make_unique<TIntCodec<uint32_t, 1000>>();
+                return GetSharedCodec<TIntCodec<uint32_t, 1000>>();
             if (enc == "uint60K")
-                return std::make_unique<TIntCodec<uint32_t, 60000>>();
+                return GetSharedCodec<TIntCodec<uint32_t, 60000>>();
             if (enc == "ubyte") {
                 if (data.isMember("values")) {
                     std::map<uint8_t, std::string> values;
@@ -38,28 +44,35 @@ namespace
                     for (Json::Value::const_iterator it = ar.begin(); it != ar.end(); ++it) {
                         values.insert({atoi(it.name().c_str()), it->asString()});
                     }
-                    return std::make_unique<TEnumCodec>(values);
+                    return std::make_shared<TEnumCodec>(values);
                 }
-                return std::make_unique<TIntCodec<uint8_t, 1>>();
+                return GetSharedCodec<TIntCodec<uint8_t, 1>>();
             }
         }
-        return std::make_unique<TIntCodec<int16_t, 10>>(); // default codec
+        return GetSharedCodec<TIntCodec<int16_t, 10>>(); // default codec
     }
 
-    std::shared_ptr<TSmartWebParameter> LoadParameter(const Json::Value& param,
-                                                      const std::string& name,
-                                                      const TSmartWebClass* programClass,
-                                                      uint32_t orderBase)
+    TSmartWebParameter LoadParameter(const Json::Value& param,
+                                     const std::string& name,
+                                     const TSmartWebClass* programClass,
+                                     uint32_t orderBase)
     {
-        auto p = std::make_shared<TSmartWebParameter>();
-        p->Id = param["id"].asUInt();
-        p->Name = name;
-        p->Type = param.get("type", "value").asString();
-        p->ProgramClass = programClass;
-        p->Order = orderBase + p->Id;
+        TSmartWebParameter p;
+        p.Id = param["id"].asUInt();
+        p.Name = name;
+        p.Type = param.get("type", "value").asString();
+        p.ProgramClass = programClass;
+        p.Order = orderBase + p.Id;
         return p;
     }
 
+    void AddParameter(TSmartWebParameterTable& params, const TSmartWebParameter& p)
+    {
+        if (!params.Add(p)) {
+            LOG(WBMQTT::Warn) << "Parameter '" << p.Name << "' is ignored. Duplicate id " << p.Id;
+        }
+    }
+
     uint32_t LoadInputs(const Json::Value& data, TSmartWebClass* programClass)
     {
         if (!data.isMember("inputs")) {
@@ -69,14 +82,14 @@ namespace
         const auto& ar = data["inputs"];
         for (Json::Value::const_iterator it = ar.begin(); it != ar.end(); ++it) {
             auto p = LoadParameter(*it, it.name(), programClass, 0);
-            if (p->Type == "onOff") {
-                p->Codec = std::make_unique<TOnOffSensorCodec>();
+            if (p.Type == "onOff") {
+                p.Codec = GetSharedCodec<TOnOffSensorCodec>();
             } else {
-                p->Codec = std::make_unique<TSensorCodec>();
+                p.Codec = GetSharedCodec<TSensorCodec>();
             }
-            LOG(WBMQTT::Debug) << "Input '" << p->Name << "' " << p->Type << " id " << p->Id;
-            programClass->Inputs.insert({p->Id, p});
-            maxId = std::max(maxId, p->Id);
+            LOG(WBMQTT::Debug) << "Input '" << p.Name << "' " << p.Type << " id " << p.Id;
+            AddParameter(programClass->Inputs, p);
+            maxId = std::max(maxId, p.Id);
         }
         return maxId + 1;
     }
@@ -90,14 +103,14 @@ namespace
         const auto& ar = data["outputs"];
         for (Json::Value::const_iterator it = ar.begin(); it != ar.end(); ++it) {
             auto p = LoadParameter(*it, it.name(), programClass, orderBase);
-            if (p->Type == "PWM") {
-                p->Codec = std::make_unique<TPwmCodec>();
+            if (p.Type == "PWM") {
+                p.Codec = GetSharedCodec<TPwmCodec>();
             } else {
-                p->Codec = std::make_unique<TOutputCodec>();
+                p.Codec = GetSharedCodec<TOutputCodec>();
             }
-            LOG(WBMQTT::Debug) << "Output '" << p->Name << "' " << p->Type << " id " << p->Id;
-            programClass->Outputs.insert({p->Id, p});
-            maxId = std::max(maxId, p->Id);
+            LOG(WBMQTT::Debug) << "Output '" << p.Name << "' " << p.Type << " id " << p.Id;
+            AddParameter(programClass->Outputs, p);
+            maxId = std::max(maxId, p.Id);
         }
         return orderBase + maxId + 1;
     }
@@ -112,19 +125,23 @@ namespace
         for (Json::Value::const_iterator it = ar.begin(); it != ar.end(); ++it) {
             try {
                 auto p = LoadParameter(*it, it.name(), programClass, orderBase);
-                p->ReadOnly = false;
-                WBMQTT::JSON::Get((*it), "readOnly", p->ReadOnly);
-                p->Codec = GetCodec(*it);
-                if (p->Type == "onOff") {
-                    p->Codec = std::make_unique<TOnOffSensorCodec>();
+                p.ReadOnly = false;
+                WBMQTT::JSON::Get((*it), "readOnly", p.ReadOnly);
+                p.Codec = GetCodec(*it);
+                if (p.Type == "onOff") {
+                    p.Codec = GetSharedCodec<TOnOffSensorCodec>();
                 }
-                if (p->Type == "temperature" && p->ReadOnly) {
-                    p->Codec = std::make_unique<TSensorCodec>();
+                if (p.Type == "temperature" && p.ReadOnly) {
+                    p.Codec = GetSharedCodec<TSensorCodec>();
                 }
-                LOG(WBMQTT::Debug) << "Parameter '" << p->Name << "', " << p->Type << ", id " << p->Id << ", "
-                                   << p->Codec->GetName() << (p->ReadOnly ? ", read only" : "");
-                programClass->Parameters.insert({p->Id, p});
-                maxId = std::max(maxId, p->Id);
+                // Cell layout of schedules isn't confirmed, so they are never written
+                if (GetScheduleCodec(p)) {
+                    p.ReadOnly = true;
+                }
+                LOG(WBMQTT::Debug) << "Parameter '" << p.Name << "', " << p.Type << ", id " << p.Id << ", "
+                                   << p.Codec->GetName() << (p.ReadOnly ? ", read only" : "");
+                AddParameter(programClass->Parameters, p);
+                maxId = std::max(maxId, p.Id);
             } catch (const std::exception& e) {
                 LOG(WBMQTT::Warn) << "Parameter '" << it.name() << "' is ignored. " << e.what();
             }
@@ -180,31 +197,143 @@ namespace
         return res;
     }
 
+    struct TClassFile
+    {
+        std::string Path;
+        TDeviceClassSource Source;
+        Json::Value Data;
+
+        //! Parse or validation error, empty if the file is valid
+        std::string Error;
+    };
+
+    void AddClassFiles(std::vector<TClassFile>& files, const std::string& classesDir, TDeviceClassSource source)
+    {
+        try {
+            IterateDirByPattern(classesDir, ".json", [&files, source](const std::string& filePath) {
+                files.push_back(TClassFile{filePath, source, Json::Value(), std::string()});
+                return false; // continue scan
+            });
+        } catch (std::filesystem::filesystem_error const& ex) {
+            LOG(WBMQTT::Error) << "Cannot open " << classesDir << " directory: " << ex.what();
+        }
+    }
+
+    /**
+     * @brief Parses and validates class files on all available cores.
+     *        Files are independent, so workers just take the next unprocessed file.
+     */
+    void ParseClassFiles(std::vector<TClassFile>& files, const Json::Value& classSchema)
+    {
+        std::atomic<size_t> nextFile{0};
+        auto worker = [&files, &classSchema, &nextFile]() {
+            for (auto i = nextFile++; i < files.size(); i = nextFile++) {
+                try {
+                    files[i].Data = WBMQTT::JSON::Parse(files[i].Path);
+                    WBMQTT::JSON::Validate(files[i].Data, classSchema);
+                } catch (const std::exception& e) {
+                    files[i].Error = e.what();
+                }
+            }
+        };
+
+        size_t threadCount = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), files.size());
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < threadCount; ++i) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto& thread: threads) {
+            thread.join();
+        }
+    }
+
+    /**
+     * @brief Computes class cache key. Paths and sources are hashed too as they define override rules.
+     */
+    uint64_t GetClassCacheKey(const std::vector<TClassFile>& files, const std::string& classSchemaFileName)
+    {
+        auto key = HashFile(classSchemaFileName);
+        for (const auto& file: files) {
+            key = HashData(file.Path.data(), file.Path.size(), key);
+            key = HashData(&file.Source, sizeof(file.Source), key);
+            key = HashFile(file.Path, key);
+        }
+        return key;
+    }
+
     void LoadSmartWebToMqttConfig(TSmartWebToMqttConfig& config,
                                   const Json::Value& configJson,
-                                  const std::string& classesDir,
-                                  const Json::Value& classSchema,
-                                  TDeviceClassSource source)
+                                  const std::vector<std::pair<std::string, TDeviceClassSource>>& classesDirs,
+                                  const std::string& classSchemaFileName,
+                                  const std::string& classCacheFilePath)
     {
         if (configJson.isMember("poll_interval_ms")) {
             config.PollInterval = std::chrono::milliseconds(configJson["poll_interval_ms"].asUInt());
         }
+        WBMQTT::JSON::Get(configJson, "passive_listen", config.PassiveListen);
+        if (configJson.isMember("offline_misses")) {
+            config.OfflineMisses = configJson["offline_misses"].asUInt();
+        }
+        if (configJson.isMember("offline_probe_interval_s")) {
+            config.OfflineProbeInterval = std::chrono::seconds(configJson["offline_probe_interval_s"].asUInt());
+        }
+        WBMQTT::JSON::Get(configJson, "metadata_discovery", config.MetadataDiscovery);
+        if (configJson.isMember("frame_workers")) {
+            config.FrameWorkers = std::max(configJson["frame_workers"].asUInt(), 1U);
+        }
 
-        try {
-            IterateDirByPattern(classesDir, ".json", [classSchema, &config, source](const std::string& filePath) {
-                try {
-                    auto classJson = WBMQTT::JSON::Parse(filePath);
-                    WBMQTT::JSON::Validate(classJson, classSchema);
-                    LoadSmartWebClass(config, classJson, source);
-                } catch (const std::exception& e) {
-                    LOG(WBMQTT::Error) << "Failed to parse " << filePath << "\n" << e.what();
+        std::vector<TClassFile> files;
+        for (const auto& dir: classesDirs) {
+            AddClassFiles(files, dir.first, dir.second);
+        }
+
+        uint64_t cacheKey = 0;
+        bool useCache = !classCacheFilePath.empty();
+        if (useCache) {
+            try {
+                cacheKey = GetClassCacheKey(files, classSchemaFileName);
+            } catch (const std::exception& e) {
+                LOG(WBMQTT::Warn) << "Class cache is not used: " << e.what();
+                useCache = false;
+            }
+        }
+        if (useCache) {
+            try {
+                if (LoadClassCache(classCacheFilePath, cacheKey, config.Classes)) {
+                    LOG(WBMQTT::Info) << config.Classes.size() << " classes are loaded from " << classCacheFilePath;
+                    BuildRequestTemplates(config.Classes);
+                    return;
                 }
+            } catch (const std::exception& e) {
+                LOG(WBMQTT::Warn) << "Class cache is broken and will be rebuilt: " << e.what();
+            }
+        }
 
-                return false; // continue scan
-            });
-        } catch (std::filesystem::filesystem_error const& ex) {
-            LOG(WBMQTT::Error) << "Cannot open " << classesDir << " directory: " << ex.what();
-            return;
+        const Json::Value classSchema = WBMQTT::JSON::Parse(classSchemaFileName);
+        ParseClassFiles(files, classSchema);
+
+        // Classes are merged in directory order and then in file name order as before parallel parsing,
+        // so BUILTIN/USER override rules give the same result on every start
+        for (const auto& file: files) {
+            try {
+                if (!file.Error.empty()) {
+                    throw std::runtime_error(file.Error);
+                }
+                LoadSmartWebClass(config, file.Data, file.Source);
+            } catch (const std::exception& e) {
+                LOG(WBMQTT::Error) << "Failed to parse " << file.Path << "\n" << e.what();
+            }
+        }
+
+        BuildRequestTemplates(config.Classes);
+
+        if (useCache) {
+            try {
+                SaveClassCache(classCacheFilePath, cacheKey, config.Classes);
+            } catch (const std::exception& e) {
+                LOG(WBMQTT::Warn) << "Failed to save class cache: " << e.what();
+            }
         }
     }
 
@@ -235,21 +364,29 @@ namespace
                                   << "parameter_index: " << (int)parameter_info.index << ", "
                                   << "raw " << (int)parameter_info.raw << "} to {channel: " << mqtt_channel << "};";
 
+                if (parameter_info.index == 0) {
+                    throw std::runtime_error("Malformed JSON config: sensor_index must be greater than 0");
+                }
+
                 if (res.ParameterMapping.count(parameter_info.raw)) {
                     throw std::runtime_error("Malformed JSON config: duplicate sensor");
                 }
 
-                res.ParameterMapping[parameter_info.raw].from_string(mqtt_channel);
-                res.ParameterCount = std::max(res.ParameterCount, uint8_t(parameter_info.index + 1));
+                auto channelNameId = res.ChannelNames.Intern(mqtt_channel);
+                res.ParameterMapping[parameter_info.raw] = channelNameId;
+                res.ParameterCount = std::max(res.ParameterCount, uint16_t(parameter_info.index + 1));
 
                 // Sensor is also accesible as output with index = sensor_index - 1
                 auto outputIndex = parameter_info.index - 1;
 
-                if (res.OutputMapping[outputIndex].is_initialized()) {
+                if (!res.OutputMapping.Add(outputIndex, channelNameId)) {
                     throw std::runtime_error("Malformed JSON config: duplicate output " + std::to_string(outputIndex));
                 }
+            }
 
-                res.OutputMapping[outputIndex].from_string(mqtt_channel);
+            if (res.ProgramId + res.OutputMapping.GetHostIdCount() > 256) {
+                throw std::runtime_error("Malformed JSON config: controller " + std::to_string(res.ProgramId) +
+                                         " has too many outputs to address them by host id");
             }
         }
 
@@ -272,8 +409,8 @@ namespace
                     throw std::runtime_error("Malformed JSON config: duplicate parameter");
                 }
 
-                res.ParameterMapping[parameter_info.raw].from_string(mqtt_channel);
-                res.ParameterCount = std::max(res.ParameterCount, uint8_t(parameter_info.index + 1));
+                res.ParameterMapping[parameter_info.raw] = res.ChannelNames.Intern(mqtt_channel);
+                res.ParameterCount = std::max(res.ParameterCount, uint16_t(parameter_info.index + 1));
             }
         }
 
@@ -353,22 +490,18 @@ void LoadConfig(TConfig& config,
                 const std::string& pathToDeviceClassDirectory,
                 const std::string& pathToBuiltInDeviceClassDirectory,
                 const std::string& configSchemaFileName,
-                const std::string& classSchemaFileName)
+                const std::string& classSchemaFileName,
+                const std::string& classCacheFilePath)
 {
     Json::Value configJson = WBMQTT::JSON::Parse(configFilePath);
     WBMQTT::JSON::Validate(configJson, WBMQTT::JSON::Parse(configSchemaFileName));
 
     LoadMqttToSmartWebConfig(config, configJson);
 
-    Json::Value classSchema = WBMQTT::JSON::Parse(classSchemaFileName);
-    LoadSmartWebToMqttConfig(config.SmartWebToMqtt,
-                             configJson,
-                             pathToBuiltInDeviceClassDirectory,
-                             classSchema,
-                             TDeviceClassSource::BUILTIN);
     LoadSmartWebToMqttConfig(config.SmartWebToMqtt,
                              configJson,
-                             pathToDeviceClassDirectory,
-                             classSchema,
-                             TDeviceClassSource::USER);
+                             {{pathToBuiltInDeviceClassDirectory, TDeviceClassSource::BUILTIN},
+                              {pathToDeviceClassDirectory, TDeviceClassSource::USER}},
+                             classSchemaFileName,
+                             classCacheFilePath);
 }
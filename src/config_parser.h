@@ -16,9 +16,16 @@ struct TConfig
 
 void LoadSmartWebClass(TSmartWebToMqttConfig& config, const Json::Value& data, TDeviceClassSource source);
 
+/**
+ * @brief Loads driver config and SmartWeb classes
+ *
+ * @param classCacheFilePath binary cache of loaded classes. It is used if class files and schema are not changed,
+ *                           otherwise it is rebuilt. Empty string disables the cache.
+ */
 void LoadConfig(TConfig& config,
                 const std::string& configFilePath,
                 const std::string& pathToDeviceClassDirectory,
                 const std::string& pathToBuiltInDeviceClassDirectory,
                 const std::string& configSchemaFileName,
-                const std::string& classSchemaFileName);
+                const std::string& classSchemaFileName,
+                const std::string& classCacheFilePath = std::string());
@@ -0,0 +1,68 @@
+#include "file_utils.h"
+
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string.h>
+
+void WriteFileAtomically(const std::string& filePath, const std::string& content)
+{
+    auto tmpFilePath = filePath + ".tmp";
+    {
+        std::ofstream file(tmpFilePath, std::ios::binary | std::ios::trunc);
+        file.write(content.data(), content.size());
+        file.close();
+        if (!file) {
+            std::remove(tmpFilePath.c_str());
+            throw std::runtime_error("can't write " + tmpFilePath);
+        }
+    }
+    if (std::rename(tmpFilePath.c_str(), filePath.c_str()) != 0) {
+        std::remove(tmpFilePath.c_str());
+        throw std::runtime_error("can't replace " + filePath + ": " + strerror(errno));
+    }
+}
+
+bool LoadVersionedJson(const std::string& filePath,
+                       uint32_t version,
+                       const std::function<void(const Json::Value& root)>& parse)
+{
+    std::ifstream file(filePath);
+    if (!file.is_open()) {
+        return false;
+    }
+    Json::Value root;
+    Json::CharReaderBuilder readerBuilder;
+    std::string errors;
+    if (!Json::parseFromStream(readerBuilder, file, &root, &errors)) {
+        throw std::runtime_error("can't parse " + filePath + ": " + errors);
+    }
+    try {
+        if (root["version"].asUInt() != version) {
+            return false;
+        }
+        parse(root);
+    } catch (const Json::Exception& e) {
+        throw std::runtime_error("malformed " + filePath + ": " + e.what());
+    } catch (const std::runtime_error& e) {
+        throw std::runtime_error("malformed " + filePath + ": " + e.what());
+    }
+    return true;
+}
+
+void SaveVersionedJson(const std::string& filePath, uint32_t version, Json::Value root)
+{
+    root["version"] = version;
+    Json::StreamWriterBuilder writerBuilder;
+    writerBuilder["indentation"] = "";
+    WriteFileAtomically(filePath, Json::writeString(writerBuilder, root));
+}
+
+uint8_t GetJsonByte(const Json::Value& data, const std::string& key)
+{
+    auto value = data[key].asUInt();
+    if (value > 0xFF) {
+        throw std::runtime_error("'" + key + "' is out of range: " + std::to_string(value));
+    }
+    return value;
+}
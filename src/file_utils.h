@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include <wblib/json_utils.h>
+
+/**
+ * @brief Helpers of state and cache files of the gateway
+ */
+
+/**
+ * @brief Writes content to a temporary file and renames it to filePath,
+ *        so readers never see a partially written file.
+ *        Throws std::runtime_error on write errors.
+ */
+void WriteFileAtomically(const std::string& filePath, const std::string& content);
+
+/**
+ * @brief Loads JSON file with "version" field and passes its root to parse
+ *
+ * @return false if there is no file or it has another format version.
+ *         Throws std::runtime_error if the file isn't valid JSON or parse throws
+ *         Json::Exception or std::runtime_error.
+ */
+bool LoadVersionedJson(const std::string& filePath,
+                       uint32_t version,
+                       const std::function<void(const Json::Value& root)>& parse);
+
+/**
+ * @brief Sets "version" field of root and atomically replaces the file with it, see WriteFileAtomically
+ */
+void SaveVersionedJson(const std::string& filePath, uint32_t version, Json::Value root);
+
+/**
+ * @brief Returns unsigned value of the key.
+ *        Throws std::runtime_error if it is greater than 255.
+ */
+uint8_t GetJsonByte(const Json::Value& data, const std::string& key);
@@ -0,0 +1,70 @@
+#include "gateway_state.h"
+#include "file_utils.h"
+
+#include <stdexcept>
+
+namespace
+{
+    const uint32_t STATE_VERSION = 1;
+
+    const char* KIND_NAMES[] = {"input", "output", "parameter"};
+
+    TParameterKind GetKind(const Json::Value& data)
+    {
+        auto name = data["kind"].asString();
+        for (size_t i = 0; i < sizeof(KIND_NAMES) / sizeof(KIND_NAMES[0]); ++i) {
+            if (name == KIND_NAMES[i]) {
+                return static_cast<TParameterKind>(i);
+            }
+        }
+        throw std::runtime_error("unknown parameter kind '" + name + "'");
+    }
+}
+
+bool LoadGatewayState(const std::string& filePath, std::vector<TProgramState>& programs)
+{
+    return LoadVersionedJson(filePath, STATE_VERSION, [&](const Json::Value& root) {
+        std::vector<TProgramState> res;
+        for (const auto& programData: root["programs"]) {
+            TProgramState program;
+            program.ProgramId = GetJsonByte(programData, "id");
+            program.ProgramType = GetJsonByte(programData, "type");
+            program.FirmwareVersion = programData["firmware"].asString();
+            for (const auto& valueData: programData["values"]) {
+                TParameterValueState value;
+                value.ProgramType = GetJsonByte(valueData, "type");
+                value.Kind = GetKind(valueData);
+                value.ParameterId = GetJsonByte(valueData, "id");
+                value.Value = valueData["value"].asString();
+                program.Values.push_back(value);
+            }
+            res.push_back(program);
+        }
+        programs.swap(res);
+    });
+}
+
+void SaveGatewayState(const std::string& filePath, const std::vector<TProgramState>& programs)
+{
+    Json::Value root;
+    root["programs"] = Json::Value(Json::arrayValue);
+    for (const auto& program: programs) {
+        Json::Value programData;
+        programData["id"] = program.ProgramId;
+        programData["type"] = program.ProgramType;
+        if (!program.FirmwareVersion.empty()) {
+            programData["firmware"] = program.FirmwareVersion;
+        }
+        programData["values"] = Json::Value(Json::arrayValue);
+        for (const auto& value: program.Values) {
+            Json::Value valueData;
+            valueData["type"] = value.ProgramType;
+            valueData["kind"] = KIND_NAMES[static_cast<size_t>(value.Kind)];
+            valueData["id"] = value.ParameterId;
+            valueData["value"] = value.Value;
+            programData["values"].append(valueData);
+        }
+        root["programs"].append(programData);
+    }
+    SaveVersionedJson(filePath, STATE_VERSION, root);
+}
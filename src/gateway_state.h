@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Snapshot of discovered SmartWeb programs and last values of their MQTT controls.
+ *        It lets the gateway recreate devices right after restart, before programs answer polling.
+ */
+
+enum class TParameterKind : uint8_t
+{
+    INPUT,
+    OUTPUT,
+    PARAMETER
+};
+
+struct TParameterValueState
+{
+    //! Type of the class declaring the parameter, it can differ from the program type
+    uint8_t ProgramType;
+    TParameterKind Kind;
+    uint8_t ParameterId;
+    std::string Value;
+};
+
+struct TProgramState
+{
+    uint8_t ProgramId;
+    uint8_t ProgramType;
+    std::vector<TParameterValueState> Values;
+    //! SmartNet protocol version read by metadata discovery, empty if it is not read yet
+    std::string FirmwareVersion;
+};
+
+/**
+ * @brief Loads programs from state file
+ *
+ * @return false if there is no state file or it has another format version.
+ *         Throws std::runtime_error if the file is malformed.
+ */
+bool LoadGatewayState(const std::string& filePath, std::vector<TProgramState>& programs);
+
+/**
+ * @brief Atomically replaces state file with new one.
+ *        Throws std::runtime_error on write errors.
+ */
+void SaveGatewayState(const std::string& filePath, const std::vector<TProgramState>& programs);
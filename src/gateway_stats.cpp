@@ -0,0 +1,166 @@
+#include "gateway_stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <wblib/log.h>
+#include <wblib/utils.h>
+
+#define LOG(logger) ::logger.Log() << "[stats] "
+
+namespace
+{
+    std::string FormatMs(std::chrono::microseconds value)
+    {
+        return WBMQTT::FormatFloat(value.count() / 1000.0);
+    }
+
+    //! Returns counter increment per second, zero if the snapshots are taken at the same time
+    std::string FormatRate(uint64_t previous, uint64_t current, std::chrono::steady_clock::duration elapsed)
+    {
+        auto seconds = std::chrono::duration_cast<std::chrono::duration<double>>(elapsed).count();
+        if (seconds <= 0 || current < previous) {
+            return "0";
+        }
+        return WBMQTT::FormatFloat(std::round((current - previous) / seconds * 10) / 10);
+    }
+
+    void AddValue(std::vector<TStatsControl>& controls,
+                  const std::string& id,
+                  uint64_t value,
+                  const std::string& units = std::string())
+    {
+        controls.push_back(TStatsControl{id, "value", units, std::to_string(value)});
+    }
+}
+
+std::vector<TStatsControl> MakeStatsControls(const TGatewayStats& previous, const TGatewayStats& current)
+{
+    std::vector<TStatsControl> res;
+    const auto& port = current.Port;
+    AddValue(res, "can_received_frames", port.ReceivedFrames);
+    AddValue(res, "can_sent_frames", port.SentFrames);
+    AddValue(res, "can_write_errors", port.WriteErrors);
+    AddValue(res, "can_write_timeouts", port.WriteTimeouts);
+
+    const auto& sw = current.SmartWebToMqtt;
+    AddValue(res, "sw_received_frames", sw.Reader.ReceivedFrames);
+    AddValue(res, "sw_accepted_frames", sw.Reader.AcceptedFrames);
+    AddValue(res, "sw_dropped_frames", sw.Reader.DroppedFrames);
+    AddValue(res, "sw_queue_length", sw.Reader.QueueLength);
+    AddValue(res, "known_programs", sw.KnownPrograms);
+    AddValue(res, "offline_programs", sw.OfflinePrograms);
+    AddValue(res, "poll_requests", sw.PollRequests);
+    res.push_back(TStatsControl{
+        "poll_requests_per_s",
+        "value",
+        "",
+        FormatRate(previous.SmartWebToMqtt.PollRequests, sw.PollRequests, current.Time - previous.Time)});
+    AddValue(res, "poll_cycle_duration", sw.PollCycleDuration.count(), "ms");
+    res.push_back(TStatsControl{"poll_task_runtime_avg", "value", "ms", FormatMs(sw.PollTask.Runtime.GetAverage())});
+    res.push_back(
+        TStatsControl{"poll_task_lateness_p99", "value", "ms", FormatMs(sw.PollTask.Lateness.GetPercentile(99))});
+    AddValue(res, "poll_task_skipped_runs", sw.PollTask.SkippedRuns);
+    AddValue(res, "passive_skipped_requests", sw.PassiveSkippedRequests);
+    AddValue(res, "foreign_value_responses", sw.ForeignValueResponses);
+    AddValue(res, "write_queue_length", sw.WriteQueueLength);
+    AddValue(res, "transactions_in_flight", sw.InFlightTransactions);
+
+    const auto& mqtt = current.MqttToSmartWeb;
+    AddValue(res, "mqtt_received_frames", mqtt.ReceivedFrames);
+    AddValue(res, "mqtt_dropped_frames", mqtt.DroppedFrames);
+    AddValue(res, "mqtt_queue_length", mqtt.QueueLength);
+    for (const auto& controller: mqtt.Controllers) {
+        auto prefix = "controller_" + std::to_string(controller.ProgramId);
+        res.push_back(TStatsControl{prefix + "_state",
+                                    "text",
+                                    "",
+                                    (controller.Status == DS_RUNNING) ? "running" : "idle"});
+        AddValue(res, prefix + "_frames", controller.HandledFrames);
+    }
+    return res;
+}
+
+TGatewayStatsPublisher::TGatewayStatsPublisher(WBMQTT::PDeviceDriver driver,
+                                               std::shared_ptr<CAN::IPort> canPort,
+                                               TSmartWebToMqttGateway& smartWebToMqttGateway,
+                                               TMqttToSmartWebExecutor& mqttToSmartWebExecutor)
+    : Driver(driver),
+      CanPort(canPort),
+      SmartWebToMqttGateway(smartWebToMqttGateway),
+      MqttToSmartWebExecutor(mqttToSmartWebExecutor),
+      Scheduler(MakeSimpleThreadedScheduler("Stats"))
+{
+    PreviousStats = CollectStats();
+    Scheduler->AddTask(MakePeriodicTask(
+        STATS_PUBLISH_INTERVAL,
+        [this]() { this->Publish(); },
+        "Statistics publishing task"));
+}
+
+TGatewayStatsPublisher::~TGatewayStatsPublisher()
+{
+    Scheduler.reset();
+    try {
+        Driver->BeginTx()->RemoveDeviceById(STATS_DEVICE_ID).Sync();
+    } catch (const std::exception& e) {
+        LOG(WBMQTT::Error) << e.what();
+    }
+}
+
+TGatewayStats TGatewayStatsPublisher::CollectStats()
+{
+    TGatewayStats stats;
+    stats.Time = std::chrono::steady_clock::now();
+    stats.Port = CanPort->GetStats();
+    stats.SmartWebToMqtt = SmartWebToMqttGateway.GetStats();
+    stats.MqttToSmartWeb = MqttToSmartWebExecutor.GetStats();
+    return stats;
+}
+
+void TGatewayStatsPublisher::Publish()
+{
+    auto stats = CollectStats();
+    auto controls = MakeStatsControls(PreviousStats, stats);
+    PreviousStats = stats;
+    try {
+        auto tx = Driver->BeginTx();
+        WBMQTT::PLocalDevice device(std::dynamic_pointer_cast<WBMQTT::TLocalDevice>(tx->GetDevice(STATS_DEVICE_ID)));
+        if (!device) {
+            device = tx->CreateDevice(WBMQTT::TLocalDeviceArgs{}
+                                          .SetId(STATS_DEVICE_ID)
+                                          .SetTitle("SmartWeb gateway statistics")
+                                          .SetIsVirtual(true))
+                         .GetValue();
+        }
+        std::vector<std::string> ids;
+        for (const auto& c: controls) {
+            ids.push_back(c.Id);
+            auto control = device->GetControl(c.Id);
+            if (control) {
+                if (control->GetRawValue() != c.Value) {
+                    control->SetRawValue(tx, c.Value).Sync();
+                }
+                continue;
+            }
+            auto args = WBMQTT::TControlArgs{}
+                            .SetId(c.Id)
+                            .SetType(c.Type)
+                            .SetReadonly(true)
+                            .SetOrder(ids.size())
+                            .SetRawValue(c.Value);
+            if (!c.Units.empty()) {
+                args.SetUnits(c.Units);
+            }
+            device->CreateControl(tx, args).GetValue();
+        }
+        // Controls of removed controllers
+        for (const auto& id: ControlIds) {
+            if (std::find(ids.begin(), ids.end(), id) == ids.end()) {
+                device->RemoveControl(tx, id).Sync();
+            }
+        }
+        ControlIds.swap(ids);
+    } catch (const std::exception& e) {
+        LOG(WBMQTT::Error) << e.what();
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <wblib/wbmqtt.h>
+
+#include "CanPort.h"
+#include "MqttToSmartWebGateway.h"
+#include "SmartWebToMqttGateway.h"
+#include "scheduler.h"
+
+const auto STATS_DEVICE_ID = "smartweb-gateway-stats";
+
+const auto STATS_PUBLISH_INTERVAL = std::chrono::seconds(5);
+
+struct TGatewayStats
+{
+    std::chrono::steady_clock::time_point Time;
+    CAN::TPortStats Port;
+    TSmartWebToMqttStats SmartWebToMqtt;
+    TMqttToSmartWebStats MqttToSmartWeb;
+};
+
+struct TStatsControl
+{
+    std::string Id;
+
+    //! "value" for numbers, "text" for states
+    std::string Type;
+
+    std::string Units;
+    std::string Value;
+};
+
+/**
+ * @brief Builds controls of the statistics device in order of publishing.
+ *        Rates are computed from counters of the previous snapshot.
+ */
+std::vector<TStatsControl> MakeStatsControls(const TGatewayStats& previous, const TGatewayStats& current);
+
+/**
+ * @brief Runtime diagnostics of the gateway published as a virtual MQTT device.
+ *        Gateway threads only increment atomic counters, they are collected and published
+ *        once per STATS_PUBLISH_INTERVAL, so statistics add no work to frame handling.
+ */
+class TGatewayStatsPublisher
+{
+    WBMQTT::PDeviceDriver Driver;
+    std::shared_ptr<CAN::IPort> CanPort;
+    TSmartWebToMqttGateway& SmartWebToMqttGateway;
+    TMqttToSmartWebExecutor& MqttToSmartWebExecutor;
+
+    //! Used only by the publish task
+    TGatewayStats PreviousStats;
+    std::vector<std::string> ControlIds;
+
+    std::unique_ptr<IScheduler> Scheduler;
+
+    TGatewayStats CollectStats();
+    void Publish();
+
+public:
+    /**
+     * @brief Creates the device and starts publishing. Gateways must outlive the publisher.
+     */
+    TGatewayStatsPublisher(WBMQTT::PDeviceDriver driver,
+                           std::shared_ptr<CAN::IPort> canPort,
+                           TSmartWebToMqttGateway& smartWebToMqttGateway,
+                           TMqttToSmartWebExecutor& mqttToSmartWebExecutor);
+
+    ~TGatewayStatsPublisher();
+};
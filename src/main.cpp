@@ -5,10 +5,13 @@
 #include <getopt.h>
 
 #include "CanPort.h"
+#include "ConfigWatcher.h"
 #include "MqttToSmartWebGateway.h"
+#include "ParametersRpc.h"
 #include "SmartWebToMqttGateway.h"
 #include "config_parser.h"
 #include "exceptions.h"
+#include "gateway_stats.h"
 #include "log.h"
 
 #define STR(x) #x
@@ -19,6 +22,9 @@ using namespace WBMQTT;
 
 const auto APP_NAME = "wb-mqtt-smartweb";
 const auto LIBWBMQTT_DB_FULL_FILE_PATH = "/var/lib/wb-mqtt-smartweb/libwbmqtt.db";
+const auto CLASS_CACHE_FULL_FILE_PATH = "/var/lib/wb-mqtt-smartweb/classes.cache";
+const auto STATE_FULL_FILE_PATH = "/var/lib/wb-mqtt-smartweb/state.json";
+const auto METADATA_CACHE_FULL_FILE_PATH = "/var/lib/wb-mqtt-smartweb/metadata.json";
 const auto CONFIG_FULL_FILE_PATH = "/etc/wb-mqtt-smartweb.conf";
 const auto BUILT_IN_DEVICE_CLASSES_PATH = "/usr/share/wb-mqtt-smartweb/classes";
 const auto CONFIG_JSON_SCHEMA_FULL_FILE_PATH = "/usr/share/wb-mqtt-confed/schemas/wb-mqtt-smartweb.schema.json";
@@ -26,6 +32,9 @@ const auto CLASS_JSON_SCHEMA_FULL_FILE_PATH = "/usr/share/wb-mqtt-confed/schemas
 
 const auto DRIVER_STOP_TIMEOUT_S = chrono::seconds(10);
 
+//! Delay between the last change of config or class files and reload
+const auto CONFIG_RELOAD_DELAY_MS = chrono::milliseconds(1000);
+
 //! Maximun time to start application. Exceded timeout will case application termination.
 const auto DRIVER_INIT_TIMEOUT_S = chrono::seconds(60);
 
@@ -180,13 +189,16 @@ int main(int argc, char* argv[])
         exit(1);
     });
 
+    // Debug enabled by -d stays enabled after config reload
+    bool commandLineDebug = ::Debug.IsEnabled();
     try {
         LoadConfig(config,
                    configFile,
                    configFile + ".d/classes",
                    BUILT_IN_DEVICE_CLASSES_PATH,
                    CONFIG_JSON_SCHEMA_FULL_FILE_PATH,
-                   CLASS_JSON_SCHEMA_FULL_FILE_PATH);
+                   CLASS_JSON_SCHEMA_FULL_FILE_PATH,
+                   CLASS_CACHE_FULL_FILE_PATH);
         if (config.Debug) {
             ::Debug.SetEnabled(true);
         }
@@ -213,15 +225,44 @@ int main(int argc, char* argv[])
         auto port = CAN::MakePort(config.InterfaceName);
 
         {
-            TSmartWebToMqttGateway smartWebToMqttGateway(config.SmartWebToMqtt, port, driver);
-            std::vector<std::shared_ptr<TMqttToSmartWebGateway>> mqttToSmartWebGateways;
-            for (const auto& controller: config.Controllers) {
-                mqttToSmartWebGateways.push_back(std::make_shared<TMqttToSmartWebGateway>(controller, port, driver));
-            }
+            TSmartWebToMqttGateway smartWebToMqttGateway(config.SmartWebToMqtt,
+                                                         port,
+                                                         driver,
+                                                         STATE_FULL_FILE_PATH,
+                                                         METADATA_CACHE_FULL_FILE_PATH);
+            TMqttToSmartWebExecutor mqttToSmartWebExecutor(config.Controllers, port, driver);
+            TGatewayStatsPublisher statsPublisher(driver, port, smartWebToMqttGateway, mqttToSmartWebExecutor);
+
+            auto rpcServer = NewMqttRpcServer(mqtt, APP_NAME);
+            TParametersRpcHandler parametersRpcHandler(rpcServer, smartWebToMqttGateway);
+            rpcServer->Start();
+
+            TConfigWatcher configWatcher(
+                {configFile, configFile + ".d/classes", BUILT_IN_DEVICE_CLASSES_PATH},
+                CONFIG_RELOAD_DELAY_MS,
+                [&]() {
+                    TConfig newConfig;
+                    newConfig.InterfaceName = config.InterfaceName;
+                    LoadConfig(newConfig,
+                               configFile,
+                               configFile + ".d/classes",
+                               BUILT_IN_DEVICE_CLASSES_PATH,
+                               CONFIG_JSON_SCHEMA_FULL_FILE_PATH,
+                               CLASS_JSON_SCHEMA_FULL_FILE_PATH,
+                               CLASS_CACHE_FULL_FILE_PATH);
+                    if (newConfig.InterfaceName != config.InterfaceName) {
+                        LOG(WBMQTT::Warn) << "CAN interface change requires restart";
+                    }
+                    ::Debug.SetEnabled(newConfig.Debug || commandLineDebug);
+                    smartWebToMqttGateway.UpdateConfig(newConfig.SmartWebToMqtt);
+                    mqttToSmartWebExecutor.UpdateControllers(newConfig.Controllers);
+                    LOG(WBMQTT::Info) << "Configuration is reloaded";
+                });
 
             initialized.Complete();
             SignalHandling::Start();
             SignalHandling::Wait();
+            rpcServer->Stop();
         }
         driver->StopLoop();
         driver->Close();
@@ -0,0 +1,76 @@
+#include "metadata_cache.h"
+#include "file_utils.h"
+
+namespace
+{
+    const uint32_t CACHE_VERSION = 1;
+
+    void SetOptional(Json::Value& data, const std::string& key, const std::string& value)
+    {
+        if (!value.empty()) {
+            data[key] = value;
+        }
+    }
+}
+
+const TParameterMetadata* FindParameterMetadata(const TProgramMetadata& metadata,
+                                                uint8_t programType,
+                                                uint8_t parameterId)
+{
+    for (const auto& param: metadata.Parameters) {
+        if (param.ProgramType == programType && param.ParameterId == parameterId) {
+            return &param;
+        }
+    }
+    return nullptr;
+}
+
+bool LoadMetadataCache(const std::string& filePath, std::vector<TProgramMetadata>& programs)
+{
+    return LoadVersionedJson(filePath, CACHE_VERSION, [&](const Json::Value& root) {
+        std::vector<TProgramMetadata> res;
+        for (const auto& programData: root["programs"]) {
+            TProgramMetadata program;
+            program.ProgramType = GetJsonByte(programData, "type");
+            program.FirmwareVersion = programData["firmware"].asString();
+            for (const auto& paramData: programData["parameters"]) {
+                TParameterMetadata param;
+                param.ProgramType = GetJsonByte(paramData, "type");
+                param.ParameterId = GetJsonByte(paramData, "id");
+                param.Name = paramData["name"].asString();
+                param.Min = paramData["min"].asString();
+                param.Max = paramData["max"].asString();
+                param.Default = paramData["default"].asString();
+                param.Unit = paramData["unit"].asString();
+                program.Parameters.push_back(param);
+            }
+            res.push_back(program);
+        }
+        programs.swap(res);
+    });
+}
+
+void SaveMetadataCache(const std::string& filePath, const std::vector<TProgramMetadata>& programs)
+{
+    Json::Value root;
+    root["programs"] = Json::Value(Json::arrayValue);
+    for (const auto& program: programs) {
+        Json::Value programData;
+        programData["type"] = program.ProgramType;
+        programData["firmware"] = program.FirmwareVersion;
+        programData["parameters"] = Json::Value(Json::arrayValue);
+        for (const auto& param: program.Parameters) {
+            Json::Value paramData;
+            paramData["type"] = param.ProgramType;
+            paramData["id"] = param.ParameterId;
+            SetOptional(paramData, "name", param.Name);
+            SetOptional(paramData, "min", param.Min);
+            SetOptional(paramData, "max", param.Max);
+            SetOptional(paramData, "default", param.Default);
+            SetOptional(paramData, "unit", param.Unit);
+            programData["parameters"].append(paramData);
+        }
+        root["programs"].append(programData);
+    }
+    SaveVersionedJson(filePath, CACHE_VERSION, root);
+}
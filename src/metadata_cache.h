@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Parameter metadata read from SmartWeb programs by GET_PARAMETER_NAME, _MINIMUM, _MAXIMUM,
+ *        _DEFAULT and _UNIT requests. Programs of the same type and firmware have the same metadata,
+ *        so it is cached and read once per firmware.
+ */
+
+struct TParameterMetadata
+{
+    //! Type of the class declaring the parameter, it can differ from the program type
+    uint8_t ProgramType;
+    uint8_t ParameterId;
+
+    //! Values are decoded by the parameter codec, empty if the program didn't answer
+    std::string Name;
+    std::string Min;
+    std::string Max;
+    std::string Default;
+    std::string Unit;
+};
+
+struct TProgramMetadata
+{
+    uint8_t ProgramType;
+    std::string FirmwareVersion;
+    std::vector<TParameterMetadata> Parameters;
+};
+
+/**
+ * @brief Returns metadata of the parameter or nullptr if it is unknown
+ */
+const TParameterMetadata* FindParameterMetadata(const TProgramMetadata& metadata,
+                                                uint8_t programType,
+                                                uint8_t parameterId);
+
+/**
+ * @brief Loads metadata of all cached program types and firmware versions
+ *
+ * @return false if there is no cache file or it has another format version.
+ *         Throws std::runtime_error if the file is malformed.
+ */
+bool LoadMetadataCache(const std::string& filePath, std::vector<TProgramMetadata>& programs);
+
+/**
+ * @brief Atomically replaces cache file with new one.
+ *        Throws std::runtime_error on write errors.
+ */
+void SaveMetadataCache(const std::string& filePath, const std::vector<TProgramMetadata>& programs);
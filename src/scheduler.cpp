@@ -2,7 +2,9 @@
 
 #include <algorithm>
 #include <atomic>
+#include <cmath>
 #include <condition_variable>
+#include <limits>
 #include <mutex>
 #include <thread>
 #include <vector>
@@ -11,59 +13,191 @@
 
 namespace
 {
+    using TTimePoint = std::chrono::steady_clock::time_point;
 
-    struct TTaskDescription
+    const size_t NOT_IN_HEAP = std::numeric_limits<size_t>::max();
+
+    struct TTaskSlot
     {
-        std::chrono::steady_clock::time_point NextRun;
         std::shared_ptr<ITask> Task;
 
-        TTaskDescription(std::chrono::steady_clock::time_point nextRun, std::shared_ptr<ITask> task)
-            : NextRun(nextRun),
-              Task(task)
-        {}
+        //! Position in heap or NOT_IN_HEAP if the task is running
+        size_t HeapIndex = NOT_IN_HEAP;
+
+        //! Incremented on every slot release to invalidate old handles
+        uint32_t Generation = 0;
+
+        bool Rescheduled = false;
+        TTimePoint RescheduledRun;
+
+        TDurationHistogram Lateness;
+        TDurationHistogram Runtime;
+        uint64_t SkippedRuns = 0;
     };
 
+    struct THeapEntry
+    {
+        TTimePoint NextRun;
+
+        //! Tasks with equal NextRun are run in order of addition
+        uint64_t Sequence;
+        uint32_t Slot;
+
+        bool operator<(const THeapEntry& other) const
+        {
+            return NextRun < other.NextRun || (NextRun == other.NextRun && Sequence < other.Sequence);
+        }
+    };
+
+    /**
+     * @brief Scheduler based on binary min-heap with task indices for O(log n) add, cancel and reschedule.
+     *        After warm-up no memory is allocated on task runs.
+     */
     class TSimpleThreadedScheduler: public IScheduler
     {
         std::thread Thread;
 
         std::atomic_bool Enabled;
         std::mutex TasksMutex;
-        std::vector<TTaskDescription> Tasks;
-
-        std::mutex WaitMutex;
         std::condition_variable ConditionVariable;
 
+        std::vector<TTaskSlot> Slots;
+        std::vector<uint32_t> FreeSlots;
+        std::vector<THeapEntry> Heap;
+        uint64_t Sequence = 0;
+
         std::string ThreadName;
 
+        static TTaskHandle MakeHandle(uint32_t slot, uint32_t generation)
+        {
+            return (TTaskHandle(generation) << 32) | slot;
+        }
+
+        TTaskSlot* FindSlot(TTaskHandle handle)
+        {
+            uint32_t slot = handle & 0xFFFFFFFF;
+            if (slot >= Slots.size() || Slots[slot].Generation != (handle >> 32) || !Slots[slot].Task) {
+                return nullptr;
+            }
+            return &Slots[slot];
+        }
+
+        void Place(size_t index, const THeapEntry& entry)
+        {
+            Heap[index] = entry;
+            Slots[entry.Slot].HeapIndex = index;
+        }
+
+        void SiftUp(size_t index)
+        {
+            auto entry = Heap[index];
+            while (index > 0) {
+                auto parent = (index - 1) / 2;
+                if (!(entry < Heap[parent])) {
+                    break;
+                }
+                Place(index, Heap[parent]);
+                index = parent;
+            }
+            Place(index, entry);
+        }
+
+        void SiftDown(size_t index)
+        {
+            auto entry = Heap[index];
+            while (true) {
+                auto child = index * 2 + 1;
+                if (child >= Heap.size()) {
+                    break;
+                }
+                if (child + 1 < Heap.size() && Heap[child + 1] < Heap[child]) {
+                    ++child;
+                }
+                if (!(Heap[child] < entry)) {
+                    break;
+                }
+                Place(index, Heap[child]);
+                index = child;
+            }
+            Place(index, entry);
+        }
+
+        void Push(uint32_t slot, TTimePoint nextRun)
+        {
+            Heap.push_back(THeapEntry{nextRun, Sequence++, slot});
+            SiftUp(Heap.size() - 1);
+        }
+
+        void RemoveFromHeap(size_t index)
+        {
+            Slots[Heap[index].Slot].HeapIndex = NOT_IN_HEAP;
+            auto last = Heap.back();
+            Heap.pop_back();
+            if (index == Heap.size()) {
+                return;
+            }
+            Place(index, last);
+            if (index > 0 && last < Heap[(index - 1) / 2]) {
+                SiftUp(index);
+            } else {
+                SiftDown(index);
+            }
+        }
+
+        void ReleaseSlot(uint32_t slot)
+        {
+            Slots[slot].Task.reset();
+            Slots[slot].Rescheduled = false;
+            Slots[slot].Lateness = TDurationHistogram();
+            Slots[slot].Runtime = TDurationHistogram();
+            Slots[slot].SkippedRuns = 0;
+            ++Slots[slot].Generation;
+            FreeSlots.push_back(slot);
+        }
+
         void MakeIteration()
         {
-            auto now = std::chrono::steady_clock::now();
             std::unique_lock<std::mutex> tasksLock(TasksMutex);
-            if (Tasks.empty()) {
-                tasksLock.unlock();
-                std::unique_lock<std::mutex> waitLock(WaitMutex);
-                ConditionVariable.wait(waitLock);
+            if (!Enabled.load()) {
                 return;
             }
-            if (Tasks.begin()->NextRun <= now) {
-                TTaskDescription td = *Tasks.begin();
-                Tasks.erase(Tasks.begin());
-                tasksLock.unlock();
-                auto res = td.Task->Run();
-                tasksLock.lock();
-                for (auto& t: res) {
-                    Tasks.emplace_back(now + t->GetPeriod(), t);
-                }
+            if (Heap.empty()) {
+                ConditionVariable.wait(tasksLock);
                 return;
             }
-            std::stable_sort(Tasks.begin(), Tasks.end(), [](const auto& t1, const auto& t2) {
-                return t1.NextRun < t2.NextRun;
-            });
-            auto nextRun = Tasks.begin()->NextRun;
+            auto now = std::chrono::steady_clock::now();
+            if (Heap.front().NextRun > now) {
+                ConditionVariable.wait_until(tasksLock, Heap.front().NextRun);
+                return;
+            }
+            auto slot = Heap.front().Slot;
+            auto plannedRun = Heap.front().NextRun;
+            RemoveFromHeap(0);
+            auto generation = Slots[slot].Generation;
+            auto task = Slots[slot].Task;
             tasksLock.unlock();
-            std::unique_lock<std::mutex> waitLock(WaitMutex);
-            ConditionVariable.wait_until(waitLock, nextRun);
+            bool runAgain = task->Run();
+            auto end = std::chrono::steady_clock::now();
+            tasksLock.lock();
+            if (Slots[slot].Generation != generation) {
+                return; // cancelled during run
+            }
+            if (plannedRun != TTimePoint()) {
+                Slots[slot].Lateness.Add(std::chrono::duration_cast<std::chrono::microseconds>(now - plannedRun));
+            }
+            Slots[slot].Runtime.Add(std::chrono::duration_cast<std::chrono::microseconds>(end - now));
+            if (Slots[slot].Rescheduled) {
+                Slots[slot].Rescheduled = false;
+                Push(slot, Slots[slot].RescheduledRun);
+                return;
+            }
+            if (runAgain) {
+                Push(slot,
+                     GetNextRun(
+                         task->GetScheduleMode(), task->GetPeriod(), plannedRun, now, end, Slots[slot].SkippedRuns));
+            } else {
+                ReleaseSlot(slot);
+            }
         }
 
     public:
@@ -79,16 +213,90 @@ namespace
 
         ~TSimpleThreadedScheduler()
         {
-            Enabled.store(false);
-            ConditionVariable.notify_one();
+            {
+                std::unique_lock<std::mutex> lk(TasksMutex);
+                Enabled.store(false);
+                ConditionVariable.notify_one();
+            }
             Thread.join();
         }
 
-        void AddTask(std::shared_ptr<ITask> task) override
+        TTaskHandle AddTask(std::shared_ptr<ITask> task) override
+        {
+            return AddTask(task, std::chrono::steady_clock::time_point());
+        }
+
+        TTaskHandle AddTask(std::shared_ptr<ITask> task, std::chrono::steady_clock::time_point firstRun) override
+        {
+            std::unique_lock<std::mutex> lk(TasksMutex);
+            uint32_t slot;
+            if (FreeSlots.empty()) {
+                slot = Slots.size();
+                Slots.emplace_back();
+            } else {
+                slot = FreeSlots.back();
+                FreeSlots.pop_back();
+            }
+            Slots[slot].Task = task;
+            Push(slot, firstRun);
+            ConditionVariable.notify_one();
+            return MakeHandle(slot, Slots[slot].Generation);
+        }
+
+        bool CancelTask(TTaskHandle handle) override
         {
             std::unique_lock<std::mutex> lk(TasksMutex);
-            Tasks.emplace(Tasks.begin(), std::chrono::steady_clock::time_point(), task);
+            auto slot = FindSlot(handle);
+            if (!slot) {
+                return false;
+            }
+            if (slot->HeapIndex != NOT_IN_HEAP) {
+                RemoveFromHeap(slot->HeapIndex);
+            }
+            ReleaseSlot(handle & 0xFFFFFFFF);
+            ConditionVariable.notify_one();
+            return true;
+        }
+
+        bool RescheduleTask(TTaskHandle handle, std::chrono::steady_clock::time_point nextRun) override
+        {
+            std::unique_lock<std::mutex> lk(TasksMutex);
+            auto slot = FindSlot(handle);
+            if (!slot) {
+                return false;
+            }
+            if (slot->HeapIndex == NOT_IN_HEAP) {
+                slot->Rescheduled = true;
+                slot->RescheduledRun = nextRun;
+                return true;
+            }
+            auto index = slot->HeapIndex;
+            Heap[index].NextRun = nextRun;
+            Heap[index].Sequence = Sequence++;
+            SiftUp(index);
+            SiftDown(slot->HeapIndex);
             ConditionVariable.notify_one();
+            return true;
+        }
+
+        size_t GetTaskCount() override
+        {
+            std::unique_lock<std::mutex> lk(TasksMutex);
+            return Slots.size() - FreeSlots.size();
+        }
+
+        bool GetTaskStats(TTaskHandle handle, TTaskStats& stats) override
+        {
+            std::unique_lock<std::mutex> lk(TasksMutex);
+            auto slot = FindSlot(handle);
+            if (!slot) {
+                return false;
+            }
+            stats.Name = slot->Task->GetName();
+            stats.Lateness = slot->Lateness;
+            stats.Runtime = slot->Runtime;
+            stats.SkippedRuns = slot->SkippedRuns;
+            return true;
         }
     };
 
@@ -97,18 +305,23 @@ namespace
         std::function<void()> Fn;
         std::chrono::microseconds Period;
         std::string Name;
+        TScheduleMode Mode;
 
     public:
-        TPeriodicTask(const std::chrono::microseconds& period, std::function<void()> fn, const std::string& name)
+        TPeriodicTask(const std::chrono::microseconds& period,
+                      std::function<void()> fn,
+                      const std::string& name,
+                      TScheduleMode mode)
             : Fn(fn),
               Period(period),
-              Name(name)
+              Name(name),
+              Mode(mode)
         {}
 
-        std::vector<std::shared_ptr<ITask>> Run() override
+        bool Run() override
         {
             Fn();
-            return {shared_from_this()};
+            return true;
         }
 
         const std::string& GetName() const override
@@ -120,9 +333,73 @@ namespace
         {
             return Period;
         }
+
+        TScheduleMode GetScheduleMode() const override
+        {
+            return Mode;
+        }
     };
 }
 
+std::chrono::steady_clock::time_point GetNextRun(TScheduleMode mode,
+                                                 std::chrono::microseconds period,
+                                                 std::chrono::steady_clock::time_point plannedRun,
+                                                 std::chrono::steady_clock::time_point start,
+                                                 std::chrono::steady_clock::time_point end,
+                                                 uint64_t& skippedRuns)
+{
+    if (mode == TScheduleMode::FIXED_DELAY || plannedRun == TTimePoint() || period.count() <= 0) {
+        // Tasks added without explicit start time are anchored to the first run
+        return start + period;
+    }
+    auto nextRun = plannedRun + period;
+    if (mode == TScheduleMode::FIXED_RATE_SKIP && nextRun <= end) {
+        auto missed = (end - nextRun) / period + 1;
+        skippedRuns += missed;
+        nextRun += period * missed;
+    }
+    return nextRun;
+}
+
+void TDurationHistogram::Add(std::chrono::microseconds value)
+{
+    if (value.count() < 0) {
+        value = std::chrono::microseconds(0);
+    }
+    size_t bucket = 0;
+    for (auto v = value.count(); v > 0 && bucket < BUCKETS_COUNT - 1; v >>= 1) {
+        ++bucket;
+    }
+    ++Buckets[bucket];
+    ++Count;
+    Sum += value;
+    Max = std::max(Max, value);
+}
+
+std::chrono::microseconds TDurationHistogram::GetPercentile(double percentile) const
+{
+    if (Count == 0) {
+        return std::chrono::microseconds(0);
+    }
+    uint64_t threshold = std::ceil(Count * percentile / 100.0);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < BUCKETS_COUNT; ++i) {
+        sum += Buckets[i];
+        if (sum >= threshold && sum > 0) {
+            return std::min(Max, std::chrono::microseconds(int64_t(1) << i));
+        }
+    }
+    return Max;
+}
+
+std::chrono::microseconds TDurationHistogram::GetAverage() const
+{
+    if (Count == 0) {
+        return std::chrono::microseconds(0);
+    }
+    return Sum / Count;
+}
+
 IScheduler* MakeSimpleThreadedScheduler(const std::string& threadName)
 {
     return new TSimpleThreadedScheduler(threadName);
@@ -130,7 +407,8 @@ IScheduler* MakeSimpleThreadedScheduler(const std::string& threadName)
 
 std::shared_ptr<ITask> MakePeriodicTask(const std::chrono::microseconds& period,
                                         std::function<void()> fn,
-                                        const std::string& name)
+                                        const std::string& name,
+                                        TScheduleMode mode)
 {
-    return std::make_shared<TPeriodicTask>(period, fn, name);
+    return std::make_shared<TPeriodicTask>(period, fn, name, mode);
 }
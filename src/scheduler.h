@@ -1,33 +1,159 @@
 #pragma once
 
+#include <array>
 #include <chrono>
 #include <functional>
 #include <memory>
 #include <string>
 #include <vector>
 
-class ITask: public std::enable_shared_from_this<ITask>
+/**
+ * @brief How next run of a periodic task is planned
+ */
+enum class TScheduleMode
+{
+    //! Next run is planned at period after start of the previous run. Delays accumulate.
+    FIXED_DELAY,
+
+    //! Runs are anchored to ideal timeline start + N * period.
+    //! If runs are missed because of overrun, they are skipped and the task is run at the next ideal time point.
+    FIXED_RATE_SKIP,
+
+    //! Runs are anchored to ideal timeline start + N * period.
+    //! Missed runs are performed one after another without delay until the task catches up the timeline.
+    FIXED_RATE_CATCH_UP
+};
+
+/**
+ * @brief Histogram with power of 2 bucket boundaries in microseconds.
+ *        Bucket 0 counts values less than 1us, bucket i counts values in [2^(i-1), 2^i) us,
+ *        the last bucket also counts all greater values.
+ */
+struct TDurationHistogram
+{
+    static const size_t BUCKETS_COUNT = 32;
+
+    std::array<uint64_t, BUCKETS_COUNT> Buckets{};
+    uint64_t Count = 0;
+    std::chrono::microseconds Sum{0};
+    std::chrono::microseconds Max{0};
+
+    void Add(std::chrono::microseconds value);
+
+    /**
+     * @brief Returns upper bound of the bucket containing the percentile
+     *
+     * @param percentile value in range [0, 100]
+     */
+    std::chrono::microseconds GetPercentile(double percentile) const;
+
+    std::chrono::microseconds GetAverage() const;
+};
+
+struct TTaskStats
+{
+    std::string Name;
+
+    //! Time between planned and actual start of runs
+    TDurationHistogram Lateness;
+
+    //! Duration of runs
+    TDurationHistogram Runtime;
+
+    //! Number of runs skipped because of overrun in TScheduleMode::FIXED_RATE_SKIP mode
+    uint64_t SkippedRuns = 0;
+};
+
+class ITask
 {
 public:
     virtual ~ITask() = default;
 
-    virtual std::vector<std::shared_ptr<ITask>> Run() = 0;
+    /**
+     * @brief Runs the task. Must not allocate memory for scheduler needs.
+     *
+     * @return true if the task must be run again after GetPeriod()
+     * @return false if the task is finished and must be removed from scheduler
+     */
+    virtual bool Run() = 0;
 
     virtual const std::string& GetName() const = 0;
 
     virtual const std::chrono::microseconds& GetPeriod() const = 0;
+
+    virtual TScheduleMode GetScheduleMode() const
+    {
+        return TScheduleMode::FIXED_DELAY;
+    }
 };
 
+/**
+ * @brief Opaque task identifier returned by IScheduler::AddTask.
+ *        Handles of finished or cancelled tasks are never reused.
+ */
+using TTaskHandle = uint64_t;
+
 class IScheduler
 {
 public:
     virtual ~IScheduler() = default;
 
-    virtual void AddTask(std::shared_ptr<ITask> task) = 0;
+    /**
+     * @brief Adds task to be run as soon as possible
+     */
+    virtual TTaskHandle AddTask(std::shared_ptr<ITask> task) = 0;
+
+    /**
+     * @brief Adds task to be run at specified time point
+     */
+    virtual TTaskHandle AddTask(std::shared_ptr<ITask> task, std::chrono::steady_clock::time_point firstRun) = 0;
+
+    /**
+     * @brief Removes the task from scheduler. If the task is running, it is not run again.
+     *
+     * @return false if the task is already finished or cancelled
+     */
+    virtual bool CancelTask(TTaskHandle handle) = 0;
+
+    /**
+     * @brief Moves next run of the task to specified time point.
+     *        If the task is running, it will be run next time at the time point.
+     *
+     * @return false if the task is already finished or cancelled
+     */
+    virtual bool RescheduleTask(TTaskHandle handle, std::chrono::steady_clock::time_point nextRun) = 0;
+
+    /**
+     * @brief Returns number of active tasks
+     */
+    virtual size_t GetTaskCount() = 0;
+
+    /**
+     * @brief Copies lateness and runtime statistics of the task
+     *
+     * @return false if the task is already finished or cancelled
+     */
+    virtual bool GetTaskStats(TTaskHandle handle, TTaskStats& stats) = 0;
 };
 
+/**
+ * @brief Returns next start time of a periodic task after a run
+ *
+ * @param plannedRun planned start of the run, default time point for tasks added without start time
+ * @param start actual start of the run
+ * @param end end of the run
+ * @param skippedRuns is increased by number of runs skipped in TScheduleMode::FIXED_RATE_SKIP mode
+ */
+std::chrono::steady_clock::time_point GetNextRun(TScheduleMode mode,
+                                                 std::chrono::microseconds period,
+                                                 std::chrono::steady_clock::time_point plannedRun,
+                                                 std::chrono::steady_clock::time_point start,
+                                                 std::chrono::steady_clock::time_point end,
+                                                 uint64_t& skippedRuns);
+
 IScheduler* MakeSimpleThreadedScheduler(const std::string& threadName);
 
 std::shared_ptr<ITask> MakePeriodicTask(const std::chrono::microseconds& period,
                                         std::function<void()> fn,
-                                        const std::string& name);
\ No newline at end of file
+                                        const std::string& name,
+                                        TScheduleMode mode = TScheduleMode::FIXED_DELAY);
@@ -0,0 +1,119 @@
+#include "CanTransactions.h"
+#include "FakeCanPort.h"
+
+#include <gtest/gtest.h>
+#include <vector>
+
+namespace
+{
+    const uint32_t RESPONSE_FLAG = 0x100;
+
+    //! Responses have RESPONSE_FLAG in CAN id, the key is CAN id without the flag
+    bool GetResponseKey(const CAN::TFrame& frame, CAN::TTransactionKey& key)
+    {
+        if (!(frame.can_id & RESPONSE_FLAG)) {
+            return false;
+        }
+        key = frame.can_id & ~RESPONSE_FLAG;
+        return true;
+    }
+
+    CAN::TFrame MakeFrame(uint32_t canId)
+    {
+        CAN::TFrame frame{0};
+        frame.can_id = canId;
+        return frame;
+    }
+}
+
+TEST(TCanTransactionsTest, Response)
+{
+    auto port = std::make_shared<TFakeCanPort>();
+    CAN::TTransactions transactions(port, GetResponseKey);
+
+    auto result = transactions.Start(MakeFrame(1), 1, std::chrono::seconds(5), 0);
+    auto sameKeyResult = transactions.Start(MakeFrame(1), 1, std::chrono::seconds(5), 0);
+    transactions.Start(MakeFrame(2), 2, std::chrono::seconds(5), 0);
+    EXPECT_EQ(2, port->GetSentCount());
+    EXPECT_EQ(2, transactions.GetInFlightCount());
+
+    port->Receive(MakeFrame(3 | RESPONSE_FLAG));
+    port->Receive(MakeFrame(1));
+    EXPECT_EQ(2, transactions.GetInFlightCount());
+
+    auto response = MakeFrame(1 | RESPONSE_FLAG);
+    response.data[0] = 42;
+    port->Receive(response);
+    ASSERT_EQ(std::future_status::ready, result.wait_for(std::chrono::seconds(1)));
+    auto r = result.get();
+    EXPECT_TRUE(r.Ok);
+    EXPECT_EQ(42, r.Response.data[0]);
+    EXPECT_EQ(1, r.Attempts);
+    EXPECT_TRUE(sameKeyResult.get().Ok);
+    EXPECT_EQ(1, transactions.GetInFlightCount());
+    EXPECT_EQ(1, transactions.GetRttStats().Count);
+}
+
+TEST(TCanTransactionsTest, Retries)
+{
+    auto port = std::make_shared<TFakeCanPort>();
+    CAN::TTransactions transactions(port, GetResponseKey);
+
+    auto result = transactions.Start(MakeFrame(1), 1, std::chrono::milliseconds(20), 2);
+    ASSERT_EQ(std::future_status::ready, result.wait_for(std::chrono::seconds(5)));
+    auto r = result.get();
+    EXPECT_FALSE(r.Ok);
+    EXPECT_EQ(3, r.Attempts);
+    EXPECT_EQ(3, port->GetSentCount());
+    EXPECT_EQ(0, transactions.GetInFlightCount());
+}
+
+TEST(TCanTransactionsTest, StartFresh)
+{
+    auto port = std::make_shared<TFakeCanPort>();
+    CAN::TTransactions transactions(port, GetResponseKey);
+
+    auto result = transactions.Start(MakeFrame(1), 1, std::chrono::seconds(5), 0);
+    std::promise<CAN::TTransactionResult> freshPromise;
+    transactions.StartFresh(MakeFrame(1), 1, std::chrono::seconds(5), 0, [&](const CAN::TTransactionResult& r) {
+        freshPromise.set_value(r);
+    });
+    auto freshResult = freshPromise.get_future();
+    EXPECT_EQ(1, port->GetSentCount());
+
+    // The response to the first request doesn't complete the fresh transaction
+    auto response = MakeFrame(1 | RESPONSE_FLAG);
+    response.data[0] = 1;
+    port->Receive(response);
+    ASSERT_EQ(std::future_status::ready, result.wait_for(std::chrono::seconds(1)));
+    EXPECT_EQ(1, result.get().Response.data[0]);
+    EXPECT_EQ(std::future_status::timeout, freshResult.wait_for(std::chrono::milliseconds(0)));
+
+    // The fresh request is sent after completion of the first one
+    auto start = std::chrono::steady_clock::now();
+    while (port->GetSentCount() < 2 && std::chrono::steady_clock::now() - start < std::chrono::seconds(5)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ASSERT_EQ(2, port->GetSentCount());
+    response.data[0] = 2;
+    port->Receive(response);
+    ASSERT_EQ(std::future_status::ready, freshResult.wait_for(std::chrono::seconds(1)));
+    auto r = freshResult.get();
+    EXPECT_TRUE(r.Ok);
+    EXPECT_EQ(2, r.Response.data[0]);
+    EXPECT_EQ(1, r.Attempts);
+    EXPECT_EQ(0, transactions.GetInFlightCount());
+}
+
+TEST(TCanTransactionsTest, Destruction)
+{
+    auto port = std::make_shared<TFakeCanPort>();
+    std::future<CAN::TTransactionResult> result;
+    {
+        CAN::TTransactions transactions(port, GetResponseKey);
+        result = transactions.Start(MakeFrame(1), 1, std::chrono::seconds(5), 0);
+    }
+    ASSERT_EQ(std::future_status::ready, result.wait_for(std::chrono::seconds(0)));
+    EXPECT_FALSE(result.get().Ok);
+    port->Receive(MakeFrame(1 | RESPONSE_FLAG));
+}
@@ -0,0 +1,98 @@
+#include "ConfigWatcher.h"
+
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+
+namespace
+{
+    using namespace std::chrono_literals;
+
+    const auto DEBOUNCE = 100ms;
+
+    void WriteFile(const std::filesystem::path& path, const std::string& content)
+    {
+        std::ofstream file(path, std::ios::trunc);
+        file << content;
+    }
+
+    template<class TPredicate> bool WaitFor(TPredicate pred, std::chrono::milliseconds timeout = 3s)
+    {
+        auto end = std::chrono::steady_clock::now() + timeout;
+        while (!pred()) {
+            if (std::chrono::steady_clock::now() > end) {
+                return false;
+            }
+            std::this_thread::sleep_for(10ms);
+        }
+        return true;
+    }
+}
+
+class TConfigWatcherTest: public testing::Test
+{
+protected:
+    std::filesystem::path Dir;
+
+    void SetUp()
+    {
+        Dir = std::filesystem::temp_directory_path() / "wb-mqtt-smartweb-config-watcher-test";
+        std::filesystem::remove_all(Dir);
+        std::filesystem::create_directories(Dir / "classes");
+        WriteFile(Dir / "config.json", "{}");
+    }
+
+    void TearDown()
+    {
+        std::filesystem::remove_all(Dir);
+    }
+};
+
+TEST_F(TConfigWatcherTest, Reload)
+{
+    std::atomic<int> reloads{0};
+    TConfigWatcher watcher({(Dir / "config.json").string(), (Dir / "classes").string()}, DEBOUNCE, [&]() {
+        ++reloads;
+    });
+
+    // Series of changes causes one reload
+    WriteFile(Dir / "config.json", "{\"debug\": true}");
+    WriteFile(Dir / "classes" / "A.json", "{}");
+    ASSERT_TRUE(WaitFor([&]() { return reloads == 1; }));
+    std::this_thread::sleep_for(DEBOUNCE * 3);
+    EXPECT_EQ(1, reloads);
+
+    // Other files in config directory are ignored
+    WriteFile(Dir / "other.json", "{}");
+    std::this_thread::sleep_for(DEBOUNCE * 5);
+    EXPECT_EQ(1, reloads);
+
+    // Replacing by rename as editors do
+    WriteFile(Dir / "config.json.tmp", "{}");
+    std::filesystem::rename(Dir / "config.json.tmp", Dir / "config.json");
+    ASSERT_TRUE(WaitFor([&]() { return reloads == 2; }));
+
+    std::filesystem::remove(Dir / "classes" / "A.json");
+    ASSERT_TRUE(WaitFor([&]() { return reloads == 3; }));
+}
+
+TEST_F(TConfigWatcherTest, CreatedDirectory)
+{
+    std::atomic<int> reloads{0};
+    TConfigWatcher watcher({(Dir / "classes.d").string()}, DEBOUNCE, [&]() { ++reloads; });
+
+    std::filesystem::create_directory(Dir / "classes.d");
+    ASSERT_TRUE(WaitFor([&]() { return reloads == 1; }));
+
+    // Files of the directory created after the watcher are watched
+    WriteFile(Dir / "classes.d" / "A.json", "{}");
+    ASSERT_TRUE(WaitFor([&]() { return reloads == 2; }));
+
+    // The directory is watched again after it is recreated
+    std::filesystem::remove_all(Dir / "classes.d");
+    ASSERT_TRUE(WaitFor([&]() { return reloads == 3; }));
+    std::filesystem::create_directory(Dir / "classes.d");
+    ASSERT_TRUE(WaitFor([&]() { return reloads == 4; }));
+    WriteFile(Dir / "classes.d" / "B.json", "{}");
+    ASSERT_TRUE(WaitFor([&]() { return reloads == 5; }));
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "CanPort.h"
+
+/**
+ * @brief CAN port of tests. Sent frames are stored, received frames are passed to handlers by Receive
+ *        in the calling thread like the reader thread of CAN::TPort does.
+ */
+class TFakeCanPort: public CAN::IPort
+{
+    std::mutex HandlersMutex;
+    std::vector<CAN::IFrameHandler*> Handlers;
+
+    std::mutex FramesMutex;
+    std::condition_variable FramesCv;
+    std::vector<CAN::TFrame> Frames;
+
+public:
+    void AddHandler(CAN::IFrameHandler* handler) override
+    {
+        std::unique_lock<std::mutex> lk(HandlersMutex);
+        Handlers.push_back(handler);
+    }
+
+    void RemoveHandler(CAN::IFrameHandler* handler) override
+    {
+        std::unique_lock<std::mutex> lk(HandlersMutex);
+        Handlers.erase(std::remove(Handlers.begin(), Handlers.end(), handler), Handlers.end());
+    }
+
+    void Send(const CAN::TFrame& frame) override
+    {
+        std::unique_lock<std::mutex> lk(FramesMutex);
+        Frames.push_back(frame);
+        FramesCv.notify_all();
+    }
+
+    //! Returns true if a handler has consumed the frame
+    bool Receive(const CAN::TFrame& frame)
+    {
+        std::unique_lock<std::mutex> lk(HandlersMutex);
+        for (auto handler: Handlers) {
+            if (handler->Handle(frame)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<CAN::TFrame> GetSentFrames()
+    {
+        std::unique_lock<std::mutex> lk(FramesMutex);
+        return Frames;
+    }
+
+    std::vector<CAN::TFrame> GetSentFrames(std::function<bool(const CAN::TFrame& frame)> match)
+    {
+        std::unique_lock<std::mutex> lk(FramesMutex);
+        std::vector<CAN::TFrame> res;
+        std::copy_if(Frames.begin(), Frames.end(), std::back_inserter(res), match);
+        return res;
+    }
+
+    size_t GetSentCount()
+    {
+        std::unique_lock<std::mutex> lk(FramesMutex);
+        return Frames.size();
+    }
+
+    void ClearSentFrames()
+    {
+        std::unique_lock<std::mutex> lk(FramesMutex);
+        Frames.clear();
+    }
+
+    /**
+     * @brief Waits until at least count sent frames match the predicate or the timeout expires
+     *
+     * @return all sent frames matching the predicate
+     */
+    std::vector<CAN::TFrame> WaitForFrames(size_t count,
+                                           std::function<bool(const CAN::TFrame& frame)> match,
+                                           std::chrono::milliseconds timeout = std::chrono::seconds(5))
+    {
+        {
+            std::unique_lock<std::mutex> lk(FramesMutex);
+            FramesCv.wait_for(lk, timeout, [&]() {
+                return size_t(std::count_if(Frames.begin(), Frames.end(), match)) >= count;
+            });
+        }
+        return GetSentFrames(match);
+    }
+};
@@ -0,0 +1,188 @@
+#include "FakeCanPort.h"
+#include "MqttToSmartWebGateway.h"
+#include "exceptions.h"
+
+#include <algorithm>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <set>
+#include <vector>
+
+namespace
+{
+    const size_t CONTROLLERS_COUNT = 250;
+
+    std::function<bool(const CAN::TFrame& frame)> HasFunction(uint8_t functionId)
+    {
+        return [functionId](const CAN::TFrame& frame) {
+            SmartWeb::TCanHeader header;
+            header.raw = frame.can_id;
+            return header.rec.function_id == functionId;
+        };
+    }
+
+    size_t GetThreadCount()
+    {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.rfind("Threads:", 0) == 0) {
+                return std::stoul(line.substr(8));
+            }
+        }
+        return 0;
+    }
+
+    TMqttToSmartWebConfig MakeController(uint8_t programId)
+    {
+        TMqttToSmartWebConfig res;
+        res.ProgramId = programId;
+        SmartWeb::TParameterInfo parameterInfo{0};
+        parameterInfo.parameter_id = SmartWeb::Controller::Parameters::SENSOR;
+        parameterInfo.program_type = SmartWeb::PT_CONTROLLER;
+        parameterInfo.index = 1;
+        auto channelNameId = res.ChannelNames.Intern("wb-adc/R1");
+        res.ParameterMapping[parameterInfo.raw] = channelNameId;
+        res.ParameterCount = 1;
+        res.MqttChannelsTiming["wb-adc/R1"].refresh_last_update_timepoint();
+        res.OutputMapping.Add(0, channelNameId);
+        return res;
+    }
+
+    CAN::TFrame MakeControllerRequest(uint8_t programId, uint8_t functionId)
+    {
+        SmartWeb::TCanHeader header{0};
+        header.rec.program_type = SmartWeb::PT_CONTROLLER;
+        header.rec.program_id = programId;
+        header.rec.function_id = functionId;
+        header.rec.message_type = SmartWeb::MT_MSG_REQUEST;
+        CAN::TFrame frame{0};
+        frame.can_id = header.raw | CAN_EFF_FLAG;
+        return frame;
+    }
+}
+
+TEST(TMqttChannelNamesTest, Intern)
+{
+    TMqttChannelNames names;
+    EXPECT_EQ(0, names.Intern("wb-adc/R1"));
+    EXPECT_EQ(1, names.Intern("wb-adc/R2"));
+    EXPECT_EQ(0, names.Intern("wb-adc/R1"));
+    EXPECT_EQ(2, names.Size());
+    EXPECT_EQ("R2", names.Get(1).control);
+    EXPECT_THROW(names.Intern("wrong"), TDriverError);
+}
+
+TEST(TOutputMappingTest, AddAndFind)
+{
+    TOutputMapping outputs;
+    EXPECT_EQ(0, outputs.GetHostIdCount());
+    EXPECT_TRUE(outputs.Add(70, 1));
+    EXPECT_TRUE(outputs.Add(3, 0));
+    EXPECT_FALSE(outputs.Add(70, 0));
+    EXPECT_EQ(2, outputs.Size());
+    EXPECT_EQ(3, outputs.GetHostIdCount());
+    ASSERT_NE(nullptr, outputs.Find(70));
+    EXPECT_EQ(1, outputs.Find(70)->ChannelNameId);
+    EXPECT_EQ(nullptr, outputs.Find(4));
+    EXPECT_EQ(3, outputs.begin()->OutputIndex);
+}
+
+TEST(TMqttToSmartWebExecutorTest, OutputsOfAdditionalHostIds)
+{
+    auto port = std::make_shared<TFakeCanPort>();
+    auto controller = MakeController(10);
+    controller.OutputMapping.Add(40, controller.ChannelNames.Intern("wb-adc/R2"));
+    controller.MqttChannelsTiming["wb-adc/R2"].refresh_last_update_timepoint();
+    TMqttToSmartWebExecutor executor({controller, MakeController(12)}, port, nullptr);
+
+    auto request = MakeControllerRequest(100, SmartWeb::Controller::Function::GET_OUTPUT_VALUE);
+    SmartWeb::TMappingPoint mappingPoint{};
+    mappingPoint.hostID = 11;
+    mappingPoint.channelID = 8;
+    memcpy(request.data, mappingPoint.rawID, 2);
+    EXPECT_TRUE(port->Receive(request));
+
+    auto outputs = port->WaitForFrames(1, HasFunction(SmartWeb::Controller::Function::GET_OUTPUT_VALUE));
+    ASSERT_EQ(1, outputs.size());
+    EXPECT_EQ(11, outputs[0].data[0]);
+    EXPECT_EQ(8, outputs[0].data[1] & 0x1F);
+
+    mappingPoint.hostID = 13;
+    memcpy(request.data, mappingPoint.rawID, 2);
+    EXPECT_FALSE(port->Receive(request));
+}
+
+TEST(TMqttToSmartWebExecutorTest, DuplicateController)
+{
+    auto port = std::make_shared<TFakeCanPort>();
+    TMqttToSmartWebExecutor executor({MakeController(10), MakeController(10), MakeController(11)}, port, nullptr);
+    EXPECT_EQ(2, executor.GetGatewayCount());
+}
+
+TEST(TMqttToSmartWebExecutorTest, Benchmark250Controllers)
+{
+    auto port = std::make_shared<TFakeCanPort>();
+    std::vector<TMqttToSmartWebConfig> controllers;
+    for (size_t i = 1; i <= CONTROLLERS_COUNT; ++i) {
+        controllers.push_back(MakeController(i));
+    }
+
+    auto threadsBefore = GetThreadCount();
+
+    TMqttToSmartWebExecutor executor(controllers, port, nullptr);
+    ASSERT_EQ(CONTROLLERS_COUNT, executor.GetGatewayCount());
+
+    // One shared worker thread regardless of controllers count
+    EXPECT_LE(GetThreadCount(), threadsBefore + 1);
+
+    // Every controller announces itself on startup
+    auto announces = port->WaitForFrames(CONTROLLERS_COUNT, HasFunction(SmartWeb::Controller::Function::I_AM_HERE));
+    ASSERT_EQ(CONTROLLERS_COUNT, announces.size());
+
+    for (size_t i = 1; i <= CONTROLLERS_COUNT; ++i) {
+        port->Receive(MakeControllerRequest(i, SmartWeb::Controller::Function::GET_CONTROLLER_TYPE));
+    }
+    auto responses =
+        port->WaitForFrames(CONTROLLERS_COUNT, HasFunction(SmartWeb::Controller::Function::GET_CONTROLLER_TYPE));
+
+    ASSERT_EQ(CONTROLLERS_COUNT, responses.size());
+    std::set<uint8_t> respondedIds;
+    for (const auto& frame: responses) {
+        SmartWeb::TCanHeader header;
+        header.raw = frame.can_id;
+        EXPECT_EQ(SmartWeb::MT_MSG_RESPONSE, header.rec.message_type);
+        respondedIds.insert(header.rec.program_id);
+    }
+    EXPECT_EQ(CONTROLLERS_COUNT, respondedIds.size());
+    EXPECT_LE(GetThreadCount(), threadsBefore + 1);
+}
+
+TEST(TMqttToSmartWebExecutorTest, UpdateControllers)
+{
+    auto changed = MakeController(10);
+    EXPECT_TRUE(IsSameMapping(MakeController(10), changed));
+    changed.OutputMapping.Add(3, changed.ChannelNames.Intern("wb-adc/R2"));
+    changed.MqttChannelsTiming["wb-adc/R2"].refresh_last_update_timepoint();
+    EXPECT_FALSE(IsSameMapping(MakeController(10), changed));
+    EXPECT_FALSE(IsSameMapping(MakeController(10), MakeController(11)));
+
+    auto port = std::make_shared<TFakeCanPort>();
+    TMqttToSmartWebExecutor executor({MakeController(10), MakeController(11)}, port, nullptr);
+    ASSERT_EQ(2, port->WaitForFrames(2, HasFunction(SmartWeb::Controller::Function::I_AM_HERE)).size());
+    EXPECT_TRUE(port->Receive(MakeControllerRequest(11, SmartWeb::Controller::Function::GET_CONTROLLER_TYPE)));
+    EXPECT_FALSE(port->Receive(MakeControllerRequest(12, SmartWeb::Controller::Function::GET_CONTROLLER_TYPE)));
+
+    executor.UpdateControllers({changed, MakeController(12)});
+    EXPECT_EQ(2, executor.GetGatewayCount());
+    EXPECT_FALSE(port->Receive(MakeControllerRequest(11, SmartWeb::Controller::Function::GET_CONTROLLER_TYPE)));
+    EXPECT_TRUE(port->Receive(MakeControllerRequest(12, SmartWeb::Controller::Function::GET_CONTROLLER_TYPE)));
+
+    // Changed controller is restarted and announces itself again
+    auto announces = port->WaitForFrames(4, HasFunction(SmartWeb::Controller::Function::I_AM_HERE));
+    EXPECT_EQ(2, std::count_if(announces.begin(), announces.end(), [](const auto& frame) {
+                  SmartWeb::TCanHeader header;
+                  header.raw = frame.can_id;
+                  return header.rec.program_id == 10;
+              }));
+}
@@ -0,0 +1,67 @@
+#include "ParametersRpc.h"
+
+#include <gtest/gtest.h>
+
+namespace
+{
+    Json::Value Parse(const std::string& str)
+    {
+        Json::Value res;
+        Json::CharReaderBuilder builder;
+        std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+        std::string errors;
+        if (!reader->parse(str.data(), str.data() + str.size(), &res, &errors)) {
+            throw std::runtime_error(errors);
+        }
+        return res;
+    }
+}
+
+TEST(TParametersRpcTest, ParseRead)
+{
+    auto request = ParseReadParametersRequest(Parse(R"({"program_id": 10, "parameters": ["p1", "p2"]})"));
+    EXPECT_EQ(10, request.ProgramId);
+    ASSERT_EQ(2, request.Values.size());
+    EXPECT_EQ("p1", request.Values[0].first);
+    EXPECT_EQ("p2", request.Values[1].first);
+
+    EXPECT_TRUE(ParseReadParametersRequest(Parse(R"({"program_id": 10})")).Values.empty());
+    EXPECT_TRUE(ParseReadParametersRequest(Parse(R"({"program_id": 10, "parameters": "all"})")).Values.empty());
+
+    EXPECT_THROW(ParseReadParametersRequest(Parse(R"({"parameters": "all"})")), std::runtime_error);
+    EXPECT_THROW(ParseReadParametersRequest(Parse(R"({"program_id": 256})")), std::runtime_error);
+    EXPECT_THROW(ParseReadParametersRequest(Parse(R"({"program_id": 10, "parameters": []})")), std::runtime_error);
+    EXPECT_THROW(ParseReadParametersRequest(Parse(R"({"program_id": 10, "parameters": [1]})")), std::runtime_error);
+    EXPECT_THROW(ParseReadParametersRequest(Parse(R"({"program_id": 10, "parameters": ["p1", "p1"]})")),
+                 std::runtime_error);
+}
+
+TEST(TParametersRpcTest, ParseWrite)
+{
+    auto request = ParseWriteParametersRequest(Parse(R"({"program_id": 3, "values": {"p1": "21.5", "p2": 7}})"));
+    EXPECT_EQ(3, request.ProgramId);
+    ASSERT_EQ(2, request.Values.size());
+    EXPECT_EQ("p1", request.Values[0].first);
+    EXPECT_EQ("21.5", request.Values[0].second);
+    EXPECT_EQ("7", request.Values[1].second);
+
+    EXPECT_THROW(ParseWriteParametersRequest(Parse(R"({"program_id": 3})")), std::runtime_error);
+    EXPECT_THROW(ParseWriteParametersRequest(Parse(R"({"program_id": 3, "values": {}})")), std::runtime_error);
+    EXPECT_THROW(ParseWriteParametersRequest(Parse(R"({"program_id": 3, "values": {"p": [1]}})")),
+                 std::runtime_error);
+}
+
+TEST(TParametersRpcTest, Response)
+{
+    auto response = MakeParametersRpcResponse(
+        3,
+        {{"p1", "21.5", ""}, {"p2", "", "timeout"}, {"p3", "20", "value is not applied"}});
+    EXPECT_EQ(3, response["program_id"].asUInt());
+    const auto& parameters = response["parameters"];
+    EXPECT_EQ("21.5", parameters["p1"]["value"].asString());
+    EXPECT_FALSE(parameters["p1"].isMember("error"));
+    EXPECT_FALSE(parameters["p2"].isMember("value"));
+    EXPECT_EQ("timeout", parameters["p2"]["error"].asString());
+    EXPECT_EQ("20", parameters["p3"]["value"].asString());
+    EXPECT_EQ("value is not applied", parameters["p3"]["error"].asString());
+}
@@ -1,6 +1,15 @@
+#include "FakeCanPort.h"
 #include "config_parser.h"
+#include "gateway_state.h"
+#include "metadata_cache.h"
 
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
 #include <gtest/gtest.h>
+#include <map>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include <wblib/json_utils.h>
@@ -10,6 +19,76 @@
 
 using namespace WBMQTT;
 
+namespace
+{
+    const uint8_t TEST_PROGRAM_TYPE = 5;
+    const auto WAIT_TIMEOUT = std::chrono::seconds(10);
+
+    const size_t BENCHMARK_PROGRAMS_COUNT = 32;
+    const size_t BENCHMARK_VALUES_PER_PROGRAM = 200;
+
+    CAN::TFrame MakeResponse(const CAN::TFrame& request)
+    {
+        auto response = request;
+        SmartWeb::TCanHeader* header = (SmartWeb::TCanHeader*)&response.can_id;
+        header->rec.message_type = SmartWeb::MT_MSG_RESPONSE;
+        return response;
+    }
+
+    CAN::TFrame MakeProgramTypeResponse(uint8_t programId, uint8_t programType = TEST_PROGRAM_TYPE)
+    {
+        auto response = MakeResponse(MakeGetProgramTypeRequest(programId));
+        response.can_dlc = 1;
+        response.data[0] = programType;
+        return response;
+    }
+
+    CAN::TFrame MakeValueResponse(uint8_t programId, uint8_t parameterId, int16_t value)
+    {
+        auto response = MakeResponse(
+            MakeGetParameterValueRequest(programId, TParameterRequest{2, {TEST_PROGRAM_TYPE, parameterId, 0}}));
+        response.can_dlc = 4;
+        response.data[2] = value & 0xFF;
+        response.data[3] = (value >> 8) & 0xFF;
+        return response;
+    }
+
+    //! Matches requests of the function sent to the program
+    std::function<bool(const CAN::TFrame& frame)> IsRequest(uint8_t programId, uint8_t functionId)
+    {
+        return [programId, functionId](const CAN::TFrame& frame) {
+            SmartWeb::TCanHeader header;
+            header.raw = frame.can_id;
+            return header.rec.message_type == SmartWeb::MT_MSG_REQUEST && header.rec.program_id == programId &&
+                   header.rec.function_id == functionId;
+        };
+    }
+
+    //! Matches requests of the program function, e.g. discovery requests, sent to any program
+    std::function<bool(const CAN::TFrame& frame)> IsProgramRequest(uint8_t functionId)
+    {
+        return [functionId](const CAN::TFrame& frame) {
+            SmartWeb::TCanHeader header;
+            header.raw = frame.can_id;
+            return header.rec.message_type == SmartWeb::MT_MSG_REQUEST &&
+                   header.rec.program_type == SmartWeb::PT_PROGRAM && header.rec.function_id == functionId;
+        };
+    }
+
+    template<class TCondition>
+    bool WaitFor(TCondition condition, std::chrono::steady_clock::duration timeout = WAIT_TIMEOUT)
+    {
+        auto end = std::chrono::steady_clock::now() + timeout;
+        while (!condition()) {
+            if (std::chrono::steady_clock::now() > end) {
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return true;
+    }
+}
+
 class TSmartWebToMqttGatewayTest: public testing::Test
 {
 protected:
@@ -38,11 +117,11 @@ TEST_F(TSmartWebToMqttGatewayTest, MakeSetParameterValueRequest)
     param.ProgramClass = &cl;
     param.ReadOnly = true;
     param.Type = "temperature";
-    param.Codec = std::make_unique<TIntCodec<int16_t, 10>>();
+    param.Codec = std::make_shared<TIntCodec<int16_t, 10>>();
 
     TSmartWebParameterControl pc;
     pc.ProgramId = 10;
-    pc.Parameter = &param;
+    pc.Parameter = ShareParameter(param);
 
     auto frame = MakeSetParameterValueRequest(pc, "11.1");
 
@@ -54,63 +133,163 @@ TEST_F(TSmartWebToMqttGatewayTest, MakeSetParameterValueRequest)
     ASSERT_EQ(frame.data[3], 0);
 }
 
+TEST_F(TSmartWebToMqttGatewayTest, MakeGetProgramTypeRequest)
+{
+    auto frame = MakeGetProgramTypeRequest(42);
+
+    ASSERT_EQ(frame.can_id, 0x80032A01);
+    ASSERT_EQ(frame.can_dlc, 0);
+}
+
+TEST_F(TSmartWebToMqttGatewayTest, MakeMetadataRequests)
+{
+    auto frame = MakeGetProtocolVersionRequest(42);
+    EXPECT_EQ(frame.can_id, 0x80062A01);
+    EXPECT_EQ(frame.can_dlc, 0);
+
+    TSmartWebClass cl;
+    cl.Type = 5;
+    TSmartWebParameter param;
+    param.Id = 1;
+    param.ProgramClass = &cl;
+
+    frame = MakeGetParameterMetadataRequest(10, param, SmartWeb::RemoteControl::Function::GET_PARAMETER_MINIMUM);
+    EXPECT_EQ(frame.can_id, 0x80050A16);
+    ASSERT_EQ(frame.can_dlc, 2);
+    EXPECT_EQ(frame.data[0], 5);
+    EXPECT_EQ(frame.data[1], 1);
+
+    // Responses to metadata requests of different parameters and functions are distinguished
+    auto key = MakeTransactionKey(frame);
+    using namespace SmartWeb::RemoteControl::Function;
+    EXPECT_NE(key, MakeTransactionKey(MakeGetParameterMetadataRequest(10, param, GET_PARAMETER_MAXIMUM)));
+    param.Id = 2;
+    EXPECT_NE(key, MakeTransactionKey(MakeGetParameterMetadataRequest(10, param, GET_PARAMETER_MINIMUM)));
+}
+
+TEST_F(TSmartWebToMqttGatewayTest, TransactionKey)
+{
+    auto request = MakeGetParameterValueRequest(10, TParameterRequest{2, {5, 1, 0}});
+    auto response = request;
+    SmartWeb::TCanHeader* header = (SmartWeb::TCanHeader*)&response.can_id;
+    header->rec.message_type = SmartWeb::MT_MSG_RESPONSE;
+    response.can_dlc = 4;
+
+    CAN::TTransactionKey key;
+    EXPECT_FALSE(GetResponseTransactionKey(request, key));
+    ASSERT_TRUE(GetResponseTransactionKey(response, key));
+    EXPECT_EQ(MakeTransactionKey(request), key);
+
+    EXPECT_NE(key, MakeTransactionKey(MakeGetParameterValueRequest(10, TParameterRequest{2, {5, 2, 0}})));
+    EXPECT_NE(key, MakeTransactionKey(MakeGetParameterValueRequest(11, TParameterRequest{2, {5, 1, 0}})));
+    EXPECT_NE(MakeTransactionKey(MakeGetParameterValueRequest(10, TParameterRequest{3, {1, 1, 2}})),
+              MakeTransactionKey(MakeGetParameterValueRequest(10, TParameterRequest{3, {1, 1, 3}})));
+}
+
+TEST_F(TSmartWebToMqttGatewayTest, ScheduleCodec)
+{
+    TScheduleCodec codec;
+    // Cells are published raw until their layout is confirmed
+    uint8_t cell[] = {6, 30, 22, 0};
+    EXPECT_EQ("061e1600", codec.Decode(cell));
+    uint8_t unused[] = {0xFF, 0, 0, 0};
+    EXPECT_EQ("ff000000", codec.Decode(unused));
+    // Schedules are read-only
+    EXPECT_THROW(codec.Encode("061e1600"), std::runtime_error);
+
+    std::vector<std::string> cells(TScheduleCodec::ROWS * TScheduleCodec::COLUMNS, "ff000000");
+    cells[1] = "061e1600";
+    cells[TScheduleCodec::COLUMNS * 6 + 3] = "0a001700";
+    auto table = codec.FormatTable(cells);
+    EXPECT_EQ(R"([["ff000000","061e1600","ff000000","ff000000"],)"
+              R"(["ff000000","ff000000","ff000000","ff000000"],)"
+              R"(["ff000000","ff000000","ff000000","ff000000"],)"
+              R"(["ff000000","ff000000","ff000000","ff000000"],)"
+              R"(["ff000000","ff000000","ff000000","ff000000"],)"
+              R"(["ff000000","ff000000","ff000000","ff000000"],)"
+              R"(["ff000000","ff000000","ff000000","0a001700"]])",
+              table);
+
+    TSmartWebClass cl;
+    cl.Type = 5;
+    TSmartWebParameter param;
+    param.Id = 22;
+    param.ProgramClass = &cl;
+    param.Codec = GetSharedCodec<TScheduleCodec>();
+    auto frame = MakeGetTableCellRequest(10, param, 3, 1);
+    EXPECT_EQ(4, frame.can_dlc);
+    EXPECT_EQ(std::vector<uint8_t>({5, 22, 3, 1}), std::vector<uint8_t>(frame.data, frame.data + 4));
+}
+
 TEST_F(TSmartWebToMqttGatewayTest, AddRequests)
 {
     std::vector<CAN::TFrame> requests;
-    TSmartWebClass cl;
+    auto pcl = std::make_shared<TSmartWebClass>();
+    auto& cl = *pcl;
     cl.Type = 5;
     cl.Name = "ROOM_DEVICE";
     cl.ParentClasses.push_back("TEST PARENT CLASS");
     cl.ParentClasses.push_back("MISSING TEST PARENT CLASS");
 
-    auto inp = std::make_shared<TSmartWebParameter>();
-    inp->Id = 1;
-    inp->Name = "Test sensor";
-    inp->Order = 1;
-    inp->ProgramClass = &cl;
-    inp->ReadOnly = true;
-    inp->Type = "temperature";
-    inp->Codec = std::make_unique<TIntCodec<int16_t, 10>>();
-    cl.Inputs.insert({1, inp});
-
-    auto out = std::make_shared<TSmartWebParameter>();
-    out->Id = 2;
-    out->Name = "Test out";
-    out->Order = 1;
-    out->ProgramClass = &cl;
-    out->ReadOnly = true;
-    out->Type = "PWM";
-    out->Codec = std::make_unique<TIntCodec<uint8_t, 1>>();
-    cl.Outputs.insert({2, out});
-
-    auto param = std::make_shared<TSmartWebParameter>();
-    param->Id = 3;
-    param->Name = "Test param";
-    param->Order = 1;
-    param->ProgramClass = &cl;
-    param->ReadOnly = false;
-    param->Type = "humidity";
-    param->Codec = std::make_unique<TIntCodec<int16_t, 10>>();
-    cl.Parameters.insert({3, param});
+    TSmartWebParameter inp;
+    inp.Id = 1;
+    inp.Name = "Test sensor";
+    inp.Order = 1;
+    inp.ProgramClass = &cl;
+    inp.ReadOnly = true;
+    inp.Type = "temperature";
+    inp.Codec = std::make_shared<TIntCodec<int16_t, 10>>();
+    cl.Inputs.Add(inp);
+
+    TSmartWebParameter out;
+    out.Id = 2;
+    out.Name = "Test out";
+    out.Order = 1;
+    out.ProgramClass = &cl;
+    out.ReadOnly = true;
+    out.Type = "PWM";
+    out.Codec = std::make_shared<TIntCodec<uint8_t, 1>>();
+    cl.Outputs.Add(out);
+
+    TSmartWebParameter param;
+    param.Id = 3;
+    param.Name = "Test param";
+    param.Order = 1;
+    param.ProgramClass = &cl;
+    param.ReadOnly = false;
+    param.Type = "humidity";
+    param.Codec = std::make_shared<TIntCodec<int16_t, 10>>();
+    cl.Parameters.Add(param);
 
     auto cl2 = std::make_shared<TSmartWebClass>();
     cl2->Type = 3;
     cl2->Name = "TEST PARENT CLASS";
 
-    auto param2 = std::make_shared<TSmartWebParameter>();
-    param->Id = 4;
-    param->Name = "Test param2";
-    param->Order = 5;
-    param->ProgramClass = cl2.get();
-    param->ReadOnly = true;
-    param->Type = "temperature";
-    param->Codec = std::make_unique<TIntCodec<uint16_t, 100>>();
-    cl2->Parameters.insert({4, param});
+    TSmartWebParameter param2;
+    param2.Id = 4;
+    param2.Name = "Test param2";
+    param2.Order = 5;
+    param2.ProgramClass = cl2.get();
+    param2.ReadOnly = true;
+    param2.Type = "temperature";
+    param2.Codec = std::make_shared<TIntCodec<uint16_t, 100>>();
+    cl2->Parameters.Add(param2);
+
+    // Tables aren't polled
+    TSmartWebParameter schedule;
+    schedule.Id = 5;
+    schedule.Name = "schedule";
+    schedule.ProgramClass = cl2.get();
+    schedule.ReadOnly = false;
+    schedule.Codec = GetSharedCodec<TScheduleCodec>();
+    cl2->Parameters.Add(schedule);
 
-    std::unordered_map<uint8_t, std::shared_ptr<TSmartWebClass>> classes;
-    classes.insert({4, cl2});
+    TSmartWebToMqttConfig::TClasses classes;
+    classes.insert({cl.Type, pcl});
+    classes.insert({cl2->Type, cl2});
+    BuildRequestTemplates(classes);
 
-    AddRequests(requests, "test", cl, 10, classes);
+    AddRequests(requests, cl, 10);
 
     ASSERT_EQ(requests.size(), 4);
 
@@ -135,4 +314,865 @@ TEST_F(TSmartWebToMqttGatewayTest, AddRequests)
     ASSERT_EQ(requests[3].can_dlc, 2);
     ASSERT_EQ(requests[3].data[0], 3); // cl2->Type
     ASSERT_EQ(requests[3].data[1], 4);
+
+    ASSERT_EQ(1, cl.TableParameters.size());
+    EXPECT_EQ("schedule", cl.TableParameters[0]->Name);
+}
+
+TEST_F(TSmartWebToMqttGatewayTest, RequestTemplate)
+{
+    // A inherits B and C, both of them inherit D. C and D inherit each other
+    TSmartWebToMqttConfig::TClasses classes;
+    std::vector<std::pair<std::string, std::vector<std::string>>> hierarchy = {{"A", {"B", "C"}},
+                                                                               {"B", {"D"}},
+                                                                               {"C", {"D", "PROGRAM"}},
+                                                                               {"D", {"C"}}};
+    uint8_t type = 1;
+    for (const auto& item: hierarchy) {
+        auto cl = std::make_shared<TSmartWebClass>();
+        cl->Type = type++;
+        cl->Name = item.first;
+        cl->ParentClasses = item.second;
+        TSmartWebParameter param;
+        param.Id = 1;
+        param.ProgramClass = cl.get();
+        param.Codec = GetSharedCodec<TSensorCodec>();
+        cl->Parameters.Add(param);
+        cl->Inputs.Add(param);
+        classes.insert({cl->Type, cl});
+    }
+    BuildRequestTemplates(classes);
+
+    std::vector<CAN::TFrame> requests;
+    AddRequests(requests, *classes[1], 10);
+
+    // One input request for all classes and one parameter request per class
+    ASSERT_EQ(5, requests.size());
+    EXPECT_EQ(3, requests[0].can_dlc);
+    std::vector<uint8_t> types;
+    for (size_t i = 1; i < requests.size(); ++i) {
+        EXPECT_EQ(2, requests[i].can_dlc);
+        types.push_back(requests[i].data[0]);
+    }
+    EXPECT_EQ(std::vector<uint8_t>({1, 2, 4, 3}), types);
+
+    EXPECT_EQ(3, classes[4]->RequestTemplate.size());
+
+    // Parameters of parents are taken from their classes in order of requests
+    auto params = GetProgramParameters(*classes[1], classes);
+    ASSERT_EQ(4, params.size());
+    EXPECT_EQ(classes[1].get(), params[0]->ProgramClass);
+    EXPECT_EQ(classes[3].get(), params[3]->ProgramClass);
+}
+
+TEST_F(TSmartWebToMqttGatewayTest, ParameterTable)
+{
+    TSmartWebParameterTable params;
+    TSmartWebParameter param;
+    param.Codec = GetSharedCodec<TOutputCodec>();
+    for (uint32_t id: {200, 7, 0, 255}) {
+        param.Id = id;
+        param.Name = std::to_string(id);
+        EXPECT_TRUE(params.Add(param));
+    }
+    EXPECT_FALSE(params.Add(param));
+    param.Id = 256;
+    EXPECT_THROW(params.Add(param), std::runtime_error);
+
+    ASSERT_EQ(4, params.size());
+    std::vector<uint32_t> ids;
+    for (const auto& p: params) {
+        ids.push_back(p.Id);
+    }
+    EXPECT_EQ(std::vector<uint32_t>({0, 7, 200, 255}), ids);
+    ASSERT_NE(nullptr, params.Find(200));
+    EXPECT_EQ("200", params.Find(200)->Name);
+    EXPECT_EQ(nullptr, params.Find(8));
+    EXPECT_EQ(nullptr, params.Find(1000));
+
+    // Stateless codecs are shared
+    EXPECT_EQ(params.Find(0)->Codec, params.Find(7)->Codec);
+}
+
+TEST_F(TSmartWebToMqttGatewayTest, ShareParameter)
+{
+    auto cl = std::make_shared<TSmartWebClass>();
+    TSmartWebParameter param;
+    param.Id = 1;
+    param.Codec = GetSharedCodec<TOutputCodec>();
+    param.ProgramClass = cl.get();
+    cl->Parameters.Add(param);
+
+    auto shared = ShareParameter(*cl->Parameters.Find(1));
+    std::weak_ptr<TSmartWebClass> weakClass(cl);
+    cl.reset();
+    // The parameter keeps its class alive
+    EXPECT_FALSE(weakClass.expired());
+    EXPECT_EQ(1, shared->Id);
+    shared.reset();
+    EXPECT_TRUE(weakClass.expired());
+
+    // Classes not owned by std::shared_ptr are only pointed to
+    TSmartWebClass localClass;
+    param.ProgramClass = &localClass;
+    EXPECT_EQ(&param, ShareParameter(param).get());
+    EXPECT_EQ(&localClass, ShareClass(localClass).get());
+}
+
+TEST_F(TSmartWebToMqttGatewayTest, PollPlan)
+{
+    TSmartWebClass cl1;
+    cl1.RequestTemplate = {TParameterRequest{2, {1, 1}}, TParameterRequest{2, {1, 2}}};
+    TSmartWebClass cl2;
+    cl2.RequestTemplate = {TParameterRequest{2, {2, 1}}};
+    TSmartWebClass empty;
+
+    TPollPlan plan;
+    TPollPlan::TCursor cursor;
+    CAN::TFrame frame;
+    EXPECT_FALSE(plan.GetNextRequest(cursor, frame));
+
+    plan.AddProgram(10, &cl1);
+    plan.AddProgram(11, &empty);
+    plan.AddProgram(12, &cl2);
+    EXPECT_EQ(3, plan.GetProgramCount());
+    EXPECT_EQ(3, plan.GetRequestCount());
+
+    auto next = [&](const TPollPlan& p) {
+        EXPECT_TRUE(p.GetNextRequest(cursor, frame));
+        SmartWeb::TCanHeader header;
+        header.raw = frame.can_id;
+        EXPECT_EQ(SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE, header.rec.function_id);
+        return std::make_pair(int(header.rec.program_id), int(frame.data[1]));
+    };
+    EXPECT_EQ(std::make_pair(10, 1), next(plan));
+    EXPECT_EQ(std::make_pair(10, 2), next(plan));
+    EXPECT_EQ(std::make_pair(12, 1), next(plan));
+    EXPECT_EQ(std::make_pair(10, 1), next(plan));
+
+    // A changed copy is published while the old plan is still in use
+    TPollPlan newPlan(plan);
+    EXPECT_TRUE(newPlan.RemoveProgram(10));
+    EXPECT_FALSE(newPlan.RemoveProgram(10));
+    EXPECT_EQ(2, newPlan.GetProgramCount());
+    EXPECT_EQ(3, plan.GetProgramCount());
+
+    // The cursor switches to the new plan, the program moved to the place of the polled one
+    // is polled from the beginning
+    EXPECT_EQ(std::make_pair(12, 1), next(newPlan));
+    EXPECT_EQ(std::make_pair(12, 1), next(newPlan));
+
+    // Class of already added program is replaced
+    newPlan.AddProgram(12, &cl1);
+    EXPECT_EQ(2, newPlan.GetProgramCount());
+    EXPECT_EQ(2, newPlan.GetRequestCount());
+
+    newPlan.RemoveProgram(12);
+    EXPECT_FALSE(newPlan.GetNextRequest(cursor, frame));
+    plan.Clear();
+    EXPECT_EQ(0, plan.GetProgramCount());
+}
+
+TEST_F(TSmartWebToMqttGatewayTest, ValueTimestamps)
+{
+    // Request and response of the same value have the same key
+    auto request = MakeGetParameterValueRequest(10, TParameterRequest{3, {SmartWeb::PT_PROGRAM, 1, 4}});
+    uint8_t response[] = {SmartWeb::PT_PROGRAM, 1, 4, 0x10, 0x20};
+    EXPECT_EQ(MakeValueRequestKey(10, request.data), MakeValueRequestKey(10, response));
+    uint8_t parameterResponse[] = {5, 1, 0x10};
+    EXPECT_NE(MakeValueRequestKey(10, parameterResponse), MakeValueRequestKey(11, parameterResponse));
+
+    TValueTimestamps timestamps;
+    auto key = MakeValueRequestKey(10, response);
+    EXPECT_FALSE(timestamps.IsRecent(key, 100, 1000));
+
+    timestamps.Update(key, 100);
+    EXPECT_TRUE(timestamps.IsRecent(key, 100, 1000));
+    EXPECT_TRUE(timestamps.IsRecent(key, 1099, 1000));
+    EXPECT_FALSE(timestamps.IsRecent(key, 1100, 1000));
+    EXPECT_FALSE(timestamps.IsRecent(MakeValueRequestKey(10, parameterResponse), 100, 1000));
+
+    // Time wraps around
+    timestamps.Update(key, UINT32_MAX - 10);
+    EXPECT_TRUE(timestamps.IsRecent(key, 10, 1000));
+
+    // Only the first caller takes a recent entry
+    EXPECT_FALSE(timestamps.TakeRecent(key, 1000, 1000));
+    EXPECT_TRUE(timestamps.TakeRecent(key, 10, 1000));
+    EXPECT_FALSE(timestamps.TakeRecent(key, 10, 1000));
+    EXPECT_FALSE(timestamps.IsRecent(key, 10, 1000));
+}
+
+TEST_F(TSmartWebToMqttGatewayTest, ParameterWriteQueue)
+{
+    TSmartWebClass cl;
+    cl.Type = 5;
+    TSmartWebParameter param1;
+    param1.Id = 1;
+    param1.ProgramClass = &cl;
+    TSmartWebParameter param2 = param1;
+    param2.Id = 2;
+
+    TParameterWriteQueue queue;
+    EXPECT_TRUE(queue.PopAll().empty());
+
+    // A dragged slider produces one write with the last value
+    EXPECT_TRUE(queue.Push({{10, ShareParameter(param1)}, "1", nullptr}));
+    EXPECT_TRUE(queue.Push({{10, ShareParameter(param2)}, "100", nullptr}));
+    EXPECT_TRUE(queue.Push({{11, ShareParameter(param1)}, "200", nullptr}));
+    for (int i = 2; i <= 50; ++i) {
+        EXPECT_FALSE(queue.Push({{10, ShareParameter(param1)}, std::to_string(i), nullptr}));
+    }
+    EXPECT_EQ(3, queue.Size());
+
+    auto writes = queue.PopAll();
+    ASSERT_EQ(3, writes.size());
+    EXPECT_EQ("50", writes[0].Value);
+    EXPECT_EQ(&param1, writes[0].Param.Parameter.get());
+    EXPECT_EQ("100", writes[1].Value);
+    EXPECT_EQ(11, writes[2].Param.ProgramId);
+    EXPECT_EQ(0, queue.Size());
+
+    EXPECT_TRUE(queue.Push({{10, ShareParameter(param1)}, "51", nullptr}));
+}
+
+TEST_F(TSmartWebToMqttGatewayTest, PriorityPolling)
+{
+    TSmartWebClass cl;
+    cl.RequestTemplate = {TParameterRequest{2, {1, 1}}, TParameterRequest{2, {1, 2}}};
+    auto now = std::chrono::steady_clock::now();
+
+    TPriorityPolling polling;
+    CAN::TFrame frame;
+    EXPECT_FALSE(polling.GetNextRequest(frame, now));
+
+    auto next = [&]() {
+        EXPECT_TRUE(polling.GetNextRequest(frame, now));
+        SmartWeb::TCanHeader header;
+        header.raw = frame.can_id;
+        return std::make_pair(int(header.rec.program_id), int(frame.data[1]));
+    };
+
+    // Refresh of already queued program doesn't add requests
+    polling.Refresh(10, &cl);
+    polling.Refresh(10, &cl);
+    EXPECT_EQ(std::make_pair(10, 1), next());
+    EXPECT_EQ(std::make_pair(10, 2), next());
+    EXPECT_FALSE(polling.GetNextRequest(frame, now));
+
+    // Refresh requests go before burst ones
+    polling.StartBurst(11, &cl, now + std::chrono::seconds(5));
+    polling.Refresh(12, &cl);
+    EXPECT_EQ(std::make_pair(12, 1), next());
+    EXPECT_EQ(std::make_pair(12, 2), next());
+    for (int i = 0; i < 3; ++i) {
+        EXPECT_EQ(std::make_pair(11, 1), next());
+        EXPECT_EQ(std::make_pair(11, 2), next());
+    }
+
+    now += std::chrono::seconds(5);
+    EXPECT_FALSE(polling.GetNextRequest(frame, now));
+    EXPECT_FALSE(polling.GetNextRequest(frame, now));
+}
+
+/**
+ * @brief Gateway with a fake CAN port and a driver on fake MQTT broker.
+ *        Published values are checked through the driver, the log of the broker isn't compared with a data file.
+ */
+class TSmartWebToMqttGatewayDriverTest: public Testing::TLoggedFixture
+{
+protected:
+    Testing::PFakeMqttBroker MqttBroker;
+    PDeviceDriver Driver;
+    std::shared_ptr<TFakeCanPort> Port;
+    std::unique_ptr<TSmartWebToMqttGateway> Gateway;
+    std::string StateFile;
+    std::string MetadataCacheFile;
+
+    void SetUp() override
+    {
+        StateFile = (std::filesystem::temp_directory_path() / "wb-mqtt-smartweb-driver-test-state.json").string();
+        MetadataCacheFile =
+            (std::filesystem::temp_directory_path() / "wb-mqtt-smartweb-driver-test-metadata.json").string();
+        RemoveTempFiles();
+        MqttBroker = Testing::NewFakeMqttBroker(*this);
+        auto client = MqttBroker->MakeClient("smartweb-test");
+        Driver = NewDriver(TDriverArgs{}.SetId("smartweb-test").SetBackend(NewDriverBackend(client)));
+        Driver->StartLoop();
+        Driver->WaitForReady();
+        Port = std::make_shared<TFakeCanPort>();
+    }
+
+    void TearDown() override
+    {
+        Gateway.reset();
+        Driver->StopLoop();
+        Driver->Close();
+        RemoveTempFiles();
+    }
+
+    void RemoveTempFiles()
+    {
+        for (const auto& file: {StateFile, MetadataCacheFile}) {
+            std::filesystem::remove(file);
+            std::filesystem::remove(file + ".tmp");
+        }
+    }
+
+    //! Adds int16 parameter ordered by id
+    static void AddParameter(TSmartWebClass& cl, uint32_t id, const std::string& name, bool readOnly)
+    {
+        TSmartWebParameter param;
+        param.Id = id;
+        param.Name = name;
+        param.Order = id;
+        param.ProgramClass = &cl;
+        param.ReadOnly = readOnly;
+        param.Type = "value";
+        param.Codec = GetSharedCodec<TIntCodec<int16_t, 1>>();
+        cl.Parameters.Add(param);
+    }
+
+    //! Class TEST with read-only parameter "Value" (id 1) and writable "Setpoint" (id 2)
+    static std::shared_ptr<TSmartWebClass> MakeClass(const std::string& name = "TEST")
+    {
+        auto cl = std::make_shared<TSmartWebClass>();
+        cl->Type = TEST_PROGRAM_TYPE;
+        cl->Name = name;
+        AddParameter(*cl, 1, "Value", true);
+        AddParameter(*cl, 2, "Setpoint", false);
+        return cl;
+    }
+
+    static TSmartWebToMqttConfig MakeConfig(std::shared_ptr<TSmartWebClass> cl = MakeClass())
+    {
+        TSmartWebToMqttConfig config;
+        config.Classes[cl->Type] = cl;
+        BuildRequestTemplates(config.Classes);
+        return config;
+    }
+
+    void StartGateway(const TSmartWebToMqttConfig& config,
+                      const std::string& stateFilePath = std::string(),
+                      const std::string& metadataCacheFilePath = std::string())
+    {
+        Gateway = std::make_unique<TSmartWebToMqttGateway>(config, Port, Driver, stateFilePath, metadataCacheFilePath);
+    }
+
+    PControl GetControl(uint8_t programId, const std::string& controlId, const std::string& className = "TEST")
+    {
+        auto tx = Driver->BeginTx();
+        auto device = tx->GetDevice("sw " + className + " " + std::to_string(programId));
+        return device ? device->GetControl(controlId) : PControl();
+    }
+
+    bool HasValue(uint8_t programId,
+                  const std::string& controlId,
+                  const std::string& value,
+                  const std::string& error = std::string())
+    {
+        auto control = GetControl(programId, controlId);
+        return control && control->GetRawValue() == value && control->GetError() == error;
+    }
+
+    //! Answers discovery request of the program and waits for its controls
+    void AddProgram(uint8_t programId)
+    {
+        Port->Receive(MakeProgramTypeResponse(programId));
+        ASSERT_TRUE(WaitFor([&]() { return GetControl(programId, "Value") != nullptr; }));
+    }
+
+    //! Result of a bulk request, it is set from CAN reader or scheduler thread
+    struct TBulkResult
+    {
+        std::mutex Mutex;
+        bool Done = false;
+        std::string Error;
+        std::map<std::string, TBulkParameterResult> Parameters;
+    };
+
+    static TBulkResultCallback MakeBulkCallback(std::shared_ptr<TBulkResult> result)
+    {
+        return [result](const std::string& error, const std::vector<TBulkParameterResult>& results) {
+            std::unique_lock<std::mutex> lk(result->Mutex);
+            result->Error = error;
+            for (const auto& parameter: results) {
+                result->Parameters[parameter.Name] = parameter;
+            }
+            result->Done = true;
+        };
+    }
+
+    static bool IsDone(std::shared_ptr<TBulkResult> result)
+    {
+        std::unique_lock<std::mutex> lk(result->Mutex);
+        return result->Done;
+    }
+
+    //! Publishes a value to /on topic of the control like MQTT clients do
+    void PublishOnValue(uint8_t programId, const std::string& controlId, const std::string& value)
+    {
+        MqttBroker->Publish(
+            "smartweb-test-client",
+            {"/devices/sw TEST " + std::to_string(programId) + "/controls/" + controlId + "/on", value, 1, false});
+    }
+};
+
+TEST_F(TSmartWebToMqttGatewayDriverTest, HandleFrame)
+{
+    StartGateway(MakeConfig());
+    AddProgram(10);
+
+    // Controls are marked as read errors until the program answers
+    EXPECT_EQ("r", GetControl(10, "Value")->GetError());
+    EXPECT_FALSE(
+        Port->WaitForFrames(1, IsRequest(10, SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE)).empty());
+
+    Port->Receive(MakeValueResponse(10, 1, 42));
+    EXPECT_TRUE(WaitFor([&]() { return HasValue(10, "Value", "42"); }));
+
+    // Responses of unknown programs are ignored
+    Port->Receive(MakeValueResponse(11, 1, 43));
+    Port->Receive(MakeValueResponse(10, 1, -5));
+    EXPECT_TRUE(WaitFor([&]() { return HasValue(10, "Value", "-5"); }));
+    EXPECT_EQ(nullptr, GetControl(11, "Value"));
+    EXPECT_EQ(1, Gateway->GetStats().KnownPrograms);
+}
+
+TEST_F(TSmartWebToMqttGatewayDriverTest, CreateControlsOnDiscovery)
+{
+    auto cl = MakeClass();
+    AddParameter(*cl, 3, "Extra", false);
+    StartGateway(MakeConfig(cl));
+
+    // All controls are created in one transaction with the device, so they are seen together
+    Port->Receive(MakeProgramTypeResponse(10));
+    PDevice device;
+    ASSERT_TRUE(WaitFor([&]() {
+        auto tx = Driver->BeginTx();
+        device = tx->GetDevice("sw TEST 10");
+        return device != nullptr;
+    }));
+    std::vector<PControl> controls;
+    for (const auto& id: {"Value", "Setpoint", "Extra"}) {
+        auto control = GetControl(10, id);
+        ASSERT_NE(nullptr, control) << id;
+        EXPECT_EQ("r", control->GetError()) << id;
+        controls.push_back(control);
+    }
+    auto controlsCount = device->GetControlsList().size();
+
+    // Values only update existing controls
+    Port->Receive(MakeValueResponse(10, 1, 42));
+    Port->Receive(MakeValueResponse(10, 3, 7));
+    EXPECT_TRUE(WaitFor([&]() { return HasValue(10, "Value", "42") && HasValue(10, "Extra", "7"); }));
+    EXPECT_EQ(controls[0], GetControl(10, "Value"));
+    EXPECT_EQ(controls[2], GetControl(10, "Extra"));
+    EXPECT_EQ(controlsCount, device->GetControlsList().size());
+}
+
+TEST_F(TSmartWebToMqttGatewayDriverTest, PassiveListen)
+{
+    auto config = MakeConfig();
+    config.PollInterval = std::chrono::milliseconds(50);
+    config.PassiveListen = true;
+    StartGateway(config);
+    AddProgram(10);
+
+    // Responses to requests of the gateway don't make next requests skipped
+    auto isValueRequest = IsRequest(10, SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE);
+    for (size_t i = 1; i <= 6; ++i) {
+        auto requests = Port->WaitForFrames(i, isValueRequest);
+        ASSERT_EQ(i, requests.size());
+        Port->Receive(MakeValueResponse(10, requests.back().data[1], 1));
+    }
+    EXPECT_EQ(0, Gateway->GetStats().PassiveSkippedRequests);
+    EXPECT_EQ(0, Gateway->GetStats().ForeignValueResponses);
+
+    // A response to a request of another master is published and the value isn't polled during the poll cycle.
+    // It is received right after the request of the other value, so the next request of the value is skipped
+    auto requests = Port->WaitForFrames(7, isValueRequest);
+    ASSERT_EQ(7, requests.size());
+    ASSERT_EQ(1, requests.back().data[1]);
+    Port->Receive(MakeValueResponse(10, 2, 7));
+    EXPECT_TRUE(WaitFor([&]() { return HasValue(10, "Setpoint", "7"); }));
+    EXPECT_EQ(1, Gateway->GetStats().ForeignValueResponses);
+    EXPECT_TRUE(WaitFor([&]() { return Gateway->GetStats().PassiveSkippedRequests > 0; }));
+}
+
+TEST_F(TSmartWebToMqttGatewayDriverTest, OfflineProgram)
+{
+    auto config = MakeConfig();
+    config.PollInterval = std::chrono::milliseconds(50);
+    config.OfflineMisses = 2;
+    config.OfflineProbeInterval = std::chrono::milliseconds(300);
+    StartGateway(config);
+    AddProgram(10);
+
+    // Requests of a parameter the program has never answered are not misses
+    auto isValueRequest = IsRequest(10, SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE);
+    size_t valueRequests = 0;
+    for (size_t i = 1; valueRequests < 12; ++i) {
+        auto requests = Port->WaitForFrames(i, isValueRequest);
+        ASSERT_EQ(i, requests.size());
+        if (requests.back().data[1] == 1) {
+            Port->Receive(MakeValueResponse(10, 1, 1));
+            ++valueRequests;
+        }
+    }
+    EXPECT_EQ(0, Gateway->GetStats().OfflinePrograms);
+    EXPECT_TRUE(WaitFor([&]() { return HasValue(10, "Value", "1"); }));
+    EXPECT_EQ("r", GetControl(10, "Setpoint")->GetError());
+
+    // Answered parameters are polled until the program misses them, then its controls are marked with read errors
+    auto isSetpointRequest = [&](const CAN::TFrame& frame) { return isValueRequest(frame) && frame.data[1] == 2; };
+    auto setpointRequests = Port->WaitForFrames(0, isSetpointRequest).size();
+    ASSERT_EQ(setpointRequests + 1, Port->WaitForFrames(setpointRequests + 1, isSetpointRequest).size());
+    Port->Receive(MakeValueResponse(10, 2, 2));
+    EXPECT_TRUE(WaitFor([&]() { return HasValue(10, "Setpoint", "2"); }));
+    EXPECT_TRUE(WaitFor([&]() { return Gateway->GetStats().OfflinePrograms == 1; }));
+    EXPECT_TRUE(HasValue(10, "Value", "1", "r"));
+    EXPECT_TRUE(HasValue(10, "Setpoint", "2", "r"));
+
+    // Offline program gets only probe requests of the first parameter, any response brings it back online
+    auto offlineRequests = Port->WaitForFrames(0, isValueRequest).size();
+    auto requests = Port->WaitForFrames(offlineRequests + 2, isValueRequest);
+    ASSERT_EQ(offlineRequests + 2, requests.size());
+    for (size_t i = offlineRequests; i < requests.size(); ++i) {
+        EXPECT_EQ(1, requests[i].data[1]);
+    }
+    Port->Receive(MakeValueResponse(10, 1, 3));
+    EXPECT_TRUE(WaitFor([&]() { return Gateway->GetStats().OfflinePrograms == 0; }));
+    EXPECT_TRUE(WaitFor([&]() { return HasValue(10, "Value", "3"); }));
+}
+
+TEST_F(TSmartWebToMqttGatewayDriverTest, WriteReadBack)
+{
+    auto config = MakeConfig();
+    // Poll requests can't be told from read-back requests
+    config.PollInterval = std::chrono::minutes(10);
+    StartGateway(config);
+    AddProgram(10);
+    auto isSetRequest = IsRequest(10, SmartWeb::RemoteControl::Function::SET_PARAMETER_VALUE);
+    auto isReadRequest = IsRequest(10, SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE);
+    auto isReadBack = [&](const CAN::TFrame& frame) { return isReadRequest(frame) && frame.data[1] == 2; };
+
+    // Written value is published at once and confirmed by read-back
+    PublishOnValue(10, "Setpoint", "5");
+    ASSERT_EQ(1, Port->WaitForFrames(1, isSetRequest).size());
+    ASSERT_EQ(1, Port->WaitForFrames(1, isReadBack).size());
+    EXPECT_TRUE(WaitFor([&]() { return GetControl(10, "Setpoint")->GetRawValue() == "5"; }));
+    Port->Receive(MakeValueResponse(10, 2, 5));
+    EXPECT_TRUE(WaitFor([&]() { return HasValue(10, "Setpoint", "5"); }));
+
+    // Actual value replaces not applied one
+    PublishOnValue(10, "Setpoint", "6");
+    ASSERT_EQ(2, Port->WaitForFrames(2, isReadBack).size());
+    Port->Receive(MakeValueResponse(10, 2, 4));
+    EXPECT_TRUE(WaitFor([&]() { return HasValue(10, "Setpoint", "4"); }));
+
+    // Unanswered read-back is resent, then the last read value is published with write error
+    PublishOnValue(10, "Setpoint", "7");
+    EXPECT_TRUE(WaitFor([&]() { return GetControl(10, "Setpoint")->GetRawValue() == "7"; }));
+    EXPECT_TRUE(WaitFor([&]() { return HasValue(10, "Setpoint", "4", "w"); }));
+    EXPECT_EQ(3 + READ_BACK_RETRIES, Port->WaitForFrames(0, isReadBack).size());
+    EXPECT_EQ(3, Port->WaitForFrames(0, isSetRequest).size());
+}
+
+TEST_F(TSmartWebToMqttGatewayDriverTest, UpdateConfig)
+{
+    StartGateway(MakeConfig());
+    AddProgram(10);
+    Port->Receive(MakeValueResponse(10, 1, 42));
+    Port->Receive(MakeValueResponse(10, 2, 5));
+    EXPECT_TRUE(WaitFor([&]() { return HasValue(10, "Value", "42") && HasValue(10, "Setpoint", "5"); }));
+    auto valueControl = GetControl(10, "Value");
+
+    // Controls of changed and added parameters are created, unchanged ones are kept with their values
+    auto cl = std::make_shared<TSmartWebClass>();
+    cl->Type = TEST_PROGRAM_TYPE;
+    cl->Name = "TEST";
+    AddParameter(*cl, 1, "Value", true);
+    AddParameter(*cl, 2, "Setpoint", true);
+    AddParameter(*cl, 3, "Extra", true);
+    Gateway->UpdateConfig(MakeConfig(cl));
+    EXPECT_EQ(valueControl, GetControl(10, "Value"));
+    EXPECT_TRUE(HasValue(10, "Value", "42"));
+    EXPECT_TRUE(HasValue(10, "Setpoint", "0", "r"));
+    EXPECT_TRUE(HasValue(10, "Extra", "0", "r"));
+
+    // Controls of removed parameters are deleted
+    cl = std::make_shared<TSmartWebClass>();
+    cl->Type = TEST_PROGRAM_TYPE;
+    cl->Name = "TEST";
+    AddParameter(*cl, 1, "Value", true);
+    Gateway->UpdateConfig(MakeConfig(cl));
+    EXPECT_EQ(valueControl, GetControl(10, "Value"));
+    EXPECT_EQ(nullptr, GetControl(10, "Setpoint"));
+    EXPECT_EQ(nullptr, GetControl(10, "Extra"));
+    Port->Receive(MakeValueResponse(10, 1, 43));
+    EXPECT_TRUE(WaitFor([&]() { return HasValue(10, "Value", "43"); }));
+
+    // Device of renamed class is replaced
+    Gateway->UpdateConfig(MakeConfig(MakeClass("RENAMED")));
+    EXPECT_EQ(nullptr, GetControl(10, "Value"));
+    EXPECT_NE(nullptr, GetControl(10, "Setpoint", "RENAMED"));
+    Port->Receive(MakeValueResponse(10, 1, 44));
+    EXPECT_TRUE(WaitFor([&]() {
+        auto control = GetControl(10, "Value", "RENAMED");
+        return control && control->GetRawValue() == "44";
+    }));
+}
+
+TEST_F(TSmartWebToMqttGatewayDriverTest, Refresh)
+{
+    auto config = MakeConfig();
+    config.PollInterval = std::chrono::milliseconds(100);
+    StartGateway(config);
+    for (uint8_t id = 10; id < 20; ++id) {
+        AddProgram(id);
+    }
+
+    // Right after a regular request to the program the next one is a cycle of 10 programs away
+    auto isValueRequest = [](const CAN::TFrame& frame) {
+        SmartWeb::TCanHeader header;
+        header.raw = frame.can_id;
+        return header.rec.message_type == SmartWeb::MT_MSG_REQUEST &&
+               header.rec.function_id == SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE;
+    };
+    auto isProgramRequest = IsRequest(15, SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE);
+    Port->ClearSentFrames();
+    ASSERT_FALSE(Port->WaitForFrames(1, isProgramRequest).empty());
+    Port->ClearSentFrames();
+    PublishOnValue(15, "refresh", "1");
+
+    // Refresh requests go before the regular ones
+    ASSERT_FALSE(Port->WaitForFrames(1, isProgramRequest).empty());
+    auto requests = Port->GetSentFrames(isValueRequest);
+    auto refreshRequest = std::find_if(requests.begin(), requests.end(), isProgramRequest);
+    EXPECT_LE(std::distance(requests.begin(), refreshRequest), 2);
+}
+
+TEST_F(TSmartWebToMqttGatewayDriverTest, BurstPolling)
+{
+    auto config = MakeConfig();
+    config.PollInterval = std::chrono::milliseconds(20);
+    StartGateway(config);
+    AddProgram(10);
+    AddProgram(11);
+    auto isOtherProgramRequest = IsRequest(11, SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE);
+    ASSERT_FALSE(Port->WaitForFrames(1, isOtherProgramRequest).empty());
+
+    // Other programs aren't polled during the burst, the control shows its duration
+    PublishOnValue(10, "burst_polling", "1");
+    ASSERT_TRUE(WaitFor([&]() { return HasValue(10, "burst_polling", "1"); }));
+    Port->ClearSentFrames();
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    EXPECT_LE(Port->GetSentFrames(isOtherProgramRequest).size(), 1);
+    EXPECT_GE(Port->GetSentFrames(IsRequest(10, SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE)).size(), 10);
+
+    // The control is reset when the burst ends and regular polling goes on
+    EXPECT_TRUE(WaitFor([&]() { return HasValue(10, "burst_polling", "0"); }, std::chrono::seconds(2)));
+    EXPECT_FALSE(Port->WaitForFrames(2, isOtherProgramRequest).empty());
+}
+
+TEST_F(TSmartWebToMqttGatewayDriverTest, BulkRead)
+{
+    // Regular polling doesn't send value requests during the test
+    auto config = MakeConfig();
+    config.PollInterval = std::chrono::hours(1);
+    StartGateway(config);
+    AddProgram(10);
+    Port->ClearSentFrames();
+
+    // Requests are sent one after another without waiting for responses
+    auto result = std::make_shared<TBulkResult>();
+    Gateway->BulkRead(10, {"Value", "Setpoint", "Unknown"}, MakeBulkCallback(result));
+    auto isValueRequest = IsRequest(10, SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE);
+    EXPECT_EQ(2, Port->WaitForFrames(2, isValueRequest).size());
+    Port->Receive(MakeValueResponse(10, 1, 42));
+
+    // Unanswered request is resent BULK_REQUEST_RETRIES times before timeout
+    ASSERT_TRUE(WaitFor([&]() { return IsDone(result); }));
+    EXPECT_EQ(2 + BULK_REQUEST_RETRIES, Port->GetSentFrames(isValueRequest).size());
+    std::unique_lock<std::mutex> lk(result->Mutex);
+    EXPECT_TRUE(result->Error.empty());
+    ASSERT_EQ(3, result->Parameters.size());
+    EXPECT_EQ("42", result->Parameters["Value"].Value);
+    EXPECT_TRUE(result->Parameters["Value"].Error.empty());
+    EXPECT_EQ("timeout", result->Parameters["Setpoint"].Error);
+    EXPECT_EQ("unknown parameter", result->Parameters["Unknown"].Error);
+}
+
+TEST_F(TSmartWebToMqttGatewayDriverTest, BulkWrite)
+{
+    auto config = MakeConfig();
+    config.PollInterval = std::chrono::hours(1);
+    StartGateway(config);
+    AddProgram(10);
+    Port->ClearSentFrames();
+
+    // Written values are read back, the program keeps another value
+    auto result = std::make_shared<TBulkResult>();
+    Gateway->BulkWrite(10, {{"Setpoint", "5"}, {"Value", "1"}}, MakeBulkCallback(result));
+    EXPECT_FALSE(
+        Port->WaitForFrames(1, IsRequest(10, SmartWeb::RemoteControl::Function::SET_PARAMETER_VALUE)).empty());
+    EXPECT_FALSE(
+        Port->WaitForFrames(1, IsRequest(10, SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE)).empty());
+    Port->Receive(MakeValueResponse(10, 2, 4));
+
+    ASSERT_TRUE(WaitFor([&]() { return IsDone(result); }));
+    std::unique_lock<std::mutex> lk(result->Mutex);
+    EXPECT_TRUE(result->Error.empty());
+    EXPECT_EQ("4", result->Parameters["Setpoint"].Value);
+    EXPECT_EQ("value is not applied", result->Parameters["Setpoint"].Error);
+    EXPECT_EQ("read-only parameter", result->Parameters["Value"].Error);
+}
+
+TEST_F(TSmartWebToMqttGatewayDriverTest, RestoreState)
+{
+    SaveGatewayState(StateFile,
+                     {TProgramState{10,
+                                    TEST_PROGRAM_TYPE,
+                                    {{TEST_PROGRAM_TYPE, TParameterKind::PARAMETER, 1, "42"},
+                                     {TEST_PROGRAM_TYPE, TParameterKind::PARAMETER, 2, "5"}},
+                                    {}},
+                      TProgramState{11, uint8_t(TEST_PROGRAM_TYPE + 1), {}, {}}});
+    StartGateway(MakeConfig(), StateFile);
+
+    // Devices are created at once, values are marked as read errors until the program answers
+    EXPECT_TRUE(HasValue(10, "Value", "42", "r"));
+    EXPECT_TRUE(HasValue(10, "Setpoint", "5", "r"));
+    // Programs of unknown types are skipped
+    EXPECT_EQ(nullptr, GetControl(11, "Value"));
+
+    // Restored programs are polled
+    ASSERT_FALSE(
+        Port->WaitForFrames(1, IsRequest(10, SmartWeb::RemoteControl::Function::GET_PARAMETER_VALUE)).empty());
+    Port->Receive(MakeValueResponse(10, 1, 43));
+    EXPECT_TRUE(WaitFor([&]() { return HasValue(10, "Value", "43"); }));
+
+    // New values are saved on stop
+    Gateway.reset();
+    std::vector<TProgramState> programs;
+    ASSERT_TRUE(LoadGatewayState(StateFile, programs));
+    ASSERT_EQ(1, programs.size());
+    EXPECT_EQ(10, programs[0].ProgramId);
+    std::map<uint8_t, std::string> values;
+    for (const auto& value: programs[0].Values) {
+        values[value.ParameterId] = value.Value;
+    }
+    EXPECT_EQ("43", values[1]);
+    EXPECT_EQ("5", values[2]);
+}
+
+TEST_F(TSmartWebToMqttGatewayDriverTest, RestoreFirmwareVersion)
+{
+    SaveGatewayState(StateFile, {TProgramState{10, TEST_PROGRAM_TYPE, {}, "1.2"}});
+    TParameterMetadata valueMetadata{TEST_PROGRAM_TYPE, 1, "Value", "0", "100", "0", "W"};
+    SaveMetadataCache(MetadataCacheFile, {TProgramMetadata{TEST_PROGRAM_TYPE, "1.2", {valueMetadata}}});
+
+    auto config = MakeConfig();
+    config.MetadataDiscovery = true;
+    StartGateway(config, StateFile, MetadataCacheFile);
+
+    // Restored controls get cached metadata of the saved version without asking the program again
+    auto valueControl = GetControl(10, "Value");
+    ASSERT_NE(nullptr, valueControl);
+    EXPECT_EQ(100, valueControl->GetArgs().Max);
+    EXPECT_EQ("W", valueControl->GetArgs().Units);
+    auto isVersionRequest = IsProgramRequest(SmartWeb::Program::Function::GET_SMARTNET_PROTOCOL_VERSION);
+    EXPECT_TRUE(Port->WaitForFrames(1, isVersionRequest, std::chrono::milliseconds(500)).empty());
+    EXPECT_EQ(valueControl, GetControl(10, "Value"));
+
+    // The version is saved back with the state
+    Gateway.reset();
+    std::vector<TProgramState> programs;
+    ASSERT_TRUE(LoadGatewayState(StateFile, programs));
+    ASSERT_EQ(1, programs.size());
+    EXPECT_EQ("1.2", programs[0].FirmwareVersion);
+}
+
+TEST_F(TSmartWebToMqttGatewayDriverTest, Discovery)
+{
+    // Program 10 is known from the state, so it isn't asked
+    SaveGatewayState(StateFile, {TProgramState{10, TEST_PROGRAM_TYPE, {}, {}}});
+    StartGateway(MakeConfig(), StateFile);
+
+    // A program answering the scan gets its device
+    auto isDiscoveryRequest = IsProgramRequest(SmartWeb::Program::Function::GET_PROGRAM_TYPE);
+    ASSERT_FALSE(Port->WaitForFrames(1, IsRequest(20, SmartWeb::Program::Function::GET_PROGRAM_TYPE)).empty());
+    AddProgram(20);
+
+    // Every unknown id is asked once and the scan stops after the last id
+    ASSERT_FALSE(Port->WaitForFrames(1, IsRequest(255, SmartWeb::Program::Function::GET_PROGRAM_TYPE)).empty());
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::vector<bool> asked(256, false);
+    auto requests = Port->GetSentFrames(isDiscoveryRequest);
+    for (const auto& frame: requests) {
+        SmartWeb::TCanHeader header;
+        header.raw = frame.can_id;
+        EXPECT_FALSE(asked[header.rec.program_id]) << "id " << (int)header.rec.program_id << " is asked twice";
+        asked[header.rec.program_id] = true;
+    }
+    EXPECT_EQ(255, requests.size());
+    EXPECT_FALSE(asked[10]);
+    EXPECT_NE(nullptr, GetControl(20, "Setpoint"));
+}
+
+/**
+ * @brief Feeds GET_PARAMETER_VALUE responses of many programs through the gateway.
+ *        Disabled, so it isn't run under valgrind by make test.
+ *        Run it with --gtest_also_run_disabled_tests --gtest_filter='TSmartWebToMqttGatewayBenchmark.*'
+ */
+class TSmartWebToMqttGatewayBenchmark: public TSmartWebToMqttGatewayDriverTest
+{
+protected:
+    //! Returns time from the first value response to publishing of the last values of all programs
+    std::chrono::milliseconds HandleValues(uint32_t workersCount, int16_t firstValue)
+    {
+        auto config = MakeConfig();
+        config.FrameWorkers = workersCount;
+        Gateway.reset();
+        Port = std::make_shared<TFakeCanPort>();
+        StartGateway(config);
+
+        for (size_t programId = 1; programId <= BENCHMARK_PROGRAMS_COUNT; ++programId) {
+            Port->Receive(MakeProgramTypeResponse(programId));
+        }
+        EXPECT_TRUE(WaitFor([&]() { return Gateway->GetStats().KnownPrograms == BENCHMARK_PROGRAMS_COUNT; }));
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < BENCHMARK_VALUES_PER_PROGRAM; ++i) {
+            // Worker queues are kept from overflow, a dropped frame would lose a value
+            EXPECT_TRUE(WaitFor([&]() { return Gateway->GetStats().Reader.QueueLength <= BENCHMARK_PROGRAMS_COUNT; }));
+            for (size_t programId = 1; programId <= BENCHMARK_PROGRAMS_COUNT; ++programId) {
+                Port->Receive(MakeValueResponse(programId, 1, firstValue + i));
+            }
+        }
+        auto lastValue = std::to_string(firstValue + BENCHMARK_VALUES_PER_PROGRAM - 1);
+        EXPECT_TRUE(WaitFor(
+            [&]() {
+                for (size_t programId = 1; programId <= BENCHMARK_PROGRAMS_COUNT; ++programId) {
+                    if (!HasValue(programId, "Value", lastValue)) {
+                        return false;
+                    }
+                }
+                return true;
+            },
+            std::chrono::seconds(60)));
+        auto end = std::chrono::steady_clock::now();
+        EXPECT_EQ(0, Gateway->GetStats().Reader.DroppedFrames);
+        return std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+    }
+};
+
+TEST_F(TSmartWebToMqttGatewayBenchmark, DISABLED_HandleFrame)
+{
+    // Devices are removed with the gateway, values of runs differ anyway
+    auto oneWorkerTime = HandleValues(1, 0);
+    auto fourWorkersTime = HandleValues(4, 1000);
+    RecordProperty("frames", int(BENCHMARK_PROGRAMS_COUNT * BENCHMARK_VALUES_PER_PROGRAM));
+    RecordProperty("one_worker_ms", int(oneWorkerTime.count()));
+    RecordProperty("four_workers_ms", int(fourWorkersTime.count()));
 }
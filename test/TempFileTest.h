@@ -0,0 +1,35 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <string>
+
+/**
+ * @brief Fixture of tests of state and cache files. The file is named after the test suite
+ *        and is removed before and after every test.
+ */
+class TTempFileTest: public testing::Test
+{
+protected:
+    std::string TempFile;
+
+    void SetUp() override
+    {
+        std::string suite(testing::UnitTest::GetInstance()->current_test_info()->test_suite_name());
+        TempFile = (std::filesystem::temp_directory_path() / ("wb-mqtt-smartweb-" + suite + ".tmp")).string();
+        std::filesystem::remove(TempFile);
+    }
+
+    void TearDown() override
+    {
+        std::filesystem::remove(TempFile);
+        std::filesystem::remove(TempFile + ".tmp");
+    }
+
+    void WriteTempFile(const std::string& content)
+    {
+        std::ofstream file(TempFile, std::ios::trunc);
+        file << content;
+    }
+};
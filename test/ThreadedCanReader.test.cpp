@@ -0,0 +1,98 @@
+#include "FakeCanPort.h"
+#include "ThreadedCanReader.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <gtest/gtest.h>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace
+{
+    const size_t PROGRAMS_COUNT = 16;
+    const size_t FRAMES_PER_PROGRAM = 20;
+    const auto WAIT_TIMEOUT = std::chrono::seconds(30);
+
+    //! Program id is in the first byte of data, sequence number of the program frame is in the second one
+    CAN::TFrame MakeFrame(uint8_t programId, uint8_t sequence)
+    {
+        CAN::TFrame frame{0};
+        frame.can_id = programId;
+        frame.can_dlc = 2;
+        frame.data[0] = programId;
+        frame.data[1] = sequence;
+        return frame;
+    }
+
+    class THandledFrames
+    {
+        std::mutex Mutex;
+        std::condition_variable Cv;
+        std::map<uint8_t, std::vector<uint8_t>> Sequences;
+        size_t Count = 0;
+
+    public:
+        void Add(const CAN::TFrame& frame)
+        {
+            std::unique_lock<std::mutex> lk(Mutex);
+            Sequences[frame.data[0]].push_back(frame.data[1]);
+            ++Count;
+            Cv.notify_all();
+        }
+
+        bool Wait(size_t count)
+        {
+            std::unique_lock<std::mutex> lk(Mutex);
+            return Cv.wait_for(lk, WAIT_TIMEOUT, [&]() { return Count >= count; });
+        }
+
+        bool IsOrdered()
+        {
+            std::unique_lock<std::mutex> lk(Mutex);
+            return std::all_of(Sequences.begin(), Sequences.end(), [](const auto& program) {
+                return std::is_sorted(program.second.begin(), program.second.end());
+            });
+        }
+    };
+}
+
+TEST(TThreadedCanReaderTest, OneWorker)
+{
+    auto port = std::make_shared<TFakeCanPort>();
+    THandledFrames handledFrames;
+    TThreadedCanReader reader(
+        "test reader",
+        port,
+        10,
+        [](const CAN::TFrame& frame) { return frame.data[0] != 0; },
+        [&](const CAN::TFrame& frame) { handledFrames.Add(frame); });
+    port->Receive(MakeFrame(0, 0));
+    port->Receive(MakeFrame(1, 0));
+    port->Receive(MakeFrame(1, 1));
+    ASSERT_TRUE(handledFrames.Wait(2));
+    EXPECT_TRUE(handledFrames.IsOrdered());
+}
+
+TEST(TThreadedCanReaderTest, ShardedWorkers)
+{
+    auto port = std::make_shared<TFakeCanPort>();
+    THandledFrames handledFrames;
+    auto framesCount = PROGRAMS_COUNT * FRAMES_PER_PROGRAM;
+    TThreadedCanReader reader(
+        "test reader",
+        port,
+        framesCount,
+        [](const CAN::TFrame& frame) { return true; },
+        [&](const CAN::TFrame& frame) { handledFrames.Add(frame); },
+        4,
+        [](const CAN::TFrame& frame) { return frame.data[0]; });
+    for (size_t i = 0; i < FRAMES_PER_PROGRAM; ++i) {
+        for (size_t programId = 0; programId < PROGRAMS_COUNT; ++programId) {
+            port->Receive(MakeFrame(programId, i));
+        }
+    }
+    ASSERT_TRUE(handledFrames.Wait(framesCount));
+    EXPECT_TRUE(handledFrames.IsOrdered());
+    EXPECT_EQ(0, reader.GetStats().DroppedFrames);
+}
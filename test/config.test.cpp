@@ -1,6 +1,10 @@
+#include "class_cache.h"
 #include "config_parser.h"
 
+#include <filesystem>
+#include <fstream>
 #include <gtest/gtest.h>
+#include <iterator>
 #include <vector>
 
 #include <wblib/json_utils.h>
@@ -95,7 +99,8 @@ TEST_F(TLoadConfigTest, SmartWebToMqttConfigInputs)
     const auto smartWebClass = config->Classes.begin()->second;
 
     EXPECT_EQ(6, smartWebClass->Inputs.size());
-    auto input = smartWebClass->Inputs.at(2);
+    auto input = smartWebClass->Inputs.Find(2);
+    ASSERT_NE(nullptr, input);
 
     TestClassParameterSample sample = {.id = 2,
                                        .name = "floorT",
@@ -114,7 +119,8 @@ TEST_F(TLoadConfigTest, SmartWebToMqttConfigOutputs)
     const auto smartWebClass = config->Classes.begin()->second;
 
     EXPECT_EQ(7, smartWebClass->Outputs.size());
-    auto output = smartWebClass->Outputs.at(2);
+    auto output = smartWebClass->Outputs.Find(2);
+    ASSERT_NE(nullptr, output);
 
     TestClassParameterSample sample = {.id = 2,
                                        .name = "addValve",
@@ -132,8 +138,14 @@ TEST_F(TLoadConfigTest, SmartWebToMqttConfigParameters)
     auto config = GetTestConfig();
     const auto smartWebClass = config->Classes.begin()->second;
 
-    EXPECT_EQ(34, smartWebClass->Parameters.size());
-    auto parameter = smartWebClass->Parameters.at(2);
+    // Including schedule and schedule2 tables
+    EXPECT_EQ(36, smartWebClass->Parameters.size());
+    auto schedule = smartWebClass->Parameters.Find(22);
+    ASSERT_NE(nullptr, schedule);
+    EXPECT_EQ("TScheduleCodec", schedule->Codec->GetName());
+    EXPECT_TRUE(schedule->ReadOnly);
+    auto parameter = smartWebClass->Parameters.Find(2);
+    ASSERT_NE(nullptr, parameter);
 
     TestClassParameterSample sample = {.id = 2,
                                        .name = "roomReducedTemperature",
@@ -159,6 +171,11 @@ TEST_F(TLoadConfigTest, LoadConfig)
     EXPECT_TRUE(config.Debug);
     EXPECT_EQ("can1", config.InterfaceName);
     EXPECT_EQ(123, config.SmartWebToMqtt.PollInterval.count());
+    EXPECT_TRUE(config.SmartWebToMqtt.PassiveListen);
+    EXPECT_TRUE(config.SmartWebToMqtt.MetadataDiscovery);
+    EXPECT_EQ(4, config.SmartWebToMqtt.FrameWorkers);
+    EXPECT_EQ(5, config.SmartWebToMqtt.OfflineMisses);
+    EXPECT_EQ(60000, config.SmartWebToMqtt.OfflineProbeInterval.count());
 
     EXPECT_EQ(3, config.SmartWebToMqtt.Classes.size());
     auto outdoorSensorDeviceClass = config.SmartWebToMqtt.Classes[2];
@@ -172,14 +189,130 @@ TEST_F(TLoadConfigTest, LoadConfig)
     auto roomDeviceClass = config.SmartWebToMqtt.Classes[5];
     ASSERT_NE(nullptr, roomDeviceClass);
     EXPECT_EQ("ROOM_DEVICE", roomDeviceClass->Name);
+    EXPECT_EQ(TDeviceClassSource::USER, roomDeviceClass->Source);
     EXPECT_EQ(6, roomDeviceClass->Inputs.size());
     EXPECT_EQ(7, roomDeviceClass->Outputs.size());
-    EXPECT_EQ(34, roomDeviceClass->Parameters.size());
+    EXPECT_EQ(36, roomDeviceClass->Parameters.size());
 
     auto temperatureSourceClass = config.SmartWebToMqtt.Classes[6];
     ASSERT_NE(nullptr, temperatureSourceClass);
     EXPECT_EQ("TEMPERATURE_SOURCE", temperatureSourceClass->Name);
+    EXPECT_EQ(TDeviceClassSource::BUILTIN, temperatureSourceClass->Source);
     EXPECT_EQ(0, temperatureSourceClass->Inputs.size());
     EXPECT_EQ(0, temperatureSourceClass->Outputs.size());
     EXPECT_EQ(6, temperatureSourceClass->Parameters.size());
-}
\ No newline at end of file
+}
+
+TEST_F(TLoadConfigTest, ClassCache)
+{
+    auto cacheFile = std::filesystem::temp_directory_path() / "wb-mqtt-smartweb-test-classes.cache";
+    std::filesystem::remove(cacheFile);
+
+    auto load = [&](TConfig& config) {
+        LoadConfig(config,
+                   TestRootDir + "/test_config.json",
+                   TestRootDir + "/classes",
+                   TestRootDir + "/builtin_classes",
+                   SchemaFile,
+                   ClassSchemaFile,
+                   cacheFile.string());
+    };
+
+    TConfig config;
+    load(config);
+    ASSERT_TRUE(std::filesystem::exists(cacheFile));
+
+    TConfig cachedConfig;
+    load(cachedConfig);
+    ASSERT_EQ(config.SmartWebToMqtt.Classes.size(), cachedConfig.SmartWebToMqtt.Classes.size());
+    for (const auto& cl: config.SmartWebToMqtt.Classes) {
+        auto cachedClass = cachedConfig.SmartWebToMqtt.Classes[cl.first];
+        ASSERT_NE(nullptr, cachedClass);
+        EXPECT_EQ(cl.second->Name, cachedClass->Name);
+        EXPECT_EQ(cl.second->Source, cachedClass->Source);
+        EXPECT_EQ(cl.second->ParentClasses, cachedClass->ParentClasses);
+        EXPECT_EQ(cl.second->Inputs.size(), cachedClass->Inputs.size());
+        EXPECT_EQ(cl.second->Outputs.size(), cachedClass->Outputs.size());
+        ASSERT_EQ(cl.second->Parameters.size(), cachedClass->Parameters.size());
+        for (const auto& param: cl.second->Parameters) {
+            auto cachedParam = cachedClass->Parameters.Find(param.Id);
+            ASSERT_NE(nullptr, cachedParam);
+            ParameterEqHelper({param.Id,
+                               param.Name,
+                               param.Type,
+                               param.Order,
+                               cl.second->Name,
+                               param.Codec->GetName(),
+                               param.ReadOnly},
+                              *cachedParam);
+        }
+    }
+
+    TSmartWebToMqttConfig::TClasses classes;
+    EXPECT_FALSE(LoadClassCache(cacheFile.string(), 0, classes));
+
+    // Broken cache is rebuilt
+    {
+        std::ofstream file(cacheFile, std::ios::trunc);
+        file << "garbage";
+    }
+    TConfig rebuiltConfig;
+    load(rebuiltConfig);
+    EXPECT_EQ(config.SmartWebToMqtt.Classes.size(), rebuiltConfig.SmartWebToMqtt.Classes.size());
+    EXPECT_GT(std::filesystem::file_size(cacheFile), 7);
+
+    std::filesystem::remove(cacheFile);
+}
+
+TEST_F(TLoadConfigTest, ClassCacheInvalidation)
+{
+    auto testDir = std::filesystem::temp_directory_path() / "wb-mqtt-smartweb-test-cache-invalidation";
+    std::filesystem::remove_all(testDir);
+    std::filesystem::copy(TestRootDir, testDir, std::filesystem::copy_options::recursive);
+    auto cacheFile = testDir / "classes.cache";
+
+    auto load = [&]() {
+        TConfig config;
+        LoadConfig(config,
+                   TestRootDir + "/test_config.json",
+                   (testDir / "classes").string(),
+                   (testDir / "builtin_classes").string(),
+                   SchemaFile,
+                   ClassSchemaFile,
+                   cacheFile.string());
+        auto cl = config.SmartWebToMqtt.Classes[2];
+        auto param = cl ? cl->Parameters.Find(1) : nullptr;
+        return param ? param->Name : std::string();
+    };
+
+    // The cache is rewritten only if classes are parsed, so its time shows where classes came from
+    auto cacheTime = std::filesystem::file_time_type() + std::chrono::hours(1);
+    EXPECT_EQ("manualValue", load());
+    std::filesystem::last_write_time(cacheFile, cacheTime);
+    EXPECT_EQ("manualValue", load());
+    EXPECT_EQ(cacheTime, std::filesystem::last_write_time(cacheFile));
+
+    // A changed class file invalidates the cache
+    auto classFile = testDir / "classes" / "OUTDOOR_SENSOR.json";
+    std::string content;
+    {
+        std::ifstream file(classFile);
+        content.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    auto pos = content.find("\"manualValue\"");
+    ASSERT_NE(std::string::npos, pos);
+    content.replace(pos, std::string("\"manualValue\"").size(), "\"manualTemperature\"");
+    {
+        std::ofstream file(classFile, std::ios::trunc);
+        file << content;
+    }
+    EXPECT_EQ("manualTemperature", load());
+    EXPECT_NE(cacheTime, std::filesystem::last_write_time(cacheFile));
+
+    // The rebuilt cache has the change
+    std::filesystem::last_write_time(cacheFile, cacheTime);
+    EXPECT_EQ("manualTemperature", load());
+    EXPECT_EQ(cacheTime, std::filesystem::last_write_time(cacheFile));
+
+    std::filesystem::remove_all(testDir);
+}
@@ -0,0 +1,40 @@
+#include "TempFileTest.h"
+#include "file_utils.h"
+
+using TFileUtilsTest = TTempFileTest;
+
+TEST_F(TFileUtilsTest, WriteFileAtomically)
+{
+    WriteFileAtomically(TempFile, "old");
+    WriteFileAtomically(TempFile, std::string("new\0data", 8));
+
+    std::ifstream file(TempFile, std::ios::binary);
+    std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    EXPECT_EQ(std::string("new\0data", 8), content);
+    EXPECT_FALSE(std::filesystem::exists(TempFile + ".tmp"));
+
+    EXPECT_THROW(WriteFileAtomically(TempFile + ".missing/file", "data"), std::runtime_error);
+}
+
+TEST_F(TFileUtilsTest, VersionedJson)
+{
+    auto parse = [](const Json::Value& root) { GetJsonByte(root, "byte"); };
+    EXPECT_FALSE(LoadVersionedJson(TempFile, 2, parse));
+
+    Json::Value root;
+    root["byte"] = 255;
+    SaveVersionedJson(TempFile, 2, root);
+    uint8_t value = 0;
+    EXPECT_TRUE(LoadVersionedJson(TempFile, 2, [&](const Json::Value& root) { value = GetJsonByte(root, "byte"); }));
+    EXPECT_EQ(255, value);
+
+    // Other versions are skipped without parsing
+    EXPECT_FALSE(LoadVersionedJson(TempFile, 3, [](const Json::Value&) { FAIL(); }));
+
+    root["byte"] = 256;
+    SaveVersionedJson(TempFile, 2, root);
+    EXPECT_THROW(LoadVersionedJson(TempFile, 2, parse), std::runtime_error);
+
+    WriteTempFile("{\"version\": 2, ");
+    EXPECT_THROW(LoadVersionedJson(TempFile, 2, parse), std::runtime_error);
+}
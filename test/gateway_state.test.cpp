@@ -0,0 +1,54 @@
+#include "gateway_state.h"
+#include "TempFileTest.h"
+
+using TGatewayStateTest = TTempFileTest;
+
+TEST_F(TGatewayStateTest, SaveAndLoad)
+{
+    std::vector<TProgramState> programs;
+    EXPECT_FALSE(LoadGatewayState(TempFile, programs));
+
+    programs.push_back(
+        TProgramState{10,
+                      5,
+                      {{5, TParameterKind::INPUT, 1, "21.5"}, {1, TParameterKind::PARAMETER, 7, "on"}},
+                      "1.2.3"});
+    programs.push_back(TProgramState{255, 3, {}, {}});
+    SaveGatewayState(TempFile, programs);
+
+    std::vector<TProgramState> loaded;
+    ASSERT_TRUE(LoadGatewayState(TempFile, loaded));
+    ASSERT_EQ(2, loaded.size());
+    EXPECT_EQ(10, loaded[0].ProgramId);
+    EXPECT_EQ(5, loaded[0].ProgramType);
+    EXPECT_EQ("1.2.3", loaded[0].FirmwareVersion);
+    ASSERT_EQ(2, loaded[0].Values.size());
+    EXPECT_EQ(5, loaded[0].Values[0].ProgramType);
+    EXPECT_EQ(TParameterKind::INPUT, loaded[0].Values[0].Kind);
+    EXPECT_EQ(1, loaded[0].Values[0].ParameterId);
+    EXPECT_EQ("21.5", loaded[0].Values[0].Value);
+    EXPECT_EQ(TParameterKind::PARAMETER, loaded[0].Values[1].Kind);
+    EXPECT_EQ("on", loaded[0].Values[1].Value);
+    EXPECT_EQ(255, loaded[1].ProgramId);
+    EXPECT_TRUE(loaded[1].Values.empty());
+    EXPECT_TRUE(loaded[1].FirmwareVersion.empty());
+}
+
+TEST_F(TGatewayStateTest, Malformed)
+{
+    std::vector<TProgramState> programs;
+
+    WriteTempFile("{\"version\": 1000, \"programs\": []}");
+    EXPECT_FALSE(LoadGatewayState(TempFile, programs));
+
+    WriteTempFile("{\"version\": 1, \"programs\": [{\"id\": 256, \"type\": 1, \"values\": []}]}");
+    EXPECT_THROW(LoadGatewayState(TempFile, programs), std::runtime_error);
+
+    WriteTempFile("{\"version\": 1, \"programs\": [{\"id\": 1, \"type\": 1, \"values\": [{\"type\": 1, \"kind\": "
+               "\"unknown\", \"id\": 1, \"value\": \"1\"}]}]}");
+    EXPECT_THROW(LoadGatewayState(TempFile, programs), std::runtime_error);
+
+    WriteTempFile("{\"version\": 1, ");
+    EXPECT_THROW(LoadGatewayState(TempFile, programs), std::runtime_error);
+    EXPECT_TRUE(programs.empty());
+}
@@ -0,0 +1,62 @@
+#include "gateway_stats.h"
+
+#include <gtest/gtest.h>
+
+namespace
+{
+    const TStatsControl* FindControl(const std::vector<TStatsControl>& controls, const std::string& id)
+    {
+        for (const auto& control: controls) {
+            if (control.Id == id) {
+                return &control;
+            }
+        }
+        return nullptr;
+    }
+}
+
+TEST(TGatewayStatsTest, MakeStatsControls)
+{
+    TGatewayStats previous;
+    previous.Time = std::chrono::steady_clock::now();
+    previous.SmartWebToMqtt.PollRequests = 100;
+
+    TGatewayStats current;
+    current.Time = previous.Time + std::chrono::seconds(4);
+    current.Port.WriteTimeouts = 3;
+    current.SmartWebToMqtt.Reader.ReceivedFrames = 20;
+    current.SmartWebToMqtt.Reader.AcceptedFrames = 12;
+    current.SmartWebToMqtt.Reader.DroppedFrames = 2;
+    current.SmartWebToMqtt.PollRequests = 110;
+    current.SmartWebToMqtt.PollCycleDuration = std::chrono::milliseconds(1500);
+    current.SmartWebToMqtt.PollTask.Runtime.Add(std::chrono::microseconds(250));
+    current.SmartWebToMqtt.KnownPrograms = 5;
+    current.MqttToSmartWeb.Controllers.push_back(TMqttToSmartWebStats::TController{204, DS_RUNNING, 7});
+    current.MqttToSmartWeb.Controllers.push_back(TMqttToSmartWebStats::TController{205, DS_IDLE, 0});
+
+    auto controls = MakeStatsControls(previous, current);
+
+    std::vector<std::pair<std::string, std::string>> expected = {{"can_write_timeouts", "3"},
+                                                                 {"sw_received_frames", "20"},
+                                                                 {"sw_accepted_frames", "12"},
+                                                                 {"sw_dropped_frames", "2"},
+                                                                 {"known_programs", "5"},
+                                                                 {"poll_requests", "110"},
+                                                                 {"poll_requests_per_s", "2.5"},
+                                                                 {"poll_cycle_duration", "1500"},
+                                                                 {"poll_task_runtime_avg", "0.25"},
+                                                                 {"controller_204_state", "running"},
+                                                                 {"controller_204_frames", "7"},
+                                                                 {"controller_205_state", "idle"}};
+    for (const auto& value: expected) {
+        auto control = FindControl(controls, value.first);
+        ASSERT_NE(nullptr, control) << value.first;
+        EXPECT_EQ(value.second, control->Value) << value.first;
+    }
+    EXPECT_EQ("text", FindControl(controls, "controller_205_state")->Type);
+    EXPECT_EQ("ms", FindControl(controls, "poll_cycle_duration")->Units);
+
+    // Snapshots of the same time give no rate
+    controls = MakeStatsControls(current, current);
+    EXPECT_EQ("0", FindControl(controls, "poll_requests_per_s")->Value);
+}
@@ -0,0 +1,50 @@
+#include "metadata_cache.h"
+#include "TempFileTest.h"
+
+using TMetadataCacheTest = TTempFileTest;
+
+TEST_F(TMetadataCacheTest, SaveAndLoad)
+{
+    std::vector<TProgramMetadata> programs;
+    EXPECT_FALSE(LoadMetadataCache(TempFile, programs));
+
+    programs.push_back(
+        TProgramMetadata{5, "1.2", {{5, 7, "T_SET", "5", "35", "21.5", "C"}, {1, 3, "", "0", "100", "", ""}}});
+    programs.push_back(TProgramMetadata{5, "1.3", {}});
+    SaveMetadataCache(TempFile, programs);
+
+    std::vector<TProgramMetadata> loaded;
+    ASSERT_TRUE(LoadMetadataCache(TempFile, loaded));
+    ASSERT_EQ(2, loaded.size());
+    EXPECT_EQ(5, loaded[0].ProgramType);
+    EXPECT_EQ("1.2", loaded[0].FirmwareVersion);
+    ASSERT_EQ(2, loaded[0].Parameters.size());
+    EXPECT_EQ("T_SET", loaded[0].Parameters[0].Name);
+    EXPECT_EQ("5", loaded[0].Parameters[0].Min);
+    EXPECT_EQ("35", loaded[0].Parameters[0].Max);
+    EXPECT_EQ("21.5", loaded[0].Parameters[0].Default);
+    EXPECT_EQ("C", loaded[0].Parameters[0].Unit);
+    EXPECT_EQ("1.3", loaded[1].FirmwareVersion);
+    EXPECT_TRUE(loaded[1].Parameters.empty());
+
+    auto param = FindParameterMetadata(loaded[0], 1, 3);
+    ASSERT_NE(nullptr, param);
+    EXPECT_TRUE(param->Name.empty());
+    EXPECT_EQ("100", param->Max);
+    EXPECT_EQ(nullptr, FindParameterMetadata(loaded[0], 5, 3));
+}
+
+TEST_F(TMetadataCacheTest, Malformed)
+{
+    std::vector<TProgramMetadata> programs;
+
+    WriteTempFile("{\"version\": 1000, \"programs\": []}");
+    EXPECT_FALSE(LoadMetadataCache(TempFile, programs));
+
+    WriteTempFile("{\"version\": 1, \"programs\": [{\"type\": 300, \"firmware\": \"1\", \"parameters\": []}]}");
+    EXPECT_THROW(LoadMetadataCache(TempFile, programs), std::runtime_error);
+
+    WriteTempFile("{\"version\": 1, ");
+    EXPECT_THROW(LoadMetadataCache(TempFile, programs), std::runtime_error);
+    EXPECT_TRUE(programs.empty());
+}
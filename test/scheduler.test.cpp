@@ -0,0 +1,257 @@
+#include "scheduler.h"
+
+#include <atomic>
+#include <gtest/gtest.h>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    using namespace std::chrono_literals;
+
+    class TCountingTask: public ITask
+    {
+        std::string Name;
+        std::chrono::microseconds Period;
+        size_t MaxRuns;
+
+        TScheduleMode Mode;
+
+    public:
+        std::atomic<size_t> Runs{0};
+
+        //! Duration of every run
+        std::chrono::microseconds RunTime{0};
+
+        //! Duration of the first run
+        std::chrono::microseconds FirstRunTime{0};
+
+        TCountingTask(std::chrono::microseconds period,
+                      size_t maxRuns = 0,
+                      TScheduleMode mode = TScheduleMode::FIXED_DELAY)
+            : Name("counting task"),
+              Period(period),
+              MaxRuns(maxRuns),
+              Mode(mode)
+        {}
+
+        bool Run() override
+        {
+            std::this_thread::sleep_for(Runs == 0 ? FirstRunTime + RunTime : RunTime);
+            ++Runs;
+            return MaxRuns == 0 || Runs < MaxRuns;
+        }
+
+        TScheduleMode GetScheduleMode() const override
+        {
+            return Mode;
+        }
+
+        const std::string& GetName() const override
+        {
+            return Name;
+        }
+
+        const std::chrono::microseconds& GetPeriod() const override
+        {
+            return Period;
+        }
+    };
+
+    template<class TPredicate> bool WaitFor(TPredicate pred, std::chrono::milliseconds timeout = 2s)
+    {
+        auto end = std::chrono::steady_clock::now() + timeout;
+        while (!pred()) {
+            if (std::chrono::steady_clock::now() > end) {
+                return false;
+            }
+            std::this_thread::sleep_for(1ms);
+        }
+        return true;
+    }
+}
+
+TEST(TSchedulerTest, RunAndFinish)
+{
+    std::unique_ptr<IScheduler> scheduler(MakeSimpleThreadedScheduler("test"));
+    auto task = std::make_shared<TCountingTask>(1ms, 3);
+    auto handle = scheduler->AddTask(task);
+    ASSERT_TRUE(WaitFor([&]() { return task->Runs == 3; }));
+    ASSERT_TRUE(WaitFor([&]() { return scheduler->GetTaskCount() == 0; }));
+    EXPECT_FALSE(scheduler->CancelTask(handle));
+    EXPECT_FALSE(scheduler->RescheduleTask(handle, std::chrono::steady_clock::now()));
+}
+
+TEST(TSchedulerTest, Cancel)
+{
+    std::unique_ptr<IScheduler> scheduler(MakeSimpleThreadedScheduler("test"));
+    auto task = std::make_shared<TCountingTask>(1ms);
+    auto handle = scheduler->AddTask(task);
+    ASSERT_TRUE(WaitFor([&]() { return task->Runs > 2; }));
+    EXPECT_TRUE(scheduler->CancelTask(handle));
+    EXPECT_FALSE(scheduler->CancelTask(handle));
+    EXPECT_EQ(0, scheduler->GetTaskCount());
+    std::this_thread::sleep_for(10ms);
+    size_t runs = task->Runs;
+    std::this_thread::sleep_for(10ms);
+    EXPECT_EQ(runs, task->Runs);
+
+    // Slot of cancelled task is reused, but old handle stays invalid
+    auto task2 = std::make_shared<TCountingTask>(1ms);
+    auto handle2 = scheduler->AddTask(task2);
+    EXPECT_NE(handle, handle2);
+    EXPECT_FALSE(scheduler->CancelTask(handle));
+    EXPECT_TRUE(scheduler->CancelTask(handle2));
+}
+
+TEST(TSchedulerTest, Reschedule)
+{
+    std::unique_ptr<IScheduler> scheduler(MakeSimpleThreadedScheduler("test"));
+    auto task = std::make_shared<TCountingTask>(1ms, 1);
+    auto handle = scheduler->AddTask(task, std::chrono::steady_clock::now() + 1h);
+    std::this_thread::sleep_for(10ms);
+    EXPECT_EQ(0, task->Runs);
+    EXPECT_TRUE(scheduler->RescheduleTask(handle, std::chrono::steady_clock::now()));
+    ASSERT_TRUE(WaitFor([&]() { return task->Runs == 1; }));
+}
+
+TEST(TSchedulerTest, Order)
+{
+    std::unique_ptr<IScheduler> scheduler(MakeSimpleThreadedScheduler("test"));
+    std::mutex mutex;
+    std::vector<int> order;
+    auto start = std::chrono::steady_clock::now() + 20ms;
+    for (int i: {3, 1, 4, 0, 2}) {
+        scheduler->AddTask(MakePeriodicTask(
+                               1h,
+                               [&, i]() {
+                                   std::unique_lock<std::mutex> lk(mutex);
+                                   order.push_back(i);
+                               },
+                               "order"),
+                           start + std::chrono::milliseconds(i));
+    }
+    ASSERT_TRUE(WaitFor([&]() {
+        std::unique_lock<std::mutex> lk(mutex);
+        return order.size() == 5;
+    }));
+    EXPECT_EQ(std::vector<int>({0, 1, 2, 3, 4}), order);
+}
+
+TEST(TSchedulerTest, Histogram)
+{
+    TDurationHistogram histogram;
+    EXPECT_EQ(0, histogram.GetPercentile(50).count());
+    EXPECT_EQ(0, histogram.GetAverage().count());
+    for (int i = 0; i < 90; ++i) {
+        histogram.Add(std::chrono::microseconds(100));
+    }
+    for (int i = 0; i < 10; ++i) {
+        histogram.Add(std::chrono::microseconds(5000));
+    }
+    histogram.Add(std::chrono::microseconds(-1));
+    EXPECT_EQ(101, histogram.Count);
+    EXPECT_EQ(1, histogram.Buckets[0]);
+    EXPECT_EQ(90, histogram.Buckets[7]); // [64, 128)
+    EXPECT_EQ(128, histogram.GetPercentile(50).count());
+    EXPECT_EQ(5000, histogram.GetPercentile(99).count());
+    EXPECT_EQ(5000, histogram.Max.count());
+    EXPECT_EQ(584, histogram.GetAverage().count());
+}
+
+TEST(TSchedulerTest, NextRun)
+{
+    auto planned = std::chrono::steady_clock::now();
+    uint64_t skipped = 0;
+
+    // Late start delays next run only in fixed delay mode
+    EXPECT_EQ(planned + 13ms,
+              GetNextRun(TScheduleMode::FIXED_DELAY, 10ms, planned, planned + 3ms, planned + 4ms, skipped));
+    EXPECT_EQ(planned + 10ms,
+              GetNextRun(TScheduleMode::FIXED_RATE_SKIP, 10ms, planned, planned + 3ms, planned + 4ms, skipped));
+    EXPECT_EQ(planned + 10ms,
+              GetNextRun(TScheduleMode::FIXED_RATE_CATCH_UP, 10ms, planned, planned + 3ms, planned + 4ms, skipped));
+    EXPECT_EQ(0, skipped);
+
+    // Tasks added without start time are anchored to the first run
+    EXPECT_EQ(planned + 13ms,
+              GetNextRun(TScheduleMode::FIXED_RATE_SKIP,
+                         10ms,
+                         std::chrono::steady_clock::time_point(),
+                         planned + 3ms,
+                         planned + 4ms,
+                         skipped));
+
+    // Overrun of 55 ms skips runs at 10, 20, 30, 40 and 50 ms
+    EXPECT_EQ(planned + 60ms,
+              GetNextRun(TScheduleMode::FIXED_RATE_SKIP, 10ms, planned, planned, planned + 55ms, skipped));
+    EXPECT_EQ(5, skipped);
+
+    // Run ending exactly at the next planned time skips it too
+    skipped = 0;
+    EXPECT_EQ(planned + 20ms,
+              GetNextRun(TScheduleMode::FIXED_RATE_SKIP, 10ms, planned, planned, planned + 10ms, skipped));
+    EXPECT_EQ(1, skipped);
+
+    // Missed runs are caught up one after another
+    skipped = 0;
+    EXPECT_EQ(planned + 10ms,
+              GetNextRun(TScheduleMode::FIXED_RATE_CATCH_UP, 10ms, planned, planned, planned + 55ms, skipped));
+    EXPECT_EQ(0, skipped);
+}
+
+TEST(TSchedulerTest, FixedRateOverrun)
+{
+    std::unique_ptr<IScheduler> scheduler(MakeSimpleThreadedScheduler("test"));
+    auto skip = std::make_shared<TCountingTask>(10ms, 0, TScheduleMode::FIXED_RATE_SKIP);
+    auto catchUp = std::make_shared<TCountingTask>(10ms, 0, TScheduleMode::FIXED_RATE_CATCH_UP);
+
+    // The first run is longer than 5 periods, so at least 5 runs are skipped. They are counted before the second run
+    skip->FirstRunTime = 55ms;
+    auto skipHandle = scheduler->AddTask(skip, std::chrono::steady_clock::now());
+    ASSERT_TRUE(WaitFor([&]() { return skip->Runs >= 2; }));
+    TTaskStats stats;
+    ASSERT_TRUE(scheduler->GetTaskStats(skipHandle, stats));
+    EXPECT_GE(stats.SkippedRuns, 5);
+    scheduler->CancelTask(skipHandle);
+
+    // The second run is planned 10 ms after start, but it can't start before end of the first one.
+    // Statistics of a run are updated after it, so the test waits for the third run
+    catchUp->FirstRunTime = 55ms;
+    auto catchUpHandle = scheduler->AddTask(catchUp, std::chrono::steady_clock::now());
+    ASSERT_TRUE(WaitFor([&]() { return catchUp->Runs >= 3; }));
+    ASSERT_TRUE(scheduler->GetTaskStats(catchUpHandle, stats));
+    EXPECT_EQ(0, stats.SkippedRuns);
+    EXPECT_GE(stats.Lateness.Max, 45ms);
+}
+
+// Takes a second of wall clock time, run with --gtest_also_run_disabled_tests
+TEST(TSchedulerTest, DISABLED_BenchmarkThousandsOfPeriodicTasks)
+{
+    const size_t TASKS_COUNT = 5000;
+    const auto PERIOD = 50ms;
+    const auto DURATION = 1s;
+
+    std::unique_ptr<IScheduler> scheduler(MakeSimpleThreadedScheduler("benchmark"));
+    std::vector<std::shared_ptr<TCountingTask>> tasks;
+    std::vector<TTaskHandle> handles;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < TASKS_COUNT; ++i) {
+        tasks.push_back(std::make_shared<TCountingTask>(PERIOD));
+        handles.push_back(scheduler->AddTask(tasks.back(), start + PERIOD * i / TASKS_COUNT));
+    }
+    std::this_thread::sleep_for(DURATION);
+    for (auto handle: handles) {
+        EXPECT_TRUE(scheduler->CancelTask(handle));
+    }
+
+    size_t minRuns = std::numeric_limits<size_t>::max();
+    for (const auto& task: tasks) {
+        minRuns = std::min<size_t>(minRuns, task->Runs);
+    }
+
+    // Every task must keep its rate, allow some slack for slow CI machines
+    EXPECT_GE(minRuns, (DURATION / PERIOD) / 2);
+}